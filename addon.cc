@@ -1,11 +1,13 @@
 #include <nan.h>
 #include "annoyindexwrapper.h"
+#include "annoyfilterwrapper.h"
 
 using v8::Local;
 using v8::Object;
 
 void InitAll(Local<Object> exports) {
   AnnoyIndexWrapper::Init(exports);
+  AnnoyFilterWrapper::Init(exports);
 }
 
 NAN_MODULE_WORKER_ENABLED(NODE_GYP_MODULE_NAME, InitAll)
@@ -0,0 +1,62 @@
+#include "annoyfilterwrapper.h"
+#include "annoyindexwrapper.h"
+#include <vector>
+
+using namespace v8;
+using namespace Nan;
+
+Nan::Persistent<v8::Function> AnnoyFilterWrapper::constructor;
+Nan::Persistent<v8::FunctionTemplate> AnnoyFilterWrapper::functionTemplate;
+
+AnnoyFilterWrapper::AnnoyFilterWrapper() {
+}
+
+AnnoyFilterWrapper::~AnnoyFilterWrapper() {
+}
+
+void AnnoyFilterWrapper::Init(v8::Local<v8::Object> exports) {
+  v8::Local<v8::Context> context = exports->CreationContext();
+
+  // Prepare constructor template
+  v8::Local<v8::FunctionTemplate> tpl = Nan::New<v8::FunctionTemplate>(New);
+  tpl->SetClassName(Nan::New("AnnoyFilter").ToLocalChecked());
+  tpl->InstanceTemplate()->SetInternalFieldCount(1);
+
+  // Prototype
+  Nan::SetPrototypeMethod(tpl, "size", GetSize);
+
+  functionTemplate.Reset(tpl);
+  constructor.Reset(tpl->GetFunction(context).ToLocalChecked());
+  exports->Set(context, Nan::New("AnnoyFilter").ToLocalChecked(), tpl->GetFunction(context).ToLocalChecked()).Check();
+}
+
+Nan::MaybeLocal<v8::Object> AnnoyFilterWrapper::NewInstance(v8::Local<v8::Value> ids) {
+  v8::Local<v8::Value> argv[] = { ids };
+  return Nan::NewInstance(Nan::New(constructor), 1, argv);
+}
+
+bool AnnoyFilterWrapper::HasInstance(v8::Local<v8::Value> value) {
+  return Nan::New(functionTemplate)->HasInstance(value);
+}
+
+void AnnoyFilterWrapper::New(const Nan::FunctionCallbackInfo<v8::Value>& info) {
+  if (info.IsConstructCall()) {
+    // Invoked as constructor: `new AnnoyFilter(ids)`
+    std::vector<int> ids;
+    if (!info[0]->IsNullOrUndefined() && !AnnoyIndexWrapper::getIntArrayParam(info, 0, &ids)) {
+      return Nan::ThrowTypeError(
+        "createFilter: Expected an array or Int32Array of item ids"
+      );
+    }
+
+    AnnoyFilterWrapper* obj = new AnnoyFilterWrapper();
+    obj->items = AnnoyItemSet<int>(ids.begin(), ids.end());
+    obj->Wrap(info.This());
+    info.GetReturnValue().Set(info.This());
+  }
+}
+
+void AnnoyFilterWrapper::GetSize(const Nan::FunctionCallbackInfo<v8::Value>& info) {
+  AnnoyFilterWrapper* obj = ObjectWrap::Unwrap<AnnoyFilterWrapper>(info.Holder());
+  info.GetReturnValue().Set(Nan::New<Number>(obj->items.size()));
+}
@@ -0,0 +1,27 @@
+#ifndef ANNOYFILTERWRAPPER_H
+#define ANNOYFILTERWRAPPER_H
+
+#include <nan.h>
+#include "annoylib.h"
+
+// A set of item ids that can be passed as the filter to many queries, so it
+// only has to be read out of JS once.
+class AnnoyFilterWrapper : public Nan::ObjectWrap {
+ public:
+  static void Init(v8::Local<v8::Object> exports);
+  static Nan::MaybeLocal<v8::Object> NewInstance(v8::Local<v8::Value> ids);
+  static bool HasInstance(v8::Local<v8::Value> value);
+  AnnoyItemSet<int> items;
+
+ private:
+  AnnoyFilterWrapper();
+  virtual ~AnnoyFilterWrapper();
+
+  static void New(const Nan::FunctionCallbackInfo<v8::Value>& info);
+  static void GetSize(const Nan::FunctionCallbackInfo<v8::Value>& info);
+
+  static Nan::Persistent<v8::Function> constructor;
+  static Nan::Persistent<v8::FunctionTemplate> functionTemplate;
+};
+
+#endif
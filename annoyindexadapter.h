@@ -0,0 +1,345 @@
+#ifndef ANNOYINDEXADAPTER_H
+#define ANNOYINDEXADAPTER_H
+
+#include "annoylib.h"
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Packs vectors of 0s and 1s into 64-bit words for Hamming indexes. Anything
+// > 0 is a set bit, which works for both 0/1 and -1/+1 codes. Bit i is stored
+// in word i / 64, counting down from the most significant bit, which is the
+// order Hamming::margin reads them in.
+struct HammingCodec {
+  typedef uint64_t value_type;
+
+  static int get_size(int dimensions) {
+    return (dimensions + 63) / 64;
+  }
+
+  static void encode(const float* w, value_type* v, int dimensions) {
+    for (int i = 0; i < get_size(dimensions); i++) {
+      v[i] = 0;
+    }
+    for (int i = 0; i < dimensions; i++) {
+      if (w[i] > 0) {
+        v[i / 64] |= (uint64_t)1 << (63 - i % 64);
+      }
+    }
+  }
+
+  static void decode(const value_type* v, float* w, int dimensions) {
+    for (int i = 0; i < dimensions; i++) {
+      w[i] = (v[i / 64] >> (63 - i % 64)) & 1 ? 1.0f : 0.0f;
+    }
+  }
+};
+
+// Stores each float as an AnnoyFloat16 or AnnoyBFloat16.
+template<typename V>
+struct NarrowFloatCodec {
+  typedef V value_type;
+
+  static int get_size(int dimensions) {
+    return dimensions;
+  }
+
+  static void encode(const float* w, value_type* v, int dimensions) {
+    for (int i = 0; i < dimensions; i++) {
+      v[i] = w[i];
+    }
+  }
+
+  static void decode(const value_type* v, float* w, int dimensions) {
+    for (int i = 0; i < dimensions; i++) {
+      w[i] = v[i];
+    }
+  }
+};
+
+// Presents an index over vectors stored some other way as an
+// AnnoyIndexInterface<int, float>, so the wrapper can treat it like the
+// others. Codec converts vectors on the way in and out, and distances are
+// converted to float.
+//
+// The inner index is also exposed, for callers that already have encoded
+// vectors.
+template<typename Codec>
+class AnnoyIndexAdapter : public AnnoyIndexInterface<int, float> {
+ public:
+  typedef typename Codec::value_type V;
+  typedef AnnoyIndexInterface<int, V> PackedIndex;
+  typedef typename PackedIndex::DT PackedDistance;
+
+  // Takes ownership of packedIndex, which should have been made with
+  // Codec::get_size(dimensions) dimensions.
+  AnnoyIndexAdapter(PackedIndex *packedIndex, int dimensions) :
+    _packed(packedIndex), _dimensions(dimensions), _size(Codec::get_size(dimensions)) {
+  }
+
+  ~AnnoyIndexAdapter() {
+    delete _packed;
+  }
+
+  PackedIndex *packed() const {
+    return _packed;
+  }
+
+  // Number of values of type V in each encoded vector.
+  int get_packed_size() const {
+    return _size;
+  }
+
+  bool add_item(int item, const float* w, char** error=NULL) {
+    std::vector<V> packed(_size);
+    Codec::encode(w, packed.data(), _dimensions);
+    return _packed->add_item(item, packed.data(), error);
+  }
+
+  bool add_items(int first_item, const float* w, int n_rows, int n_threads=1, char** error=NULL) {
+    std::vector<V> packed((size_t)n_rows * _size);
+    for (int i = 0; i < n_rows; i++) {
+      Codec::encode(w + (size_t)i * _dimensions, &packed[(size_t)i * _size], _dimensions);
+    }
+    return _packed->add_items(first_item, packed.data(), n_rows, n_threads, error);
+  }
+
+  bool build(int q, int n_threads=-1, char** error=NULL) {
+    return _packed->build(q, n_threads, error);
+  }
+
+  bool unbuild(char** error=NULL) {
+    return _packed->unbuild(error);
+  }
+
+  bool save(const char* filename, bool prefault=false, char** error=NULL) {
+    return _packed->save(filename, prefault, error);
+  }
+
+  void unload() {
+    _packed->unload();
+  }
+
+  bool load(const char* filename, bool prefault=false, char** error=NULL) {
+    return _packed->load(filename, prefault, error);
+  }
+
+  bool loadBuffer(void* buffer, off_t size, bool copy=false, char** error=NULL) {
+    return _packed->loadBuffer(buffer, size, copy, error);
+  }
+
+  void set_file_header(bool enabled) {
+    _packed->set_file_header(enabled);
+  }
+
+  void set_compact_layout(bool enabled) {
+    _packed->set_compact_layout(enabled);
+  }
+
+  float get_distance(int i, int j) const {
+    return (float)_packed->get_distance(i, j);
+  }
+
+  void get_nns_by_item(int item, size_t n, int search_k, vector<int>* result, vector<float>* distances,
+                       const char* filter_type, vector<int>* filter_vector) const {
+    vector<PackedDistance> packed_distances;
+    _packed->get_nns_by_item(item, n, search_k, result, distances ? &packed_distances : NULL,
+                             filter_type, filter_vector);
+    _copy_distances(packed_distances, distances);
+  }
+
+  void get_nns_by_vector(const float* w, size_t n, int search_k, vector<int>* result, vector<float>* distances,
+                         const char* filter_type, vector<int>* filter_vector) const {
+    std::vector<V> packed(_size);
+    Codec::encode(w, packed.data(), _dimensions);
+    vector<PackedDistance> packed_distances;
+    _packed->get_nns_by_vector(packed.data(), n, search_k, result, distances ? &packed_distances : NULL,
+                               filter_type, filter_vector);
+    _copy_distances(packed_distances, distances);
+  }
+
+  void get_nns_by_item(int item, size_t n, int search_k, vector<int>* result, vector<float>* distances,
+                       const AnnoyFilter<int>* filter) const {
+    vector<PackedDistance> packed_distances;
+    _packed->get_nns_by_item(item, n, search_k, result, distances ? &packed_distances : NULL, filter);
+    _copy_distances(packed_distances, distances);
+  }
+
+  void get_nns_by_vector(const float* w, size_t n, int search_k, vector<int>* result, vector<float>* distances,
+                         const AnnoyFilter<int>* filter) const {
+    std::vector<V> packed(_size);
+    Codec::encode(w, packed.data(), _dimensions);
+    get_nns_by_packed_vector(packed.data(), n, search_k, result, distances, filter);
+  }
+
+  void get_nns_by_packed_vector(const V* w, size_t n, int search_k, vector<int>* result,
+                                vector<float>* distances, const AnnoyFilter<int>* filter) const {
+    vector<PackedDistance> packed_distances;
+    _packed->get_nns_by_vector(w, n, search_k, result, distances ? &packed_distances : NULL, filter);
+    _copy_distances(packed_distances, distances);
+  }
+
+  void get_nns_exact(const float* w, size_t n, vector<int>* result, vector<float>* distances,
+                     const AnnoyFilter<int>* filter=nullptr, int n_threads=1) const {
+    std::vector<V> packed(_size);
+    Codec::encode(w, packed.data(), _dimensions);
+    vector<PackedDistance> packed_distances;
+    _packed->get_nns_exact(packed.data(), n, result, distances ? &packed_distances : NULL, filter, n_threads);
+    _copy_distances(packed_distances, distances);
+  }
+
+  int get_n_items() const {
+    return _packed->get_n_items();
+  }
+
+  int get_n_trees() const {
+    return _packed->get_n_trees();
+  }
+
+  void verbose(bool v) {
+    _packed->verbose(v);
+  }
+
+  void get_item(int item, float* v) const {
+    std::vector<V> packed(_size);
+    _packed->get_item(item, packed.data());
+    Codec::decode(packed.data(), v, _dimensions);
+  }
+
+  void set_seed(uint64_t q) {
+    _packed->set_seed(q);
+  }
+
+  bool on_disk_build(const char* filename, char** error=NULL) {
+    return _packed->on_disk_build(filename, error);
+  }
+
+  bool build_from_file(const char* vectors_filename, const char* filename, int q, size_t memory_limit=0, char** error=NULL) {
+    // The inner index reads encoded vectors, so encode the file into another
+    // one next to filename first, a chunk of rows at a time.
+    FILE* input = fopen(vectors_filename, "rb");
+    if (!input) {
+      set_error_from_errno(error, "Unable to open");
+      return false;
+    }
+    size_t row_size = sizeof(float) * _dimensions;
+    off_t input_size = lseek_getsize(fileno(input));
+    rewind(input);
+    if (input_size <= 0 || (size_t)input_size % row_size != 0) {
+      fclose(input);
+      set_error_from_string(error, "Vector file size isn't a multiple of the vector size");
+      return false;
+    }
+    std::string encoded_filename = std::string(filename) + ".encoded";
+    FILE* output = fopen(encoded_filename.c_str(), "wb");
+    if (!output) {
+      fclose(input);
+      set_error_from_errno(error, "Unable to open");
+      return false;
+    }
+
+    const size_t chunk = 4096;
+    std::vector<float> rows(chunk * _dimensions);
+    std::vector<V> packed(chunk * _size);
+    bool ok = true;
+    size_t count;
+    while (ok && (count = fread(rows.data(), row_size, chunk, input)) > 0) {
+      for (size_t i = 0; i < count; i++) {
+        Codec::encode(&rows[i * _dimensions], &packed[i * _size], _dimensions);
+      }
+      ok = fwrite(packed.data(), sizeof(V) * _size, count, output) == count;
+    }
+    if (ferror(input)) {
+      set_error_from_errno(error, "Unable to read");
+      ok = false;
+    } else if (!ok) {
+      set_error_from_errno(error, "Unable to write");
+    }
+    fclose(input);
+    if (fclose(output) != 0 && ok) {
+      set_error_from_errno(error, "Unable to write");
+      ok = false;
+    }
+
+    ok = ok && _packed->build_from_file(encoded_filename.c_str(), filename, q, memory_limit, error);
+    remove(encoded_filename.c_str());
+    return ok;
+  }
+
+  bool quantize(char** error=NULL) {
+    return _packed->quantize(error);
+  }
+
+  bool save_quantized(const char* filename, char** error=NULL) const {
+    return _packed->save_quantized(filename, error);
+  }
+
+  bool load_quantized(const char* filename, char** error=NULL) {
+    return _packed->load_quantized(filename, error);
+  }
+
+  void set_rerank(int k) {
+    _packed->set_rerank(k);
+  }
+
+  bool remove_item(int item, char** error=NULL) {
+    return _packed->remove_item(item, error);
+  }
+
+  bool compact_removed(char** error=NULL) {
+    return _packed->compact_removed(error);
+  }
+
+  bool add_item_with_id(uint64_t id, const float* w, char** error=NULL) {
+    std::vector<V> packed(_size);
+    Codec::encode(w, packed.data(), _dimensions);
+    return _packed->add_item_with_id(id, packed.data(), error);
+  }
+
+  bool has_item_ids() const {
+    return _packed->has_item_ids();
+  }
+
+  int find_item(uint64_t id) const {
+    return _packed->find_item(id);
+  }
+
+  uint64_t get_item_id(int item) const {
+    return _packed->get_item_id(item);
+  }
+
+  bool set_payload(int item, const void* data, size_t size, char** error=NULL) {
+    return _packed->set_payload(item, data, size, error);
+  }
+
+  bool get_payload(int item, const uint8_t** data, size_t* size) const {
+    return _packed->get_payload(item, data, size);
+  }
+
+  bool get_stats(AnnoyQueryStats* stats) const {
+    return _packed->get_stats(stats);
+  }
+
+  bool get_last_query_stats(AnnoyQueryStats* stats) const {
+    return _packed->get_last_query_stats(stats);
+  }
+
+  void reset_stats() {
+    _packed->reset_stats();
+  }
+
+ protected:
+  static void _copy_distances(const vector<PackedDistance>& packed_distances, vector<float>* distances) {
+    if (distances) {
+      distances->insert(distances->end(), packed_distances.begin(), packed_distances.end());
+    }
+  }
+
+  PackedIndex *_packed;
+  int _dimensions;
+  int _size;
+};
+
+typedef AnnoyIndexAdapter<HammingCodec> HammingIndexAdapter;
+
+#endif
@@ -0,0 +1,373 @@
+#include "annoyindexworkers.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+using namespace v8;
+using namespace Nan;
+
+// A fixed set of threads shared by every index in the process. Workers
+// running on the libuv pool hand it ranges of work and wait for them.
+class QueryThreadPool {
+ public:
+  static QueryThreadPool& shared() {
+    // Never destroyed: the threads are blocked on the condition variable at
+    // exit, and joining them from a static destructor would hang.
+    static QueryThreadPool *pool = new QueryThreadPool(
+      std::max(1, (int)std::thread::hardware_concurrency())
+    );
+    return *pool;
+  }
+
+  // Calls fn(begin, end) over ranges covering [0, count), and waits for them.
+  // With maxThreads > 0, at most that many threads work on them at once.
+  void run(size_t count, const std::function<void(size_t, size_t)>& fn, size_t maxThreads = 0) {
+    if (count == 0) {
+      return;
+    }
+    // Small ranges even out uneven queries; each task takes the next range
+    // until there are none left, so the task count limits the concurrency.
+    size_t chunkCount = std::min(count, threads.size() * 4);
+    size_t chunkSize = (count + chunkCount - 1) / chunkCount;
+    size_t taskCount = std::min(chunkCount, threads.size());
+    if (maxThreads > 0) {
+      taskCount = std::min(taskCount, maxThreads);
+    }
+
+    std::atomic<size_t> nextBegin(0);
+    std::mutex doneMutex;
+    std::condition_variable done;
+    size_t remaining = taskCount;
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      for (size_t i = 0; i < taskCount; i++) {
+        tasks.push_back([&]() {
+          size_t begin;
+          while ((begin = nextBegin.fetch_add(chunkSize)) < count) {
+            fn(begin, std::min(count, begin + chunkSize));
+          }
+          std::lock_guard<std::mutex> doneLock(doneMutex);
+          if (--remaining == 0) {
+            done.notify_one();
+          }
+        });
+      }
+    }
+    workAvailable.notify_all();
+
+    std::unique_lock<std::mutex> doneLock(doneMutex);
+    done.wait(doneLock, [&]() { return remaining == 0; });
+  }
+
+ private:
+  explicit QueryThreadPool(int numberOfThreads) {
+    for (int i = 0; i < numberOfThreads; i++) {
+      threads.push_back(std::thread(&QueryThreadPool::work, this));
+    }
+  }
+
+  void work() {
+    while (true) {
+      std::function<void()> task;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        workAvailable.wait(lock, [this]() { return !tasks.empty(); });
+        task = tasks.front();
+        tasks.pop_front();
+      }
+      task();
+    }
+  }
+
+  std::vector<std::thread> threads;
+  std::deque<std::function<void()> > tasks;
+  std::mutex mutex;
+  std::condition_variable workAvailable;
+};
+
+// Node-style callback (err, result) that settles the promise held in its data.
+static void settlePromise(const Nan::FunctionCallbackInfo<v8::Value>& info) {
+  v8::Local<v8::Context> context = info.GetIsolate()->GetCurrentContext();
+  Local<Promise::Resolver> resolver = info.Data().As<Promise::Resolver>();
+
+  if (!info[0]->IsNullOrUndefined()) {
+    resolver->Reject(context, info[0]).Check();
+  } else {
+    resolver->Resolve(context, info[1]).Check();
+  }
+}
+
+Nan::Callback *getCallbackOrPromise(
+  const Nan::FunctionCallbackInfo<v8::Value>& info, int paramIndex) {
+  v8::Local<v8::Context> context = info.GetIsolate()->GetCurrentContext();
+
+  if (info[paramIndex]->IsFunction()) {
+    return new Nan::Callback(info[paramIndex].As<Function>());
+  }
+
+  // Settling through a Nan::Callback (rather than resolving directly from the
+  // worker) goes through MakeCallback, so the microtask queue gets drained.
+  Local<Promise::Resolver> resolver = Promise::Resolver::New(context).ToLocalChecked();
+  Local<Function> settle = Nan::GetFunction(
+    Nan::New<FunctionTemplate>(settlePromise, resolver)
+  ).ToLocalChecked();
+
+  info.GetReturnValue().Set(resolver->GetPromise());
+  return new Nan::Callback(settle);
+}
+
+BuildWorker::BuildWorker(Nan::Callback *callback, AnnoyIndexWrapper *obj,
+  int numberOfTrees, int numberOfThreads) :
+  Nan::AsyncWorker(callback, "annoy:BuildWorker"),
+  obj(obj), numberOfTrees(numberOfTrees), numberOfThreads(numberOfThreads) {
+}
+
+void BuildWorker::Execute() {
+  char *error = NULL;
+  if (!obj->annoyIndex->build(numberOfTrees, numberOfThreads, &error)) {
+    SetErrorMessage(error);
+    free(error);
+  }
+}
+
+void BuildWorker::HandleOKCallback() {
+  obj->isBuilding = false;
+  Nan::AsyncWorker::HandleOKCallback();
+}
+
+void BuildWorker::HandleErrorCallback() {
+  obj->isBuilding = false;
+  Nan::AsyncWorker::HandleErrorCallback();
+}
+
+BuildFromFileWorker::BuildFromFileWorker(Nan::Callback *callback, AnnoyIndexWrapper *obj,
+  const std::string& vectorsPath, const std::string& indexPath,
+  int numberOfTrees, size_t memoryLimit) :
+  Nan::AsyncWorker(callback, "annoy:BuildFromFileWorker"),
+  obj(obj), vectorsPath(vectorsPath), indexPath(indexPath),
+  numberOfTrees(numberOfTrees), memoryLimit(memoryLimit) {
+}
+
+void BuildFromFileWorker::Execute() {
+  char *error = NULL;
+  if (!obj->annoyIndex->build_from_file(vectorsPath.c_str(), indexPath.c_str(),
+      numberOfTrees, memoryLimit, &error)) {
+    SetErrorMessage(error);
+    free(error);
+  }
+}
+
+void BuildFromFileWorker::HandleOKCallback() {
+  obj->isBuilding = false;
+  Nan::AsyncWorker::HandleOKCallback();
+}
+
+void BuildFromFileWorker::HandleErrorCallback() {
+  obj->isBuilding = false;
+  Nan::AsyncWorker::HandleErrorCallback();
+}
+
+QueryBatchWorker::QueryBatchWorker(Nan::Callback *callback, AnnoyIndexWrapper *obj,
+  const std::vector<float>& queries, int numberOfNeighbors, int searchK,
+  int *nnIndexes, uint64_t *nnIds, float *distances) :
+  Nan::AsyncWorker(callback, "annoy:QueryBatchWorker"),
+  obj(obj), queries(queries), numberOfNeighbors(numberOfNeighbors),
+  searchK(searchK), exact(obj->useExactSearch()), nnIndexes(nnIndexes), nnIds(nnIds),
+  distances(distances) {
+}
+
+void QueryBatchWorker::Execute() {
+  int length = obj->getDimensions();
+  size_t numberOfQueries = queries.size() / length;
+
+  QueryThreadPool::shared().run(numberOfQueries, [this, length](size_t begin, size_t end) {
+    std::vector<int> queryNNIndexes;
+    std::vector<float> queryDistances;
+
+    for (size_t i = begin; i < end; i++) {
+      queryNNIndexes.clear();
+      queryDistances.clear();
+      // The pool already has a thread per core, so exact scans get one each.
+      if (exact) {
+        obj->annoyIndex->get_nns_exact(
+          &queries[i * length], numberOfNeighbors, &queryNNIndexes, &queryDistances
+        );
+      } else {
+        obj->annoyIndex->get_nns_by_vector(
+          &queries[i * length], numberOfNeighbors, searchK,
+          &queryNNIndexes, &queryDistances, nullptr, nullptr
+        );
+      }
+
+      float *distanceSlots = distances + i * numberOfNeighbors;
+      size_t resultCount = std::min(queryNNIndexes.size(), (size_t)numberOfNeighbors);
+      if (nnIds) {
+        uint64_t *idSlots = nnIds + i * numberOfNeighbors;
+        for (size_t k = 0; k < resultCount; k++) {
+          idSlots[k] = obj->annoyIndex->get_item_id(queryNNIndexes[k]);
+        }
+        std::fill(idSlots + resultCount, idSlots + numberOfNeighbors, ANNOY_NO_ID);
+      } else {
+        int *nnSlots = nnIndexes + i * numberOfNeighbors;
+        std::copy(queryNNIndexes.begin(), queryNNIndexes.begin() + resultCount, nnSlots);
+        std::fill(nnSlots + resultCount, nnSlots + numberOfNeighbors, -1);
+      }
+      std::copy(queryDistances.begin(), queryDistances.begin() + resultCount, distanceSlots);
+      std::fill(distanceSlots + resultCount, distanceSlots + numberOfNeighbors, NAN);
+    }
+  });
+}
+
+void QueryBatchWorker::HandleOKCallback() {
+  Nan::HandleScope scope;
+  obj->pendingQueries -= 1;
+
+  v8::Local<v8::Value> argv[] = { Nan::Null(), GetFromPersistent("result") };
+  callback->Call(2, argv, async_resource);
+}
+
+void QueryBatchWorker::HandleErrorCallback() {
+  obj->pendingQueries -= 1;
+  Nan::AsyncWorker::HandleErrorCallback();
+}
+
+KnnGraphWorker::KnnGraphWorker(Nan::Callback *callback, AnnoyIndexWrapper *obj,
+  int numberOfNeighbors, int searchK, int numberOfThreads, const std::string& path,
+  int *nnIndexes, uint64_t *nnIds, float *distances, uint64_t *rowIds) :
+  Nan::AsyncWorker(callback, "annoy:KnnGraphWorker"),
+  obj(obj), numberOfNeighbors(numberOfNeighbors), searchK(searchK),
+  numberOfThreads(numberOfThreads), exact(obj->useExactSearch()), path(path),
+  nnIndexes(nnIndexes), nnIds(nnIds), distances(distances), rowIds(rowIds) {
+}
+
+void KnnGraphWorker::Execute() {
+  size_t numberOfItems = obj->annoyIndex->get_n_items();
+  if (path.empty()) {
+    QueryThreadPool::shared().run(numberOfItems, [this](size_t begin, size_t end) {
+      queryRows(begin, end, nnIndexes, nnIds, distances);
+    }, numberOfThreads);
+    if (rowIds) {
+      for (size_t i = 0; i < numberOfItems; i++) {
+        rowIds[i] = obj->annoyIndex->get_item_id(i);
+      }
+    }
+    return;
+  }
+
+  FILE *file = fopen(path.c_str(), "wb");
+  if (!file) {
+    SetErrorMessage((std::string("Unable to open ") + path + ": " + strerror(errno)).c_str());
+    return;
+  }
+  // The graph for a big index may not fit in memory, so it's found a block
+  // of items at a time, and each block written out before the next.
+  const size_t blockSize = 65536;
+  bool hasIds = obj->annoyIndex->has_item_ids();
+  std::vector<int> blockIndexes(hasIds ? 0 : blockSize * numberOfNeighbors);
+  std::vector<uint64_t> blockIds(hasIds ? blockSize * numberOfNeighbors : 0);
+  bool ok = true;
+  for (size_t first = 0; ok && first < numberOfItems; first += blockSize) {
+    size_t last = std::min(numberOfItems, first + blockSize);
+    QueryThreadPool::shared().run(last - first, [&](size_t begin, size_t end) {
+      queryRows(first + begin, first + end,
+        hasIds ? nullptr : &blockIndexes[begin * numberOfNeighbors],
+        hasIds ? &blockIds[begin * numberOfNeighbors] : nullptr, nullptr);
+    }, numberOfThreads);
+    if (!hasIds) {
+      ok = fwrite(blockIndexes.data(), sizeof(int) * numberOfNeighbors, last - first, file) == last - first;
+      continue;
+    }
+    // Each row starts with the id of the item it's for.
+    for (size_t i = first; ok && i < last; i++) {
+      uint64_t id = obj->annoyIndex->get_item_id(i);
+      ok = fwrite(&id, sizeof(id), 1, file) == 1 &&
+        fwrite(&blockIds[(i - first) * numberOfNeighbors], sizeof(uint64_t), numberOfNeighbors, file) ==
+          (size_t)numberOfNeighbors;
+    }
+  }
+  if (fclose(file) != 0) {
+    ok = false;
+  }
+  if (!ok) {
+    SetErrorMessage((std::string("Unable to write ") + path + ": " + strerror(errno)).c_str());
+  }
+}
+
+// Finds the neighbors of items begin to end, leaving out each item itself,
+// and writes them to row i - begin of nnSlots or idSlots and distanceSlots
+// (when they're not null). Slots past the end of the neighbors are padded
+// like QueryBatchWorker's.
+void KnnGraphWorker::queryRows(size_t begin, size_t end,
+  int *nnSlots, uint64_t *idSlots, float *distanceSlots) {
+  std::vector<int> itemNNIndexes;
+  std::vector<float> itemDistances;
+  std::vector<float> vec(exact ? obj->getDimensions() : 0);
+
+  for (size_t i = begin; i < end; i++) {
+    itemNNIndexes.clear();
+    itemDistances.clear();
+    // One more than asked for, because the item is usually its own nearest.
+    if (exact) {
+      obj->annoyIndex->get_item(i, vec.data());
+      obj->annoyIndex->get_nns_exact(
+        vec.data(), numberOfNeighbors + 1, &itemNNIndexes, &itemDistances
+      );
+    } else {
+      obj->annoyIndex->get_nns_by_item(
+        i, numberOfNeighbors + 1, searchK, &itemNNIndexes, &itemDistances, nullptr
+      );
+    }
+
+    size_t offset = (i - begin) * numberOfNeighbors;
+    size_t resultCount = 0;
+    for (size_t j = 0; j < itemNNIndexes.size() && resultCount < (size_t)numberOfNeighbors; j++) {
+      if (itemNNIndexes[j] == (int)i) {
+        continue;
+      }
+      if (idSlots) {
+        idSlots[offset + resultCount] = obj->annoyIndex->get_item_id(itemNNIndexes[j]);
+      } else {
+        nnSlots[offset + resultCount] = itemNNIndexes[j];
+      }
+      if (distanceSlots) {
+        distanceSlots[offset + resultCount] = itemDistances[j];
+      }
+      resultCount++;
+    }
+    if (idSlots) {
+      std::fill(idSlots + offset + resultCount, idSlots + offset + numberOfNeighbors, ANNOY_NO_ID);
+    } else {
+      std::fill(nnSlots + offset + resultCount, nnSlots + offset + numberOfNeighbors, -1);
+    }
+    if (distanceSlots) {
+      std::fill(distanceSlots + offset + resultCount, distanceSlots + offset + numberOfNeighbors, NAN);
+    }
+  }
+}
+
+void KnnGraphWorker::HandleOKCallback() {
+  Nan::HandleScope scope;
+  obj->pendingQueries -= 1;
+
+  if (!path.empty()) {
+    Nan::AsyncWorker::HandleOKCallback();
+    return;
+  }
+  v8::Local<v8::Value> argv[] = { Nan::Null(), GetFromPersistent("result") };
+  callback->Call(2, argv, async_resource);
+}
+
+void KnnGraphWorker::HandleErrorCallback() {
+  obj->pendingQueries -= 1;
+  Nan::AsyncWorker::HandleErrorCallback();
+}
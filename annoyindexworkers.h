@@ -0,0 +1,118 @@
+#ifndef ANNOYINDEXWORKERS_H
+#define ANNOYINDEXWORKERS_H
+
+#include <nan.h>
+#include "annoyindexwrapper.h"
+#include <string>
+#include <vector>
+
+// Returns the function passed at paramIndex as a callback. If there isn't
+// one, it creates a promise, sets it as the return value of the call, and
+// returns a callback that settles that promise instead.
+Nan::Callback *getCallbackOrPromise(
+  const Nan::FunctionCallbackInfo<v8::Value>& info, int paramIndex);
+
+// Runs AnnoyIndex::build on the libuv thread pool. The wrapper is marked as
+// building until the callback runs, so that conflicting calls can be refused.
+class BuildWorker : public Nan::AsyncWorker {
+ public:
+  BuildWorker(Nan::Callback *callback, AnnoyIndexWrapper *obj,
+    int numberOfTrees, int numberOfThreads);
+
+  void Execute();
+
+ protected:
+  void HandleOKCallback();
+  void HandleErrorCallback();
+
+ private:
+  AnnoyIndexWrapper *obj;
+  int numberOfTrees;
+  int numberOfThreads;
+};
+
+// Runs AnnoyIndex::build_from_file on the libuv thread pool, marking the
+// wrapper as building like BuildWorker does.
+class BuildFromFileWorker : public Nan::AsyncWorker {
+ public:
+  BuildFromFileWorker(Nan::Callback *callback, AnnoyIndexWrapper *obj,
+    const std::string& vectorsPath, const std::string& indexPath,
+    int numberOfTrees, size_t memoryLimit);
+
+  void Execute();
+
+ protected:
+  void HandleOKCallback();
+  void HandleErrorCallback();
+
+ private:
+  AnnoyIndexWrapper *obj;
+  std::string vectorsPath;
+  std::string indexPath;
+  int numberOfTrees;
+  size_t memoryLimit;
+};
+
+// Runs a batch of getNNsByVector queries, spread over a fixed pool of native
+// threads. Results are written into buffers allocated by the caller, with
+// numberOfNeighbors slots per query: items into nnIndexes, or for indexes
+// with external ids, their ids into nnIds. Slots past the end of a query's
+// results hold -1 (ANNOY_NO_ID for ids) and NaN.
+class QueryBatchWorker : public Nan::AsyncWorker {
+ public:
+  QueryBatchWorker(Nan::Callback *callback, AnnoyIndexWrapper *obj,
+    const std::vector<float>& queries, int numberOfNeighbors, int searchK,
+    int *nnIndexes, uint64_t *nnIds, float *distances);
+
+  void Execute();
+
+ protected:
+  void HandleOKCallback();
+  void HandleErrorCallback();
+
+ private:
+  AnnoyIndexWrapper *obj;
+  std::vector<float> queries;
+  int numberOfNeighbors;
+  int searchK;
+  bool exact;
+  int *nnIndexes;
+  uint64_t *nnIds;
+  float *distances;
+};
+
+// Finds the numberOfNeighbors nearest neighbors of every item, on the same
+// pool of threads as QueryBatchWorker, using at most numberOfThreads of them
+// (0 for all). Each item gets a row of numberOfNeighbors slots, laid out
+// and padded like a QueryBatchWorker's results, and leaving out the item
+// itself. The rows go into the buffers passed in, with the id of each row's
+// item in rowIds for indexes with external ids; or if path isn't empty,
+// they're written to that file instead, and the buffers aren't used.
+class KnnGraphWorker : public Nan::AsyncWorker {
+ public:
+  KnnGraphWorker(Nan::Callback *callback, AnnoyIndexWrapper *obj,
+    int numberOfNeighbors, int searchK, int numberOfThreads, const std::string& path,
+    int *nnIndexes, uint64_t *nnIds, float *distances, uint64_t *rowIds);
+
+  void Execute();
+
+ protected:
+  void HandleOKCallback();
+  void HandleErrorCallback();
+
+ private:
+  void queryRows(size_t begin, size_t end, int *nnSlots, uint64_t *idSlots, float *distanceSlots);
+
+  AnnoyIndexWrapper *obj;
+  int numberOfNeighbors;
+  int searchK;
+  int numberOfThreads;
+  bool exact;
+  std::string path;
+  int *nnIndexes;
+  uint64_t *nnIds;
+  float *distances;
+  uint64_t *rowIds;
+};
+
+#endif
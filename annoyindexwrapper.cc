@@ -1,9 +1,13 @@
 #include "annoyindexwrapper.h"
+#include "annoyindexworkers.h"
+#include "annoyfilterwrapper.h"
 #include "kissrandom.h"
 #include <vector>
 #include <fstream>
 #include <iostream>
 #include <string>
+#include <algorithm>
+#include <climits>
 
 // using v8::Context;
 // using v8::Function;
@@ -17,6 +21,9 @@
 using namespace v8;
 using namespace Nan;
 
+// Ids above this are returned as BigInts, since Numbers can't hold them all.
+static const uint64_t MAX_SAFE_ID = 9007199254740991ULL; // Number.MAX_SAFE_INTEGER
+
 #ifdef ANNOYLIB_MULTITHREADED_BUILD
 #define THREADED_POLICY AnnoyIndexMultiThreadedBuildPolicy
 #else
@@ -25,18 +32,73 @@ using namespace Nan;
 
 Nan::Persistent<v8::Function> AnnoyIndexWrapper::constructor;
 
-AnnoyIndexWrapper::AnnoyIndexWrapper(int dimensions, const char *metricString) :
-  annoyDimensions(dimensions) {
+AnnoyIndexWrapper::AnnoyIndexWrapper(int dimensions, const char *metricString,
+  const char *storageString) :
+  annoyIndex(nullptr), isBuilding(false), buildingItemCount(0), pendingQueries(0), hammingIndex(nullptr),
+  exactThreshold(0) {
+  createIndex(dimensions, metricString, storageString);
+}
 
-  if (strcmp(metricString, "Angular") == 0) {
-    annoyIndex = new AnnoyIndex<int, float, Angular, Kiss64Random, THREADED_POLICY>(dimensions);
+// Makes an index for metric D, storing vectors as float32 (the default),
+// float16 or bfloat16.
+template<typename D>
+static AnnoyIndexInterface<int, float> *newFloatIndex(int dimensions, const char *storageString) {
+  if (strcasecmp(storageString, "float16") == 0) {
+    return new AnnoyIndexAdapter<NarrowFloatCodec<AnnoyFloat16> >(
+      new AnnoyIndex<int, AnnoyFloat16, D, Kiss64Random, THREADED_POLICY>(dimensions), dimensions
+    );
   }
-  else if (strcmp(metricString, "Manhattan") == 0) {
-    annoyIndex = new AnnoyIndex<int, float, Manhattan, Kiss64Random, THREADED_POLICY>(dimensions);
+  else if (strcasecmp(storageString, "bfloat16") == 0) {
+    return new AnnoyIndexAdapter<NarrowFloatCodec<AnnoyBFloat16> >(
+      new AnnoyIndex<int, AnnoyBFloat16, D, Kiss64Random, THREADED_POLICY>(dimensions), dimensions
+    );
+  }
+  return new AnnoyIndex<int, float, D, Kiss64Random, THREADED_POLICY>(dimensions);
+}
+
+// Replaces annoyIndex with a new, empty index. Metric names are matched
+// case-insensitively, so the names annoylib records in file headers work too.
+void AnnoyIndexWrapper::createIndex(int dimensions, const char *metricString,
+  const char *storageString) {
+  delete annoyIndex;
+  hammingIndex = nullptr;
+  annoyDimensions = dimensions;
+
+  if (strcasecmp(metricString, "Angular") == 0) {
+    annoyIndex = newFloatIndex<Angular>(dimensions, storageString);
+  }
+  else if (strcasecmp(metricString, "Manhattan") == 0) {
+    annoyIndex = newFloatIndex<Manhattan>(dimensions, storageString);
+  }
+  else if (strcasecmp(metricString, "DotProduct") == 0 || strcasecmp(metricString, "Dot") == 0) {
+    annoyIndex = newFloatIndex<DotProduct>(dimensions, storageString);
+  }
+  else if (strcasecmp(metricString, "Hamming") == 0) {
+    // dimensions is a number of bits, which are stored 64 to a word.
+    hammingIndex = new HammingIndexAdapter(
+      new AnnoyIndex<int, uint64_t, Hamming, Kiss64Random, THREADED_POLICY>(
+        HammingCodec::get_size(dimensions)
+      ),
+      dimensions
+    );
+    annoyIndex = hammingIndex;
   }
   else {
-    annoyIndex = new AnnoyIndex<int, float, Euclidean, Kiss64Random, THREADED_POLICY>(dimensions);
+    annoyIndex = newFloatIndex<Euclidean>(dimensions, storageString);
+  }
+}
+
+// An index constructed without dimensions takes its dimensions, metric and
+// storage type from the header of the file it loads, if it has one.
+void AnnoyIndexWrapper::createIndexFromHeader(const AnnoyFileHeader& header) {
+  std::string metric(header.metric, strnlen(header.metric, sizeof(header.metric)));
+  std::string storage(header.value_type, strnlen(header.value_type, sizeof(header.value_type)));
+  int dimensions = header.f;
+  if (metric == "hamming") {
+    // The header only knows the number of words.
+    dimensions = header.f * 64;
   }
+  createIndex(dimensions, metric.c_str(), storage.c_str());
 }
 
 AnnoyIndexWrapper::~AnnoyIndexWrapper() {
@@ -56,16 +118,39 @@ void AnnoyIndexWrapper::Init(v8::Local<v8::Object> exports) {
   // Nan::SetPrototypeMethod(tpl, "plusOne", PlusOne);
   // Nan::SetPrototypeMethod(tpl, "multiply", Multiply);
   Nan::SetPrototypeMethod(tpl, "addItem", AddItem);
+  Nan::SetPrototypeMethod(tpl, "addItems", AddItems);
+  Nan::SetPrototypeMethod(tpl, "addItemWithId", AddItemWithId);
+  Nan::SetPrototypeMethod(tpl, "addItemPacked", AddItemPacked);
   Nan::SetPrototypeMethod(tpl, "onDiskBuild", OnDiskBuild);
   Nan::SetPrototypeMethod(tpl, "build", Build);
+  Nan::SetPrototypeMethod(tpl, "buildAsync", BuildAsync);
+  Nan::SetPrototypeMethod(tpl, "buildFromFile", BuildFromFile);
   Nan::SetPrototypeMethod(tpl, "save", Save);
   Nan::SetPrototypeMethod(tpl, "load", Load);
   Nan::SetPrototypeMethod(tpl, "unload", Unload);
+  Nan::SetPrototypeMethod(tpl, "quantize", Quantize);
+  Nan::SetPrototypeMethod(tpl, "saveQuantized", SaveQuantized);
+  Nan::SetPrototypeMethod(tpl, "loadQuantized", LoadQuantized);
+  Nan::SetPrototypeMethod(tpl, "setRerank", SetRerank);
+  Nan::SetPrototypeMethod(tpl, "removeItem", RemoveItem);
+  Nan::SetPrototypeMethod(tpl, "compact", Compact);
   Nan::SetPrototypeMethod(tpl, "getItem", GetItem);
+  Nan::SetPrototypeMethod(tpl, "getItemPacked", GetItemPacked);
+  Nan::SetPrototypeMethod(tpl, "setPayload", SetPayload);
+  Nan::SetPrototypeMethod(tpl, "getPayload", GetPayload);
   Nan::SetPrototypeMethod(tpl, "getNNsByVector", GetNNSByVector);
+  Nan::SetPrototypeMethod(tpl, "getNNsByVectorBatch", GetNNSByVectorBatch);
+  Nan::SetPrototypeMethod(tpl, "getNNsByVectorPacked", GetNNSByVectorPacked);
   Nan::SetPrototypeMethod(tpl, "getNNsByItem", GetNNSByItem);
+  Nan::SetPrototypeMethod(tpl, "getNNsExact", GetNNSExact);
+  Nan::SetPrototypeMethod(tpl, "buildKnnGraph", BuildKnnGraph);
+  Nan::SetPrototypeMethod(tpl, "setExactThreshold", SetExactThreshold);
   Nan::SetPrototypeMethod(tpl, "getNItems", GetNItems);
+  Nan::SetPrototypeMethod(tpl, "getStats", GetStats);
+  Nan::SetPrototypeMethod(tpl, "getLastQueryStats", GetLastQueryStats);
+  Nan::SetPrototypeMethod(tpl, "resetStats", ResetStats);
   Nan::SetPrototypeMethod(tpl, "getDistance", GetDistance);
+  Nan::SetPrototypeMethod(tpl, "createFilter", CreateFilter);
 
   constructor.Reset(tpl->GetFunction(context).ToLocalChecked());
   exports->Set(context, Nan::New("Annoy").ToLocalChecked(), tpl->GetFunction(context).ToLocalChecked()).Check();
@@ -78,6 +163,7 @@ void AnnoyIndexWrapper::New(const Nan::FunctionCallbackInfo<v8::Value>& info) {
     // Invoked as constructor: `new AnnoyIndexWrapper(...)`
     double dimensions = info[0]->IsNullOrUndefined() ? 0 : info[0]->NumberValue(context).FromJust();
     Local<String> metricString;
+    Local<String> storageString;
 
     if (!info[1]->IsNullOrUndefined()) {
       Nan::MaybeLocal<String> s = Nan::To<String>(info[1]);
@@ -85,9 +171,15 @@ void AnnoyIndexWrapper::New(const Nan::FunctionCallbackInfo<v8::Value>& info) {
         metricString = s.ToLocalChecked();
       }
     }
+    if (!info[2]->IsNullOrUndefined()) {
+      Nan::MaybeLocal<String> s = Nan::To<String>(info[2]);
+      if (!s.IsEmpty()) {
+        storageString = s.ToLocalChecked();
+      }
+    }
 
     AnnoyIndexWrapper* obj = new AnnoyIndexWrapper(
-      (int)dimensions, *Nan::Utf8String(metricString)
+      (int)dimensions, *Nan::Utf8String(metricString), *Nan::Utf8String(storageString)
     );
     obj->Wrap(info.This());
     info.GetReturnValue().Set(info.This());
@@ -95,30 +187,148 @@ void AnnoyIndexWrapper::New(const Nan::FunctionCallbackInfo<v8::Value>& info) {
 }
 
 void AnnoyIndexWrapper::AddItem(const Nan::FunctionCallbackInfo<v8::Value>& info) {
+  // Get out object.
+  AnnoyIndexWrapper* obj = ObjectWrap::Unwrap<AnnoyIndexWrapper>(info.Holder());
+  if (!checkIdle(obj, "addItem")) {
+    return;
+  }
+  // Get out index, which can be left out, passing just the vector, to
+  // append. Anything else that isn't an index throws.
+  int index = obj->annoyIndex->get_n_items();
+  int arrayParam = 0;
+  if (!info[0]->IsArray() && !info[0]->IsTypedArray()) {
+    if (!getIndexParam(info, 0, "addItem", &index)) {
+      return;
+    }
+    arrayParam = 1;
+  }
+  // Get out array.
+  int length = obj->getDimensions();
+  std::vector<float> vec(length, 0.0f);
+  if (!getFloatArrayParam(info, arrayParam, length, vec.data())) {
+    return;
+  }
+  char *error = NULL;
+  if (!obj->annoyIndex->add_item(index, vec.data(), &error)) {
+    std::string message = std::string("addItem: ") + error;
+    free(error);
+    return Nan::ThrowError(message.c_str());
+  }
+}
+
+void AnnoyIndexWrapper::AddItems(const Nan::FunctionCallbackInfo<v8::Value>& info) {
   v8::Local<v8::Context> context = info.GetIsolate()->GetCurrentContext();
   // Get out object.
   AnnoyIndexWrapper* obj = ObjectWrap::Unwrap<AnnoyIndexWrapper>(info.Holder());
-  // Get out index.
-  if (info[0]->IsNumber()) {
-    int index = info[0]->NumberValue(context).FromJust();
-    // Get out array.
-    int length = obj->getDimensions();
-    std::vector<float> vec(length, 0.0f);
-    if (getFloatArrayParam(info, 1, vec.data())) {
-      obj->annoyIndex->add_item(index, vec.data());
+  if (!checkIdle(obj, "addItems")) {
+    return;
+  }
+  // Get out the row-major matrix of vectors.
+  int length = obj->getDimensions();
+  if (!info[0]->IsFloat32Array()) {
+    return Nan::ThrowTypeError(
+      "addItems: Expected a Float32Array of vectors"
+    );
+  }
+  Nan::TypedArrayContents<float> contents(info[0]);
+  if (length <= 0 || contents.length() % length != 0) {
+    return Nan::ThrowRangeError(
+      "addItems: Matrix length is not a multiple of the index dimensions"
+    );
+  }
+  int numberOfRows = contents.length() / length;
+  // Get out the external id of each row instead, if there's an array.
+  if (info[1]->IsArray() || info[1]->IsBigUint64Array()) {
+    std::vector<uint64_t> ids;
+    if (!getIdArrayParam(info, 1, &ids)) {
+      return Nan::ThrowTypeError("addItems: Expected ids as non-negative integers or BigInts");
     }
-  } else { // info[0] is null, undefined, or array
-    int length = obj->getDimensions();
-    std::vector<float> vec(length, 0.0f);
-    if (getFloatArrayParam(info, 0, vec.data())) {
-      obj->annoyIndex->add_item(obj->annoyIndex->get_n_items(), vec.data());
+    if ((int)ids.size() != numberOfRows) {
+      return Nan::ThrowRangeError("addItems: Number of ids does not match the number of rows");
+    }
+    for (int i = 0; i < numberOfRows; i++) {
+      char *error = NULL;
+      if (!obj->annoyIndex->add_item_with_id(ids[i], *contents + (size_t)i * length, &error)) {
+        std::string message = std::string("addItems: ") + error;
+        free(error);
+        return Nan::ThrowError(message.c_str());
+      }
     }
+    return;
+  }
+  // Get out the id of the first row, which defaults to appending.
+  int startIndex = info[1]->IsNullOrUndefined() ?
+    obj->annoyIndex->get_n_items() : info[1]->NumberValue(context).FromJust();
+  int numberOfThreads = info[2]->IsNullOrUndefined() ? 1 : info[2]->NumberValue(context).FromJust();
+  if (startIndex < 0) {
+    return Nan::ThrowRangeError("addItems: Start index is negative");
+  }
+
+  char *error = NULL;
+  if (!obj->annoyIndex->add_items(startIndex, *contents, numberOfRows, numberOfThreads, &error)) {
+    std::string message = std::string("addItems: ") + error;
+    free(error);
+    return Nan::ThrowError(message.c_str());
+  }
+}
+
+void AnnoyIndexWrapper::AddItemWithId(const Nan::FunctionCallbackInfo<v8::Value>& info) {
+  // Get out object.
+  AnnoyIndexWrapper* obj = ObjectWrap::Unwrap<AnnoyIndexWrapper>(info.Holder());
+  if (!checkIdle(obj, "addItemWithId")) {
+    return;
+  }
+  // Get out id.
+  uint64_t id;
+  if (!getIdValue(info[0], &id)) {
+    return Nan::ThrowTypeError("addItemWithId: Expected an id, as a non-negative integer or a BigInt");
+  }
+  // Get out array.
+  int length = obj->getDimensions();
+  std::vector<float> vec(length, 0.0f);
+  if (!getFloatArrayParam(info, 1, length, vec.data())) {
+    return;
+  }
+  char *error = NULL;
+  if (!obj->annoyIndex->add_item_with_id(id, vec.data(), &error)) {
+    std::string message = std::string("addItemWithId: ") + error;
+    free(error);
+    return Nan::ThrowError(message.c_str());
+  }
+}
+
+void AnnoyIndexWrapper::AddItemPacked(const Nan::FunctionCallbackInfo<v8::Value>& info) {
+  v8::Local<v8::Context> context = info.GetIsolate()->GetCurrentContext();
+  // Get out object.
+  AnnoyIndexWrapper* obj = ObjectWrap::Unwrap<AnnoyIndexWrapper>(info.Holder());
+  if (!checkIdle(obj, "addItemPacked") || !checkHamming(obj, "addItemPacked")) {
+    return;
+  }
+  // Get out index.
+  int index = info[0]->IsNullOrUndefined() ?
+    obj->annoyIndex->get_n_items() : info[0]->NumberValue(context).FromJust();
+  if (index < 0) {
+    return Nan::ThrowRangeError("addItemPacked: Index is negative");
+  }
+  // Get out words.
+  std::vector<uint64_t> words(obj->hammingIndex->get_packed_size());
+  if (!getPackedParam(info, 1, "addItemPacked", &words)) {
+    return;
+  }
+  char *error = NULL;
+  if (!obj->hammingIndex->packed()->add_item(index, words.data(), &error)) {
+    std::string message = std::string("addItemPacked: ") + error;
+    free(error);
+    return Nan::ThrowError(message.c_str());
   }
 }
 
 void AnnoyIndexWrapper::OnDiskBuild(const Nan::FunctionCallbackInfo<v8::Value>& info) {
   // Get out object.
   AnnoyIndexWrapper* obj = ObjectWrap::Unwrap<AnnoyIndexWrapper>(info.Holder());
+  if (!checkIdle(obj, "onDiskBuild")) {
+    return;
+  }
   // Get out filename.
   Local<String> filenameString;
 
@@ -139,17 +349,82 @@ void AnnoyIndexWrapper::Build(const Nan::FunctionCallbackInfo<v8::Value>& info)
   v8::Local<v8::Context> context = info.GetIsolate()->GetCurrentContext();
   // Get out object.
   AnnoyIndexWrapper* obj = ObjectWrap::Unwrap<AnnoyIndexWrapper>(info.Holder());
+  if (!checkIdle(obj, "build")) {
+    return;
+  }
   // Get out numberOfTrees.
   int numberOfTrees = info[0]->IsNullOrUndefined() ? 1 : info[0]->NumberValue(context).FromJust();
   // printf("%s\n", "Calling build");
   obj->annoyIndex->build(numberOfTrees);
 }
 
+void AnnoyIndexWrapper::BuildAsync(const Nan::FunctionCallbackInfo<v8::Value>& info) {
+  v8::Local<v8::Context> context = info.GetIsolate()->GetCurrentContext();
+  // Get out object.
+  AnnoyIndexWrapper* obj = ObjectWrap::Unwrap<AnnoyIndexWrapper>(info.Holder());
+  if (!checkIdle(obj, "buildAsync")) {
+    return;
+  }
+  // Get out numberOfTrees and numberOfThreads (-1 means one per core).
+  int numberOfTrees = info[0]->IsNullOrUndefined() ? 1 : info[0]->NumberValue(context).FromJust();
+  int numberOfThreads = info[1]->IsNullOrUndefined() ? -1 : info[1]->NumberValue(context).FromJust();
+
+  BuildWorker *worker = new BuildWorker(
+    getCallbackOrPromise(info, 2), obj, numberOfTrees, numberOfThreads
+  );
+  // Keep the index object alive until the build finishes.
+  worker->SaveToPersistent("index", info.Holder());
+  obj->buildingItemCount = obj->annoyIndex->get_n_items();
+  obj->isBuilding = true;
+  Nan::AsyncQueueWorker(worker);
+}
+
+void AnnoyIndexWrapper::BuildFromFile(const Nan::FunctionCallbackInfo<v8::Value>& info) {
+  v8::Local<v8::Context> context = info.GetIsolate()->GetCurrentContext();
+  // Get out object.
+  AnnoyIndexWrapper* obj = ObjectWrap::Unwrap<AnnoyIndexWrapper>(info.Holder());
+  if (!checkIdle(obj, "buildFromFile")) {
+    return;
+  }
+  // Get out the file paths.
+  if (!info[0]->IsString() || !info[1]->IsString()) {
+    return Nan::ThrowTypeError("buildFromFile: Expected the paths of the vector file and the index file");
+  }
+  std::string vectorsPath = *Nan::Utf8String(info[0]);
+  std::string indexPath = *Nan::Utf8String(info[1]);
+  // Get out numberOfTrees and memoryLimit (0 means the default).
+  int numberOfTrees = info[2]->IsNullOrUndefined() ? 1 : info[2]->NumberValue(context).FromJust();
+  double memoryLimit = info[3]->IsNullOrUndefined() ? 0 : info[3]->NumberValue(context).FromJust();
+  if (!(memoryLimit >= 0)) {
+    return Nan::ThrowRangeError("buildFromFile: memoryLimit is negative");
+  }
+
+  BuildFromFileWorker *worker = new BuildFromFileWorker(
+    getCallbackOrPromise(info, 4), obj, vectorsPath, indexPath,
+    numberOfTrees, (size_t)memoryLimit
+  );
+  // Keep the index object alive until the build finishes.
+  worker->SaveToPersistent("index", info.Holder());
+  obj->buildingItemCount = obj->annoyIndex->get_n_items();
+  obj->isBuilding = true;
+  Nan::AsyncQueueWorker(worker);
+}
+
 void AnnoyIndexWrapper::Save(const Nan::FunctionCallbackInfo<v8::Value>& info) {
   bool result = false;
 
   // Get out object.
   AnnoyIndexWrapper* obj = ObjectWrap::Unwrap<AnnoyIndexWrapper>(info.Holder());
+  if (!checkIdle(obj, "save")) {
+    return;
+  }
+  // Get out the optional file header flag, or 'compact' for the compact
+  // layout, which always has a header.
+  if (!info[1]->IsNullOrUndefined()) {
+    bool compact = info[1]->IsString() && std::string(*Nan::Utf8String(info[1])) == "compact";
+    obj->annoyIndex->set_compact_layout(compact);
+    obj->annoyIndex->set_file_header(compact || info[1]->BooleanValue(info.GetIsolate()));
+  }
   // Get out file path.
   if (!info[0]->IsNullOrUndefined()) {
     Nan::MaybeLocal<String> maybeStr = Nan::To<String>(info[0]);
@@ -166,6 +441,9 @@ void AnnoyIndexWrapper::Load(const Nan::FunctionCallbackInfo<v8::Value>& info) {
   bool result = false;
   // Get out object.
   AnnoyIndexWrapper* obj = ObjectWrap::Unwrap<AnnoyIndexWrapper>(info.Holder());
+  if (!checkIdle(obj, "load")) {
+    return;
+  }
   // Get out file path.
   if (!info[0]->IsNullOrUndefined()) {
     if (info[0]->IsArrayBuffer()) {
@@ -174,12 +452,20 @@ void AnnoyIndexWrapper::Load(const Nan::FunctionCallbackInfo<v8::Value>& info) {
       // result = obj->annoyIndex->loadBuffer(bufContents->Data(), bufContents->ByteLength());
       ArrayBuffer::Contents bufContents = ArrayBuffer::Cast(*inputBuf)->GetContents();
       bool makeCopy = info[1]->IsBoolean() ? info[1]->BooleanValue(info.GetIsolate()) : false;
+      if (obj->annoyDimensions <= 0 && annoy_has_file_header(bufContents.Data(), bufContents.ByteLength())) {
+        obj->createIndexFromHeader(*(AnnoyFileHeader *)bufContents.Data());
+      }
       result = obj->annoyIndex->loadBuffer(bufContents.Data(), bufContents.ByteLength(), makeCopy);
     } else if (info[0]->IsString()) {
       Nan::MaybeLocal<String> maybeStr = Nan::To<String>(info[0]);
       v8::Local<String> str;
       if (maybeStr.ToLocal(&str)) {
-        result = obj->annoyIndex->load(*Nan::Utf8String(str));
+        Nan::Utf8String path(str);
+        AnnoyFileHeader header;
+        if (obj->annoyDimensions <= 0 && annoy_read_file_header(*path, &header)) {
+          obj->createIndexFromHeader(header);
+        }
+        result = obj->annoyIndex->load(*path);
       }
     }
   }
@@ -188,59 +474,305 @@ void AnnoyIndexWrapper::Load(const Nan::FunctionCallbackInfo<v8::Value>& info) {
 
 void AnnoyIndexWrapper::Unload(const Nan::FunctionCallbackInfo<v8::Value>& info) {
   AnnoyIndexWrapper* obj = ObjectWrap::Unwrap<AnnoyIndexWrapper>(info.Holder());
+  if (!checkIdle(obj, "unload")) {
+    return;
+  }
   obj->annoyIndex->unload();
 }
 
+void AnnoyIndexWrapper::Quantize(const Nan::FunctionCallbackInfo<v8::Value>& info) {
+  // Get out object.
+  AnnoyIndexWrapper* obj = ObjectWrap::Unwrap<AnnoyIndexWrapper>(info.Holder());
+  if (!checkIdle(obj, "quantize")) {
+    return;
+  }
+  char *error = NULL;
+  if (!obj->annoyIndex->quantize(&error)) {
+    std::string message = std::string("quantize: ") + error;
+    free(error);
+    return Nan::ThrowError(message.c_str());
+  }
+}
+
+void AnnoyIndexWrapper::SaveQuantized(const Nan::FunctionCallbackInfo<v8::Value>& info) {
+  bool result = false;
+  // Get out object.
+  AnnoyIndexWrapper* obj = ObjectWrap::Unwrap<AnnoyIndexWrapper>(info.Holder());
+  if (!checkNotBuilding(obj, "saveQuantized")) {
+    return;
+  }
+  // Get out file path.
+  if (!info[0]->IsNullOrUndefined()) {
+    Nan::MaybeLocal<String> maybeStr = Nan::To<String>(info[0]);
+    v8::Local<String> str;
+    if (maybeStr.ToLocal(&str)) {
+      result = obj->annoyIndex->save_quantized(*Nan::Utf8String(str));
+    }
+  }
+  info.GetReturnValue().Set(Nan::New(result));
+}
+
+void AnnoyIndexWrapper::LoadQuantized(const Nan::FunctionCallbackInfo<v8::Value>& info) {
+  bool result = false;
+  // Get out object.
+  AnnoyIndexWrapper* obj = ObjectWrap::Unwrap<AnnoyIndexWrapper>(info.Holder());
+  if (!checkIdle(obj, "loadQuantized")) {
+    return;
+  }
+  // Get out file path.
+  if (!info[0]->IsNullOrUndefined()) {
+    Nan::MaybeLocal<String> maybeStr = Nan::To<String>(info[0]);
+    v8::Local<String> str;
+    if (maybeStr.ToLocal(&str)) {
+      result = obj->annoyIndex->load_quantized(*Nan::Utf8String(str));
+    }
+  }
+  info.GetReturnValue().Set(Nan::New(result));
+}
+
+void AnnoyIndexWrapper::SetRerank(const Nan::FunctionCallbackInfo<v8::Value>& info) {
+  v8::Local<v8::Context> context = info.GetIsolate()->GetCurrentContext();
+  // Get out object.
+  AnnoyIndexWrapper* obj = ObjectWrap::Unwrap<AnnoyIndexWrapper>(info.Holder());
+  if (!checkIdle(obj, "setRerank")) {
+    return;
+  }
+  // Get out the number of candidates to re-rank (-1 turns re-ranking off).
+  int rerank = info[0]->IsNullOrUndefined() ? 0 : info[0]->NumberValue(context).FromJust();
+  obj->annoyIndex->set_rerank(rerank);
+}
+
+void AnnoyIndexWrapper::SetExactThreshold(const Nan::FunctionCallbackInfo<v8::Value>& info) {
+  v8::Local<v8::Context> context = info.GetIsolate()->GetCurrentContext();
+  // Get out object.
+  AnnoyIndexWrapper* obj = ObjectWrap::Unwrap<AnnoyIndexWrapper>(info.Holder());
+  // Get out the item count below which searches are exact (0 turns it off).
+  int threshold = info[0]->IsNullOrUndefined() ? 0 : info[0]->NumberValue(context).FromJust();
+  if (threshold < 0) {
+    return Nan::ThrowRangeError(
+      "setExactThreshold: threshold is negative"
+    );
+  }
+  obj->exactThreshold = threshold;
+}
+
+void AnnoyIndexWrapper::RemoveItem(const Nan::FunctionCallbackInfo<v8::Value>& info) {
+  // Get out object.
+  AnnoyIndexWrapper* obj = ObjectWrap::Unwrap<AnnoyIndexWrapper>(info.Holder());
+  if (!checkIdle(obj, "removeItem")) {
+    return;
+  }
+  // Get out index.
+  int index;
+  if (obj->annoyIndex->has_item_ids()) {
+    if (!getIdParam(info, 0, "removeItem", &index)) {
+      return;
+    }
+  } else if (!getIndexParam(info, 0, "removeItem", &index)) {
+    return;
+  }
+  char *error = NULL;
+  if (!obj->annoyIndex->remove_item(index, &error)) {
+    std::string message = std::string("removeItem: ") + error;
+    free(error);
+    return Nan::ThrowError(message.c_str());
+  }
+}
+
+void AnnoyIndexWrapper::Compact(const Nan::FunctionCallbackInfo<v8::Value>& info) {
+  bool result = true;
+  // Get out object.
+  AnnoyIndexWrapper* obj = ObjectWrap::Unwrap<AnnoyIndexWrapper>(info.Holder());
+  if (!checkIdle(obj, "compact")) {
+    return;
+  }
+  char *error = NULL;
+  if (!obj->annoyIndex->compact_removed(&error)) {
+    std::string message = std::string("compact: ") + error;
+    free(error);
+    return Nan::ThrowError(message.c_str());
+  }
+  // Get out the optional file path to save the compacted index to.
+  if (!info[0]->IsNullOrUndefined()) {
+    result = false;
+    Nan::MaybeLocal<String> maybeStr = Nan::To<String>(info[0]);
+    v8::Local<String> str;
+    if (maybeStr.ToLocal(&str)) {
+      result = obj->annoyIndex->save(*Nan::Utf8String(str));
+    }
+  }
+  info.GetReturnValue().Set(Nan::New(result));
+}
+
 void AnnoyIndexWrapper::GetItem(const Nan::FunctionCallbackInfo<v8::Value>& info) {
   v8::Local<v8::Context> context = info.GetIsolate()->GetCurrentContext();
   Nan::HandleScope scope;
 
   // Get out object.
   AnnoyIndexWrapper* obj = ObjectWrap::Unwrap<AnnoyIndexWrapper>(info.Holder());
+  if (!checkNotBuilding(obj, "getItem")) {
+    return;
+  }
 
   // Get out index.
-  int index = info[0]->IsNullOrUndefined() ? 1 : info[0]->NumberValue(context).FromJust();
+  int index;
+  if (obj->annoyIndex->has_item_ids()) {
+    if (!getIdParam(info, 0, "getItem", &index)) {
+      return;
+    }
+  } else {
+    index = info[0]->IsNullOrUndefined() ? 1 : info[0]->NumberValue(context).FromJust();
 
-  int annoyIndexSize = obj->annoyIndex->get_n_items();
-  if (index < 0) {
-    index = annoyIndexSize - index;
-  }
-  if (index >= annoyIndexSize || index < 0) {
-    return Nan::ThrowError(
-      "getItem: Index out of bounds"
-    );
+    int annoyIndexSize = obj->annoyIndex->get_n_items();
+    if (index < 0) {
+      index = annoyIndexSize + index;
+    }
+    if (index >= annoyIndexSize || index < 0) {
+      return Nan::ThrowError(
+        "getItem: Index out of bounds"
+      );
+    }
   }
 
-  // Get the vector.
+  // Allocate the return array and copy the vector straight into it.
   int length = obj->getDimensions();
-  std::vector<float> vec(length, 0.0f);
-  obj->annoyIndex->get_item(index, vec.data());
+  Local<Float32Array> results = Float32Array::New(
+    ArrayBuffer::New(info.GetIsolate(), length * sizeof(float)), 0, length
+  );
+  obj->annoyIndex->get_item(index, *Nan::TypedArrayContents<float>(results));
+
+  info.GetReturnValue().Set(results);
+}
+
+void AnnoyIndexWrapper::GetItemPacked(const Nan::FunctionCallbackInfo<v8::Value>& info) {
+  v8::Local<v8::Context> context = info.GetIsolate()->GetCurrentContext();
+  Nan::HandleScope scope;
 
-  // Allocate the return array.
-  Local<Array> results = Nan::New<Array>(length);
-  for (int i = 0; i < length; ++i) {
-    // printf("Adding to array: %f\n", vec[i]);
-    Nan::Set(results, i, Nan::New<Number>(vec[i]));
+  // Get out object.
+  AnnoyIndexWrapper* obj = ObjectWrap::Unwrap<AnnoyIndexWrapper>(info.Holder());
+  if (!checkNotBuilding(obj, "getItemPacked") || !checkHamming(obj, "getItemPacked")) {
+    return;
+  }
+
+  // Get out index.
+  int index;
+  if (obj->annoyIndex->has_item_ids()) {
+    if (!getIdParam(info, 0, "getItemPacked", &index)) {
+      return;
+    }
+  } else {
+    index = info[0]->IsNullOrUndefined() ? 1 : info[0]->NumberValue(context).FromJust();
+
+    int annoyIndexSize = obj->annoyIndex->get_n_items();
+    if (index < 0) {
+      index = annoyIndexSize + index;
+    }
+    if (index >= annoyIndexSize || index < 0) {
+      return Nan::ThrowError(
+        "getItemPacked: Index out of bounds"
+      );
+    }
   }
 
+  // Allocate the return array and copy the words straight into it.
+  int numberOfWords = obj->hammingIndex->get_packed_size();
+  Local<BigUint64Array> results = BigUint64Array::New(
+    ArrayBuffer::New(info.GetIsolate(), numberOfWords * sizeof(uint64_t)), 0, numberOfWords
+  );
+  obj->hammingIndex->packed()->get_item(
+    index, (uint64_t *)*Nan::TypedArrayContents<uint8_t>(results)
+  );
+
   info.GetReturnValue().Set(results);
 }
 
+void AnnoyIndexWrapper::SetPayload(const Nan::FunctionCallbackInfo<v8::Value>& info) {
+  // Get out object.
+  AnnoyIndexWrapper* obj = ObjectWrap::Unwrap<AnnoyIndexWrapper>(info.Holder());
+  if (!checkIdle(obj, "setPayload")) {
+    return;
+  }
+  // Get out index.
+  int index;
+  if (obj->annoyIndex->has_item_ids()) {
+    if (!getIdParam(info, 0, "setPayload", &index)) {
+      return;
+    }
+  } else if (!getIndexParam(info, 0, "setPayload", &index)) {
+    return;
+  }
+  // Get out the payload, which is a string (stored as UTF-8) or bytes.
+  std::string payload;
+  if (info[1]->IsString()) {
+    Nan::Utf8String str(info[1]);
+    payload.assign(*str, str.length());
+  } else if (info[1]->IsArrayBufferView()) {
+    Nan::TypedArrayContents<char> contents(info[1]);
+    payload.assign(*contents, contents.length());
+  } else {
+    return Nan::ThrowTypeError("setPayload: Expected a string or a Buffer");
+  }
+  char *error = NULL;
+  if (!obj->annoyIndex->set_payload(index, payload.data(), payload.size(), &error)) {
+    std::string message = std::string("setPayload: ") + error;
+    free(error);
+    return Nan::ThrowError(message.c_str());
+  }
+}
+
+void AnnoyIndexWrapper::GetPayload(const Nan::FunctionCallbackInfo<v8::Value>& info) {
+  // Get out object.
+  AnnoyIndexWrapper* obj = ObjectWrap::Unwrap<AnnoyIndexWrapper>(info.Holder());
+  if (!checkNotBuilding(obj, "getPayload")) {
+    return;
+  }
+  // Get out index.
+  int index;
+  if (obj->annoyIndex->has_item_ids()) {
+    if (!getIdParam(info, 0, "getPayload", &index)) {
+      return;
+    }
+  } else if (!getIndexParam(info, 0, "getPayload", &index)) {
+    return;
+  }
+  info.GetReturnValue().Set(obj->payloadValue(index, info[1]));
+}
+
 void AnnoyIndexWrapper::GetDistance(const Nan::FunctionCallbackInfo<v8::Value>& info) {
   v8::Local<v8::Context> context = info.GetIsolate()->GetCurrentContext();
   // Get out object.
   AnnoyIndexWrapper* obj = ObjectWrap::Unwrap<AnnoyIndexWrapper>(info.Holder());
+  if (!checkNotBuilding(obj, "getDistance")) {
+    return;
+  }
 
   // Get out indexes.
-  int indexA = info[0]->IsNullOrUndefined() ? 0 : info[0]->NumberValue(context).FromJust();
-  int indexB = info[1]->IsNullOrUndefined() ? 0 : info[1]->NumberValue(context).FromJust();
+  int indexA, indexB;
+  if (obj->annoyIndex->has_item_ids()) {
+    if (!getIdParam(info, 0, "getDistance", &indexA) || !getIdParam(info, 1, "getDistance", &indexB)) {
+      return;
+    }
+  } else {
+    indexA = info[0]->IsNullOrUndefined() ? 0 : info[0]->NumberValue(context).FromJust();
+    indexB = info[1]->IsNullOrUndefined() ? 0 : info[1]->NumberValue(context).FromJust();
+  }
 
   // Return the distances.
   info.GetReturnValue().Set(obj->annoyIndex->get_distance(indexA, indexB));
 }
 
 void AnnoyIndexWrapper::GetNNSByVector(const Nan::FunctionCallbackInfo<v8::Value>& info) {
-  Isolate *isolate = info.GetIsolate();
+  findNNsByVector(info, "getNNsByVector", false);
+}
+
+void AnnoyIndexWrapper::GetNNSExact(const Nan::FunctionCallbackInfo<v8::Value>& info) {
+  findNNsByVector(info, "getNNsExact", true);
+}
+
+// Does getNNsByVector, or getNNsExact if exact is true. They take the same
+// params, though getNNsExact ignores searchK.
+void AnnoyIndexWrapper::findNNsByVector(const Nan::FunctionCallbackInfo<v8::Value>& info,
+  const char *methodName, bool exact) {
   Nan::HandleScope scope;
 
   int numberOfNeighbors, searchK;
@@ -249,6 +781,9 @@ void AnnoyIndexWrapper::GetNNSByVector(const Nan::FunctionCallbackInfo<v8::Value
 
   // Get out object.
   AnnoyIndexWrapper* obj = ObjectWrap::Unwrap<AnnoyIndexWrapper>(info.Holder());
+  if (!checkNotBuilding(obj, methodName)) {
+    return;
+  }
 
   int annoyIndexSize = obj->annoyIndex->get_n_items();
   if (numberOfNeighbors >= annoyIndexSize) {
@@ -258,38 +793,232 @@ void AnnoyIndexWrapper::GetNNSByVector(const Nan::FunctionCallbackInfo<v8::Value
   // Get out input array.
   int length = obj->getDimensions();
   std::vector<float> vec(length, 0.0f);
-  if (!getFloatArrayParam(info, 0, vec.data())) {
+  if (!getFloatArrayParam(info, 0, length, vec.data())) {
+    return;
+  }
+  // Get out optional filter.
+  AnnoyItemSet<int> filterItems;
+  AnnoyFilter<int> filter;
+  const AnnoyFilter<int> *filterPtr = nullptr;
+  if (!getFilterParams(info, filterItems, filter, &filterPtr)) {
     return;
   }
-  // Get out optional filter array.
-  std::vector<int> filterVec;
-  std::vector<int> *filterPtr = nullptr;
 
-  Local<String> filterString = String::Empty(isolate);
-  if (!info[4]->IsNullOrUndefined()) {
-    Nan::MaybeLocal<String> s = Nan::To<String>(info[4]);
-    if (!s.IsEmpty()) {
-      filterString = s.ToLocalChecked();
-    }
-    Local<String> FILTER_INCLUDE = String::NewFromUtf8(isolate, "include").ToLocalChecked();
-    Local<String> FILTER_EXCLUDE = String::NewFromUtf8(isolate, "exclude").ToLocalChecked();
-    if ((info[4]->StrictEquals(FILTER_INCLUDE) || info[4]->StrictEquals(FILTER_EXCLUDE)) == false) {
-      // Local<String> INVALID_FILTER_VALUE = String::NewFromUtf8(isolate,
-      //   "Expected 'include' or 'exclude' for filter_type but received '" +
+  std::vector<int> nnIndexes;
+  std::vector<float> distances;
+  std::vector<float> *distancesPtr = nullptr;
+
+  if (includeDistances) {
+    distancesPtr = &distances;
+  }
+
+  // Make the call.
+  if (exact || obj->useExactSearch()) {
+    obj->annoyIndex->get_nns_exact(
+      vec.data(), numberOfNeighbors, &nnIndexes, distancesPtr, filterPtr
+    );
+  } else {
+    obj->annoyIndex->get_nns_by_vector(
+      vec.data(), numberOfNeighbors, searchK, &nnIndexes, distancesPtr, filterPtr
+    );
+  }
+
+  setNNReturnValues(numberOfNeighbors, includeDistances, nnIndexes, distances, info);
+}
+
+void AnnoyIndexWrapper::GetNNSByVectorBatch(const Nan::FunctionCallbackInfo<v8::Value>& info) {
+  Isolate *isolate = info.GetIsolate();
+  v8::Local<v8::Context> context = isolate->GetCurrentContext();
+
+  // Get out object.
+  AnnoyIndexWrapper* obj = ObjectWrap::Unwrap<AnnoyIndexWrapper>(info.Holder());
+  if (!checkNotBuilding(obj, "getNNsByVectorBatch")) {
+    return;
+  }
+
+  // Get out the queries, which are packed one after another.
+  int length = obj->getDimensions();
+  if (!info[0]->IsFloat32Array()) {
+    return Nan::ThrowTypeError(
+      "getNNsByVectorBatch: Expected a Float32Array of queries"
+    );
+  }
+  Nan::TypedArrayContents<float> queryContents(info[0]);
+  if (length <= 0 || queryContents.length() % length != 0) {
+    return Nan::ThrowRangeError(
+      "getNNsByVectorBatch: Queries length is not a multiple of the index dimensions"
+    );
+  }
+  int numberOfQueries = queryContents.length() / length;
+  // Copied, because JS is free to change the array while we work.
+  std::vector<float> queries(*queryContents, *queryContents + queryContents.length());
+
+  int numberOfNeighbors = 1;
+  int searchK = -1;
+  if (!info[1]->IsNullOrUndefined() &&
+      !getIntParam(info, 1, "getNNsByVectorBatch", "n", 0, &numberOfNeighbors)) {
+    return;
+  }
+  if (!info[2]->IsNullOrUndefined() &&
+      !getIntParam(info, 2, "getNNsByVectorBatch", "searchK", -1, &searchK)) {
+    return;
+  }
+  // No query can find more neighbors than there are items, so there's no
+  // need for slots for them.
+  numberOfNeighbors = std::min(numberOfNeighbors, (int)obj->annoyIndex->get_n_items());
+
+  // Allocate the results up front so the worker can write straight into them.
+  // External ids need 64 bits.
+  size_t resultCount = (size_t)numberOfQueries * numberOfNeighbors;
+  bool hasIds = obj->annoyIndex->has_item_ids();
+  Local<TypedArray> jsNNIndexes;
+  if (hasIds) {
+    jsNNIndexes = BigUint64Array::New(
+      ArrayBuffer::New(isolate, resultCount * sizeof(uint64_t)), 0, resultCount
+    );
+  } else {
+    jsNNIndexes = Int32Array::New(
+      ArrayBuffer::New(isolate, resultCount * sizeof(int)), 0, resultCount
+    );
+  }
+  Local<Float32Array> jsDistances = Float32Array::New(
+    ArrayBuffer::New(isolate, resultCount * sizeof(float)), 0, resultCount
+  );
+  Local<Object> jsResultObject = Nan::New<Object>();
+  jsResultObject->Set(context, Nan::New("neighbors").ToLocalChecked(), jsNNIndexes).Check();
+  jsResultObject->Set(context, Nan::New("distances").ToLocalChecked(), jsDistances).Check();
+
+  void *nnIndexes = *Nan::TypedArrayContents<uint8_t>(jsNNIndexes);
+  QueryBatchWorker *worker = new QueryBatchWorker(
+    getCallbackOrPromise(info, 3), obj, queries, numberOfNeighbors, searchK,
+    hasIds ? nullptr : (int *)nnIndexes, hasIds ? (uint64_t *)nnIndexes : nullptr,
+    *Nan::TypedArrayContents<float>(jsDistances)
+  );
+  worker->SaveToPersistent("index", info.Holder());
+  worker->SaveToPersistent("result", jsResultObject);
+  obj->pendingQueries += 1;
+  Nan::AsyncQueueWorker(worker);
+}
 
-      // ).ToLocalChecked();
+void AnnoyIndexWrapper::BuildKnnGraph(const Nan::FunctionCallbackInfo<v8::Value>& info) {
+  Isolate *isolate = info.GetIsolate();
+  v8::Local<v8::Context> context = isolate->GetCurrentContext();
+
+  // Get out object.
+  AnnoyIndexWrapper* obj = ObjectWrap::Unwrap<AnnoyIndexWrapper>(info.Holder());
+  if (!checkNotBuilding(obj, "buildKnnGraph")) {
+    return;
+  }
+
+  // Get out params.
+  int numberOfNeighbors = 10;
+  int searchK = -1;
+  int numberOfThreads = 0;
+  if (!info[0]->IsNullOrUndefined() &&
+      !getIntParam(info, 0, "buildKnnGraph", "k", 1, &numberOfNeighbors)) {
+    return;
+  }
+  if (!info[1]->IsNullOrUndefined() &&
+      !getIntParam(info, 1, "buildKnnGraph", "searchK", -1, &searchK)) {
+    return;
+  }
+  if (!info[2]->IsNullOrUndefined() &&
+      !getIntParam(info, 2, "buildKnnGraph", "numberOfThreads", 0, &numberOfThreads)) {
+    return;
+  }
+  std::string path;
+  if (!info[3]->IsNullOrUndefined()) {
+    if (!info[3]->IsString()) {
       return Nan::ThrowTypeError(
-        "Expected 'include' or 'exclude' for filter_type"
+        "buildKnnGraph: Expected a string path"
       );
     }
-    if (!info[5]->IsNullOrUndefined()) {
-      filterPtr = &filterVec;
-      if (!getIntArrayParam(info, 5, filterPtr)) {
-        return Nan::ThrowError(
-          "Library error: failed to parse filter_vector for values"
-        );
-      }
+    path = *Nan::Utf8String(info[3]);
+  }
+
+  // Without a path, allocate the rows up front so the worker can write
+  // straight into them, like getNNsByVectorBatch does.
+  size_t numberOfItems = obj->annoyIndex->get_n_items();
+  // An item has at most n - 1 other items to be neighbors.
+  if (numberOfItems > 1) {
+    numberOfNeighbors = (int)std::min<size_t>(numberOfNeighbors, numberOfItems - 1);
+  }
+  if (path.empty() && numberOfItems > TypedArray::kMaxLength / numberOfNeighbors) {
+    return Nan::ThrowRangeError(
+      "buildKnnGraph: The graph is too large to return; pass a path to write it to a file"
+    );
+  }
+  size_t resultCount = path.empty() ? numberOfItems * numberOfNeighbors : 0;
+  bool hasIds = obj->annoyIndex->has_item_ids();
+  Local<Object> jsResultObject = Nan::New<Object>();
+  void *nnIndexes = nullptr;
+  float *distances = nullptr;
+  uint64_t *rowIds = nullptr;
+  if (path.empty()) {
+    Local<TypedArray> jsNNIndexes;
+    if (hasIds) {
+      jsNNIndexes = BigUint64Array::New(
+        ArrayBuffer::New(isolate, resultCount * sizeof(uint64_t)), 0, resultCount
+      );
+      Local<BigUint64Array> jsRowIds = BigUint64Array::New(
+        ArrayBuffer::New(isolate, numberOfItems * sizeof(uint64_t)), 0, numberOfItems
+      );
+      jsResultObject->Set(context, Nan::New("ids").ToLocalChecked(), jsRowIds).Check();
+      rowIds = *Nan::TypedArrayContents<uint64_t>(jsRowIds);
+    } else {
+      jsNNIndexes = Int32Array::New(
+        ArrayBuffer::New(isolate, resultCount * sizeof(int)), 0, resultCount
+      );
     }
+    Local<Float32Array> jsDistances = Float32Array::New(
+      ArrayBuffer::New(isolate, resultCount * sizeof(float)), 0, resultCount
+    );
+    jsResultObject->Set(context, Nan::New("neighbors").ToLocalChecked(), jsNNIndexes).Check();
+    jsResultObject->Set(context, Nan::New("distances").ToLocalChecked(), jsDistances).Check();
+    nnIndexes = *Nan::TypedArrayContents<uint8_t>(jsNNIndexes);
+    distances = *Nan::TypedArrayContents<float>(jsDistances);
+  }
+
+  KnnGraphWorker *worker = new KnnGraphWorker(
+    getCallbackOrPromise(info, 4), obj, numberOfNeighbors, searchK, numberOfThreads, path,
+    hasIds ? nullptr : (int *)nnIndexes, hasIds ? (uint64_t *)nnIndexes : nullptr,
+    distances, rowIds
+  );
+  worker->SaveToPersistent("index", info.Holder());
+  worker->SaveToPersistent("result", jsResultObject);
+  obj->pendingQueries += 1;
+  Nan::AsyncQueueWorker(worker);
+}
+
+void AnnoyIndexWrapper::GetNNSByVectorPacked(const Nan::FunctionCallbackInfo<v8::Value>& info) {
+  Nan::HandleScope scope;
+
+  int numberOfNeighbors, searchK;
+  bool includeDistances;
+  getSupplementaryGetNNsParams(info, numberOfNeighbors, searchK, includeDistances);
+
+  // Get out object.
+  AnnoyIndexWrapper* obj = ObjectWrap::Unwrap<AnnoyIndexWrapper>(info.Holder());
+  if (!checkNotBuilding(obj, "getNNsByVectorPacked") || !checkHamming(obj, "getNNsByVectorPacked")) {
+    return;
+  }
+
+  int annoyIndexSize = obj->annoyIndex->get_n_items();
+  if (numberOfNeighbors >= annoyIndexSize) {
+    numberOfNeighbors = annoyIndexSize - 1;
+  }
+
+  // Get out input words.
+  std::vector<uint64_t> words(obj->hammingIndex->get_packed_size());
+  if (!getPackedParam(info, 0, "getNNsByVectorPacked", &words)) {
+    return;
+  }
+  // Get out optional filter.
+  AnnoyItemSet<int> filterItems;
+  AnnoyFilter<int> filter;
+  const AnnoyFilter<int> *filterPtr = nullptr;
+  if (!getFilterParams(info, filterItems, filter, &filterPtr)) {
+    return;
   }
 
   std::vector<int> nnIndexes;
@@ -301,8 +1030,8 @@ void AnnoyIndexWrapper::GetNNSByVector(const Nan::FunctionCallbackInfo<v8::Value
   }
 
   // Make the call.
-  obj->annoyIndex->get_nns_by_vector(
-    vec.data(), numberOfNeighbors, searchK, &nnIndexes, distancesPtr, *Nan::Utf8String(filterString), filterPtr
+  obj->hammingIndex->get_nns_by_packed_vector(
+    words.data(), numberOfNeighbors, searchK, &nnIndexes, distancesPtr, filterPtr
   );
 
   setNNReturnValues(numberOfNeighbors, includeDistances, nnIndexes, distances, info);
@@ -314,22 +1043,32 @@ void AnnoyIndexWrapper::GetNNSByItem(const Nan::FunctionCallbackInfo<v8::Value>&
 
   // Get out object.
   AnnoyIndexWrapper* obj = ObjectWrap::Unwrap<AnnoyIndexWrapper>(info.Holder());
+  if (!checkNotBuilding(obj, "getNNsByItem")) {
+    return;
+  }
 
   if (info[0]->IsNullOrUndefined()) {
     return;
   }
 
   // Get out params.
-  int index = info[0]->NumberValue(context).FromJust();
+  int index;
+  if (obj->annoyIndex->has_item_ids()) {
+    if (!getIdParam(info, 0, "getNNsByItem", &index)) {
+      return;
+    }
+  } else {
+    index = info[0]->NumberValue(context).FromJust();
 
-  int annoyIndexSize = obj->annoyIndex->get_n_items();
-  if (index < 0) {
-    index = annoyIndexSize - index;
-  }
-  if (index >= annoyIndexSize || index < 0) {
-    return Nan::ThrowError(
-      "getNNSByItem: Index out of bounds"
-    );
+    int annoyIndexSize = obj->annoyIndex->get_n_items();
+    if (index < 0) {
+      index = annoyIndexSize + index;
+    }
+    if (index >= annoyIndexSize || index < 0) {
+      return Nan::ThrowError(
+        "getNNSByItem: Index out of bounds"
+      );
+    }
   }
 
   int numberOfNeighbors, searchK;
@@ -337,20 +1076,12 @@ void AnnoyIndexWrapper::GetNNSByItem(const Nan::FunctionCallbackInfo<v8::Value>&
 
   getSupplementaryGetNNsParams(info, numberOfNeighbors, searchK, includeDistances);
 
-  // Get out optional filter array.
-  std::vector<int> filterVec;
-  std::vector<int> *filterPtr = nullptr;
-
-  Local<String> filterString;
-  if (!info[4]->IsNullOrUndefined()) {
-    Nan::MaybeLocal<String> s = Nan::To<String>(info[4]);
-    if (!s.IsEmpty()) {
-      filterString = s.ToLocalChecked();
-    }
-    if (!info[5]->IsNullOrUndefined()) {
-      filterPtr = &filterVec;
-      getIntArrayParam(info, 5, filterPtr);
-    }
+  // Get out optional filter.
+  AnnoyItemSet<int> filterItems;
+  AnnoyFilter<int> filter;
+  const AnnoyFilter<int> *filterPtr = nullptr;
+  if (!getFilterParams(info, filterItems, filter, &filterPtr)) {
+    return;
   }
 
   std::vector<int> nnIndexes;
@@ -362,9 +1093,17 @@ void AnnoyIndexWrapper::GetNNSByItem(const Nan::FunctionCallbackInfo<v8::Value>&
   }
 
   // Make the call.
-  obj->annoyIndex->get_nns_by_item(
-    index, numberOfNeighbors, searchK, &nnIndexes, distancesPtr, *Nan::Utf8String(filterString), filterPtr
-  );
+  if (obj->useExactSearch()) {
+    std::vector<float> vec(obj->getDimensions());
+    obj->annoyIndex->get_item(index, vec.data());
+    obj->annoyIndex->get_nns_exact(
+      vec.data(), numberOfNeighbors, &nnIndexes, distancesPtr, filterPtr
+    );
+  } else {
+    obj->annoyIndex->get_nns_by_item(
+      index, numberOfNeighbors, searchK, &nnIndexes, distancesPtr, filterPtr
+    );
+  }
 
   setNNReturnValues(numberOfNeighbors, includeDistances, nnIndexes, distances, info);
 }
@@ -384,11 +1123,59 @@ void AnnoyIndexWrapper::getSupplementaryGetNNsParams(
   includeDistances = info[3]->IsNullOrUndefined() ? false : Nan::To<bool>(info[3]).FromJust();
 }
 
+// Gets out the optional filter type (info[4]) and filter (info[5]), which is
+// either an array of item ids or a filter made by createFilter. An array is
+// turned into a set in filterItems; for indexes with external ids it holds
+// those ids. *filterPtr stays null if there's no filter. Returns false
+// after throwing if the params are invalid.
+bool AnnoyIndexWrapper::getFilterParams(
+  const Nan::FunctionCallbackInfo<v8::Value>& info,
+  AnnoyItemSet<int>& filterItems, AnnoyFilter<int>& filter,
+  const AnnoyFilter<int> **filterPtr) {
+  Isolate *isolate = info.GetIsolate();
+
+  if (info[4]->IsNullOrUndefined()) {
+    return true;
+  }
+  Local<String> FILTER_INCLUDE = String::NewFromUtf8(isolate, "include").ToLocalChecked();
+  Local<String> FILTER_EXCLUDE = String::NewFromUtf8(isolate, "exclude").ToLocalChecked();
+  if ((info[4]->StrictEquals(FILTER_INCLUDE) || info[4]->StrictEquals(FILTER_EXCLUDE)) == false) {
+    Nan::ThrowTypeError(
+      "Expected 'include' or 'exclude' for filter_type"
+    );
+    return false;
+  }
+  if (info[5]->IsNullOrUndefined()) {
+    return true;
+  }
+
+  if (AnnoyFilterWrapper::HasInstance(info[5])) {
+    AnnoyFilterWrapper* filterObj = ObjectWrap::Unwrap<AnnoyFilterWrapper>(info[5].As<Object>());
+    filter.items = &filterObj->items;
+  } else {
+    std::vector<int> filterVec;
+    AnnoyIndexWrapper* obj = ObjectWrap::Unwrap<AnnoyIndexWrapper>(info.Holder());
+    if (obj->annoyIndex->has_item_ids() ? !obj->getItemsForIds(info, 5, &filterVec) : !getIntArrayParam(info, 5, &filterVec)) {
+      Nan::ThrowError(
+        "Library error: failed to parse filter_vector for values"
+      );
+      return false;
+    }
+    obj->keepItemsInRange(&filterVec);
+    filterItems = AnnoyItemSet<int>(filterVec.begin(), filterVec.end());
+    filter.items = &filterItems;
+  }
+  filter.exclude = info[4]->StrictEquals(FILTER_EXCLUDE);
+  *filterPtr = &filter;
+  return true;
+}
+
 void AnnoyIndexWrapper::setNNReturnValues(
   int numberOfNeighbors, bool includeDistances,
   const std::vector<int>& nnIndexes, const std::vector<float>& distances,
   const Nan::FunctionCallbackInfo<v8::Value>& info) {
   v8::Local<v8::Context> context = info.GetIsolate()->GetCurrentContext();
+  AnnoyIndexWrapper* obj = ObjectWrap::Unwrap<AnnoyIndexWrapper>(info.Holder());
 
   // note: numberOfNeighbors might not be needed
   int resultVectorSize = nnIndexes.size();
@@ -397,11 +1184,22 @@ void AnnoyIndexWrapper::setNNReturnValues(
   Local<Array> jsNNIndexes = Nan::New<Array>(resultCount);
   for (int i = 0; i < resultCount; ++i) {
     // printf("Adding to neighbors array: %d\n", nnIndexes[i]);
-    Nan::Set(jsNNIndexes, i, Nan::New<Number>(nnIndexes[i]));
+    Nan::Set(jsNNIndexes, i, obj->itemValue(nnIndexes[i]));
   }
 
   Local<Object> jsResultObject;
   Local<Array> jsDistancesArray;
+  // Get out the optional payload flag, which is true for Buffers or an
+  // encoding for strings.
+  bool includePayloads = !info[6]->IsNullOrUndefined() && !info[6]->IsFalse();
+
+  if (includeDistances || includePayloads) {
+    jsResultObject = Nan::New<Object>();
+    jsResultObject->Set(context, Nan::New("neighbors").ToLocalChecked(), jsNNIndexes).Check();
+  }
+  else {
+    jsResultObject = jsNNIndexes.As<Object>();
+  }
 
   if (includeDistances) {
     // Allocate the distances array.
@@ -412,36 +1210,140 @@ void AnnoyIndexWrapper::setNNReturnValues(
       Nan::Set(jsDistancesArray, i, Nan::New<Number>(distances[i]));
     }
 
-    jsResultObject = Nan::New<Object>();
-    jsResultObject->Set(context, Nan::New("neighbors").ToLocalChecked(), jsNNIndexes).Check();
     jsResultObject->Set(context, Nan::New("distances").ToLocalChecked(), jsDistancesArray).Check();
   }
-  else {
-    jsResultObject = jsNNIndexes.As<Object>();
+
+  if (includePayloads) {
+    Local<Array> jsPayloadsArray = Nan::New<Array>(resultCount);
+    for (int i = 0; i < resultCount; ++i) {
+      Nan::Set(jsPayloadsArray, i, obj->payloadValue(nnIndexes[i], info[6]));
+    }
+    jsResultObject->Set(context, Nan::New("payloads").ToLocalChecked(), jsPayloadsArray).Check();
   }
 
   info.GetReturnValue().Set(jsResultObject);
 }
 
+void AnnoyIndexWrapper::CreateFilter(const Nan::FunctionCallbackInfo<v8::Value>& info) {
+  v8::Local<v8::Value> ids = info[0];
+  // Filters hold items, so external ids are looked up once, here, and ids
+  // that can't match any item are dropped rather than taking up bits.
+  AnnoyIndexWrapper* obj = ObjectWrap::Unwrap<AnnoyIndexWrapper>(info.Holder());
+  if (!checkNotBuilding(obj, "createFilter")) {
+    return;
+  }
+  if (!info[0]->IsNullOrUndefined()) {
+    std::vector<int> items;
+    if (obj->annoyIndex->has_item_ids()) {
+      if (!obj->getItemsForIds(info, 0, &items)) {
+        return Nan::ThrowTypeError(
+          "createFilter: Expected an array or BigUint64Array of ids"
+        );
+      }
+    } else {
+      if (!getIntArrayParam(info, 0, &items)) {
+        return Nan::ThrowTypeError(
+          "createFilter: Expected an array or Int32Array of item ids"
+        );
+      }
+      obj->keepItemsInRange(&items);
+    }
+    Local<Int32Array> itemArray = Int32Array::New(
+      ArrayBuffer::New(info.GetIsolate(), items.size() * sizeof(int)), 0, items.size()
+    );
+    std::copy(items.begin(), items.end(), *Nan::TypedArrayContents<int>(itemArray));
+    ids = itemArray;
+  }
+  v8::Local<v8::Object> filter;
+  if (AnnoyFilterWrapper::NewInstance(ids).ToLocal(&filter)) {
+    info.GetReturnValue().Set(filter);
+  }
+}
+
 void AnnoyIndexWrapper::GetNItems(const Nan::FunctionCallbackInfo<v8::Value>& info) {
   // Get out object.
   AnnoyIndexWrapper* obj = ObjectWrap::Unwrap<AnnoyIndexWrapper>(info.Holder());
-  Local<Number> count = Nan::New<Number>(obj->annoyIndex->get_n_items());
+  // A build can move pending items into the index as we read it, so use the
+  // count from when it started.
+  int numberOfItems = obj->isBuilding ? obj->buildingItemCount : obj->annoyIndex->get_n_items();
+  Local<Number> count = Nan::New<Number>(numberOfItems);
   info.GetReturnValue().Set(count);
 }
 
+void AnnoyIndexWrapper::GetStats(const Nan::FunctionCallbackInfo<v8::Value>& info) {
+  // Get out object.
+  AnnoyIndexWrapper* obj = ObjectWrap::Unwrap<AnnoyIndexWrapper>(info.Holder());
+  AnnoyQueryStats stats;
+  if (obj->annoyIndex->get_stats(&stats)) {
+    info.GetReturnValue().Set(statsValue(stats));
+  } else {
+    info.GetReturnValue().SetNull();
+  }
+}
+
+void AnnoyIndexWrapper::GetLastQueryStats(const Nan::FunctionCallbackInfo<v8::Value>& info) {
+  // Get out object.
+  AnnoyIndexWrapper* obj = ObjectWrap::Unwrap<AnnoyIndexWrapper>(info.Holder());
+  AnnoyQueryStats stats;
+  if (obj->annoyIndex->get_last_query_stats(&stats)) {
+    info.GetReturnValue().Set(statsValue(stats));
+  } else {
+    info.GetReturnValue().SetNull();
+  }
+}
+
+void AnnoyIndexWrapper::ResetStats(const Nan::FunctionCallbackInfo<v8::Value>& info) {
+  // Get out object.
+  AnnoyIndexWrapper* obj = ObjectWrap::Unwrap<AnnoyIndexWrapper>(info.Holder());
+  obj->annoyIndex->reset_stats();
+}
+
+// Query stats as an object of Numbers.
+Local<Object> AnnoyIndexWrapper::statsValue(const AnnoyQueryStats& stats) {
+  v8::Local<v8::Context> context = Nan::GetCurrentContext();
+  Local<Object> jsStats = Nan::New<Object>();
+  const char *names[] = {
+    "queries", "searchK", "nodesVisited", "leavesVisited",
+    "candidates", "duplicates", "distances"
+  };
+  uint64_t values[] = {
+    stats.n_queries, stats.search_k, stats.n_nodes, stats.n_leaves,
+    stats.n_candidates, stats.n_duplicates, stats.n_distances
+  };
+  for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); ++i) {
+    jsStats->Set(
+      context, Nan::New(names[i]).ToLocalChecked(), Nan::New<Number>((double)values[i])
+    ).Check();
+  }
+  return jsStats;
+}
+
 // Returns true if it was able to get items out of the array. false, if not.
+// Reads at most length items. Typed arrays are copied without going through
+// V8 for each element.
 bool AnnoyIndexWrapper::getFloatArrayParam(
-  const Nan::FunctionCallbackInfo<v8::Value>& info, int paramIndex, float *vec) {
+  const Nan::FunctionCallbackInfo<v8::Value>& info, int paramIndex, int length, float *vec) {
   v8::Local<v8::Context> context = info.GetIsolate()->GetCurrentContext();
 
   bool succeeded = false;
 
-  Local<Value> val;
-  if (info[paramIndex]->IsArray()) {
+  if (info[paramIndex]->IsFloat32Array()) {
+    Nan::TypedArrayContents<float> contents(info[paramIndex]);
+    size_t count = std::min(contents.length(), (size_t)length);
+    memcpy(vec, *contents, count * sizeof(float));
+    succeeded = true;
+  } else if (info[paramIndex]->IsFloat64Array()) {
+    Nan::TypedArrayContents<double> contents(info[paramIndex]);
+    size_t count = std::min(contents.length(), (size_t)length);
+    for (size_t i = 0; i < count; i++) {
+      vec[i] = (float)(*contents)[i];
+    }
+    succeeded = true;
+  } else if (info[paramIndex]->IsArray()) {
     Local<Array> jsArray = Local<Array>::Cast(info[paramIndex]);
     Local<Value> val;
-    for (unsigned int i = 0; i < jsArray->Length(); i++) {
+    unsigned int count = std::min(jsArray->Length(), (unsigned int)length);
+    for (unsigned int i = 0; i < count; i++) {
       val = jsArray->Get(context, i).ToLocalChecked();
       // printf("Adding item to array: %f\n", (float)val->NumberValue(context).FromJust());
       vec[i] = (float)val->NumberValue(context).FromJust();
@@ -459,8 +1361,11 @@ bool AnnoyIndexWrapper::getIntArrayParam(
 
   bool succeeded = false;
 
-  Local<Value> val;
-  if (info[paramIndex]->IsArray()) {
+  if (info[paramIndex]->IsInt32Array()) {
+    Nan::TypedArrayContents<int> contents(info[paramIndex]);
+    vec->insert(vec->end(), *contents, *contents + contents.length());
+    succeeded = true;
+  } else if (info[paramIndex]->IsArray()) {
     Local<Array> jsArray = Local<Array>::Cast(info[paramIndex]);
     Local<Value> val;
     for (unsigned int i = 0; i < jsArray->Length(); i++) {
@@ -474,6 +1379,215 @@ bool AnnoyIndexWrapper::getIntArrayParam(
   return succeeded;
 }
 
+// Reads an external id, which is a non-negative integer Number or a BigInt.
+// Returns false if it's neither.
+bool AnnoyIndexWrapper::getIdValue(v8::Local<v8::Value> value, uint64_t *id) {
+  if (value->IsBigInt()) {
+    bool lossless;
+    *id = value.As<BigInt>()->Uint64Value(&lossless);
+    return lossless;
+  }
+  if (value->IsNumber()) {
+    double number = value.As<Number>()->Value();
+    if (number >= 0 && number <= MAX_SAFE_ID && number == floor(number)) {
+      *id = (uint64_t)number;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Reads an array or BigUint64Array of external ids. Returns true if it was
+// able to get them all out.
+bool AnnoyIndexWrapper::getIdArrayParam(
+  const Nan::FunctionCallbackInfo<v8::Value>& info, int paramIndex, std::vector<uint64_t> *ids) {
+  v8::Local<v8::Context> context = info.GetIsolate()->GetCurrentContext();
+
+  if (info[paramIndex]->IsBigUint64Array()) {
+    Nan::TypedArrayContents<uint8_t> contents(info[paramIndex]);
+    size_t count = contents.length() / sizeof(uint64_t);
+    ids->resize(count);
+    memcpy(ids->data(), *contents, count * sizeof(uint64_t));
+    return true;
+  }
+  if (!info[paramIndex]->IsArray()) {
+    return false;
+  }
+  Local<Array> jsArray = Local<Array>::Cast(info[paramIndex]);
+  ids->resize(jsArray->Length());
+  for (unsigned int i = 0; i < jsArray->Length(); i++) {
+    if (!getIdValue(jsArray->Get(context, i).ToLocalChecked(), &(*ids)[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Reads the item index at paramIndex, which has to be an integer that fits
+// in an int. Returns false after throwing if it isn't.
+bool AnnoyIndexWrapper::getIndexParam(
+  const Nan::FunctionCallbackInfo<v8::Value>& info, int paramIndex,
+  const char *methodName, int *index) {
+  return getIntParam(info, paramIndex, methodName, "an item index", 0, index);
+}
+
+// Reads the integer at paramIndex, which has to be at least min and fit in
+// an int; what names it in the error. Returns false after throwing if it
+// isn't.
+bool AnnoyIndexWrapper::getIntParam(
+  const Nan::FunctionCallbackInfo<v8::Value>& info, int paramIndex,
+  const char *methodName, const char *what, int min, int *value) {
+  v8::Local<v8::Context> context = info.GetIsolate()->GetCurrentContext();
+  double number = info[paramIndex]->IsNumber() ? info[paramIndex]->NumberValue(context).FromJust() : NAN;
+  if (!(number >= min && number <= INT_MAX && number == (int)number)) {
+    std::string message = std::string(methodName) + ": Expected " + what +
+      (min == 0 ? " as a non-negative integer" : " as an integer of at least " + std::to_string(min));
+    Nan::ThrowTypeError(message.c_str());
+    return false;
+  }
+  *value = (int)number;
+  return true;
+}
+
+bool AnnoyIndexWrapper::getIdParam(
+  const Nan::FunctionCallbackInfo<v8::Value>& info, int paramIndex,
+  const char *methodName, int *index) {
+  AnnoyIndexWrapper* obj = ObjectWrap::Unwrap<AnnoyIndexWrapper>(info.Holder());
+  uint64_t id;
+  if (!getIdValue(info[paramIndex], &id)) {
+    std::string message = std::string(methodName) + ": Expected an id, as a non-negative integer or a BigInt";
+    Nan::ThrowTypeError(message.c_str());
+    return false;
+  }
+  *index = obj->annoyIndex->find_item(id);
+  if (*index < 0) {
+    std::string message = std::string(methodName) + ": No item has this id";
+    Nan::ThrowError(message.c_str());
+    return false;
+  }
+  return true;
+}
+
+// For indexes with external ids: reads the ids at paramIndex and adds their
+// items to items. Ids that aren't in the index are left out, since they
+// can't match anything. Returns false if the ids can't be read.
+bool AnnoyIndexWrapper::getItemsForIds(
+  const Nan::FunctionCallbackInfo<v8::Value>& info, int paramIndex, std::vector<int> *items) {
+  std::vector<uint64_t> ids;
+  if (!getIdArrayParam(info, paramIndex, &ids)) {
+    return false;
+  }
+  for (size_t i = 0; i < ids.size(); i++) {
+    int item = annoyIndex->find_item(ids[i]);
+    if (item >= 0) {
+      items->push_back(item);
+    }
+  }
+  return true;
+}
+
+// Drops items that aren't in [0, getNItems()), which can't match anything
+// and would only make a filter's bitset bigger.
+void AnnoyIndexWrapper::keepItemsInRange(std::vector<int> *items) {
+  int numberOfItems = annoyIndex->get_n_items();
+  items->erase(
+    std::remove_if(items->begin(), items->end(), [numberOfItems](int item) {
+      return item < 0 || item >= numberOfItems;
+    }),
+    items->end()
+  );
+}
+
+// Returns item as JS sees it: its external id if the index has them, which
+// is a Number if it can be one exactly and a BigInt if not.
+v8::Local<v8::Value> AnnoyIndexWrapper::itemValue(int item) {
+  if (!annoyIndex->has_item_ids()) {
+    return Nan::New<Number>(item);
+  }
+  uint64_t id = annoyIndex->get_item_id(item);
+  if (id <= MAX_SAFE_ID) {
+    return Nan::New<Number>((double)id);
+  }
+  return BigInt::NewFromUnsigned(Isolate::GetCurrent(), id);
+}
+
+// Returns the payload of item as a Buffer, or as a string if encoding is
+// 'utf8', or null if it has none. It's a copy, so it stays valid after the
+// index is unloaded.
+v8::Local<v8::Value> AnnoyIndexWrapper::payloadValue(int item, v8::Local<v8::Value> encoding) {
+  const uint8_t *data;
+  size_t size;
+  if (!annoyIndex->get_payload(item, &data, &size)) {
+    return Nan::Null();
+  }
+  if (encoding->IsString()) {
+    return Nan::New<String>((const char *)data, size).ToLocalChecked();
+  }
+  return Nan::CopyBuffer((const char *)data, size).ToLocalChecked();
+}
+
+// Copies the packed vector at paramIndex into words, which is already sized
+// for the index. Any typed array (or DataView) with exactly that many bytes
+// is accepted; its bytes are read as native-endian 64-bit words, so a
+// BigUint64Array is the natural fit. Returns false after throwing if not.
+bool AnnoyIndexWrapper::getPackedParam(
+  const Nan::FunctionCallbackInfo<v8::Value>& info, int paramIndex,
+  const char *methodName, std::vector<uint64_t> *words) {
+
+  if (!info[paramIndex]->IsArrayBufferView()) {
+    std::string message = std::string(methodName) + ": Expected a BigUint64Array of packed words";
+    Nan::ThrowTypeError(message.c_str());
+    return false;
+  }
+  Nan::TypedArrayContents<uint8_t> contents(info[paramIndex]);
+  if (contents.length() != words->size() * sizeof(uint64_t)) {
+    std::string message = std::string(methodName) + ": Packed vector length does not match the index dimensions";
+    Nan::ThrowRangeError(message.c_str());
+    return false;
+  }
+  memcpy(words->data(), *contents, contents.length());
+  return true;
+}
+
+// Throws and returns false if the index doesn't store packed words.
+bool AnnoyIndexWrapper::checkHamming(AnnoyIndexWrapper *obj, const char *methodName) {
+  if (!obj->hammingIndex) {
+    std::string message = std::string(methodName) + ": Only Hamming indexes store packed vectors";
+    Nan::ThrowError(message.c_str());
+    return false;
+  }
+  return true;
+}
+
+// Throws and returns false if a background build owns the index. Use this
+// before reading from the index.
+bool AnnoyIndexWrapper::checkNotBuilding(AnnoyIndexWrapper *obj, const char *methodName) {
+  if (obj->isBuilding) {
+    std::string message = std::string(methodName) + ": Index is busy building";
+    Nan::ThrowError(message.c_str());
+    return false;
+  }
+  return true;
+}
+
+// Throws and returns false if any background job is using the index. Use
+// this before changing, unloading or replacing the index.
+bool AnnoyIndexWrapper::checkIdle(AnnoyIndexWrapper *obj, const char *methodName) {
+  if (!checkNotBuilding(obj, methodName)) {
+    return false;
+  }
+  if (obj->pendingQueries > 0) {
+    std::string message = std::string(methodName) + ": Index is busy answering queries";
+    Nan::ThrowError(message.c_str());
+    return false;
+  }
+  return true;
+}
+
 int AnnoyIndexWrapper::getDimensions() {
   return annoyDimensions;
 }
+
+bool AnnoyIndexWrapper::useExactSearch() {
+  return annoyIndex->get_n_items() < exactThreshold;
+}
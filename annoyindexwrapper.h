@@ -3,41 +3,105 @@
 
 #include <nan.h>
 #include "annoylib.h"
+#include "annoyindexadapter.h"
 #include <vector>
 
 class AnnoyIndexWrapper : public Nan::ObjectWrap {
  public:
   static void Init(v8::Local<v8::Object> exports);
   int getDimensions();
+  static bool getIntArrayParam(const Nan::FunctionCallbackInfo<v8::Value>& info, 
+    int paramIndex, std::vector<int> *vec);
+  v8::Local<v8::Value> itemValue(int item);
+  v8::Local<v8::Value> payloadValue(int item, v8::Local<v8::Value> encoding);
   AnnoyIndexInterface<int, float> *annoyIndex;
+  // True while a BuildWorker owns annoyIndex.
+  bool isBuilding;
+  // What getNItems returns while isBuilding is set.
+  int buildingItemCount;
+  // Number of QueryBatchWorkers reading from annoyIndex.
+  int pendingQueries;
+  // Also annoyIndex, for Hamming indexes; null for the other metrics.
+  HammingIndexAdapter *hammingIndex;
+  // Indexes with fewer items than this are searched exactly instead of
+  // through the trees; 0 never does.
+  int exactThreshold;
+  bool useExactSearch();
 
  private:
-  explicit AnnoyIndexWrapper(int dimensions, const char *metricString);
+  explicit AnnoyIndexWrapper(int dimensions, const char *metricString,
+    const char *storageString);
   virtual ~AnnoyIndexWrapper();
+  void createIndex(int dimensions, const char *metricString, const char *storageString);
+  void createIndexFromHeader(const AnnoyFileHeader& header);
 
   static void New(const Nan::FunctionCallbackInfo<v8::Value>& info);
   static void AddItem(const Nan::FunctionCallbackInfo<v8::Value>& info);
+  static void AddItems(const Nan::FunctionCallbackInfo<v8::Value>& info);
+  static void AddItemWithId(const Nan::FunctionCallbackInfo<v8::Value>& info);
+  static void AddItemPacked(const Nan::FunctionCallbackInfo<v8::Value>& info);
   static void OnDiskBuild(const Nan::FunctionCallbackInfo<v8::Value>& info);
   static void PrepDiskBuild(const Nan::FunctionCallbackInfo<v8::Value>& info);
   static void Build(const Nan::FunctionCallbackInfo<v8::Value>& info);
+  static void BuildAsync(const Nan::FunctionCallbackInfo<v8::Value>& info);
+  static void BuildFromFile(const Nan::FunctionCallbackInfo<v8::Value>& info);
   static void Save(const Nan::FunctionCallbackInfo<v8::Value>& info);
   static void Load(const Nan::FunctionCallbackInfo<v8::Value>& info);
   static void Unload(const Nan::FunctionCallbackInfo<v8::Value>& info);
+  static void Quantize(const Nan::FunctionCallbackInfo<v8::Value>& info);
+  static void SaveQuantized(const Nan::FunctionCallbackInfo<v8::Value>& info);
+  static void LoadQuantized(const Nan::FunctionCallbackInfo<v8::Value>& info);
+  static void SetRerank(const Nan::FunctionCallbackInfo<v8::Value>& info);
+  static void RemoveItem(const Nan::FunctionCallbackInfo<v8::Value>& info);
+  static void Compact(const Nan::FunctionCallbackInfo<v8::Value>& info);
   static void GetItem(const Nan::FunctionCallbackInfo<v8::Value>& info);
+  static void GetItemPacked(const Nan::FunctionCallbackInfo<v8::Value>& info);
+  static void SetPayload(const Nan::FunctionCallbackInfo<v8::Value>& info);
+  static void GetPayload(const Nan::FunctionCallbackInfo<v8::Value>& info);
   static void GetNNSByVector(const Nan::FunctionCallbackInfo<v8::Value>& info);
+  static void GetNNSByVectorBatch(const Nan::FunctionCallbackInfo<v8::Value>& info);
+  static void GetNNSByVectorPacked(const Nan::FunctionCallbackInfo<v8::Value>& info);
   static void GetNNSByItem(const Nan::FunctionCallbackInfo<v8::Value>& info);
+  static void GetNNSExact(const Nan::FunctionCallbackInfo<v8::Value>& info);
+  static void BuildKnnGraph(const Nan::FunctionCallbackInfo<v8::Value>& info);
+  static void SetExactThreshold(const Nan::FunctionCallbackInfo<v8::Value>& info);
   static void GetNItems(const Nan::FunctionCallbackInfo<v8::Value>& info);
+  static void GetStats(const Nan::FunctionCallbackInfo<v8::Value>& info);
+  static void GetLastQueryStats(const Nan::FunctionCallbackInfo<v8::Value>& info);
+  static void ResetStats(const Nan::FunctionCallbackInfo<v8::Value>& info);
   static void GetDistance(const Nan::FunctionCallbackInfo<v8::Value>& info);
+  static void CreateFilter(const Nan::FunctionCallbackInfo<v8::Value>& info);
 
   static Nan::Persistent<v8::Function> constructor;
+  static bool checkNotBuilding(AnnoyIndexWrapper *obj, const char *methodName);
+  static bool checkIdle(AnnoyIndexWrapper *obj, const char *methodName);
+  static bool checkHamming(AnnoyIndexWrapper *obj, const char *methodName);
+  static bool getPackedParam(const Nan::FunctionCallbackInfo<v8::Value>& info,
+    int paramIndex, const char *methodName, std::vector<uint64_t> *words);
+  static bool getIdValue(v8::Local<v8::Value> value, uint64_t *id);
+  static bool getIdArrayParam(const Nan::FunctionCallbackInfo<v8::Value>& info,
+    int paramIndex, std::vector<uint64_t> *ids);
+  static bool getIndexParam(const Nan::FunctionCallbackInfo<v8::Value>& info,
+    int paramIndex, const char *methodName, int *index);
+  static bool getIntParam(const Nan::FunctionCallbackInfo<v8::Value>& info,
+    int paramIndex, const char *methodName, const char *what, int min, int *value);
+  static bool getIdParam(const Nan::FunctionCallbackInfo<v8::Value>& info,
+    int paramIndex, const char *methodName, int *index);
+  void keepItemsInRange(std::vector<int> *items);
+  bool getItemsForIds(const Nan::FunctionCallbackInfo<v8::Value>& info,
+    int paramIndex, std::vector<int> *items);
   static bool getFloatArrayParam(const Nan::FunctionCallbackInfo<v8::Value>& info, 
-    int paramIndex, float *vec);
-  static bool getIntArrayParam(const Nan::FunctionCallbackInfo<v8::Value>& info, 
-    int paramIndex, std::vector<int> *vec);
+    int paramIndex, int length, float *vec);
+  static bool getFilterParams(const Nan::FunctionCallbackInfo<v8::Value>& info,
+    AnnoyItemSet<int>& filterItems, AnnoyFilter<int>& filter,
+    const AnnoyFilter<int> **filterPtr);
+  static void findNNsByVector(const Nan::FunctionCallbackInfo<v8::Value>& info,
+    const char *methodName, bool exact);
   static void setNNReturnValues(
     int numberOfNeighbors, bool includeDistances,
     const std::vector<int>& nnIndexes, const std::vector<float>& distances,
     const Nan::FunctionCallbackInfo<v8::Value>& info);
+  static v8::Local<v8::Object> statsValue(const AnnoyQueryStats& stats);
   static void getSupplementaryGetNNsParams(
     const Nan::FunctionCallbackInfo<v8::Value>& info,
     int& numberOfNeighbors, int& searchK, bool& includeDistances);
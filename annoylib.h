@@ -60,6 +60,8 @@ typedef signed __int64    int64_t;
 #include <algorithm>
 #include <queue>
 #include <limits>
+#include <unordered_map>
+#include <atomic>
 
 #if __cplusplus >= 201103L
 #include <type_traits>
@@ -68,7 +70,11 @@ typedef signed __int64    int64_t;
 #ifdef ANNOYLIB_MULTITHREADED_BUILD
 #include <thread>
 #include <mutex>
-#include <shared_mutex>
+#include <deque>
+#endif
+
+#ifdef ANNOYLIB_QUERY_STATS
+#include <mutex>
 #endif
 
 #ifdef _MSC_VER
@@ -114,6 +120,14 @@ inline void set_error_from_string(char **error, const char* msg) {
 // Compilers need *some* size defined for the v array, and some memory checking tools will flag for buffer overruns if this is set too low.
 #define V_ARRAY_SIZE 65536
 
+// Number of candidates _get_all_nns scores with one call to D::distance_batch.
+// It prefetches the next batch while scoring one.
+#define ANNOY_DISTANCE_BATCH 8
+
+// Fewest items get_nns_exact gives each of its threads; smaller scans finish
+// before a thread would start.
+#define ANNOY_EXACT_THREAD_ITEMS 4096
+
 #ifndef _MSC_VER
 #define popcount __builtin_popcountll
 #else // See #293, #358
@@ -124,10 +138,23 @@ inline void set_error_from_string(char **error, const char* msg) {
 #define USE_AVX512
 #elif !defined(NO_MANUAL_VECTORIZATION) && defined(__AVX__) && defined (__SSE__) && defined(__SSE2__) && defined(__SSE3__)
 #define USE_AVX
+#elif !defined(NO_MANUAL_VECTORIZATION) && defined(__x86_64__) && (defined(__clang__) || (defined(__GNUC__) && (__GNUC__ >6)))
+// Built for plain x86-64, as node-gyp does by default: compile kernels for
+// each instruction set with target attributes, and pick one at runtime (see
+// annoy_kernels).
+#define USE_RUNTIME_DISPATCH
+#else
+#endif
+
+#if defined(USE_RUNTIME_DISPATCH)
+#define ANNOY_TARGET_AVX2 __attribute__((target("avx2,fma,f16c")))
+#define ANNOY_TARGET_AVX512 __attribute__((target("avx512f,avx2,fma,f16c")))
 #else
+#define ANNOY_TARGET_AVX2
+#define ANNOY_TARGET_AVX512
 #endif
 
-#if defined(USE_AVX) || defined(USE_AVX512)
+#if defined(USE_AVX) || defined(USE_AVX512) || defined(USE_RUNTIME_DISPATCH)
 #if defined(_MSC_VER)
 #include <intrin.h>
 #elif defined(__GNUC__)
@@ -146,6 +173,136 @@ using std::pair;
 using std::numeric_limits;
 using std::make_pair;
 
+inline uint16_t annoy_float_to_half(float value) {
+  // Rounds to the nearest IEEE 754 half, ties to even.
+  uint32_t x;
+  memcpy(&x, &value, sizeof(x));
+  uint32_t sign = (x >> 16) & 0x8000;
+  uint32_t exponent = (x >> 23) & 0xff;
+  uint32_t mantissa = x & 0x7fffff;
+  if (exponent == 0xff)  // Inf or NaN
+    return (uint16_t)(sign | 0x7c00 | (mantissa ? 0x200 : 0));
+  int e = (int)exponent - 127 + 15;
+  if (e >= 0x1f)  // Too big, so Inf
+    return (uint16_t)(sign | 0x7c00);
+  if (e <= 0) {  // Subnormal, or too small, so zero
+    if (e < -10)
+      return (uint16_t)sign;
+    mantissa |= 0x800000;
+    int shift = 14 - e;
+    uint32_t half = mantissa >> shift;
+    uint32_t rest = mantissa & ((1u << shift) - 1);
+    uint32_t halfway = 1u << (shift - 1);
+    if (rest > halfway || (rest == halfway && (half & 1)))
+      half++;
+    return (uint16_t)(sign | half);
+  }
+  uint32_t half = sign | ((uint32_t)e << 10) | (mantissa >> 13);
+  uint32_t rest = mantissa & 0x1fff;
+  if (rest > 0x1000 || (rest == 0x1000 && (half & 1)))
+    half++;  // Carries into the exponent when it has to
+  return (uint16_t)half;
+}
+
+inline float annoy_half_to_float(uint16_t half) {
+  uint32_t sign = (uint32_t)(half & 0x8000) << 16;
+  uint32_t exponent = (half >> 10) & 0x1f;
+  uint32_t mantissa = half & 0x3ff;
+  uint32_t x;
+  if (exponent == 0x1f) {
+    x = sign | 0x7f800000 | (mantissa << 13);
+  } else if (exponent == 0) {
+    if (mantissa == 0) {
+      x = sign;
+    } else {
+      // Subnormal: shift the mantissa up until it's normal
+      exponent = 127 - 15 + 1;
+      while (!(mantissa & 0x400)) {
+        mantissa <<= 1;
+        exponent--;
+      }
+      x = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+    }
+  } else {
+    x = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+  }
+  float value;
+  memcpy(&value, &x, sizeof(value));
+  return value;
+}
+
+inline uint16_t annoy_float_to_bfloat16(float value) {
+  // Keeps the top half of the float, rounded to nearest, ties to even.
+  uint32_t x;
+  memcpy(&x, &value, sizeof(x));
+  if ((x & 0x7fffffff) > 0x7f800000)  // NaN: keep it quiet rather than rounding to Inf
+    return (uint16_t)((x >> 16) | 0x40);
+  return (uint16_t)((x + 0x7fff + ((x >> 16) & 1)) >> 16);
+}
+
+inline float annoy_bfloat16_to_float(uint16_t bfloat16) {
+  uint32_t x = (uint32_t)bfloat16 << 16;
+  float value;
+  memcpy(&value, &x, sizeof(value));
+  return value;
+}
+
+struct AnnoyFloat16 {
+  /*
+   * IEEE 754 half precision storage for vectors. Arithmetic goes through
+   * float, and the distance functions below accumulate in float, so only
+   * the stored values lose precision. Half has a range of +-65504.
+   */
+  uint16_t bits;
+
+  AnnoyFloat16() {}
+  AnnoyFloat16(float value) : bits(annoy_float_to_half(value)) {}
+  operator float() const { return annoy_half_to_float(bits); }
+
+  AnnoyFloat16& operator+=(float x) { return *this = *this + x; }
+  AnnoyFloat16& operator-=(float x) { return *this = *this - x; }
+  AnnoyFloat16& operator*=(float x) { return *this = *this * x; }
+  AnnoyFloat16& operator/=(float x) { return *this = *this / x; }
+};
+
+struct AnnoyBFloat16 {
+  /*
+   * bfloat16 storage for vectors: the top 16 bits of a float. It has the
+   * same range as float but only 8 bits of precision, against 11 for
+   * AnnoyFloat16, and converts to float with a shift.
+   */
+  uint16_t bits;
+
+  AnnoyBFloat16() {}
+  AnnoyBFloat16(float value) : bits(annoy_float_to_bfloat16(value)) {}
+  operator float() const { return annoy_bfloat16_to_float(bits); }
+
+  AnnoyBFloat16& operator+=(float x) { return *this = *this + x; }
+  AnnoyBFloat16& operator-=(float x) { return *this = *this - x; }
+  AnnoyBFloat16& operator*=(float x) { return *this = *this * x; }
+  AnnoyBFloat16& operator/=(float x) { return *this = *this / x; }
+};
+
+template<typename T>
+struct AnnoyDistanceType {
+  // What distances, margins and norms are computed and returned in, for
+  // vectors stored as T. Narrow storage types compute in float.
+  typedef T type;
+};
+template<> struct AnnoyDistanceType<AnnoyFloat16> { typedef float type; };
+template<> struct AnnoyDistanceType<AnnoyBFloat16> { typedef float type; };
+
+template<typename T>
+struct AnnoyValueType {
+  // Name of the vector storage type, as recorded in file headers.
+  static const char* name();
+};
+template<> inline const char* AnnoyValueType<float>::name() { return "float32"; }
+template<> inline const char* AnnoyValueType<double>::name() { return "float64"; }
+template<> inline const char* AnnoyValueType<uint64_t>::name() { return "uint64"; }
+template<> inline const char* AnnoyValueType<AnnoyFloat16>::name() { return "float16"; }
+template<> inline const char* AnnoyValueType<AnnoyBFloat16>::name() { return "bfloat16"; }
+
 inline bool remap_memory_and_truncate(void** _ptr, int _fd, size_t old_size, size_t new_size) {
 #ifdef __linux__
     *_ptr = mremap(*_ptr, old_size, new_size, MREMAP_MAYMOVE);
@@ -201,14 +358,18 @@ inline T euclidean_distance(const T* x, const T* y, int f) {
   return d;
 }
 
-#ifdef USE_AVX
+#if defined(USE_AVX) || defined(USE_RUNTIME_DISPATCH)
 // Horizontal single sum of 256bit vector.
+ANNOY_TARGET_AVX2
 inline float hsum256_ps_avx(__m256 v) {
   const __m128 x128 = _mm_add_ps(_mm256_extractf128_ps(v, 1), _mm256_castps256_ps128(v));
   const __m128 x64 = _mm_add_ps(x128, _mm_movehl_ps(x128, x128));
   const __m128 x32 = _mm_add_ss(x64, _mm_shuffle_ps(x64, x64, 0x55));
   return _mm_cvtss_f32(x32);
 }
+#endif
+
+#ifdef USE_AVX
 
 template<>
 inline float dot<float>(const float* x, const float *y, int f) {
@@ -284,9 +445,14 @@ inline float euclidean_distance<float>(const float* x, const float* y, int f) {
 
 #endif
 
-#ifdef USE_AVX512
-template<>
-inline float dot<float>(const float* x, const float *y, int f) {
+#if defined(USE_AVX512) || defined(USE_RUNTIME_DISPATCH)
+#if defined(__GNUC__) && !defined(__clang__)
+// GCC 12's AVX-512 headers set this off from inside the intrinsics (GCC bug 105593)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+ANNOY_TARGET_AVX512
+inline float dot_avx512(const float* x, const float *y, int f) {
   float result = 0;
   if (f > 15) {
     __m512 d = _mm512_setzero_ps();
@@ -308,8 +474,8 @@ inline float dot<float>(const float* x, const float *y, int f) {
   return result;
 }
 
-template<>
-inline float manhattan_distance<float>(const float* x, const float* y, int f) {
+ANNOY_TARGET_AVX512
+inline float manhattan_distance_avx512(const float* x, const float* y, int f) {
   float result = 0;
   int i = f;
   if (f > 15) {
@@ -332,8 +498,8 @@ inline float manhattan_distance<float>(const float* x, const float* y, int f) {
   return result;
 }
 
-template<>
-inline float euclidean_distance<float>(const float* x, const float* y, int f) {
+ANNOY_TARGET_AVX512
+inline float euclidean_distance_avx512(const float* x, const float* y, int f) {
   float result=0;
   if (f > 15) {
     __m512 d = _mm512_setzero_ps();
@@ -355,399 +521,876 @@ inline float euclidean_distance<float>(const float* x, const float* y, int f) {
   }
   return result;
 }
-
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
 #endif
 
-
-template<typename T>
-inline T get_norm(T* v, int f) {
-  return sqrt(dot(v, v, f));
+#ifdef USE_AVX512
+template<>
+inline float dot<float>(const float* x, const float *y, int f) {
+  return dot_avx512(x, y, f);
 }
 
-template<typename T, typename Random, typename Distance, typename Node>
-inline void two_means(const vector<Node*>& nodes, int f, Random& random, bool cosine, Node* p, Node* q) {
-  /*
-    This algorithm is a huge heuristic. Empirically it works really well, but I
-    can't motivate it well. The basic idea is to keep two centroids and assign
-    points to either one of them. We weight each centroid by the number of points
-    assigned to it, so to balance it.
-  */
-  static int iteration_steps = 200;
-  size_t count = nodes.size();
+template<>
+inline float manhattan_distance<float>(const float* x, const float* y, int f) {
+  return manhattan_distance_avx512(x, y, f);
+}
 
-  size_t i = random.index(count);
-  size_t j = random.index(count-1);
-  j += (j >= i); // ensure that i != j
+template<>
+inline float euclidean_distance<float>(const float* x, const float* y, int f) {
+  return euclidean_distance_avx512(x, y, f);
+}
+#endif
 
-  Distance::template copy_node<T, Node>(p, nodes[i], f);
-  Distance::template copy_node<T, Node>(q, nodes[j], f);
+#ifdef USE_RUNTIME_DISPATCH
+// SSE2 is part of x86-64, so these need no target attribute.
 
-  if (cosine) { Distance::template normalize<T, Node>(p, f); Distance::template normalize<T, Node>(q, f); }
-  Distance::init_node(p, f);
-  Distance::init_node(q, f);
+// Horizontal single sum of 128bit vector.
+inline float hsum128_ps_sse(__m128 v) {
+  const __m128 x64 = _mm_add_ps(v, _mm_movehl_ps(v, v));
+  const __m128 x32 = _mm_add_ss(x64, _mm_shuffle_ps(x64, x64, 0x55));
+  return _mm_cvtss_f32(x32);
+}
 
-  int ic = 1, jc = 1;
-  for (int l = 0; l < iteration_steps; l++) {
-    size_t k = random.index(count);
-    T di = ic * Distance::distance(p, nodes[k], f),
-      dj = jc * Distance::distance(q, nodes[k], f);
-    T norm = cosine ? get_norm(nodes[k]->v, f) : 1;
-    if (!(norm > T(0))) {
-      continue;
-    }
-    if (di < dj) {
-      for (int z = 0; z < f; z++)
-        p->v[z] = (p->v[z] * ic + nodes[k]->v[z] / norm) / (ic + 1);
-      Distance::init_node(p, f);
-      ic++;
-    } else if (dj < di) {
-      for (int z = 0; z < f; z++)
-        q->v[z] = (q->v[z] * jc + nodes[k]->v[z] / norm) / (jc + 1);
-      Distance::init_node(q, f);
-      jc++;
-    }
+inline float dot_sse(const float* x, const float *y, int f) {
+  float result = 0;
+  int i = 0;
+  if (f > 3) {
+    __m128 d = _mm_setzero_ps();
+    for (; i + 4 <= f; i += 4)
+      d = _mm_add_ps(d, _mm_mul_ps(_mm_loadu_ps(x + i), _mm_loadu_ps(y + i)));
+    result = hsum128_ps_sse(d);
   }
+  for (; i < f; i++)
+    result += x[i] * y[i];
+  return result;
 }
-} // namespace
 
-struct Base {
-  template<typename T, typename S, typename Node>
-  static inline void preprocess(void* nodes, size_t _s, const S node_count, const int f) {
-    // Override this in specific metric structs below if you need to do any pre-processing
-    // on the entire set of nodes passed into this index.
+inline float manhattan_distance_sse(const float* x, const float* y, int f) {
+  float result = 0;
+  int i = 0;
+  if (f > 3) {
+    __m128 d = _mm_setzero_ps();
+    const __m128 minus_zero = _mm_set1_ps(-0.0f);
+    for (; i + 4 <= f; i += 4)
+      d = _mm_add_ps(d, _mm_andnot_ps(minus_zero, _mm_sub_ps(_mm_loadu_ps(x + i), _mm_loadu_ps(y + i))));
+    result = hsum128_ps_sse(d);
   }
+  for (; i < f; i++)
+    result += fabsf(x[i] - y[i]);
+  return result;
+}
 
-  template<typename Node>
-  static inline void zero_value(Node* dest) {
-    // Initialize any fields that require sane defaults within this node.
+inline float euclidean_distance_sse(const float* x, const float* y, int f) {
+  float result = 0;
+  int i = 0;
+  if (f > 3) {
+    __m128 d = _mm_setzero_ps();
+    for (; i + 4 <= f; i += 4) {
+      const __m128 diff = _mm_sub_ps(_mm_loadu_ps(x + i), _mm_loadu_ps(y + i));
+      d = _mm_add_ps(d, _mm_mul_ps(diff, diff));
+    }
+    result = hsum128_ps_sse(d);
   }
-
-  template<typename T, typename Node>
-  static inline void copy_node(Node* dest, const Node* source, const int f) {
-    memcpy(dest->v, source->v, f * sizeof(T));
+  for (; i < f; i++) {
+    float tmp = x[i] - y[i];
+    result += tmp * tmp;
   }
+  return result;
+}
 
-  template<typename T, typename Node>
-  static inline void normalize(Node* node, int f) {
-    T norm = get_norm(node->v, f);
-    if (norm > 0) {
-      for (int z = 0; z < f; z++)
-        node->v[z] /= norm;
-    }
+ANNOY_TARGET_AVX2
+inline float dot_avx2(const float* x, const float *y, int f) {
+  float result = 0;
+  int i = 0;
+  if (f > 7) {
+    __m256 d = _mm256_setzero_ps();
+    for (; i + 8 <= f; i += 8)
+      d = _mm256_fmadd_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i), d);
+    result = hsum256_ps_avx(d);
   }
-};
+  for (; i < f; i++)
+    result += x[i] * y[i];
+  return result;
+}
 
-struct Angular : Base {
-  template<typename S, typename T>
-  struct Node {
-    /*
-     * We store a binary tree where each node has two things
-     * - A vector associated with it
-     * - Two children
-     * All nodes occupy the same amount of memory
-     * All nodes with n_descendants == 1 are leaf nodes.
-     * A memory optimization is that for nodes with 2 <= n_descendants <= K,
-     * we skip the vector. Instead we store a list of all descendants. K is
-     * determined by the number of items that fits in the space of the vector.
-     * For nodes with n_descendants == 1 the vector is a data point.
-     * For nodes with n_descendants > K the vector is the normal of the split plane.
-     * Note that we can't really do sizeof(node<T>) because we cheat and allocate
-     * more memory to be able to fit the vector outside
-     */
-    S n_descendants;
-    union {
-      S children[2]; // Will possibly store more than 2
-      T norm;
-    };
-    T v[V_ARRAY_SIZE];
-  };
-  template<typename S, typename T>
-  static inline T distance(const Node<S, T>* x, const Node<S, T>* y, int f) {
-    // want to calculate (a/|a| - b/|b|)^2
-    // = a^2 / a^2 + b^2 / b^2 - 2ab/|a||b|
-    // = 2 - 2cos
-    T pp = x->norm ? x->norm : dot(x->v, x->v, f); // For backwards compatibility reasons, we need to fall back and compute the norm here
-    T qq = y->norm ? y->norm : dot(y->v, y->v, f);
-    T pq = dot(x->v, y->v, f);
-    T ppqq = pp * qq;
-    if (ppqq > 0) return 2.0 - 2.0 * pq / sqrt(ppqq);
-    else return 2.0; // cos is 0
-  }
-  template<typename S, typename T>
-  static inline T margin(const Node<S, T>* n, const T* y, int f) {
-    return dot(n->v, y, f);
-  }
-  template<typename S, typename T, typename Random>
-  static inline bool side(const Node<S, T>* n, const T* y, int f, Random& random) {
-    T dot = margin(n, y, f);
-    if (dot != 0)
-      return (dot > 0);
-    else
-      return (bool)random.flip();
-  }
-  template<typename S, typename T, typename Random>
-  static inline void create_split(const vector<Node<S, T>*>& nodes, int f, size_t s, Random& random, Node<S, T>* n) {
-    Node<S, T>* p = (Node<S, T>*)alloca(s);
-    Node<S, T>* q = (Node<S, T>*)alloca(s);
-    two_means<T, Random, Angular, Node<S, T> >(nodes, f, random, true, p, q);
-    for (int z = 0; z < f; z++)
-      n->v[z] = p->v[z] - q->v[z];
-    Base::normalize<T, Node<S, T> >(n, f);
-  }
-  template<typename T>
-  static inline T normalized_distance(T distance) {
-    // Used when requesting distances from Python layer
-    // Turns out sometimes the squared distance is -0.0
-    // so we have to make sure it's a positive number.
-    return sqrt(std::max(distance, T(0)));
-  }
-  template<typename T>
-  static inline T pq_distance(T distance, T margin, int child_nr) {
-    if (child_nr == 0)
-      margin = -margin;
-    return std::min(distance, margin);
-  }
-  template<typename T>
-  static inline T pq_initial_value() {
-    return numeric_limits<T>::infinity();
+ANNOY_TARGET_AVX2
+inline float manhattan_distance_avx2(const float* x, const float* y, int f) {
+  float result = 0;
+  int i = 0;
+  if (f > 7) {
+    __m256 d = _mm256_setzero_ps();
+    const __m256 minus_zero = _mm256_set1_ps(-0.0f);
+    for (; i + 8 <= f; i += 8)
+      d = _mm256_add_ps(d, _mm256_andnot_ps(minus_zero, _mm256_sub_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i))));
+    result = hsum256_ps_avx(d);
   }
-  template<typename S, typename T>
-  static inline void init_node(Node<S, T>* n, int f) {
-    n->norm = dot(n->v, n->v, f);
+  for (; i < f; i++)
+    result += fabsf(x[i] - y[i]);
+  return result;
+}
+
+ANNOY_TARGET_AVX2
+inline float euclidean_distance_avx2(const float* x, const float* y, int f) {
+  float result = 0;
+  int i = 0;
+  if (f > 7) {
+    __m256 d = _mm256_setzero_ps();
+    for (; i + 8 <= f; i += 8) {
+      const __m256 diff = _mm256_sub_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i));
+      d = _mm256_fmadd_ps(diff, diff, d);
+    }
+    result = hsum256_ps_avx(d);
   }
-  static const char* name() {
-    return "angular";
+  for (; i < f; i++) {
+    float tmp = x[i] - y[i];
+    result += tmp * tmp;
   }
-};
+  return result;
+}
 
+inline size_t hamming_distance_scalar(const uint64_t* x, const uint64_t* y, int f) {
+  size_t dist = 0;
+  for (int i = 0; i < f; i++)
+    dist += __builtin_popcountll(x[i] ^ y[i]);
+  return dist;
+}
 
-struct DotProduct : Angular {
-  template<typename S, typename T>
-  struct Node {
-    /*
-     * This is an extension of the Angular node with an extra attribute for the scaled norm.
-     */
-    S n_descendants;
-    S children[2]; // Will possibly store more than 2
-    T dot_factor;
-    T v[V_ARRAY_SIZE];
-  };
+__attribute__((target("popcnt")))
+inline size_t hamming_distance_popcnt(const uint64_t* x, const uint64_t* y, int f) {
+  size_t dist = 0;
+  for (int i = 0; i < f; i++)
+    dist += __builtin_popcountll(x[i] ^ y[i]);
+  return dist;
+}
+#endif
 
-  static const char* name() {
-    return "dot";
-  }
-  template<typename S, typename T>
-  static inline T distance(const Node<S, T>* x, const Node<S, T>* y, int f) {
-    return -dot(x->v, y->v, f);
-  }
 
-  template<typename Node>
-  static inline void zero_value(Node* dest) {
-    dest->dot_factor = 0;
-  }
+// Distance functions for vectors stored as AnnoyFloat16 or AnnoyBFloat16.
+// Values are widened to float as they're loaded and summed in float, so
+// these return float rather than the storage type.
 
-  template<typename S, typename T>
-  static inline void init_node(Node<S, T>* n, int f) {
-  }
+#if defined(USE_AVX) && defined(__F16C__) && defined(__AVX2__)
+#define USE_AVX_NARROW_FLOAT
+#endif
 
-  template<typename T, typename Node>
-  static inline void copy_node(Node* dest, const Node* source, const int f) {
-    memcpy(dest->v, source->v, f * sizeof(T));
-    dest->dot_factor = source->dot_factor;
-  }
+#if defined(USE_AVX512) || defined(USE_RUNTIME_DISPATCH)
+#if defined(__GNUC__) && !defined(__clang__)
+// GCC 12's AVX-512 headers set this off from inside the intrinsics (GCC bug 105593)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+ANNOY_TARGET_AVX512
+inline __m512 load_ps_avx512(const AnnoyFloat16* x) {
+  return _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i*)x));
+}
 
-  template<typename S, typename T, typename Random>
-  static inline void create_split(const vector<Node<S, T>*>& nodes, int f, size_t s, Random& random, Node<S, T>* n) {
-    Node<S, T>* p = (Node<S, T>*)alloca(s);
-    Node<S, T>* q = (Node<S, T>*)alloca(s);
-    DotProduct::zero_value(p);
-    DotProduct::zero_value(q);
-    two_means<T, Random, DotProduct, Node<S, T> >(nodes, f, random, true, p, q);
-    for (int z = 0; z < f; z++)
-      n->v[z] = p->v[z] - q->v[z];
-    n->dot_factor = p->dot_factor - q->dot_factor;
-    DotProduct::normalize<T, Node<S, T> >(n, f);
-  }
+ANNOY_TARGET_AVX512
+inline __m512 load_ps_avx512(const AnnoyBFloat16* x) {
+  return _mm512_castsi512_ps(_mm512_slli_epi32(_mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*)x)), 16));
+}
 
-  template<typename T, typename Node>
-  static inline void normalize(Node* node, int f) {
-    T norm = sqrt(dot(node->v, node->v, f) + pow(node->dot_factor, 2));
-    if (norm > 0) {
-      for (int z = 0; z < f; z++)
-        node->v[z] /= norm;
-      node->dot_factor /= norm;
-    }
+template<typename V>
+ANNOY_TARGET_AVX512
+inline float narrow_dot_avx512(const V* x, const V* y, int f) {
+  float result = 0;
+  int i = 0;
+  if (f > 15) {
+    __m512 d = _mm512_setzero_ps();
+    for (; i + 16 <= f; i += 16)
+      d = _mm512_fmadd_ps(load_ps_avx512(x + i), load_ps_avx512(y + i), d);
+    result = _mm512_reduce_add_ps(d);
   }
+  for (; i < f; i++)
+    result += (float)x[i] * (float)y[i];
+  return result;
+}
 
-  template<typename S, typename T>
-  static inline T margin(const Node<S, T>* n, const T* y, int f) {
-    return dot(n->v, y, f) + (n->dot_factor * n->dot_factor);
+template<typename V>
+ANNOY_TARGET_AVX512
+inline float narrow_euclidean_distance_avx512(const V* x, const V* y, int f) {
+  float result = 0;
+  int i = 0;
+  if (f > 15) {
+    __m512 d = _mm512_setzero_ps();
+    for (; i + 16 <= f; i += 16) {
+      const __m512 diff = _mm512_sub_ps(load_ps_avx512(x + i), load_ps_avx512(y + i));
+      d = _mm512_fmadd_ps(diff, diff, d);
+    }
+    result = _mm512_reduce_add_ps(d);
   }
-
-  template<typename S, typename T, typename Random>
-  static inline bool side(const Node<S, T>* n, const T* y, int f, Random& random) {
-    T dot = margin(n, y, f);
-    if (dot != 0)
-      return (dot > 0);
-    else
-      return (bool)random.flip();
+  for (; i < f; i++) {
+    float tmp = (float)x[i] - (float)y[i];
+    result += tmp * tmp;
   }
+  return result;
+}
 
-  template<typename T>
-  static inline T normalized_distance(T distance) {
-    return -distance;
+template<typename V>
+ANNOY_TARGET_AVX512
+inline float narrow_manhattan_distance_avx512(const V* x, const V* y, int f) {
+  float result = 0;
+  int i = 0;
+  if (f > 15) {
+    __m512 d = _mm512_setzero_ps();
+    for (; i + 16 <= f; i += 16)
+      d = _mm512_add_ps(d, _mm512_abs_ps(_mm512_sub_ps(load_ps_avx512(x + i), load_ps_avx512(y + i))));
+    result = _mm512_reduce_add_ps(d);
   }
+  for (; i < f; i++)
+    result += fabsf((float)x[i] - (float)y[i]);
+  return result;
+}
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+#endif
 
-  template<typename T, typename S, typename Node>
-  static inline void preprocess(void* nodes, size_t _s, const S node_count, const int f) {
-    // This uses a method from Microsoft Research for transforming inner product spaces to cosine/angular-compatible spaces.
-    // (Bachrach et al., 2014, see https://www.microsoft.com/en-us/research/wp-content/uploads/2016/02/XboxInnerProduct.pdf)
+#if defined(USE_AVX_NARROW_FLOAT) || defined(USE_RUNTIME_DISPATCH)
+ANNOY_TARGET_AVX2
+inline __m256 load_ps_avx2(const AnnoyFloat16* x) {
+  return _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)x));
+}
 
-    // Step one: compute the norm of each vector and store that in its extra dimension (f-1)
-    for (S i = 0; i < node_count; i++) {
-      Node* node = get_node_ptr<S, Node>(nodes, _s, i);
-      T d = dot(node->v, node->v, f);
-      T norm = d < 0 ? 0 : sqrt(d);
-      node->dot_factor = norm;
-    }
+ANNOY_TARGET_AVX2
+inline __m256 load_ps_avx2(const AnnoyBFloat16* x) {
+  return _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)x)), 16));
+}
 
-    // Step two: find the maximum norm
-    T max_norm = 0;
-    for (S i = 0; i < node_count; i++) {
-      Node* node = get_node_ptr<S, Node>(nodes, _s, i);
-      if (node->dot_factor > max_norm) {
-        max_norm = node->dot_factor;
-      }
-    }
+ANNOY_TARGET_AVX2
+inline __m256 fmadd_ps(__m256 a, __m256 b, __m256 c) {
+#if defined(__FMA__) || defined(USE_RUNTIME_DISPATCH)
+  return _mm256_fmadd_ps(a, b, c);
+#else
+  return _mm256_add_ps(_mm256_mul_ps(a, b), c);
+#endif
+}
 
-    // Step three: set each vector's extra dimension to sqrt(max_norm^2 - norm^2)
-    for (S i = 0; i < node_count; i++) {
-      Node* node = get_node_ptr<S, Node>(nodes, _s, i);
-      T node_norm = node->dot_factor;
-      T squared_norm_diff = pow(max_norm, static_cast<T>(2.0)) - pow(node_norm, static_cast<T>(2.0));
-      T dot_factor = squared_norm_diff < 0 ? 0 : sqrt(squared_norm_diff);
+template<typename V>
+ANNOY_TARGET_AVX2
+inline float narrow_dot_avx2(const V* x, const V* y, int f) {
+  float result = 0;
+  int i = 0;
+  if (f > 7) {
+    __m256 d = _mm256_setzero_ps();
+    for (; i + 8 <= f; i += 8)
+      d = fmadd_ps(load_ps_avx2(x + i), load_ps_avx2(y + i), d);
+    result = hsum256_ps_avx(d);
+  }
+  for (; i < f; i++)
+    result += (float)x[i] * (float)y[i];
+  return result;
+}
 
-      node->dot_factor = dot_factor;
+template<typename V>
+ANNOY_TARGET_AVX2
+inline float narrow_euclidean_distance_avx2(const V* x, const V* y, int f) {
+  float result = 0;
+  int i = 0;
+  if (f > 7) {
+    __m256 d = _mm256_setzero_ps();
+    for (; i + 8 <= f; i += 8) {
+      const __m256 diff = _mm256_sub_ps(load_ps_avx2(x + i), load_ps_avx2(y + i));
+      d = fmadd_ps(diff, diff, d);
     }
+    result = hsum256_ps_avx(d);
   }
-};
+  for (; i < f; i++) {
+    float tmp = (float)x[i] - (float)y[i];
+    result += tmp * tmp;
+  }
+  return result;
+}
 
-struct Hamming : Base {
-  template<typename S, typename T>
-  struct Node {
-    S n_descendants;
-    S children[2];
-    T v[V_ARRAY_SIZE];
-  };
+template<typename V>
+ANNOY_TARGET_AVX2
+inline float narrow_manhattan_distance_avx2(const V* x, const V* y, int f) {
+  float result = 0;
+  int i = 0;
+  if (f > 7) {
+    __m256 d = _mm256_setzero_ps();
+    const __m256 minus_zero = _mm256_set1_ps(-0.0f);
+    for (; i + 8 <= f; i += 8)
+      d = _mm256_add_ps(d, _mm256_andnot_ps(minus_zero, _mm256_sub_ps(load_ps_avx2(x + i), load_ps_avx2(y + i))));
+    result = hsum256_ps_avx(d);
+  }
+  for (; i < f; i++)
+    result += fabsf((float)x[i] - (float)y[i]);
+  return result;
+}
+#endif
 
-  static const size_t max_iterations = 20;
+template<typename V>
+inline float narrow_dot(const V* x, const V* y, int f) {
+#if defined(USE_AVX512)
+  return narrow_dot_avx512(x, y, f);
+#elif defined(USE_AVX_NARROW_FLOAT)
+  return narrow_dot_avx2(x, y, f);
+#else
+  float result = 0;
+  for (int i = 0; i < f; i++)
+    result += (float)x[i] * (float)y[i];
+  return result;
+#endif
+}
 
-  template<typename T>
-  static inline T pq_distance(T distance, T margin, int child_nr) {
-    return distance - (margin != (unsigned int) child_nr);
+template<typename V>
+inline float narrow_euclidean_distance(const V* x, const V* y, int f) {
+#if defined(USE_AVX512)
+  return narrow_euclidean_distance_avx512(x, y, f);
+#elif defined(USE_AVX_NARROW_FLOAT)
+  return narrow_euclidean_distance_avx2(x, y, f);
+#else
+  float result = 0;
+  for (int i = 0; i < f; i++) {
+    float tmp = (float)x[i] - (float)y[i];
+    result += tmp * tmp;
   }
+  return result;
+#endif
+}
 
-  template<typename T>
-  static inline T pq_initial_value() {
-    return numeric_limits<T>::max();
-  }
-  template<typename T>
-  static inline int cole_popcount(T v) {
-    // Note: Only used with MSVC 9, which lacks intrinsics and fails to
-    // calculate std::bitset::count for v > 32bit. Uses the generalized
-    // approach by Eric Cole.
-    // See https://graphics.stanford.edu/~seander/bithacks.html#CountBitsSet64
-    v = v - ((v >> 1) & (T)~(T)0/3);
-    v = (v & (T)~(T)0/15*3) + ((v >> 2) & (T)~(T)0/15*3);
-    v = (v + (v >> 4)) & (T)~(T)0/255*15;
-    return (T)(v * ((T)~(T)0/255)) >> (sizeof(T) - 1) * 8;
-  }
-  template<typename S, typename T>
-  static inline T distance(const Node<S, T>* x, const Node<S, T>* y, int f) {
-    size_t dist = 0;
-    for (int i = 0; i < f; i++) {
-      dist += popcount(x->v[i] ^ y->v[i]);
+template<typename V>
+inline float narrow_manhattan_distance(const V* x, const V* y, int f) {
+#if defined(USE_AVX512)
+  return narrow_manhattan_distance_avx512(x, y, f);
+#elif defined(USE_AVX_NARROW_FLOAT)
+  return narrow_manhattan_distance_avx2(x, y, f);
+#else
+  float result = 0;
+  for (int i = 0; i < f; i++)
+    result += fabsf((float)x[i] - (float)y[i]);
+  return result;
+#endif
+}
+
+// Kernels that compare one vector against several, for scoring candidates.
+// Each chunk of x is loaded once for four vectors at a time, and the four
+// sums are reduced together, in the same order as the one-vector kernels
+// above so that both give identical results.
+
+#if defined(USE_AVX512) || defined(USE_RUNTIME_DISPATCH)
+// Sums of a, b, c and d in lanes 0 to 3, each added up in the same order as
+// hsum256_ps_avx and _mm512_reduce_add_ps.
+inline __m128 hsum4_ps_sse(__m128 a, __m128 b, __m128 c, __m128 d) {
+  _MM_TRANSPOSE4_PS(a, b, c, d);
+  return _mm_add_ps(_mm_add_ps(a, c), _mm_add_ps(b, d));
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+ANNOY_TARGET_AVX512
+inline __m128 reduce_ps_avx512(__m512 v) {
+  const __m256 x256 = _mm256_add_ps(_mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(v), 1)),
+                                    _mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(v), 0)));
+  return _mm_add_ps(_mm256_extractf128_ps(x256, 1), _mm256_castps256_ps128(x256));
+}
+
+ANNOY_TARGET_AVX512
+inline void dot_batch_avx512(const float* x, const float* const* ys, int n, int f, float* out) {
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    const float *y0 = ys[i], *y1 = ys[i + 1], *y2 = ys[i + 2], *y3 = ys[i + 3];
+    __m512 d0 = _mm512_setzero_ps(), d1 = _mm512_setzero_ps(), d2 = _mm512_setzero_ps(), d3 = _mm512_setzero_ps();
+    int z = 0;
+    if (f > 15) {
+      for (; z + 16 <= f; z += 16) {
+        const __m512 q = _mm512_loadu_ps(x + z);
+        d0 = _mm512_fmadd_ps(q, _mm512_loadu_ps(y0 + z), d0);
+        d1 = _mm512_fmadd_ps(q, _mm512_loadu_ps(y1 + z), d1);
+        d2 = _mm512_fmadd_ps(q, _mm512_loadu_ps(y2 + z), d2);
+        d3 = _mm512_fmadd_ps(q, _mm512_loadu_ps(y3 + z), d3);
+      }
+      _mm_storeu_ps(out + i, hsum4_ps_sse(reduce_ps_avx512(d0), reduce_ps_avx512(d1),
+                                          reduce_ps_avx512(d2), reduce_ps_avx512(d3)));
+    } else {
+      out[i] = out[i + 1] = out[i + 2] = out[i + 3] = 0;
+    }
+    for (; z < f; z++) {
+      out[i] += x[z] * y0[z];
+      out[i + 1] += x[z] * y1[z];
+      out[i + 2] += x[z] * y2[z];
+      out[i + 3] += x[z] * y3[z];
     }
-    return dist;
-  }
-  template<typename S, typename T>
-  static inline bool margin(const Node<S, T>* n, const T* y, int f) {
-    static const size_t n_bits = sizeof(T) * 8;
-    T chunk = n->v[0] / n_bits;
-    return (y[chunk] & (static_cast<T>(1) << (n_bits - 1 - (n->v[0] % n_bits)))) != 0;
-  }
-  template<typename S, typename T, typename Random>
-  static inline bool side(const Node<S, T>* n, const T* y, int f, Random& random) {
-    return margin(n, y, f);
   }
-  template<typename S, typename T, typename Random>
-  static inline void create_split(const vector<Node<S, T>*>& nodes, int f, size_t s, Random& random, Node<S, T>* n) {
-    size_t cur_size = 0;
-    size_t i = 0;
-    int dim = f * 8 * sizeof(T);
-    for (; i < max_iterations; i++) {
-      // choose random position to split at
-      n->v[0] = random.index(dim);
-      cur_size = 0;
-      for (typename vector<Node<S, T>*>::const_iterator it = nodes.begin(); it != nodes.end(); ++it) {
-        if (margin(n, (*it)->v, f)) {
-          cur_size++;
-        }
-      }
-      if (cur_size > 0 && cur_size < nodes.size()) {
-        break;
+  for (; i < n; i++)
+    out[i] = dot_avx512(x, ys[i], f);
+}
+
+ANNOY_TARGET_AVX512
+inline void euclidean_distance_batch_avx512(const float* x, const float* const* ys, int n, int f, float* out) {
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    const float *y0 = ys[i], *y1 = ys[i + 1], *y2 = ys[i + 2], *y3 = ys[i + 3];
+    __m512 d0 = _mm512_setzero_ps(), d1 = _mm512_setzero_ps(), d2 = _mm512_setzero_ps(), d3 = _mm512_setzero_ps();
+    int z = 0;
+    if (f > 15) {
+      for (; z + 16 <= f; z += 16) {
+        const __m512 q = _mm512_loadu_ps(x + z);
+        const __m512 diff0 = _mm512_sub_ps(q, _mm512_loadu_ps(y0 + z));
+        const __m512 diff1 = _mm512_sub_ps(q, _mm512_loadu_ps(y1 + z));
+        const __m512 diff2 = _mm512_sub_ps(q, _mm512_loadu_ps(y2 + z));
+        const __m512 diff3 = _mm512_sub_ps(q, _mm512_loadu_ps(y3 + z));
+        d0 = _mm512_fmadd_ps(diff0, diff0, d0);
+        d1 = _mm512_fmadd_ps(diff1, diff1, d1);
+        d2 = _mm512_fmadd_ps(diff2, diff2, d2);
+        d3 = _mm512_fmadd_ps(diff3, diff3, d3);
       }
+      _mm_storeu_ps(out + i, hsum4_ps_sse(reduce_ps_avx512(d0), reduce_ps_avx512(d1),
+                                          reduce_ps_avx512(d2), reduce_ps_avx512(d3)));
+    } else {
+      out[i] = out[i + 1] = out[i + 2] = out[i + 3] = 0;
     }
-    // brute-force search for splitting coordinate
-    if (i == max_iterations) {
-      int j = 0;
-      for (; j < dim; j++) {
-        n->v[0] = j;
-        cur_size = 0;
-        for (typename vector<Node<S, T>*>::const_iterator it = nodes.begin(); it != nodes.end(); ++it) {
-          if (margin(n, (*it)->v, f)) {
-            cur_size++;
-          }
-        }
-        if (cur_size > 0 && cur_size < nodes.size()) {
-          break;
-        }
+    for (; z < f; z++) {
+      float t0 = x[z] - y0[z], t1 = x[z] - y1[z], t2 = x[z] - y2[z], t3 = x[z] - y3[z];
+      out[i] += t0 * t0;
+      out[i + 1] += t1 * t1;
+      out[i + 2] += t2 * t2;
+      out[i + 3] += t3 * t3;
+    }
+  }
+  for (; i < n; i++)
+    out[i] = euclidean_distance_avx512(x, ys[i], f);
+}
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+#endif
+
+#ifdef USE_RUNTIME_DISPATCH
+ANNOY_TARGET_AVX2
+inline __m128 reduce_ps_avx2(__m256 v) {
+  return _mm_add_ps(_mm256_extractf128_ps(v, 1), _mm256_castps256_ps128(v));
+}
+
+ANNOY_TARGET_AVX2
+inline void dot_batch_avx2(const float* x, const float* const* ys, int n, int f, float* out) {
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    const float *y0 = ys[i], *y1 = ys[i + 1], *y2 = ys[i + 2], *y3 = ys[i + 3];
+    __m256 d0 = _mm256_setzero_ps(), d1 = _mm256_setzero_ps(), d2 = _mm256_setzero_ps(), d3 = _mm256_setzero_ps();
+    int z = 0;
+    if (f > 7) {
+      for (; z + 8 <= f; z += 8) {
+        const __m256 q = _mm256_loadu_ps(x + z);
+        d0 = _mm256_fmadd_ps(q, _mm256_loadu_ps(y0 + z), d0);
+        d1 = _mm256_fmadd_ps(q, _mm256_loadu_ps(y1 + z), d1);
+        d2 = _mm256_fmadd_ps(q, _mm256_loadu_ps(y2 + z), d2);
+        d3 = _mm256_fmadd_ps(q, _mm256_loadu_ps(y3 + z), d3);
       }
+      _mm_storeu_ps(out + i, hsum4_ps_sse(reduce_ps_avx2(d0), reduce_ps_avx2(d1),
+                                          reduce_ps_avx2(d2), reduce_ps_avx2(d3)));
+    } else {
+      out[i] = out[i + 1] = out[i + 2] = out[i + 3] = 0;
+    }
+    for (; z < f; z++) {
+      out[i] += x[z] * y0[z];
+      out[i + 1] += x[z] * y1[z];
+      out[i + 2] += x[z] * y2[z];
+      out[i + 3] += x[z] * y3[z];
     }
   }
-  template<typename T>
-  static inline T normalized_distance(T distance) {
-    return distance;
+  for (; i < n; i++)
+    out[i] = dot_avx2(x, ys[i], f);
+}
+
+ANNOY_TARGET_AVX2
+inline void euclidean_distance_batch_avx2(const float* x, const float* const* ys, int n, int f, float* out) {
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    const float *y0 = ys[i], *y1 = ys[i + 1], *y2 = ys[i + 2], *y3 = ys[i + 3];
+    __m256 d0 = _mm256_setzero_ps(), d1 = _mm256_setzero_ps(), d2 = _mm256_setzero_ps(), d3 = _mm256_setzero_ps();
+    int z = 0;
+    if (f > 7) {
+      for (; z + 8 <= f; z += 8) {
+        const __m256 q = _mm256_loadu_ps(x + z);
+        const __m256 diff0 = _mm256_sub_ps(q, _mm256_loadu_ps(y0 + z));
+        const __m256 diff1 = _mm256_sub_ps(q, _mm256_loadu_ps(y1 + z));
+        const __m256 diff2 = _mm256_sub_ps(q, _mm256_loadu_ps(y2 + z));
+        const __m256 diff3 = _mm256_sub_ps(q, _mm256_loadu_ps(y3 + z));
+        d0 = _mm256_fmadd_ps(diff0, diff0, d0);
+        d1 = _mm256_fmadd_ps(diff1, diff1, d1);
+        d2 = _mm256_fmadd_ps(diff2, diff2, d2);
+        d3 = _mm256_fmadd_ps(diff3, diff3, d3);
+      }
+      _mm_storeu_ps(out + i, hsum4_ps_sse(reduce_ps_avx2(d0), reduce_ps_avx2(d1),
+                                          reduce_ps_avx2(d2), reduce_ps_avx2(d3)));
+    } else {
+      out[i] = out[i + 1] = out[i + 2] = out[i + 3] = 0;
+    }
+    for (; z < f; z++) {
+      float t0 = x[z] - y0[z], t1 = x[z] - y1[z], t2 = x[z] - y2[z], t3 = x[z] - y3[z];
+      out[i] += t0 * t0;
+      out[i + 1] += t1 * t1;
+      out[i + 2] += t2 * t2;
+      out[i + 3] += t3 * t3;
+    }
   }
-  template<typename S, typename T>
-  static inline void init_node(Node<S, T>* n, int f) {
+  for (; i < n; i++)
+    out[i] = euclidean_distance_avx2(x, ys[i], f);
+}
+
+template<float (*Kernel)(const float*, const float*, int)>
+inline void batch_loop(const float* x, const float* const* ys, int n, int f, float* out) {
+  for (int i = 0; i < n; i++)
+    out[i] = Kernel(x, ys[i], f);
+}
+#endif
+
+#ifdef USE_RUNTIME_DISPATCH
+struct AnnoyKernels {
+  // One implementation of each distance function, all for the same
+  // instruction set. Margins go through dot, so they follow along.
+  const char* name;
+  float (*dot)(const float*, const float*, int);
+  float (*euclidean_distance)(const float*, const float*, int);
+  float (*manhattan_distance)(const float*, const float*, int);
+  float (*dot_float16)(const AnnoyFloat16*, const AnnoyFloat16*, int);
+  float (*euclidean_distance_float16)(const AnnoyFloat16*, const AnnoyFloat16*, int);
+  float (*manhattan_distance_float16)(const AnnoyFloat16*, const AnnoyFloat16*, int);
+  float (*dot_bfloat16)(const AnnoyBFloat16*, const AnnoyBFloat16*, int);
+  float (*euclidean_distance_bfloat16)(const AnnoyBFloat16*, const AnnoyBFloat16*, int);
+  float (*manhattan_distance_bfloat16)(const AnnoyBFloat16*, const AnnoyBFloat16*, int);
+  size_t (*hamming_distance)(const uint64_t*, const uint64_t*, int);
+  void (*dot_batch)(const float*, const float* const*, int, int, float*);
+  void (*euclidean_distance_batch)(const float*, const float* const*, int, int, float*);
+};
+
+inline AnnoyKernels annoy_detect_kernels() {
+  // Picks the widest instruction set the CPU has. ANNOY_SIMD can be set to
+  // "sse" or "avx2" to use a narrower one, e.g. to compare them.
+  const char* cap = getenv("ANNOY_SIMD");
+  bool allow_avx512 = cap == NULL || *cap == '\0' || strcmp(cap, "avx512") == 0;
+  bool allow_avx2 = allow_avx512 || strcmp(cap, "avx2") == 0;
+
+  __builtin_cpu_init();
+  size_t (*hamming)(const uint64_t*, const uint64_t*, int) =
+    __builtin_cpu_supports("popcnt") ? hamming_distance_popcnt : hamming_distance_scalar;
+  if (allow_avx512 && __builtin_cpu_supports("avx512f")) {
+    AnnoyKernels kernels = {
+      "avx512", dot_avx512, euclidean_distance_avx512, manhattan_distance_avx512,
+      narrow_dot_avx512<AnnoyFloat16>, narrow_euclidean_distance_avx512<AnnoyFloat16>, narrow_manhattan_distance_avx512<AnnoyFloat16>,
+      narrow_dot_avx512<AnnoyBFloat16>, narrow_euclidean_distance_avx512<AnnoyBFloat16>, narrow_manhattan_distance_avx512<AnnoyBFloat16>,
+      hamming, dot_batch_avx512, euclidean_distance_batch_avx512
+    };
+    return kernels;
   }
-  static const char* name() {
-    return "hamming";
+  if (allow_avx2 && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+    // Every CPU with AVX2 also has F16C
+    AnnoyKernels kernels = {
+      "avx2", dot_avx2, euclidean_distance_avx2, manhattan_distance_avx2,
+      narrow_dot_avx2<AnnoyFloat16>, narrow_euclidean_distance_avx2<AnnoyFloat16>, narrow_manhattan_distance_avx2<AnnoyFloat16>,
+      narrow_dot_avx2<AnnoyBFloat16>, narrow_euclidean_distance_avx2<AnnoyBFloat16>, narrow_manhattan_distance_avx2<AnnoyBFloat16>,
+      hamming, dot_batch_avx2, euclidean_distance_batch_avx2
+    };
+    return kernels;
   }
-};
+  AnnoyKernels kernels = {
+    "sse", dot_sse, euclidean_distance_sse, manhattan_distance_sse,
+    narrow_dot<AnnoyFloat16>, narrow_euclidean_distance<AnnoyFloat16>, narrow_manhattan_distance<AnnoyFloat16>,
+    narrow_dot<AnnoyBFloat16>, narrow_euclidean_distance<AnnoyBFloat16>, narrow_manhattan_distance<AnnoyBFloat16>,
+    hamming, batch_loop<dot_sse>, batch_loop<euclidean_distance_sse>
+  };
+  return kernels;
+}
 
+inline const AnnoyKernels& annoy_kernels() {
+  static const AnnoyKernels kernels = annoy_detect_kernels();
+  return kernels;
+}
 
-struct Minkowski : Base {
-  template<typename S, typename T>
-  struct Node {
-    S n_descendants;
-    T a; // need an extra constant term to determine the offset of the plane
-    S children[2];
-    T v[V_ARRAY_SIZE];
+template<>
+inline float dot<float>(const float* x, const float *y, int f) {
+  return annoy_kernels().dot(x, y, f);
+}
+
+template<>
+inline float manhattan_distance<float>(const float* x, const float* y, int f) {
+  return annoy_kernels().manhattan_distance(x, y, f);
+}
+
+template<>
+inline float euclidean_distance<float>(const float* x, const float* y, int f) {
+  return annoy_kernels().euclidean_distance(x, y, f);
+}
+
+inline float dot(const AnnoyFloat16* x, const AnnoyFloat16* y, int f) {
+  return annoy_kernels().dot_float16(x, y, f);
+}
+
+inline float dot(const AnnoyBFloat16* x, const AnnoyBFloat16* y, int f) {
+  return annoy_kernels().dot_bfloat16(x, y, f);
+}
+
+inline float euclidean_distance(const AnnoyFloat16* x, const AnnoyFloat16* y, int f) {
+  return annoy_kernels().euclidean_distance_float16(x, y, f);
+}
+
+inline float euclidean_distance(const AnnoyBFloat16* x, const AnnoyBFloat16* y, int f) {
+  return annoy_kernels().euclidean_distance_bfloat16(x, y, f);
+}
+
+inline float manhattan_distance(const AnnoyFloat16* x, const AnnoyFloat16* y, int f) {
+  return annoy_kernels().manhattan_distance_float16(x, y, f);
+}
+
+inline float manhattan_distance(const AnnoyBFloat16* x, const AnnoyBFloat16* y, int f) {
+  return annoy_kernels().manhattan_distance_bfloat16(x, y, f);
+}
+#else
+inline float dot(const AnnoyFloat16* x, const AnnoyFloat16* y, int f) {
+  return narrow_dot(x, y, f);
+}
+
+inline float dot(const AnnoyBFloat16* x, const AnnoyBFloat16* y, int f) {
+  return narrow_dot(x, y, f);
+}
+
+inline float euclidean_distance(const AnnoyFloat16* x, const AnnoyFloat16* y, int f) {
+  return narrow_euclidean_distance(x, y, f);
+}
+
+inline float euclidean_distance(const AnnoyBFloat16* x, const AnnoyBFloat16* y, int f) {
+  return narrow_euclidean_distance(x, y, f);
+}
+
+inline float manhattan_distance(const AnnoyFloat16* x, const AnnoyFloat16* y, int f) {
+  return narrow_manhattan_distance(x, y, f);
+}
+
+inline float manhattan_distance(const AnnoyBFloat16* x, const AnnoyBFloat16* y, int f) {
+  return narrow_manhattan_distance(x, y, f);
+}
+#endif
+
+template<typename T>
+inline void dot_batch(const T* x, const T* const* ys, int n, int f, typename AnnoyDistanceType<T>::type* out) {
+  // out[i] = dot(x, ys[i], f)
+  for (int i = 0; i < n; i++)
+    out[i] = dot(x, ys[i], f);
+}
+
+template<typename T>
+inline void euclidean_distance_batch(const T* x, const T* const* ys, int n, int f, typename AnnoyDistanceType<T>::type* out) {
+  for (int i = 0; i < n; i++)
+    out[i] = euclidean_distance(x, ys[i], f);
+}
+
+template<typename T>
+inline void manhattan_distance_batch(const T* x, const T* const* ys, int n, int f, typename AnnoyDistanceType<T>::type* out) {
+  for (int i = 0; i < n; i++)
+    out[i] = manhattan_distance(x, ys[i], f);
+}
+
+#if defined(USE_RUNTIME_DISPATCH)
+template<>
+inline void dot_batch<float>(const float* x, const float* const* ys, int n, int f, float* out) {
+  annoy_kernels().dot_batch(x, ys, n, f, out);
+}
+
+template<>
+inline void euclidean_distance_batch<float>(const float* x, const float* const* ys, int n, int f, float* out) {
+  annoy_kernels().euclidean_distance_batch(x, ys, n, f, out);
+}
+#elif defined(USE_AVX512)
+template<>
+inline void dot_batch<float>(const float* x, const float* const* ys, int n, int f, float* out) {
+  dot_batch_avx512(x, ys, n, f, out);
+}
+
+template<>
+inline void euclidean_distance_batch<float>(const float* x, const float* const* ys, int n, int f, float* out) {
+  euclidean_distance_batch_avx512(x, ys, n, f, out);
+}
+#endif
+
+inline void annoy_prefetch(const void* p, size_t size) {
+  // Asks for size bytes from p to be brought into cache.
+#if defined(__GNUC__)
+  for (size_t offset = 0; offset < size; offset += 64)
+    __builtin_prefetch((const char*)p + offset);
+#endif
+}
+
+inline const char* annoy_simd_name() {
+  // Which of the distance kernels are in use.
+#if defined(USE_RUNTIME_DISPATCH)
+  return annoy_kernels().name;
+#elif defined(USE_AVX512)
+  return "avx512";
+#elif defined(USE_AVX)
+  return "avx";
+#else
+  return "none";
+#endif
+}
+
+template<typename T>
+inline typename AnnoyDistanceType<T>::type get_norm(T* v, int f) {
+  return sqrt(dot(v, v, f));
+}
+
+template<typename T, typename Random, typename Distance, typename Node>
+inline void two_means(const vector<Node*>& nodes, int f, Random& random, bool cosine, Node* p, Node* q) {
+  /*
+    This algorithm is a huge heuristic. Empirically it works really well, but I
+    can't motivate it well. The basic idea is to keep two centroids and assign
+    points to either one of them. We weight each centroid by the number of points
+    assigned to it, so to balance it.
+  */
+  static int iteration_steps = 200;
+  size_t count = nodes.size();
+
+  size_t i = random.index(count);
+  size_t j = random.index(count-1);
+  j += (j >= i); // ensure that i != j
+
+  Distance::template copy_node<T, Node>(p, nodes[i], f);
+  Distance::template copy_node<T, Node>(q, nodes[j], f);
+
+  if (cosine) { Distance::template normalize<T, Node>(p, f); Distance::template normalize<T, Node>(q, f); }
+  Distance::init_node(p, f);
+  Distance::init_node(q, f);
+
+  int ic = 1, jc = 1;
+  for (int l = 0; l < iteration_steps; l++) {
+    size_t k = random.index(count);
+    typename AnnoyDistanceType<T>::type di = ic * Distance::distance(p, nodes[k], f),
+      dj = jc * Distance::distance(q, nodes[k], f);
+    typename AnnoyDistanceType<T>::type norm = cosine ? get_norm(nodes[k]->v, f) : 1;
+    if (!(norm > 0)) {
+      continue;
+    }
+    if (di < dj) {
+      for (int z = 0; z < f; z++)
+        p->v[z] = (p->v[z] * ic + nodes[k]->v[z] / norm) / (ic + 1);
+      Distance::init_node(p, f);
+      ic++;
+    } else if (dj < di) {
+      for (int z = 0; z < f; z++)
+        q->v[z] = (q->v[z] * jc + nodes[k]->v[z] / norm) / (jc + 1);
+      Distance::init_node(q, f);
+      jc++;
+    }
+  }
+}
+} // namespace
+
+struct Base {
+  template<typename T, typename S, typename Node>
+  static inline void preprocess(void* nodes, size_t _s, const S node_count, const int f) {
+    // Override this in specific metric structs below if you need to do any pre-processing
+    // on the entire set of nodes passed into this index.
+  }
+
+  template<typename T, typename S, typename Node>
+  static inline void preprocess_added(void* nodes, size_t _s, const S first, const S node_count, const int f) {
+    // Like preprocess, for the nodes from first on, which were added after
+    // the ones before first were preprocessed.
+  }
+
+  template<typename Node>
+  static inline void zero_value(Node* dest) {
+    // Initialize any fields that require sane defaults within this node.
+  }
+
+  template<typename T, typename Node>
+  static inline void copy_node(Node* dest, const Node* source, const int f) {
+    memcpy(dest->v, source->v, f * sizeof(T));
+  }
+
+  template<typename T, typename Node>
+  static inline void normalize(Node* node, int f) {
+    typename AnnoyDistanceType<T>::type norm = get_norm(node->v, f);
+    if (norm > 0) {
+      for (int z = 0; z < f; z++)
+        node->v[z] /= norm;
+    }
+  }
+};
+
+struct Angular : Base {
+  template<typename S, typename T>
+  struct Node {
+    /*
+     * We store a binary tree where each node has two things
+     * - A vector associated with it
+     * - Two children
+     * All nodes occupy the same amount of memory
+     * All nodes with n_descendants == 1 are leaf nodes.
+     * A memory optimization is that for nodes with 2 <= n_descendants <= K,
+     * we skip the vector. Instead we store a list of all descendants. K is
+     * determined by the number of items that fits in the space of the vector.
+     * For nodes with n_descendants == 1 the vector is a data point.
+     * For nodes with n_descendants > K the vector is the normal of the split plane.
+     * Note that we can't really do sizeof(node<T>) because we cheat and allocate
+     * more memory to be able to fit the vector outside
+     */
+    S n_descendants;
+    union {
+      S children[2]; // Will possibly store more than 2
+      typename AnnoyDistanceType<T>::type norm;
+    };
+    T v[V_ARRAY_SIZE];
   };
   template<typename S, typename T>
-  static inline T margin(const Node<S, T>* n, const T* y, int f) {
-    return n->a + dot(n->v, y, f);
+  static inline typename AnnoyDistanceType<T>::type distance(const Node<S, T>* x, const Node<S, T>* y, int f) {
+    // want to calculate (a/|a| - b/|b|)^2
+    // = a^2 / a^2 + b^2 / b^2 - 2ab/|a||b|
+    // = 2 - 2cos
+    typename AnnoyDistanceType<T>::type pp = x->norm ? x->norm : dot(x->v, x->v, f); // For backwards compatibility reasons, we need to fall back and compute the norm here
+    typename AnnoyDistanceType<T>::type qq = y->norm ? y->norm : dot(y->v, y->v, f);
+    typename AnnoyDistanceType<T>::type pq = dot(x->v, y->v, f);
+    typename AnnoyDistanceType<T>::type ppqq = pp * qq;
+    if (ppqq > 0) return 2.0 - 2.0 * pq / sqrt(ppqq);
+    else return 2.0; // cos is 0
+  }
+  template<typename S, typename T>
+  static inline void distance_batch(const Node<S, T>* x, Node<S, T>* const* ys, int n, int f, typename AnnoyDistanceType<T>::type* out) {
+    // distance(x, ys[i], f) for each of the n <= ANNOY_DISTANCE_BATCH nodes
+    const T* vs[ANNOY_DISTANCE_BATCH];
+    for (int i = 0; i < n; i++)
+      vs[i] = ys[i]->v;
+    dot_batch(x->v, vs, n, f, out);
+    typename AnnoyDistanceType<T>::type pp = x->norm ? x->norm : dot(x->v, x->v, f);
+    for (int i = 0; i < n; i++) {
+      typename AnnoyDistanceType<T>::type qq = ys[i]->norm ? ys[i]->norm : dot(ys[i]->v, ys[i]->v, f);
+      typename AnnoyDistanceType<T>::type ppqq = pp * qq;
+      if (ppqq > 0) out[i] = 2.0 - 2.0 * out[i] / sqrt(ppqq);
+      else out[i] = 2.0; // cos is 0
+    }
+  }
+  template<typename S, typename T>
+  static inline typename AnnoyDistanceType<T>::type margin(const Node<S, T>* n, const T* y, int f) {
+    return dot(n->v, y, f);
   }
   template<typename S, typename T, typename Random>
   static inline bool side(const Node<S, T>* n, const T* y, int f, Random& random) {
-    T dot = margin(n, y, f);
+    typename AnnoyDistanceType<T>::type dot = margin(n, y, f);
     if (dot != 0)
       return (dot > 0);
     else
       return (bool)random.flip();
   }
+  template<typename S, typename T, typename Random>
+  static inline void create_split(const vector<Node<S, T>*>& nodes, int f, size_t s, Random& random, Node<S, T>* n) {
+    Node<S, T>* p = (Node<S, T>*)alloca(s);
+    Node<S, T>* q = (Node<S, T>*)alloca(s);
+    two_means<T, Random, Angular, Node<S, T> >(nodes, f, random, true, p, q);
+    for (int z = 0; z < f; z++)
+      n->v[z] = p->v[z] - q->v[z];
+    Base::normalize<T, Node<S, T> >(n, f);
+  }
+  template<typename T>
+  static inline T normalized_distance(T distance) {
+    // Used when requesting distances from Python layer
+    // Turns out sometimes the squared distance is -0.0
+    // so we have to make sure it's a positive number.
+    return sqrt(std::max(distance, T(0)));
+  }
   template<typename T>
   static inline T pq_distance(T distance, T margin, int child_nr) {
     if (child_nr == 0)
@@ -758,217 +1401,2660 @@ struct Minkowski : Base {
   static inline T pq_initial_value() {
     return numeric_limits<T>::infinity();
   }
+  template<typename S, typename T>
+  static inline void init_node(Node<S, T>* n, int f) {
+    n->norm = dot(n->v, n->v, f);
+  }
+  static const char* name() {
+    return "angular";
+  }
 };
 
 
-struct Euclidean : Minkowski {
+struct DotProduct : Angular {
   template<typename S, typename T>
-  static inline T distance(const Node<S, T>* x, const Node<S, T>* y, int f) {
-    return euclidean_distance(x->v, y->v, f);
-  }
-  template<typename S, typename T, typename Random>
-  static inline void create_split(const vector<Node<S, T>*>& nodes, int f, size_t s, Random& random, Node<S, T>* n) {
-    Node<S, T>* p = (Node<S, T>*)alloca(s);
-    Node<S, T>* q = (Node<S, T>*)alloca(s);
-    two_means<T, Random, Euclidean, Node<S, T> >(nodes, f, random, false, p, q);
+  struct Node {
+    /*
+     * This is an extension of the Angular node with an extra attribute for the scaled norm.
+     */
+    S n_descendants;
+    S children[2]; // Will possibly store more than 2
+    typename AnnoyDistanceType<T>::type dot_factor;
+    T v[V_ARRAY_SIZE];
+  };
 
-    for (int z = 0; z < f; z++)
-      n->v[z] = p->v[z] - q->v[z];
-    Base::normalize<T, Node<S, T> >(n, f);
-    n->a = 0.0;
-    for (int z = 0; z < f; z++)
-      n->a += -n->v[z] * (p->v[z] + q->v[z]) / 2;
-  }
-  template<typename T>
-  static inline T normalized_distance(T distance) {
-    return sqrt(std::max(distance, T(0)));
+  static const char* name() {
+    return "dot";
   }
   template<typename S, typename T>
-  static inline void init_node(Node<S, T>* n, int f) {
+  static inline typename AnnoyDistanceType<T>::type distance(const Node<S, T>* x, const Node<S, T>* y, int f) {
+    return -dot(x->v, y->v, f);
   }
-  static const char* name() {
-    return "euclidean";
+
+  template<typename S, typename T>
+  static inline void distance_batch(const Node<S, T>* x, Node<S, T>* const* ys, int n, int f, typename AnnoyDistanceType<T>::type* out) {
+    const T* vs[ANNOY_DISTANCE_BATCH];
+    for (int i = 0; i < n; i++)
+      vs[i] = ys[i]->v;
+    dot_batch(x->v, vs, n, f, out);
+    for (int i = 0; i < n; i++)
+      out[i] = -out[i];
   }
 
-};
+  template<typename Node>
+  static inline void zero_value(Node* dest) {
+    dest->dot_factor = 0;
+  }
 
-struct Manhattan : Minkowski {
   template<typename S, typename T>
-  static inline T distance(const Node<S, T>* x, const Node<S, T>* y, int f) {
-    return manhattan_distance(x->v, y->v, f);
+  static inline void init_node(Node<S, T>* n, int f) {
+  }
+
+  template<typename T, typename Node>
+  static inline void copy_node(Node* dest, const Node* source, const int f) {
+    memcpy(dest->v, source->v, f * sizeof(T));
+    dest->dot_factor = source->dot_factor;
   }
+
   template<typename S, typename T, typename Random>
   static inline void create_split(const vector<Node<S, T>*>& nodes, int f, size_t s, Random& random, Node<S, T>* n) {
     Node<S, T>* p = (Node<S, T>*)alloca(s);
     Node<S, T>* q = (Node<S, T>*)alloca(s);
-    two_means<T, Random, Manhattan, Node<S, T> >(nodes, f, random, false, p, q);
-
+    DotProduct::zero_value(p);
+    DotProduct::zero_value(q);
+    two_means<T, Random, DotProduct, Node<S, T> >(nodes, f, random, true, p, q);
     for (int z = 0; z < f; z++)
       n->v[z] = p->v[z] - q->v[z];
-    Base::normalize<T, Node<S, T> >(n, f);
-    n->a = 0.0;
-    for (int z = 0; z < f; z++)
-      n->a += -n->v[z] * (p->v[z] + q->v[z]) / 2;
+    n->dot_factor = p->dot_factor - q->dot_factor;
+    DotProduct::normalize<T, Node<S, T> >(n, f);
+  }
+
+  template<typename T, typename Node>
+  static inline void normalize(Node* node, int f) {
+    typename AnnoyDistanceType<T>::type norm = sqrt(dot(node->v, node->v, f) + pow(node->dot_factor, 2));
+    if (norm > 0) {
+      for (int z = 0; z < f; z++)
+        node->v[z] /= norm;
+      node->dot_factor /= norm;
+    }
+  }
+
+  template<typename S, typename T>
+  static inline typename AnnoyDistanceType<T>::type margin(const Node<S, T>* n, const T* y, int f) {
+    return dot(n->v, y, f) + (n->dot_factor * n->dot_factor);
+  }
+
+  template<typename S, typename T, typename Random>
+  static inline bool side(const Node<S, T>* n, const T* y, int f, Random& random) {
+    typename AnnoyDistanceType<T>::type dot = margin(n, y, f);
+    if (dot != 0)
+      return (dot > 0);
+    else
+      return (bool)random.flip();
   }
+
   template<typename T>
   static inline T normalized_distance(T distance) {
-    return std::max(distance, T(0));
+    return -distance;
   }
-  template<typename S, typename T>
-  static inline void init_node(Node<S, T>* n, int f) {
+
+  template<typename T, typename S, typename Node>
+  static inline void preprocess(void* nodes, size_t _s, const S node_count, const int f) {
+    // This uses a method from Microsoft Research for transforming inner product spaces to cosine/angular-compatible spaces.
+    // (Bachrach et al., 2014, see https://www.microsoft.com/en-us/research/wp-content/uploads/2016/02/XboxInnerProduct.pdf)
+
+    // Step one: compute the norm of each vector and store that in its extra dimension (f-1)
+    for (S i = 0; i < node_count; i++) {
+      Node* node = get_node_ptr<S, Node>(nodes, _s, i);
+      typename AnnoyDistanceType<T>::type d = dot(node->v, node->v, f);
+      typename AnnoyDistanceType<T>::type norm = d < 0 ? 0 : sqrt(d);
+      node->dot_factor = norm;
+    }
+
+    // Step two: find the maximum norm
+    typename AnnoyDistanceType<T>::type max_norm = 0;
+    for (S i = 0; i < node_count; i++) {
+      Node* node = get_node_ptr<S, Node>(nodes, _s, i);
+      if (node->dot_factor > max_norm) {
+        max_norm = node->dot_factor;
+      }
+    }
+
+    // Step three: set each vector's extra dimension to sqrt(max_norm^2 - norm^2)
+    for (S i = 0; i < node_count; i++) {
+      Node* node = get_node_ptr<S, Node>(nodes, _s, i);
+      typename AnnoyDistanceType<T>::type node_norm = node->dot_factor;
+      typename AnnoyDistanceType<T>::type squared_norm_diff = pow(max_norm, static_cast<typename AnnoyDistanceType<T>::type>(2.0)) - pow(node_norm, static_cast<typename AnnoyDistanceType<T>::type>(2.0));
+      typename AnnoyDistanceType<T>::type dot_factor = squared_norm_diff < 0 ? 0 : sqrt(squared_norm_diff);
+
+      node->dot_factor = dot_factor;
+    }
   }
-  static const char* name() {
-    return "manhattan";
+
+  template<typename T, typename S, typename Node>
+  static inline void preprocess_added(void* nodes, size_t _s, const S first, const S node_count, const int f) {
+    // Every preprocessed vector has the maximum norm once its extra dimension
+    // is counted, so that can be read off any of them. New vectors with a
+    // bigger norm get an extra dimension of 0, which is what preprocess does
+    // with rounding errors.
+    typename AnnoyDistanceType<T>::type max_norm = 0;
+    for (S i = 0; i < first; i++) {
+      Node* node = get_node_ptr<S, Node>(nodes, _s, i);
+      if (node->n_descendants >= 1) {
+        max_norm = sqrt(dot(node->v, node->v, f) + node->dot_factor * node->dot_factor);
+        break;
+      }
+    }
+
+    for (S i = first; i < node_count; i++) {
+      Node* node = get_node_ptr<S, Node>(nodes, _s, i);
+      typename AnnoyDistanceType<T>::type d = dot(node->v, node->v, f);
+      typename AnnoyDistanceType<T>::type squared_norm_diff = max_norm * max_norm - d;
+      node->dot_factor = squared_norm_diff < 0 ? 0 : sqrt(squared_norm_diff);
+    }
   }
 };
 
-template<typename S, typename T, typename R = uint64_t>
-class AnnoyIndexInterface {
- public:
-  // Note that the methods with an **error argument will allocate memory and write the pointer to that string if error is non-NULL
-  virtual ~AnnoyIndexInterface() {};
-  virtual bool add_item(S item, const T* w, char** error=NULL) = 0;
-  virtual bool build(int q, int n_threads=-1, char** error=NULL) = 0;
-  virtual bool unbuild(char** error=NULL) = 0;
-  virtual bool save(const char* filename, bool prefault=false, char** error=NULL) = 0;
-  virtual void unload() = 0;
-  virtual bool load(const char* filename, bool prefault=false, char** error=NULL) = 0;
-  virtual bool loadBuffer(void* buffer, off_t size, bool copy=false, char** error=NULL) = 0;
-  virtual T get_distance(S i, S j) const = 0;
-  virtual void get_nns_by_item(S item, size_t n, int search_k, vector<S>* result, vector<T>* distances, const char* filter_type, vector<int>* filter_vector) const = 0;
-  virtual void get_nns_by_vector(const T* w, size_t n, int search_k, vector<S>* result, vector<T>* distances, const char* filter_type, vector<int>* filter_vector) const = 0;
-  virtual S get_n_items() const = 0;
-  virtual S get_n_trees() const = 0;
-  virtual void verbose(bool v) = 0;
-  virtual void get_item(S item, T* v) const = 0;
-  virtual void set_seed(R q) = 0;
-  virtual bool on_disk_build(const char* filename, char** error=NULL) = 0;
-};
+struct Hamming : Base {
+  template<typename S, typename T>
+  struct Node {
+    S n_descendants;
+    S children[2];
+    T v[V_ARRAY_SIZE];
+  };
 
-template<typename S, typename T, typename Distance, typename Random, class ThreadedBuildPolicy>
-  class AnnoyIndex : public AnnoyIndexInterface<S, T,
-#if __cplusplus >= 201103L
-    typename std::remove_const<decltype(Random::default_seed)>::type
-#else
-    typename Random::seed_type
-#endif
-    > {
-  /*
-   * We use random projection to build a forest of binary trees of all items.
-   * Basically just split the hyperspace into two sides by a hyperplane,
-   * then recursively split each of those subtrees etc.
-   * We create a tree like this q times. The default q is determined automatically
-   * in such a way that we at most use 2x as much memory as the vectors take.
-   */
-public:
-  typedef Distance D;
-  typedef typename D::template Node<S, T> Node;
-#if __cplusplus >= 201103L
-  typedef typename std::remove_const<decltype(Random::default_seed)>::type R;
-#else
-  typedef typename Random::seed_type R;
-#endif
+  static const size_t max_iterations = 20;
 
-protected:
-  const int _f;
-  size_t _s;
-  S _n_items;
-  void* _nodes; // Could either be mmapped, or point to a memory buffer that we reallocate
-  S _n_nodes;
-  S _nodes_size;
-  vector<S> _roots;
-  S _K;
-  R _seed;
-  bool _loaded;
-  bool _verbose;
-  int _fd;
-  bool _is_buffer;
-  bool _on_disk;
-  bool _built;
-public:
+  template<typename T>
+  static inline T pq_distance(T distance, T margin, int child_nr) {
+    return distance - (margin != (unsigned int) child_nr);
+  }
 
-   AnnoyIndex(int f) : _f(f), _seed(Random::default_seed) {
-    _s = offsetof(Node, v) + _f * sizeof(T); // Size of each node
-    _verbose = false;
-    _built = false;
-    _K = (S) (((size_t) (_s - offsetof(Node, children))) / sizeof(S)); // Max number of descendants to fit into node
-    reinitialize(); // Reset everything
+  template<typename T>
+  static inline T pq_initial_value() {
+    return numeric_limits<T>::max();
   }
-  ~AnnoyIndex() {
-    unload();
+  template<typename T>
+  static inline int cole_popcount(T v) {
+    // Note: Only used with MSVC 9, which lacks intrinsics and fails to
+    // calculate std::bitset::count for v > 32bit. Uses the generalized
+    // approach by Eric Cole.
+    // See https://graphics.stanford.edu/~seander/bithacks.html#CountBitsSet64
+    v = v - ((v >> 1) & (T)~(T)0/3);
+    v = (v & (T)~(T)0/15*3) + ((v >> 2) & (T)~(T)0/15*3);
+    v = (v + (v >> 4)) & (T)~(T)0/255*15;
+    return (T)(v * ((T)~(T)0/255)) >> (sizeof(T) - 1) * 8;
   }
-
-  int get_f() const {
-    return _f;
+  template<typename S, typename T>
+  static inline T distance(const Node<S, T>* x, const Node<S, T>* y, int f) {
+#ifdef USE_RUNTIME_DISPATCH
+    if (std::is_same<T, uint64_t>::value)
+      return annoy_kernels().hamming_distance((const uint64_t*)x->v, (const uint64_t*)y->v, f);
+#endif
+    size_t dist = 0;
+    for (int i = 0; i < f; i++) {
+      dist += popcount(x->v[i] ^ y->v[i]);
+    }
+    return dist;
+  }
+  template<typename S, typename T>
+  static inline void distance_batch(const Node<S, T>* x, Node<S, T>* const* ys, int n, int f, T* out) {
+    for (int i = 0; i < n; i++)
+      out[i] = distance(x, ys[i], f);
+  }
+  template<typename S, typename T>
+  static inline bool margin(const Node<S, T>* n, const T* y, int f) {
+    static const size_t n_bits = sizeof(T) * 8;
+    T chunk = n->v[0] / n_bits;
+    return (y[chunk] & (static_cast<T>(1) << (n_bits - 1 - (n->v[0] % n_bits)))) != 0;
+  }
+  template<typename S, typename T, typename Random>
+  static inline bool side(const Node<S, T>* n, const T* y, int f, Random& random) {
+    return margin(n, y, f);
+  }
+  template<typename S, typename T, typename Random>
+  static inline void create_split(const vector<Node<S, T>*>& nodes, int f, size_t s, Random& random, Node<S, T>* n) {
+    size_t cur_size = 0;
+    size_t i = 0;
+    int dim = f * 8 * sizeof(T);
+    for (; i < max_iterations; i++) {
+      // choose random position to split at
+      n->v[0] = random.index(dim);
+      cur_size = 0;
+      for (typename vector<Node<S, T>*>::const_iterator it = nodes.begin(); it != nodes.end(); ++it) {
+        if (margin(n, (*it)->v, f)) {
+          cur_size++;
+        }
+      }
+      if (cur_size > 0 && cur_size < nodes.size()) {
+        break;
+      }
+    }
+    // brute-force search for splitting coordinate
+    if (i == max_iterations) {
+      int j = 0;
+      for (; j < dim; j++) {
+        n->v[0] = j;
+        cur_size = 0;
+        for (typename vector<Node<S, T>*>::const_iterator it = nodes.begin(); it != nodes.end(); ++it) {
+          if (margin(n, (*it)->v, f)) {
+            cur_size++;
+          }
+        }
+        if (cur_size > 0 && cur_size < nodes.size()) {
+          break;
+        }
+      }
+    }
+  }
+  template<typename T>
+  static inline T normalized_distance(T distance) {
+    return distance;
+  }
+  template<typename S, typename T>
+  static inline void init_node(Node<S, T>* n, int f) {
+  }
+  static const char* name() {
+    return "hamming";
   }
+};
 
-  bool add_item(S item, const T* w, char** error=NULL) {
-    return add_item_impl(item, w, error);
+
+struct Minkowski : Base {
+  template<typename S, typename T>
+  struct Node {
+    S n_descendants;
+    typename AnnoyDistanceType<T>::type a; // need an extra constant term to determine the offset of the plane
+    S children[2];
+    T v[V_ARRAY_SIZE];
+  };
+  template<typename S, typename T>
+  static inline typename AnnoyDistanceType<T>::type margin(const Node<S, T>* n, const T* y, int f) {
+    return n->a + dot(n->v, y, f);
+  }
+  template<typename S, typename T, typename Random>
+  static inline bool side(const Node<S, T>* n, const T* y, int f, Random& random) {
+    typename AnnoyDistanceType<T>::type dot = margin(n, y, f);
+    if (dot != 0)
+      return (dot > 0);
+    else
+      return (bool)random.flip();
   }
+  template<typename T>
+  static inline T pq_distance(T distance, T margin, int child_nr) {
+    if (child_nr == 0)
+      margin = -margin;
+    return std::min(distance, margin);
+  }
+  template<typename T>
+  static inline T pq_initial_value() {
+    return numeric_limits<T>::infinity();
+  }
+};
+
+
+struct Euclidean : Minkowski {
+  template<typename S, typename T>
+  static inline typename AnnoyDistanceType<T>::type distance(const Node<S, T>* x, const Node<S, T>* y, int f) {
+    return euclidean_distance(x->v, y->v, f);
+  }
+  template<typename S, typename T>
+  static inline void distance_batch(const Node<S, T>* x, Node<S, T>* const* ys, int n, int f, typename AnnoyDistanceType<T>::type* out) {
+    const T* vs[ANNOY_DISTANCE_BATCH];
+    for (int i = 0; i < n; i++)
+      vs[i] = ys[i]->v;
+    euclidean_distance_batch(x->v, vs, n, f, out);
+  }
+  template<typename S, typename T, typename Random>
+  static inline void create_split(const vector<Node<S, T>*>& nodes, int f, size_t s, Random& random, Node<S, T>* n) {
+    Node<S, T>* p = (Node<S, T>*)alloca(s);
+    Node<S, T>* q = (Node<S, T>*)alloca(s);
+    two_means<T, Random, Euclidean, Node<S, T> >(nodes, f, random, false, p, q);
+
+    for (int z = 0; z < f; z++)
+      n->v[z] = p->v[z] - q->v[z];
+    Base::normalize<T, Node<S, T> >(n, f);
+    n->a = 0.0;
+    for (int z = 0; z < f; z++)
+      n->a += -n->v[z] * (p->v[z] + q->v[z]) / 2;
+  }
+  template<typename T>
+  static inline T normalized_distance(T distance) {
+    return sqrt(std::max(distance, T(0)));
+  }
+  template<typename S, typename T>
+  static inline void init_node(Node<S, T>* n, int f) {
+  }
+  static const char* name() {
+    return "euclidean";
+  }
+
+};
+
+struct Manhattan : Minkowski {
+  template<typename S, typename T>
+  static inline typename AnnoyDistanceType<T>::type distance(const Node<S, T>* x, const Node<S, T>* y, int f) {
+    return manhattan_distance(x->v, y->v, f);
+  }
+  template<typename S, typename T>
+  static inline void distance_batch(const Node<S, T>* x, Node<S, T>* const* ys, int n, int f, typename AnnoyDistanceType<T>::type* out) {
+    const T* vs[ANNOY_DISTANCE_BATCH];
+    for (int i = 0; i < n; i++)
+      vs[i] = ys[i]->v;
+    manhattan_distance_batch(x->v, vs, n, f, out);
+  }
+  template<typename S, typename T, typename Random>
+  static inline void create_split(const vector<Node<S, T>*>& nodes, int f, size_t s, Random& random, Node<S, T>* n) {
+    Node<S, T>* p = (Node<S, T>*)alloca(s);
+    Node<S, T>* q = (Node<S, T>*)alloca(s);
+    two_means<T, Random, Manhattan, Node<S, T> >(nodes, f, random, false, p, q);
+
+    for (int z = 0; z < f; z++)
+      n->v[z] = p->v[z] - q->v[z];
+    Base::normalize<T, Node<S, T> >(n, f);
+    n->a = 0.0;
+    for (int z = 0; z < f; z++)
+      n->a += -n->v[z] * (p->v[z] + q->v[z]) / 2;
+  }
+  template<typename T>
+  static inline T normalized_distance(T distance) {
+    return std::max(distance, T(0));
+  }
+  template<typename S, typename T>
+  static inline void init_node(Node<S, T>* n, int f) {
+  }
+  static const char* name() {
+    return "manhattan";
+  }
+};
+
+template<typename S>
+class AnnoyItemSet {
+  /*
+   * A set of item ids, stored as a bitset over [0, largest id] so that
+   * lookups are O(1) no matter how many ids it holds. It can be built once
+   * and then shared by any number of queries.
+   */
+public:
+  AnnoyItemSet() : _size(0) {}
+
+  template<typename Iterator>
+  AnnoyItemSet(Iterator begin, Iterator end) : _size(0) {
+    for (Iterator it = begin; it != end; ++it)
+      add(*it);
+  }
+
+  void add(S item) {
+    if (item < 0)
+      return;
+    size_t word = (size_t)item / 64;
+    if (word >= _bits.size())
+      _bits.resize(word + 1, 0);
+    uint64_t mask = (uint64_t)1 << ((size_t)item % 64);
+    if (!(_bits[word] & mask)) {
+      _bits[word] |= mask;
+      _size++;
+    }
+  }
+
+  bool contains(S item) const {
+    size_t word = (size_t)item / 64;
+    return item >= 0 && word < _bits.size() && ((_bits[word] >> ((size_t)item % 64)) & 1);
+  }
+
+  size_t size() const {
+    return _size;
+  }
+
+protected:
+  vector<uint64_t> _bits;
+  size_t _size;
+};
+
+template<typename S>
+struct AnnoyFilter {
+  // Keeps only the items in the set, or with exclude, only the items outside it.
+  const AnnoyItemSet<S>* items;
+  bool exclude;
+
+  bool accepts(S item) const {
+    return items->contains(item) != exclude;
+  }
+};
+
+struct AnnoyQueryStats {
+  // What queries cost. They're only counted when compiled with
+  // ANNOYLIB_QUERY_STATS, and otherwise the counting compiles to nothing.
+  uint64_t n_queries;
+  uint64_t search_k;     // After -1 is replaced with n times the number of trees
+  uint64_t n_nodes;      // Nodes popped from the priority queue
+  uint64_t n_leaves;     // Of those, buckets and items, whose items are collected
+  uint64_t n_candidates; // Items collected, once for each tree they're found in
+  uint64_t n_duplicates; // Of those, items that had already been collected
+  uint64_t n_distances;  // Distances computed, including to quantized codes
+
+  void add(const AnnoyQueryStats& other) {
+    n_queries += other.n_queries;
+    search_k += other.search_k;
+    n_nodes += other.n_nodes;
+    n_leaves += other.n_leaves;
+    n_candidates += other.n_candidates;
+    n_duplicates += other.n_duplicates;
+    n_distances += other.n_distances;
+  }
+};
+
+#ifdef ANNOYLIB_QUERY_STATS
+inline AnnoyQueryStats& annoy_query_stats() {
+  // The stats of the query running on this thread, counted as it goes and
+  // then handed to AnnoyQueryCounters::add
+  static thread_local AnnoyQueryStats stats;
+  return stats;
+}
+
+#define ANNOY_QUERY_STAT(field, n) (annoy_query_stats().field += (n))
+
+class AnnoyQueryCounters {
+  // The sum of the stats of every query on an index, from any thread, and
+  // the stats of the last one to finish
+public:
+  AnnoyQueryCounters() {
+    reset();
+  }
+
+  void add(const AnnoyQueryStats& stats) {
+    for (int i = 0; i < N_FIELDS; i++)
+      _counts[i].fetch_add(((const uint64_t*)&stats)[i], std::memory_order_relaxed);
+    std::lock_guard<std::mutex> lock(_last_mutex);
+    _last = stats;
+  }
+
+  void get(AnnoyQueryStats* stats) const {
+    for (int i = 0; i < N_FIELDS; i++)
+      ((uint64_t*)stats)[i] = _counts[i].load(std::memory_order_relaxed);
+  }
+
+  void get_last(AnnoyQueryStats* stats) const {
+    std::lock_guard<std::mutex> lock(_last_mutex);
+    *stats = _last;
+  }
+
+  void reset() {
+    for (int i = 0; i < N_FIELDS; i++)
+      _counts[i].store(0, std::memory_order_relaxed);
+    std::lock_guard<std::mutex> lock(_last_mutex);
+    _last = AnnoyQueryStats();
+  }
+
+protected:
+  static const int N_FIELDS = sizeof(AnnoyQueryStats) / sizeof(uint64_t);
+  std::atomic<uint64_t> _counts[N_FIELDS];
+  AnnoyQueryStats _last;
+  mutable std::mutex _last_mutex;
+};
+#else
+#define ANNOY_QUERY_STAT(field, n) ((void)0)
+#endif
+
+static const uint64_t ANNOY_NO_ID = numeric_limits<uint64_t>::max(); // Not a valid external id
+
+template<typename S>
+class AnnoyIdMap {
+  /*
+   * Maps external 64-bit ids to items, for callers whose own ids are sparse
+   * or too big to use as items. Items are numbered from 0 in the order
+   * their ids are added. It's saved as two arrays: the id of each item, and
+   * the items sorted by id, which lookups binary search. A loaded map reads
+   * both straight from the file, and is copied into a hash map before more
+   * ids are added to it.
+   */
+public:
+  AnnoyIdMap() : _ids(NULL), _order(NULL), _n(0) {}
+
+  AnnoyIdMap(const AnnoyIdMap& other) {
+    *this = other;
+  }
+
+  AnnoyIdMap& operator=(const AnnoyIdMap& other) {
+    // Copies are always in memory, since the file may go away
+    if (this == &other)
+      return *this;
+    _id_buffer.assign(other._ids, other._ids + other._n);
+    if (other._order) {
+      _items.clear();
+      for (S i = 0; i < other._n; i++)
+        _items[other._ids[i]] = i;
+    } else {
+      _items = other._items;
+    }
+    _ids = _id_buffer.empty() ? NULL : &_id_buffer[0];
+    _order = NULL;
+    _n = other._n;
+    return *this;
+  }
+
+  bool empty() const {
+    return _n == 0;
+  }
+
+  S size() const {
+    return _n;
+  }
+
+  uint64_t get_id(S item) const {
+    return item >= 0 && item < _n ? _ids[item] : ANNOY_NO_ID;
+  }
+
+  S find(uint64_t id) const {
+    // Returns the item with this id, or -1
+    if (!_order) {
+      typename std::unordered_map<uint64_t, S>::const_iterator it = _items.find(id);
+      return it == _items.end() ? -1 : it->second;
+    }
+    S lo = 0, hi = _n;
+    while (lo < hi) {
+      S mid = lo + (hi - lo) / 2;
+      S item = _order[mid];
+      if (item < 0 || item >= _n)
+        return -1; // Corrupt file
+      if (_ids[item] < id)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    return lo < _n && _ids[_order[lo]] == id ? _order[lo] : -1;
+  }
+
+  bool add(uint64_t id) {
+    // Gives id the next item. Fails if it already has one.
+    if (find(id) != -1)
+      return false;
+    detach();
+    _id_buffer.push_back(id);
+    _items[id] = _n++;
+    _ids = &_id_buffer[0];
+    return true;
+  }
+
+  void load(const uint64_t* ids, const S* order, S n) {
+    // Uses the arrays written by save, which have to outlive the map
+    clear();
+    _ids = ids;
+    _order = order;
+    _n = n;
+  }
+
+  void detach() {
+    // Copies a loaded map into memory, so it no longer needs the file
+    if (_order)
+      *this = AnnoyIdMap(*this);
+  }
+
+  const uint64_t* ids() const {
+    return _ids;
+  }
+
+  void get_order(S n, vector<S>* order) const {
+    // The first n items, sorted by id
+    order->clear();
+    if (_order) {
+      for (S k = 0; k < _n; k++) {
+        if (_order[k] < n)
+          order->push_back(_order[k]);
+      }
+      return;
+    }
+    for (S i = 0; i < n && i < _n; i++)
+      order->push_back(i);
+    const uint64_t* ids = _ids;
+    std::sort(order->begin(), order->end(), [ids](S a, S b) { return ids[a] < ids[b]; });
+  }
+
+  void clear() {
+    vector<uint64_t>().swap(_id_buffer);
+    std::unordered_map<uint64_t, S>().swap(_items);
+    _ids = NULL;
+    _order = NULL;
+    _n = 0;
+  }
+
+protected:
+  const uint64_t* _ids;
+  const S* _order; // Set when loaded, otherwise _items is used
+  S _n;
+  vector<uint64_t> _id_buffer;
+  std::unordered_map<uint64_t, S> _items;
+};
+
+template<typename S>
+class AnnoyPayloads {
+  /*
+   * Holds a string of bytes for each item, such as a label, so that queries
+   * can hand it back without another lookup. It's saved as a table of n + 1
+   * offsets, where item i has the bytes from offsets[i] to offsets[i + 1],
+   * and the bytes of every item back to back. Loaded payloads are read
+   * straight from the file, and are copied into memory before any of them
+   * change.
+   */
+public:
+  AnnoyPayloads() : _offsets(NULL), _blob(NULL), _blob_size(0), _n(0) {}
+
+  bool empty() const {
+    return _n == 0;
+  }
+
+  S size() const {
+    // Items up to this one can have payloads
+    return _n;
+  }
+
+  bool get(S item, const uint8_t** data, size_t* size) const {
+    // Points data at the payload of item, which stays valid until the
+    // payloads change or are unloaded. Items without one have an empty one.
+    *data = NULL;
+    *size = 0;
+    if (item < 0 || item >= _n)
+      return false;
+    if (!_offsets) {
+      *data = _buffer.data() + _starts[item];
+      *size = _sizes[item];
+      return true;
+    }
+    uint64_t begin = _offsets[item], end = _offsets[item + 1];
+    if (begin > end || end > _blob_size)
+      return false; // Corrupt file
+    *data = _blob + begin;
+    *size = end - begin;
+    return true;
+  }
+
+  void set(S item, const void* data, size_t size) {
+    // Replaced payloads keep their room until the next save
+    detach();
+    if (item >= _n) {
+      _starts.resize(item + 1, 0);
+      _sizes.resize(item + 1, 0);
+      _n = item + 1;
+    }
+    _starts[item] = _buffer.size();
+    _sizes[item] = size;
+    _buffer.insert(_buffer.end(), (const uint8_t*)data, (const uint8_t*)data + size);
+  }
+
+  void load(const uint64_t* offsets, const uint8_t* blob, size_t blob_size, S n) {
+    // Uses the arrays written by save, which have to outlive the payloads
+    clear();
+    _offsets = offsets;
+    _blob = blob;
+    _blob_size = blob_size;
+    _n = n;
+  }
+
+  void detach() {
+    // Copies loaded payloads into memory, so they no longer need the file
+    if (!_offsets)
+      return;
+    vector<uint64_t> offsets;
+    vector<uint8_t> blob;
+    get_layout(_n, &offsets, &blob);
+    S n = _n;
+    clear();
+    _buffer.swap(blob);
+    _starts.assign(offsets.begin(), offsets.end() - 1);
+    _sizes.resize(n);
+    for (S i = 0; i < n; i++)
+      _sizes[i] = offsets[i + 1] - offsets[i];
+    _n = n;
+  }
+
+  void get_layout(S n, vector<uint64_t>* offsets, vector<uint8_t>* blob) const {
+    // Lays out the payloads of the first n items the way they're saved
+    offsets->assign(1, 0);
+    blob->clear();
+    for (S i = 0; i < n; i++) {
+      const uint8_t* data;
+      size_t size;
+      if (get(i, &data, &size))
+        blob->insert(blob->end(), data, data + size);
+      offsets->push_back(blob->size());
+    }
+  }
+
+  void clear() {
+    vector<uint8_t>().swap(_buffer);
+    vector<uint64_t>().swap(_starts);
+    vector<uint64_t>().swap(_sizes);
+    _offsets = NULL;
+    _blob = NULL;
+    _blob_size = 0;
+    _n = 0;
+  }
+
+protected:
+  const uint64_t* _offsets; // Set when loaded
+  const uint8_t* _blob;
+  size_t _blob_size;
+  S _n;
+  vector<uint8_t> _buffer;  // Otherwise, each item has _sizes[i] bytes from _starts[i] in here
+  vector<uint64_t> _starts;
+  vector<uint64_t> _sizes;
+};
+
+struct AnnoyFileHeader {
+  /*
+   * Optional header at the start of a saved index. It records what the index
+   * was built with, so that loading can check it against the index it's
+   * loaded into, and find the roots without scanning the nodes.
+   *
+   * It's followed by n_roots 64-bit root ids, then (from version 2) n_sections
+   * AnnoyFileSections, then padding up to header_size (a multiple of
+   * ANNOY_FILE_ALIGNMENT). Without sections, the nodes follow exactly as
+   * they're written without a header. With sections, the data is wherever
+   * the sections say.
+   */
+  char magic[8];       // ANNOY_FILE_MAGIC
+  uint32_t version;    // ANNOY_FILE_VERSION, or 1 if there are no sections
+  uint32_t header_size;
+  char metric[16];     // Distance::name()
+  char value_type[16]; // AnnoyValueType<T>::name()
+  int32_t f;
+  uint16_t index_size; // sizeof(S)
+  uint16_t value_size; // sizeof(T)
+  uint64_t node_size;
+  uint64_t n_items;
+  uint64_t n_nodes;
+  uint64_t n_roots;
+  uint64_t seed;
+  uint64_t checksum;   // FNV-1a of the header (with this field zeroed), roots and sections
+  uint64_t n_sections; // Version 2 on
+};
+
+struct AnnoyFileSection {
+  uint32_t type;     // ANNOY_SECTION_*
+  uint32_t reserved;
+  uint64_t offset;   // From the start of the file, a multiple of ANNOY_FILE_ALIGNMENT
+  uint64_t size;     // In bytes
+};
+
+static const char ANNOY_FILE_MAGIC[8] = { 'A', 'N', 'N', 'O', 'Y', 'I', 'D', 'X' };
+static const uint32_t ANNOY_FILE_VERSION = 2;
+static const size_t ANNOY_FILE_ALIGNMENT = 64;
+
+// Sections of the compact layout (see AnnoyIndex::_write_compact)
+static const uint32_t ANNOY_SECTION_ITEMS = 1;  // The item nodes
+static const uint32_t ANNOY_SECTION_SPLITS = 2; // The split nodes
+static const uint32_t ANNOY_SECTION_LEAVES = 3; // Every bucket as its number of items, then their ids
+static const uint32_t ANNOY_SECTION_IDS = 4;    // The external id of each item (see AnnoyIdMap)
+static const uint32_t ANNOY_SECTION_ID_ORDER = 5; // The items, sorted by external id
+static const uint32_t ANNOY_SECTION_PAYLOAD_OFFSETS = 6; // Where the payload of each item starts, then where the last ends (see AnnoyPayloads)
+static const uint32_t ANNOY_SECTION_PAYLOADS = 7; // The payloads, back to back
+
+inline size_t annoy_file_header_base_size(uint32_t version) {
+  // Version 1 headers end at the checksum
+  return version == 1 ? offsetof(AnnoyFileHeader, n_sections) : sizeof(AnnoyFileHeader);
+}
+
+inline const uint64_t* annoy_file_roots(const AnnoyFileHeader* header) {
+  return (const uint64_t*)((const uint8_t*)header + annoy_file_header_base_size(header->version));
+}
+
+inline const AnnoyFileSection* annoy_file_sections(const AnnoyFileHeader* header) {
+  return (const AnnoyFileSection*)(annoy_file_roots(header) + header->n_roots);
+}
+
+inline size_t annoy_file_n_sections(const AnnoyFileHeader* header) {
+  return header->version == 1 ? 0 : (size_t)header->n_sections;
+}
+
+inline const AnnoyFileSection* annoy_find_file_section(const AnnoyFileHeader* header, uint32_t type) {
+  const AnnoyFileSection* sections = annoy_file_sections(header);
+  for (size_t i = 0; i < annoy_file_n_sections(header); i++) {
+    if (sections[i].type == type)
+      return &sections[i];
+  }
+  return NULL;
+}
+
+inline uint64_t annoy_fnv1a(const void* data, size_t size, uint64_t hash=14695981039346656037ULL) {
+  const uint8_t* bytes = (const uint8_t*)data;
+  for (size_t i = 0; i < size; i++) {
+    hash ^= bytes[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+inline uint64_t annoy_file_checksum(const AnnoyFileHeader* header) {
+  AnnoyFileHeader copy = *header;
+  copy.checksum = 0;
+  uint64_t hash = annoy_fnv1a(&copy, annoy_file_header_base_size(header->version));
+  hash = annoy_fnv1a(annoy_file_roots(header), header->n_roots * sizeof(uint64_t), hash);
+  return annoy_fnv1a(annoy_file_sections(header), annoy_file_n_sections(header) * sizeof(AnnoyFileSection), hash);
+}
+
+inline bool annoy_has_file_header(const void* data, size_t size) {
+  return size >= sizeof(AnnoyFileHeader) && memcmp(data, ANNOY_FILE_MAGIC, sizeof(ANNOY_FILE_MAGIC)) == 0;
+}
+
+inline bool annoy_check_file_header(const void* data, size_t size, char** error) {
+  // Checks that the header is intact and describes a file of this size.
+  // Whether it matches a particular index is up to AnnoyIndex.
+  const AnnoyFileHeader* header = (const AnnoyFileHeader*)data;
+  if (header->version < 1 || header->version > ANNOY_FILE_VERSION) {
+    set_error_from_string(error, "Index file has an unsupported format version");
+    return false;
+  }
+  size_t base_size = annoy_file_header_base_size(header->version);
+  if (header->header_size < base_size || header->header_size > size ||
+      header->n_roots > (header->header_size - base_size) / sizeof(uint64_t) ||
+      annoy_file_n_sections(header) > (header->header_size - base_size - header->n_roots * sizeof(uint64_t)) / sizeof(AnnoyFileSection) ||
+      header->node_size == 0) {
+    set_error_from_string(error, "Index file is truncated or its header is corrupt");
+    return false;
+  }
+  if (annoy_file_n_sections(header) == 0 && header->n_nodes > (size - header->header_size) / header->node_size) {
+    set_error_from_string(error, "Index file is truncated or its header is corrupt");
+    return false;
+  }
+  const AnnoyFileSection* sections = annoy_file_sections(header);
+  for (size_t i = 0; i < annoy_file_n_sections(header); i++) {
+    if (sections[i].offset < header->header_size || sections[i].offset % ANNOY_FILE_ALIGNMENT ||
+        sections[i].offset > size || sections[i].size > size - sections[i].offset) {
+      set_error_from_string(error, "Index file is truncated or its header is corrupt");
+      return false;
+    }
+  }
+  if (header->checksum != annoy_file_checksum(header)) {
+    set_error_from_string(error, "Index file header checksum does not match");
+    return false;
+  }
+  return true;
+}
+
+inline bool annoy_read_file_header(const char* filename, AnnoyFileHeader* header, char** error=NULL) {
+  // Reads just the header of a saved index, so that callers can find out
+  // how to construct the index before loading it. Returns false if the file
+  // can't be read or was saved without a header.
+  FILE *f = fopen(filename, "rb");
+  if (f == NULL) {
+    set_error_from_errno(error, "Unable to open");
+    return false;
+  }
+  size_t n = fread(header, 1, sizeof(AnnoyFileHeader), f);
+  fclose(f);
+  if (!annoy_has_file_header(header, n)) {
+    // Not worth logging, since most callers are just checking.
+    if (error)
+      set_error_from_string(error, "Index file has no header");
+    return false;
+  }
+  return true;
+}
+
+class AnnoyNodeArena {
+  /*
+   * Holds the nodes made while building trees. The memory comes in chunks,
+   * allocated as ids reach them, and never moves, so that build threads can
+   * use nodes while others are adding more, without taking any locks. Ids
+   * are handed out by an atomic counter. Chunks are zeroed by calloc, so
+   * the part of a chunk that hasn't been used yet mostly costs address
+   * space rather than memory.
+   */
+public:
+  static const size_t max_chunks = 1 << 16;
+
+  AnnoyNodeArena() : _node_size(0), _nodes_per_chunk(1), _size(0) {
+  }
+
+  ~AnnoyNodeArena() {
+    clear();
+  }
+
+  void reset(size_t node_size, size_t max_nodes) {
+    clear();
+    // 64-bit ids allow far more nodes than fit in memory, so they needn't
+    // make the chunks any bigger than this
+    max_nodes = std::min(max_nodes, max_chunks << 20);
+    _node_size = node_size;
+    _nodes_per_chunk = std::max(((size_t)1 << 20) / node_size, max_nodes / max_chunks + 1);
+    vector<std::atomic<uint8_t*> >(max_chunks).swap(_chunks);
+  }
+
+  size_t allocate(size_t n) {
+    // Reserves n consecutive ids, and returns the first
+    size_t first = _size.fetch_add(n);
+    for (size_t c = first / _nodes_per_chunk; c <= (first + n - 1) / _nodes_per_chunk; c++) {
+      if (!_chunks[c].load()) {
+        uint8_t* chunk = (uint8_t*)calloc(_nodes_per_chunk, _node_size);
+        if (!chunk) {
+          // Build threads use nodes as soon as they have ids, with no way
+          // back out, so there's nothing to do but stop
+          fprintf(stderr, "annoy: unable to allocate %zu bytes for tree nodes\n", _nodes_per_chunk * _node_size);
+          abort();
+        }
+        uint8_t* expected = NULL;
+        if (!_chunks[c].compare_exchange_strong(expected, chunk))
+          free(chunk); // Another thread got there first
+      }
+    }
+    return first;
+  }
+
+  void* get(size_t i) const {
+    return _chunks[i / _nodes_per_chunk].load() + (i % _nodes_per_chunk) * _node_size;
+  }
+
+  size_t size() const {
+    return _size.load();
+  }
+
+  void clear() {
+    for (size_t c = 0; c < _chunks.size(); c++)
+      free(_chunks[c].load());
+    vector<std::atomic<uint8_t*> >().swap(_chunks);
+    _size = 0;
+  }
+
+private:
+  size_t _node_size;
+  size_t _nodes_per_chunk;
+  vector<std::atomic<uint8_t*> > _chunks;
+  std::atomic<size_t> _size;
+};
+
+struct AnnoyQuantizedHeader {
+  /*
+   * Start of a file saved by AnnoyQuantizedItems::save. It's followed by f
+   * float offsets, f float scales, then n_items * f one-byte codes.
+   */
+  char magic[8];    // ANNOY_QUANTIZED_MAGIC
+  uint32_t version; // ANNOY_QUANTIZED_VERSION
+  int32_t f;
+  uint64_t n_items;
+};
+
+static const char ANNOY_QUANTIZED_MAGIC[8] = { 'A', 'N', 'N', 'O', 'Y', 'Q', '8', '\0' };
+static const uint32_t ANNOY_QUANTIZED_VERSION = 1;
+
+class AnnoyQuantizedItems {
+  /*
+   * One byte per dimension copies of the item vectors, used to score
+   * candidates without touching the full vectors. Dimension z is quantized
+   * with its own offset and scale, so x[z] ~ offset[z] + scale[z] * code[z],
+   * with the offset and scale chosen to cover the range of that dimension
+   * over all items.
+   *
+   * The codes are either computed in memory, or mmapped from a file written
+   * by save, separately from the index.
+   */
+public:
+  AnnoyQuantizedItems() : _f(0), _n_items(0), _offset(NULL), _scale(NULL), _codes(NULL), _map(NULL), _map_size(0) {}
+  ~AnnoyQuantizedItems() {
+    clear();
+  }
+
+  bool empty() const {
+    return _codes == NULL;
+  }
+
+  size_t get_n_items() const {
+    return _n_items;
+  }
+
+  template<typename S, typename Node>
+  void quantize(int f, const void* nodes, size_t s, S n_items) {
+    // Computes codes for the first n_items nodes. Ids that were never added
+    // get all zero codes.
+    clear();
+    _f = f;
+    _n_items = n_items;
+    _buffer.assign(sizeof(float) * 2 * f + (size_t)n_items * f, 0);
+    float* offset = (float*)&_buffer[0];
+    float* scale = offset + f;
+    uint8_t* codes = (uint8_t*)(scale + f);
+
+    vector<float> hi(f, -std::numeric_limits<float>::infinity());
+    for (int z = 0; z < f; z++)
+      offset[z] = std::numeric_limits<float>::infinity();
+    for (S i = 0; i < n_items; i++) {
+      const Node* n = get_node_ptr<S, Node>(nodes, s, i);
+      if (n->n_descendants != 1)
+        continue;
+      for (int z = 0; z < f; z++) {
+        float x = n->v[z];
+        offset[z] = std::min(offset[z], x);
+        hi[z] = std::max(hi[z], x);
+      }
+    }
+    for (int z = 0; z < f; z++) {
+      if (hi[z] < offset[z])
+        offset[z] = hi[z] = 0; // No items at all
+      scale[z] = (hi[z] - offset[z]) / 255;
+    }
+
+    _set(offset);
+    _encode<S, Node>(nodes, s, 0, n_items, codes);
+  }
+
+  template<typename S, typename Node>
+  void extend(const void* nodes, size_t s, S n_items) {
+    // Adds codes for the nodes from get_n_items() up to n_items, with the
+    // offsets and scales already chosen. Values outside the range those
+    // cover are clamped to it.
+    int f = _f;
+    size_t n_old = _n_items;
+    vector<uint8_t> buffer(sizeof(float) * 2 * f + (size_t)n_items * f, 0);
+    memcpy(&buffer[0], _offset, sizeof(float) * 2 * f + n_old * f);
+    clear();
+    _f = f;
+    _n_items = n_items;
+    _buffer.swap(buffer);
+    _set((const float*)&_buffer[0]);
+    _encode<S, Node>(nodes, s, (S)n_old, n_items, &_buffer[sizeof(float) * 2 * f]);
+  }
+
+  template<typename T>
+  void decode(size_t item, T* v) const {
+    const uint8_t* c = _codes + item * _f;
+    for (int z = 0; z < _f; z++)
+      v[z] = _offset[z] + _scale[z] * c[z];
+  }
+
+  bool save(const char* filename, char** error=NULL) const {
+    if (empty()) {
+      set_error_from_string(error, "There are no quantized vectors to save");
+      return false;
+    }
+    FILE *f = fopen(filename, "wb");
+    if (f == NULL) {
+      set_error_from_errno(error, "Unable to open");
+      return false;
+    }
+    AnnoyQuantizedHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, ANNOY_QUANTIZED_MAGIC, sizeof(ANNOY_QUANTIZED_MAGIC));
+    header.version = ANNOY_QUANTIZED_VERSION;
+    header.f = _f;
+    header.n_items = _n_items;
+    if (fwrite(&header, sizeof(header), 1, f) != 1 ||
+        fwrite(_offset, sizeof(float), _f, f) != (size_t)_f ||
+        fwrite(_scale, sizeof(float), _f, f) != (size_t)_f ||
+        fwrite(_codes, _f, _n_items, f) != _n_items) {
+      set_error_from_errno(error, "Unable to write");
+      fclose(f);
+      return false;
+    }
+    if (fclose(f) == EOF) {
+      set_error_from_errno(error, "Unable to close");
+      return false;
+    }
+    return true;
+  }
+
+  bool load(const char* filename, int f, char** error=NULL) {
+    clear();
+    int fd = open(filename, O_RDONLY, (int)0400);
+    if (fd == -1) {
+      set_error_from_errno(error, "Unable to open");
+      return false;
+    }
+    off_t size = lseek_getsize(fd);
+    if (size < (off_t)sizeof(AnnoyQuantizedHeader)) {
+      close(fd);
+      set_error_from_string(error, "Quantized vector file is truncated");
+      return false;
+    }
+    void* map = mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+      set_error_from_errno(error, "Unable to mmap");
+      return false;
+    }
+    _map = map;
+    _map_size = size;
+
+    const AnnoyQuantizedHeader* header = (const AnnoyQuantizedHeader*)map;
+    if (memcmp(header->magic, ANNOY_QUANTIZED_MAGIC, sizeof(ANNOY_QUANTIZED_MAGIC)) != 0 ||
+        header->version != ANNOY_QUANTIZED_VERSION) {
+      clear();
+      set_error_from_string(error, "Not a quantized vector file");
+      return false;
+    }
+    if (header->f != f) {
+      clear();
+      set_error_from_string(error, "Quantized vectors have different dimensions than the index");
+      return false;
+    }
+    size_t codes_offset = sizeof(AnnoyQuantizedHeader) + sizeof(float) * 2 * f;
+    if ((size_t)size < codes_offset || (size_t)size - codes_offset != header->n_items * f) {
+      clear();
+      set_error_from_string(error, "Quantized vector file is truncated");
+      return false;
+    }
+    _f = f;
+    _n_items = header->n_items;
+    _set((const float*)(header + 1));
+    return true;
+  }
+
+  void swap(AnnoyQuantizedItems& other) {
+    std::swap(_f, other._f);
+    std::swap(_n_items, other._n_items);
+    std::swap(_offset, other._offset);
+    std::swap(_scale, other._scale);
+    std::swap(_codes, other._codes);
+    _buffer.swap(other._buffer);
+    std::swap(_map, other._map);
+    std::swap(_map_size, other._map_size);
+  }
+
+  void clear() {
+    if (_map)
+      munmap(_map, _map_size);
+    _map = NULL;
+    _map_size = 0;
+    vector<uint8_t>().swap(_buffer);
+    _offset = _scale = NULL;
+    _codes = NULL;
+    _n_items = 0;
+  }
+
+protected:
+  void _set(const float* offset) {
+    _offset = offset;
+    _scale = offset + _f;
+    _codes = (const uint8_t*)(_scale + _f);
+  }
+
+  template<typename S, typename Node>
+  void _encode(const void* nodes, size_t s, S begin, S end, uint8_t* codes) const {
+    for (S i = begin; i < end; i++) {
+      const Node* n = get_node_ptr<S, Node>(nodes, s, i);
+      if (n->n_descendants != 1)
+        continue;
+      uint8_t* c = codes + (size_t)i * _f;
+      for (int z = 0; z < _f; z++) {
+        float x = _scale[z] > 0 ? ((float)n->v[z] - _offset[z]) / _scale[z] : 0;
+        c[z] = (uint8_t)std::max(0.0f, std::min(255.0f, roundf(x)));
+      }
+    }
+  }
+
+  int _f;
+  size_t _n_items;
+  const float* _offset;
+  const float* _scale;
+  const uint8_t* _codes;
+  vector<uint8_t> _buffer; // Backs the codes when they were computed in memory
+  void* _map;              // or when they were loaded
+  size_t _map_size;
+};
+
+// Builds from a vector file (see AnnoyIndex::build_from_file) keep sets of
+// up to about this many bytes of item ids in memory by default, and choose
+// each split of a bigger set from a sample of this many of its items.
+static const size_t ANNOY_STREAMING_MEMORY_LIMIT = (size_t)256 << 20;
+static const size_t ANNOY_STREAMING_SAMPLE = 4096;
+
+template<typename S, typename T, typename R = uint64_t>
+class AnnoyIndexInterface {
+ public:
+  typedef typename AnnoyDistanceType<T>::type DT; // Same as T, unless T is a storage-only type
+  // Note that the methods with an **error argument will allocate memory and write the pointer to that string if error is non-NULL
+  virtual ~AnnoyIndexInterface() {};
+  virtual bool add_item(S item, const T* w, char** error=NULL) = 0;
+  virtual bool add_items(S first_item, const T* w, S n_rows, int n_threads=1, char** error=NULL) = 0;
+  virtual bool build(int q, int n_threads=-1, char** error=NULL) = 0;
+  virtual bool unbuild(char** error=NULL) = 0;
+  virtual bool save(const char* filename, bool prefault=false, char** error=NULL) = 0;
+  virtual void unload() = 0;
+  virtual bool load(const char* filename, bool prefault=false, char** error=NULL) = 0;
+  virtual bool loadBuffer(void* buffer, off_t size, bool copy=false, char** error=NULL) = 0;
+  virtual void set_file_header(bool enabled) = 0;
+  virtual void set_compact_layout(bool enabled) = 0;
+  virtual DT get_distance(S i, S j) const = 0;
+  virtual void get_nns_by_item(S item, size_t n, int search_k, vector<S>* result, vector<DT>* distances, const char* filter_type, vector<int>* filter_vector) const = 0;
+  virtual void get_nns_by_vector(const T* w, size_t n, int search_k, vector<S>* result, vector<DT>* distances, const char* filter_type, vector<int>* filter_vector) const = 0;
+  virtual void get_nns_by_item(S item, size_t n, int search_k, vector<S>* result, vector<DT>* distances, const AnnoyFilter<S>* filter) const = 0;
+  virtual void get_nns_by_vector(const T* w, size_t n, int search_k, vector<S>* result, vector<DT>* distances, const AnnoyFilter<S>* filter) const = 0;
+  virtual void get_nns_exact(const T* w, size_t n, vector<S>* result, vector<DT>* distances, const AnnoyFilter<S>* filter=nullptr, int n_threads=1) const = 0;
+  virtual S get_n_items() const = 0;
+  virtual S get_n_trees() const = 0;
+  virtual void verbose(bool v) = 0;
+  virtual void get_item(S item, T* v) const = 0;
+  virtual void set_seed(R q) = 0;
+  virtual bool on_disk_build(const char* filename, char** error=NULL) = 0;
+  virtual bool build_from_file(const char* vectors_filename, const char* filename, int q, size_t memory_limit=0, char** error=NULL) = 0;
+  virtual bool quantize(char** error=NULL) = 0;
+  virtual bool save_quantized(const char* filename, char** error=NULL) const = 0;
+  virtual bool load_quantized(const char* filename, char** error=NULL) = 0;
+  virtual void set_rerank(int k) = 0;
+  virtual bool remove_item(S item, char** error=NULL) = 0;
+  virtual bool compact_removed(char** error=NULL) = 0;
+  virtual bool add_item_with_id(uint64_t id, const T* w, char** error=NULL) = 0;
+  virtual bool has_item_ids() const = 0;
+  virtual S find_item(uint64_t id) const = 0;
+  virtual uint64_t get_item_id(S item) const = 0;
+  virtual bool set_payload(S item, const void* data, size_t size, char** error=NULL) = 0;
+  virtual bool get_payload(S item, const uint8_t** data, size_t* size) const = 0;
+  virtual bool get_stats(AnnoyQueryStats* stats) const = 0;
+  virtual bool get_last_query_stats(AnnoyQueryStats* stats) const = 0;
+  virtual void reset_stats() = 0;
+};
+
+template<typename S, typename T, typename Distance, typename Random, class ThreadedBuildPolicy>
+  class AnnoyIndex : public AnnoyIndexInterface<S, T,
+#if __cplusplus >= 201103L
+    typename std::remove_const<decltype(Random::default_seed)>::type
+#else
+    typename Random::seed_type
+#endif
+    > {
+  /*
+   * We use random projection to build a forest of binary trees of all items.
+   * Basically just split the hyperspace into two sides by a hyperplane,
+   * then recursively split each of those subtrees etc.
+   * We create a tree like this q times. The default q is determined automatically
+   * in such a way that we at most use 2x as much memory as the vectors take.
+   */
+public:
+  typedef Distance D;
+  typedef typename D::template Node<S, T> Node;
+  typedef typename AnnoyDistanceType<T>::type DT;
+#if __cplusplus >= 201103L
+  typedef typename std::remove_const<decltype(Random::default_seed)>::type R;
+#else
+  typedef typename Random::seed_type R;
+#endif
+
+protected:
+  const int _f;
+  size_t _s;
+  S _n_items;
+  void* _nodes; // Could either be mmapped, or point to a memory buffer that we reallocate
+  S _n_nodes;
+  S _nodes_size;
+  vector<S> _roots;
+  S _K;
+  R _seed;
+  bool _loaded;
+  bool _verbose;
+  int _fd;
+  bool _is_buffer;
+  bool _on_disk;
+  bool _built;
+  bool _file_header;
+  bool _compact_layout;
+  size_t _data_offset; // Bytes before the first node in the loaded file or buffer
+  size_t _file_size;
+  // Set when the loaded index has the compact layout. Then _nodes only holds
+  // the items. Ids from _n_items refer to the split nodes at _splits, and
+  // ids after those to positions in _leaves, where each bucket starts.
+  bool _compact;
+  S _n_splits;
+  const uint8_t* _splits;
+  const S* _leaves;
+  AnnoyQuantizedItems _quantized;
+  int _rerank;
+  AnnoyNodeArena _build_nodes; // Nodes being built, with ids from _n_items
+  vector<uint8_t> _pending; // Nodes for items added since the index was built, from _n_items on
+  AnnoyItemSet<S> _removed; // Items that queries skip
+  S _n_dead;                // Removed items that are still in the trees
+  AnnoyIdMap<S> _id_map;    // External ids of the items, if they were added with them
+  AnnoyPayloads<S> _payloads;
+#ifdef ANNOYLIB_QUERY_STATS
+  mutable AnnoyQueryCounters _stats;
+#endif
+public:
+
+   AnnoyIndex(int f) : _f(f), _seed(Random::default_seed) {
+    _s = offsetof(Node, v) + _f * sizeof(T); // Size of each node
+    _verbose = false;
+    _built = false;
+    _file_header = false;
+    _compact_layout = false;
+    _rerank = 0;
+#ifdef USE_RUNTIME_DISPATCH
+    annoy_kernels(); // Check the CPU now, rather than in the first query
+#endif
+    _K = (S) (((size_t) (_s - offsetof(Node, children))) / sizeof(S)); // Max number of descendants to fit into node
+    reinitialize(); // Reset everything
+  }
+  ~AnnoyIndex() {
+    unload();
+  }
+
+  int get_f() const {
+    return _f;
+  }
+
+  bool add_item(S item, const T* w, char** error=NULL) {
+    if (!_id_map.empty()) {
+      set_error_from_string(error, "Items in this index have external ids, so add them with add_item_with_id");
+      return false;
+    }
+    return add_item_impl(item, w, error);
+  }
+
+  bool add_item_with_id(uint64_t id, const T* w, char** error=NULL) {
+    // Adds an item with an external id, which queries and the other methods
+    // then translate to and from with find_item and get_item_id. The item is
+    // the next one, so an index has to use ids for all its items or none.
+    S item = get_n_items();
+    if (_id_map.size() != item) {
+      set_error_from_string(error, "Items were already added to this index without external ids");
+      return false;
+    }
+    if (_on_disk) {
+      set_error_from_string(error, "External ids are saved in the file header, which an index built on disk doesn't have");
+      return false;
+    }
+    if (id == ANNOY_NO_ID || _id_map.find(id) != -1) {
+      set_error_from_string(error, id == ANNOY_NO_ID ? "This id is reserved" : "An item with this id was already added");
+      return false;
+    }
+    if (!add_item_impl(item, w, error))
+      return false;
+    _id_map.add(id);
+    return true;
+  }
+
+  bool has_item_ids() const {
+    return !_id_map.empty();
+  }
+
+  S find_item(uint64_t id) const {
+    // Returns the item with this external id, or -1
+    return _id_map.find(id);
+  }
+
+  uint64_t get_item_id(S item) const {
+    // Returns the external id of item, or ANNOY_NO_ID
+    return _id_map.get_id(item);
+  }
+
+  bool set_payload(S item, const void* data, size_t size, char** error=NULL) {
+    // Gives item a payload, such as a label, which is saved with the index
+    // and can be read back with get_payload.
+    if (item < 0 || item >= get_n_items()) {
+      set_error_from_string(error, "Item is out of range");
+      return false;
+    }
+    if (_on_disk) {
+      set_error_from_string(error, "Payloads are saved in the file header, which an index built on disk doesn't have");
+      return false;
+    }
+    _payloads.set(item, data, size);
+    return true;
+  }
+
+  bool get_payload(S item, const uint8_t** data, size_t* size) const {
+    // Points data at the payload of item, without copying it. It stays valid
+    // until payloads are set or the index is unloaded. Items that were never
+    // given one have an empty payload, or none past the last one that was.
+    return _payloads.get(item, data, size);
+  }
+
+  bool get_stats(AnnoyQueryStats* stats) const {
+    // The sum of the stats of every query since the index was made or
+    // reset_stats was called. False if queries aren't counted.
+#ifdef ANNOYLIB_QUERY_STATS
+    _stats.get(stats);
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  bool get_last_query_stats(AnnoyQueryStats* stats) const {
+    // The stats of the last query on this index to finish, on any thread
+#ifdef ANNOYLIB_QUERY_STATS
+    _stats.get_last(stats);
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  void reset_stats() {
+#ifdef ANNOYLIB_QUERY_STATS
+    _stats.reset();
+#endif
+  }
+
+  template<typename W>
+  bool add_item_impl(S item, const W& w, char** error=NULL) {
+    if (_built) {
+      // Kept aside until the next build adds it to the trees
+      if (item < _n_items) {
+        set_error_from_string(error, "You can't replace an item in a built index");
+        return false;
+      }
+      size_t k = (size_t)(item - _n_items);
+      if (_pending.size() < (k + 1) * _s)
+        _pending.resize((k + 1) * _s, 0);
+      _init_item((Node*)&_pending[k * _s], w);
+      return true;
+    }
+    _allocate_size(item + 1);
+    _init_item(_get(item), w);
+
+    if (item >= _n_items)
+      _n_items = item + 1;
+
+    return true;
+  }
+
+  bool add_items(S first_item, const T* w, S n_rows, int n_threads=1, char** error=NULL) {
+    // Adds n_rows items with consecutive ids, read from a row-major matrix.
+    if (!_id_map.empty()) {
+      set_error_from_string(error, "Items in this index have external ids, so add them with add_item_with_id");
+      return false;
+    }
+    if (n_rows <= 0)
+      return true;
+    // The last id has to fit in S, and the node storage for it in a size_t
+    if (first_item < 0 || n_rows > numeric_limits<S>::max() - first_item ||
+        (size_t)(first_item + n_rows) > numeric_limits<size_t>::max() / _s) {
+      set_error_from_string(error, "Too many items for the index");
+      return false;
+    }
+    if (_built) {
+      for (S i = 0; i < n_rows; i++) {
+        if (!add_item_impl(first_item + i, w + (size_t)i * _f, error))
+          return false;
+      }
+      return true;
+    }
+
+    // Grow the node storage once, instead of once per item
+    _allocate_size(first_item + n_rows);
+
+    ThreadedBuildPolicy::template add_items<S, T>(this, first_item, w, n_rows, n_threads);
+
+    if (first_item + n_rows > _n_items)
+      _n_items = first_item + n_rows;
+
+    return true;
+  }
+
+  void add_items_range(S first_item, const T* w, S begin, S end) {
+    for (S i = begin; i < end; i++)
+      _init_item(_get(first_item + i), w + (size_t)i * _f);
+  }
+
+  bool on_disk_build(const char* file, char** error=NULL) {
+    if (!_id_map.empty()) {
+      set_error_from_string(error, "External ids are saved in the file header, which an index built on disk doesn't have");
+      return false;
+    }
+    _on_disk = true;
+    _fd = open(file, O_RDWR | O_CREAT | O_TRUNC, (int) 0600);
+    if (_fd == -1) {
+      set_error_from_errno(error, "Unable to open");
+      _fd = 0;
+      return false;
+    }
+    _nodes_size = 1;
+    if (ftruncate(_fd, FTRUNCATE_SIZE(_s) * FTRUNCATE_SIZE(_nodes_size)) == -1) {
+      set_error_from_errno(error, "Unable to truncate");
+      return false;
+    }
+#ifdef MAP_POPULATE
+    _nodes = (Node*) mmap(0, _s * _nodes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, 0);
+#else
+    _nodes = (Node*) mmap(0, _s * _nodes_size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+#endif
+    return true;
+  }
+
+  bool build_from_file(const char* vectors_filename, const char* filename, int q, size_t memory_limit=0, char** error=NULL) {
+    // Builds q trees over the vectors in vectors_filename, which holds them
+    // back to back as _f values of type T each, into an index file with a
+    // header at filename, which is then loaded. Unlike on_disk_build, this
+    // doesn't need memory in proportion to the number of items: they're
+    // written to filename and read back through the page cache, and each
+    // set of items too big for memory_limit bytes of ids is split on a
+    // hyperplane chosen from a sample of it, with its ids streamed through
+    // temporary files next to filename. Nodes are appended to the file as
+    // each subtree is finished.
+    if (_loaded || _built || _on_disk || get_n_items() > 0 || !_id_map.empty()) {
+      set_error_from_string(error, "You can't build from a file into an index that already has items");
+      return false;
+    }
+    if (q < 1) {
+      set_error_from_string(error, "Building from a file needs a number of trees");
+      return false;
+    }
+    if (memory_limit == 0)
+      memory_limit = ANNOY_STREAMING_MEMORY_LIMIT;
+
+    FILE* input = fopen(vectors_filename, "rb");
+    if (!input) {
+      set_error_from_errno(error, "Unable to open");
+      return false;
+    }
+    size_t row_size = (size_t)_f * sizeof(T);
+    off_t input_size = lseek_getsize(fileno(input));
+    rewind(input);
+    if (input_size <= 0 || (size_t)input_size % row_size != 0) {
+      fclose(input);
+      set_error_from_string(error, "Vector file size isn't a multiple of the vector size");
+      return false;
+    }
+    size_t n = (size_t)input_size / row_size;
+    if (n >= (size_t)numeric_limits<S>::max()) {
+      fclose(input);
+      set_error_from_string(error, "Vector file has too many vectors for the index");
+      return false;
+    }
+
+    // The items go straight after the header, which is written last
+    size_t header_size = _header_size(q, 0);
+    size_t items_end = header_size + n * _s;
+    int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, (int) 0600);
+    if (fd == -1) {
+      fclose(input);
+      set_error_from_errno(error, "Unable to open");
+      return false;
+    }
+    if (ftruncate(fd, FTRUNCATE_SIZE(items_end)) == -1) {
+      fclose(input);
+      close(fd);
+      set_error_from_errno(error, "Unable to truncate");
+      return false;
+    }
+    void* map = mmap(0, items_end, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+      fclose(input);
+      set_error_from_errno(error, "Unable to mmap");
+      return false;
+    }
+
+    _nodes = (uint8_t*)map + header_size;
+    _n_items = (S)n;
+    _n_nodes = (S)n;
+    bool ok = _stream_items(input, error);
+    fclose(input);
+    FILE* out = NULL;
+    if (ok) {
+      D::template preprocess<T, S, Node>(_nodes, _s, _n_items, _f);
+      out = fopen(filename, "ab");
+      if (!out) {
+        set_error_from_errno(error, "Unable to open");
+        ok = false;
+      }
+    }
+
+    size_t max_ids = std::max(memory_limit / (4 * sizeof(S) + sizeof(Node*)), (size_t)_K + 1);
+    for (int t = 0; ok && t < q; t++) {
+      if (_verbose) showUpdate("pass %d...\n", t);
+      Random _random(_seed + t);
+      S root;
+      ok = _stream_tree(NULL, _n_items, true, max_ids, _random, filename, out, &root, error);
+      if (ok)
+        _roots.push_back(root);
+    }
+    if (out && fclose(out) != 0 && ok) {
+      set_error_from_errno(error, "Unable to write");
+      ok = false;
+    }
+
+    if (ok) {
+      vector<uint8_t> buffer;
+      _fill_header(&buffer, _roots, _n_nodes, vector<AnnoyFileSection>());
+      memcpy(map, &buffer[0], buffer.size());
+      if (_verbose) showUpdate("has %zu nodes\n", (size_t)_n_nodes);
+    }
+    munmap(map, items_end);
+    R seed = _seed;
+    reinitialize();
+    _seed = seed;
+    return ok && load(filename, false, error);
+  }
+
+  bool build(int q, int n_threads=-1, char** error=NULL) {
+    // On a built or loaded index, this adds the items added since to the
+    // existing trees instead (see _build_pending).
+    if (_built && !_pending.empty())
+      return _build_pending(n_threads, error);
+
+    if (_loaded) {
+      set_error_from_string(error, "You can't build a loaded index");
+      return false;
+    }
+
+    if (_built) {
+      set_error_from_string(error, "You can't build a built index");
+      return false;
+    }
+
+    D::template preprocess<T, S, Node>(_nodes, _s, _n_items, _f);
+
+    _n_nodes = _n_items;
+    _build_nodes.reset(_s, (size_t)numeric_limits<S>::max() - (size_t)_n_items);
+
+    ThreadedBuildPolicy::template build<S, T>(this, q, n_threads);
+
+    return _finish_build(error);
+  }
+
+  bool unbuild(char** error=NULL) {
+    if (_loaded) {
+      set_error_from_string(error, "You can't unbuild a loaded index");
+      return false;
+    }
+
+    _roots.clear();
+    _n_nodes = _n_items;
+    _built = false;
+    _mark_removed(0, _n_items);
+    _n_dead = 0;
+
+    if (!_pending.empty()) {
+      S n_pending = (S)(_pending.size() / _s);
+      _allocate_size(_n_items + n_pending);
+      memcpy(_get(_n_items), &_pending[0], _pending.size());
+      _n_items += n_pending;
+      _n_nodes = _n_items;
+      vector<uint8_t>().swap(_pending);
+    }
+
+    return true;
+  }
+
+  bool save(const char* filename, bool prefault=false, char** error=NULL) {
+    if (!_built) {
+      set_error_from_string(error, "You can't save an index that hasn't been built");
+      return false;
+    }
+    // Removed items only leave the file once they're out of the trees
+    if (_n_dead && !compact_removed(error))
+      return false;
+    if (_on_disk) {
+      return true;
+    } else {
+      // Delete file if it already exists (See issue #335)
+      unlink(filename);
+
+      FILE *f = fopen(filename, "wb");
+      if (f == NULL) {
+        set_error_from_errno(error, "Unable to open");
+        return false;
+      }
+
+      if (_compact_layout || _compact) {
+        if (!_write_compact(f, error))
+          return false;
+      } else if (_file_header || !_id_map.empty() || !_payloads.empty()) {
+        // External ids and payloads go in sections after the nodes
+        if (!_write_plain(f, error))
+          return false;
+      } else {
+        if (fwrite(_nodes, _s, _n_nodes, f) != (size_t) _n_nodes) {
+          set_error_from_errno(error, "Unable to write");
+          return false;
+        }
+      }
+
+      if (fclose(f) == EOF) {
+        set_error_from_errno(error, "Unable to close");
+        return false;
+      }
+
+      // Keep the quantized vectors, since the items haven't changed, and
+      // any items waiting for the next build, and which items were removed.
+      // The file only has ids for the items in the trees.
+      AnnoyQuantizedItems quantized;
+      quantized.swap(_quantized);
+      vector<uint8_t> pending;
+      pending.swap(_pending);
+      AnnoyItemSet<S> removed = _removed;
+      AnnoyIdMap<S> id_map;
+      if (_id_map.size() > _n_items)
+        id_map = _id_map;
+      AnnoyPayloads<S> payloads;
+      if (_payloads.size() > _n_items) {
+        payloads = _payloads;
+        payloads.detach();
+      }
+      unload();
+      if (!load(filename, prefault, error))
+        return false;
+      _quantized.swap(quantized);
+      _pending.swap(pending);
+      _removed = removed;
+      if (!id_map.empty())
+        _id_map = id_map;
+      if (!payloads.empty())
+        _payloads = payloads;
+      return true;
+    }
+  }
+
+  void set_file_header(bool enabled) {
+    // Whether save writes an AnnoyFileHeader. Indexes saved without one can
+    // still be loaded by older versions. Indexes built on disk never get one.
+    _file_header = enabled;
+  }
+
+  void set_compact_layout(bool enabled) {
+    // Whether save writes the compact layout, which always has a header (see
+    // _write_compact). Indexes loaded from a compact file are saved compact
+    // regardless.
+    _compact_layout = enabled;
+  }
+
+  bool quantize(char** error=NULL) {
+    // Computes one byte per dimension codes for the items. Once there are
+    // codes, queries score candidates with them, and only go back to the
+    // full vectors to re-rank the best ones (see set_rerank).
+    if (!_built) {
+      set_error_from_string(error, "You can't quantize an index that hasn't been built");
+      return false;
+    }
+    if (std::numeric_limits<T>::is_integer) {
+      set_error_from_string(error, "You can't quantize an index of integer vectors");
+      return false;
+    }
+    _quantized.template quantize<S, Node>(_f, _nodes, _s, _n_items);
+    return true;
+  }
+
+  bool save_quantized(const char* filename, char** error=NULL) const {
+    return _quantized.save(filename, error);
+  }
+
+  bool load_quantized(const char* filename, char** error=NULL) {
+    // Loads codes saved by save_quantized, for the index that's loaded now.
+    if (!_built) {
+      set_error_from_string(error, "You can't load quantized vectors before the index");
+      return false;
+    }
+    if (std::numeric_limits<T>::is_integer) {
+      set_error_from_string(error, "You can't quantize an index of integer vectors");
+      return false;
+    }
+    if (!_quantized.load(filename, _f, error))
+      return false;
+    if (_quantized.get_n_items() != (size_t)_n_items) {
+      _quantized.clear();
+      set_error_from_string(error, "Quantized vectors are for a different number of items");
+      return false;
+    }
+    return true;
+  }
+
+  void set_rerank(int k) {
+    // With quantized codes, queries re-score the best max(n, k) candidates
+    // with the full vectors, and return the best n of those. A k of -1 turns
+    // that off, so the full vectors aren't read at all, and the distances
+    // returned are approximate.
+    _rerank = k;
+  }
+
+  bool remove_item(S item, char** error=NULL) {
+    // Marks item as removed, so that queries skip it. It stays in the trees
+    // until compact_removed, which save does too. Ids aren't reused.
+    if (item < 0 || item >= get_n_items()) {
+      set_error_from_string(error, "Item is out of range");
+      return false;
+    }
+    if (_removed.contains(item))
+      return true;
+    _removed.add(item);
+    if (item >= _n_items)
+      memset(&_pending[(size_t)(item - _n_items) * _s], 0, _s); // Never goes into the trees
+    else if (_built)
+      _n_dead++;
+    else
+      _mark_removed(item, item + 1);
+    return true;
+  }
+
+  bool compact_removed(char** error=NULL) {
+    // Rewrites the trees without the removed items, and marks them as never
+    // added, which also keeps them out of later builds. Splits that are left
+    // with few enough items become buckets. An index built on disk is
+    // rewritten in place; a loaded one is copied into memory first.
+    if (!_n_dead)
+      return true;
+    vector<S> items;
+    _get_tree_items(&items);
+    size_t n_live = 0;
+    for (size_t i = 0; i < items.size(); i++)
+      n_live += !_removed.contains(items[i]);
+    if (n_live == 0) {
+      set_error_from_string(error, "You can't compact an index with every item removed");
+      return false;
+    }
+
+    NodeRange node_range;
+    ThreadedBuildPolicy threaded_build_policy;
+    _build_nodes.reset(_s, (size_t)numeric_limits<S>::max() - (size_t)_n_items);
+    for (size_t r = 0; r < _roots.size(); r++) {
+      S n_root;
+      S root = _copy_live(_roots[r], &n_root);
+      if (n_root > _K) {
+        _build_node(root)->n_descendants = _n_items;
+        _roots[r] = root;
+      } else {
+        // Roots are special (see _make_tree), so make a new one for these
+        vector<S> indices;
+        _append_items(root, &indices);
+        Random _random(_seed + r);
+        _roots[r] = _make_tree(indices, true, _random, node_range, threaded_build_policy);
+      }
+    }
+
+    if (_loaded || _compact || _data_offset)
+      _copy_to_memory(_n_items);
+    _mark_removed(0, _n_items);
+    _n_nodes = _n_items;
+    _n_dead = 0;
+    if (_verbose) showUpdate("compacted %zu trees\n", _roots.size());
+    return _finish_build(error);
+  }
+
+  void reinitialize() {
+    _fd = 0;
+    _is_buffer = false;
+    _nodes = NULL;
+    _data_offset = 0;
+    _file_size = 0;
+    _compact = false;
+    _n_splits = 0;
+    _splits = NULL;
+    _leaves = NULL;
+    _loaded = false;
+    _n_items = 0;
+    _n_nodes = 0;
+    _nodes_size = 0;
+    _on_disk = false;
+    _seed = Random::default_seed;
+    _roots.clear();
+    vector<uint8_t>().swap(_pending);
+    _removed = AnnoyItemSet<S>();
+    _n_dead = 0;
+    _id_map.clear();
+    _payloads.clear();
+  }
+
+  void unload() {
+    _release_nodes();
+    _quantized.clear();
+    reinitialize();
+    if (_verbose) showUpdate("unloaded\n");
+  }
+
+  bool load(const char* filename, bool prefault=false, char** error=NULL) {
+    _fd = open(filename, O_RDONLY, (int)0400);
+    if (_fd == -1) {
+      set_error_from_errno(error, "Unable to open");
+      _fd = 0;
+      return false;
+    }
+    off_t size = lseek_getsize(_fd);
+    if (size == -1) {
+      set_error_from_errno(error, "Unable to get size");
+      return false;
+    } else if (size == 0) {
+      set_error_from_errno(error, "Size of file is zero");
+      return false;
+    }
+
+    int flags = MAP_SHARED;
+    if (prefault) {
+#ifdef MAP_POPULATE
+      flags |= MAP_POPULATE;
+#else
+      showUpdate("prefault is set to true, but MAP_POPULATE is not defined on this platform");
+#endif
+    }
+    _nodes = (Node*)mmap(0, size, PROT_READ, flags, _fd, 0);
+    _file_size = size;
+    if (!_load_nodes(error)) {
+      unload();
+      return false;
+    }
+    return true;
+  }
+
+  bool loadBuffer(void* buffer, off_t size, bool copy=false, char** error=NULL) {
+    if (size == 0) {
+      set_error_from_errno(error, "Size of file is zero");
+      return false;
+    }
+
+    if (copy) {
+      _nodes = malloc(size);
+      memcpy(_nodes, buffer, size);
+    } else {
+      _is_buffer = true;
+      _nodes = (Node*)buffer;
+    }
+    _file_size = size;
+    if (!_load_nodes(error)) {
+      unload();
+      return false;
+    }
+    return true;
+  }
+
+  DT get_distance(S i, S j) const {
+    return D::normalized_distance(D::distance(_get_item(i), _get_item(j), _f));
+  }
+
+  void get_nns_by_item(S item, size_t n, int search_k, vector<S>* result, vector<DT>* distances, const char* filter_type=nullptr, vector<int>* filter_vector=nullptr) const {
+    AnnoyItemSet<S> filter_items;
+    AnnoyFilter<S> filter;
+    get_nns_by_item(item, n, search_k, result, distances, _make_filter(filter_type, filter_vector, &filter_items, &filter));
+  }
+
+  void get_nns_by_vector(const T* w, size_t n, int search_k, vector<S>* result, vector<DT>* distances, const char* filter_type=nullptr, vector<int>* filter_vector=nullptr) const {
+    AnnoyItemSet<S> filter_items;
+    AnnoyFilter<S> filter;
+    get_nns_by_vector(w, n, search_k, result, distances, _make_filter(filter_type, filter_vector, &filter_items, &filter));
+  }
+
+  void get_nns_by_item(S item, size_t n, int search_k, vector<S>* result, vector<DT>* distances, const AnnoyFilter<S>* filter) const {
+    // TODO: handle OOB
+    const Node* m = _get_item(item);
+    _get_all_nns(m->v, n, search_k, result, distances, filter);
+  }
+
+  void get_nns_by_vector(const T* w, size_t n, int search_k, vector<S>* result, vector<DT>* distances, const AnnoyFilter<S>* filter) const {
+    _get_all_nns(w, n, search_k, result, distances, filter);
+  }
+
+  void get_nns_exact(const T* w, size_t n, vector<S>* result, vector<DT>* distances, const AnnoyFilter<S>* filter=nullptr, int n_threads=1) const {
+    // Finds the n nearest items by scoring every one of them instead of
+    // searching the trees. That's exact, and for small indexes faster too.
+    // It doesn't use the trees, so it also works before the index is built,
+    // but like a tree search it doesn't see items added since the last build.
+    // With n_threads > 1 (in multithreaded builds), each thread scans a
+    // range of the items; n_threads <= 0 uses one per core.
+    Node* v_node = (Node *)alloca(_s);
+    D::template zero_value<Node>(v_node);
+    memcpy(v_node->v, w, sizeof(T) * _f);
+    D::init_node(v_node, _f);
+
+    vector<pair<DT, S> > nns_dist;
+    size_t n_scored = 0;
+#ifdef ANNOYLIB_MULTITHREADED_BUILD
+    if (n_threads <= 0)
+      n_threads = std::max(1, (int)std::thread::hardware_concurrency());
+    n_threads = (int)std::max((S)1, std::min((S)n_threads, _n_items / ANNOY_EXACT_THREAD_ITEMS));
+    if (n_threads > 1) {
+      vector<vector<pair<DT, S> > > heaps(n_threads);
+      vector<size_t> n_thread_scored(n_threads);
+      vector<std::thread> threads;
+      for (int t = 0; t < n_threads; t++) {
+        S begin = (S)((size_t)_n_items * t / n_threads);
+        S end = (S)((size_t)_n_items * (t + 1) / n_threads);
+        threads.push_back(std::thread([this, v_node, n, begin, end, filter, &heaps, &n_thread_scored, t]() {
+          n_thread_scored[t] = _scan_exact(v_node, n, begin, end, filter, &heaps[t]);
+        }));
+      }
+      for (int t = 0; t < n_threads; t++) {
+        threads[t].join();
+        nns_dist.insert(nns_dist.end(), heaps[t].begin(), heaps[t].end());
+        n_scored += n_thread_scored[t];
+      }
+    } else
+#endif
+    {
+      n_scored = _scan_exact(v_node, n, 0, _n_items, filter, &nns_dist);
+    }
+
+    size_t p = std::min(n, nns_dist.size());
+    std::partial_sort(nns_dist.begin(), nns_dist.begin() + p, nns_dist.end());
+    for (size_t i = 0; i < p; i++) {
+      if (distances)
+        distances->push_back(D::normalized_distance(nns_dist[i].first));
+      result->push_back(nns_dist[i].second);
+    }
+#ifdef ANNOYLIB_QUERY_STATS
+    annoy_query_stats() = AnnoyQueryStats();
+    annoy_query_stats().n_queries = 1;
+    annoy_query_stats().n_candidates = n_scored;
+    annoy_query_stats().n_distances = n_scored;
+    _stats.add(annoy_query_stats());
+#else
+    (void)n_scored;
+#endif
+  }
+
+  S get_n_items() const {
+    // Including any added since the index was built
+    return _n_items + (S)(_pending.size() / _s);
+  }
+
+  S get_n_trees() const {
+    return (S)_roots.size();
+  }
+
+  void verbose(bool v) {
+    _verbose = v;
+  }
+
+  void get_item(S item, T* v) const {
+    // TODO: handle OOB
+    const Node* m = _get_item(item);
+    memcpy(v, m->v, (_f) * sizeof(T));
+  }
+
+  void set_seed(R seed) {
+    _seed = seed;
+  }
+
+  void thread_build(int q, int thread_idx, ThreadedBuildPolicy& threaded_build_policy) {
+    // Each thread needs its own seed, otherwise each thread would be building the same tree(s)
+    Random _random(_seed + thread_idx);
+    NodeRange node_range;
+
+    vector<S> thread_roots;
+    while (1) {
+      if (q == -1) {
+        if (_build_nodes.size() >= (size_t)_n_items) {
+          break;
+        }
+      } else {
+        if (thread_roots.size() >= (size_t)q) {
+          break;
+        }
+      }
+
+      if (_verbose) showUpdate("pass %zd...\n", thread_roots.size());
+
+      vector<S> indices;
+      _get_tree_items(&indices);
+      thread_roots.push_back(_make_tree(indices, true, _random, node_range, threaded_build_policy));
+    }
+
+    threaded_build_policy.lock_roots();
+    _roots.insert(_roots.end(), thread_roots.begin(), thread_roots.end());
+    threaded_build_policy.unlock_roots();
+  }
+
+  struct BuildTask {
+    // A subtree still to be built by thread_build_tasks
+    vector<S> indices;
+    bool is_root;
+    S parent; // Split node whose child this is, or -1 for a root
+    int side; // Which child of parent, or the tree number of a root
+    Random random;
+
+    BuildTask() : is_root(false), parent(-1), side(0) {}
+  };
+
+  void thread_insert_items(S first_item, int thread_idx, int n_threads, ThreadedBuildPolicy& threaded_build_policy) {
+    // Adds the items from first_item on to trees thread_idx,
+    // thread_idx + n_threads, etc. (see _build_pending)
+    NodeRange node_range;
+    for (size_t r = thread_idx; r < _roots.size(); r += n_threads) {
+      Random _random(_seed + r);
+      if (_build_node(_roots[r])->n_descendants <= _K) {
+        // The root is a bucket of the old items, so start a new tree
+        vector<S> indices;
+        _get_tree_items(&indices);
+        _roots[r] = _make_tree(indices, true, _random, node_range, threaded_build_policy);
+        continue;
+      }
+      for (S j = first_item; j < _n_items; j++) {
+        if (_get(j)->n_descendants >= 1) // Issue #223
+          _insert_item(_roots[r], j, _random, node_range, threaded_build_policy);
+      }
+      _build_node(_roots[r])->n_descendants = _n_items;
+    }
+  }
+
+#ifdef ANNOYLIB_MULTITHREADED_BUILD
+  template<typename Tasks>
+  void thread_build_tasks(int q, int thread_idx, Tasks& tasks, std::atomic<int>& n_trees, ThreadedBuildPolicy& threaded_build_policy) {
+    // Builds trees together with the other threads sharing tasks. Subtrees
+    // with more than min_task_items items are split into a task for each
+    // side, so that idle threads can take them, and smaller ones are built
+    // right away. A thread works on its own tasks first, then takes some
+    // from the others, and only then starts a new tree. Each task has its
+    // own random state, seeded from its parent's, so the trees depend on the
+    // seed but not on the number of threads or how the work is shared.
+    NodeRange node_range;
+    BuildTask task;
+    while (1) {
+      if (!tasks.pop(thread_idx, &task)) {
+        int tree = n_trees.load();
+        if (q == -1) {
+          if (_build_nodes.size() >= (size_t)_n_items)
+            tree = -1;
+        } else if (tree >= q) {
+          tree = -1;
+        }
+        if (tree == -1) {
+          if (tasks.finished())
+            break;
+          std::this_thread::yield();
+          continue;
+        }
+        if (!n_trees.compare_exchange_weak(tree, tree + 1))
+          continue;
+        tasks.begin_task();
+
+        if (_verbose) showUpdate("pass %d...\n", tree);
+        task.indices.clear();
+        _get_tree_items(&task.indices);
+        task.is_root = true;
+        task.parent = -1;
+        task.side = tree;
+        task.random = Random(_seed + tree);
+      }
+      _run_build_task(&task, thread_idx, tasks, node_range, threaded_build_policy);
+      tasks.end_task();
+    }
+  }
+#endif
+
+protected:
+  // Node ids reserved by one build thread, that it hasn't used yet
+  struct NodeRange {
+    S next, end;
+    NodeRange() : next(0), end(0) {}
+  };
+
+  static const size_t min_task_items = 1024;
+
+  void _get_tree_items(vector<S>* indices) const {
+    for (S i = 0; i < _n_items; i++) {
+      if (_get(i)->n_descendants >= 1) { // Issue #223
+        indices->push_back(i);
+      }
+    }
+  }
+
+  template<typename Tasks>
+  void _run_build_task(BuildTask* task, int thread_idx, Tasks& tasks, NodeRange& node_range, ThreadedBuildPolicy& threaded_build_policy) {
+    S item;
+    if (task->indices.size() <= (size_t)min_task_items || task->indices.size() <= (size_t)_K) {
+      item = _make_tree(task->indices, task->is_root, task->random, node_range, threaded_build_policy);
+    } else {
+      // Write the split node before queueing its children, which fill in
+      // its children ids when they're done.
+      Node* m = (Node*)alloca(_s);
+      vector<S> children_indices[2];
+      _make_split(task->indices, task->is_root, task->random, m, children_indices);
+      m->children[0] = m->children[1] = 0;
+      item = _allocate_node(node_range);
+      memcpy(_build_node(item), m, _s);
+
+      // The thread pops the smaller side first, and the bigger one is left
+      // for other threads to take.
+      int flip = (children_indices[0].size() > children_indices[1].size());
+      for (int side = 0; side < 2; side++) {
+        BuildTask child;
+        child.indices.swap(children_indices[side^flip^1]);
+        child.is_root = false;
+        child.parent = item;
+        child.side = side^flip^1;
+        child.random = Random(task->random.kiss());
+        tasks.push(thread_idx, child);
+      }
+    }
+
+    if (task->parent == -1) {
+      threaded_build_policy.lock_roots();
+      if (_roots.size() <= (size_t)task->side)
+        _roots.resize(task->side + 1, -1);
+      _roots[task->side] = item;
+      threaded_build_policy.unlock_roots();
+    } else {
+      _build_node(task->parent)->children[task->side] = item;
+    }
+  }
+
+  S _allocate_node(NodeRange& node_range) {
+    // Takes the next id from the thread's range, reserving a new range of
+    // ThreadedBuildPolicy::node_ids_per_allocation ids when it runs out.
+    // Ids that are never used are dropped by _relayout.
+    if (node_range.next == node_range.end) {
+      S n = ThreadedBuildPolicy::node_ids_per_allocation;
+      node_range.next = _n_items + (S)_build_nodes.allocate(n);
+      node_range.end = node_range.next + n;
+    }
+    return node_range.next++;
+  }
+
+  Node* _build_node(S i) const {
+    // Node i >= _n_items, while the trees are being built
+    return (Node*)_build_nodes.get(i - _n_items);
+  }
+
+protected:
+  void _release_nodes() {
+    if (_on_disk && _fd) {
+      close(_fd);
+      munmap(_nodes, _s * _nodes_size);
+    } else {
+      if (_fd) {
+        // we have mmapped data
+        close(_fd);
+        munmap((uint8_t*)_nodes - _data_offset, _file_size);
+      } else if (_is_buffer) {
+        // do nothing, v8 controls it
+      } else if (_nodes) {
+        // We have heap allocated data
+        free((uint8_t*)_nodes - _data_offset);
+      }
+    }
+  }
+
+  void _reallocate_nodes(S n) {
+    const double reallocation_factor = 1.3;
+    S new_nodes_size = std::max(n, (S) ((_nodes_size + 1) * reallocation_factor));
+    void *old = _nodes;
+
+    if (_on_disk) {
+      if (!remap_memory_and_truncate(&_nodes, _fd,
+          static_cast<size_t>(_s) * static_cast<size_t>(_nodes_size),
+          static_cast<size_t>(_s) * static_cast<size_t>(new_nodes_size)) &&
+          _verbose)
+          showUpdate("File truncation error\n");
+    } else {
+      _nodes = realloc(_nodes, _s * new_nodes_size);
+      memset((char *) _nodes + (_nodes_size * _s) / sizeof(char), 0, (new_nodes_size - _nodes_size) * _s);
+    }
+
+    _nodes_size = new_nodes_size;
+    if (_verbose) showUpdate("Reallocating to %zu nodes: old_address=%p, new_address=%p\n", (size_t)new_nodes_size, old, _nodes);
+  }
+
+  void _allocate_size(S n) {
+    if (n > _nodes_size) {
+      _reallocate_nodes(n);
+    }
+  }
+
+  Node* _get(const S i) const {
+    return get_node_ptr<S, Node>(_nodes, _s, i);
+  }
+
+  const Node* _get_item(const S i) const {
+    // Like _get, but also finds items that are waiting in _pending
+    if (i >= _n_items && !_pending.empty())
+      return get_node_ptr<S, Node>(&_pending[0], _s, i - _n_items);
+    return _get(i);
+  }
+
+  template<typename W>
+  void _init_item(Node* n, const W& w) {
+    D::zero_value(n);
+
+    n->children[0] = 0;
+    n->children[1] = 0;
+    n->n_descendants = 1;
+
+    for (int z = 0; z < _f; z++)
+      n->v[z] = w[z];
+
+    D::init_node(n, _f);
+  }
+
+  static const AnnoyFilter<S>* _make_filter(const char* filter_type, const vector<int>* filter_vector, AnnoyItemSet<S>* items, AnnoyFilter<S>* filter) {
+    // Turns the "include"/"exclude" string form of a filter into an AnnoyFilter
+    if (filter_type == nullptr || filter_vector == nullptr)
+      return nullptr;
+    if (strcmp(filter_type, "exclude") == 0)
+      filter->exclude = true;
+    else if (strcmp(filter_type, "include") == 0)
+      filter->exclude = false;
+    else
+      return nullptr;
+    *items = AnnoyItemSet<S>(filter_vector->begin(), filter_vector->end());
+    filter->items = items;
+    return filter;
+  }
+
+  double _split_imbalance(const vector<S>& left_indices, const vector<S>& right_indices) {
+    return _split_imbalance(left_indices.size(), right_indices.size());
+  }
+
+  static double _split_imbalance(size_t left_size, size_t right_size) {
+    double ls = (float)left_size;
+    double rs = (float)right_size;
+    float f = ls / (ls + rs + 1e-9);  // Avoid 0/0
+    return std::max(f, 1-f);
+  }
+
+  S _make_tree(const vector<S>& indices, bool is_root, Random& _random, NodeRange& node_range, ThreadedBuildPolicy& threaded_build_policy) {
+    // The basic rule is that if we have <= _K items, then it's a leaf node, otherwise it's a split node.
+    // There's some regrettable complications caused by the problem that root nodes have to be "special":
+    // 1. We identify root nodes by the arguable logic that _n_items == n->n_descendants, regardless of how many descendants they actually have
+    // 2. Root nodes with only 1 child need to be a "dummy" parent
+    // 3. Due to the _n_items "hack", we need to be careful with the cases where _n_items <= _K or _n_items > _K
+    if (indices.size() == 1 && !is_root)
+      return indices[0];
+
+    if (indices.size() <= (size_t)_K && (!is_root || (size_t)_n_items <= (size_t)_K || indices.size() == 1)) {
+      S item = _allocate_node(node_range);
+      Node* m = _build_node(item);
+      m->n_descendants = is_root ? _n_items : (S)indices.size();
+
+      // Using std::copy instead of a loop seems to resolve issues #3 and #13,
+      // probably because gcc 4.8 goes overboard with optimizations.
+      // Using memcpy instead of std::copy for MSVC compatibility. #235
+      // Only copy when necessary to avoid crash in MSVC 9. #293
+      if (!indices.empty())
+        memcpy(m->children, &indices[0], indices.size() * sizeof(S));
+
+      return item;
+    }
+
+    Node* m = (Node*)alloca(_s);
+    vector<S> children_indices[2];
+    _make_split(indices, is_root, _random, m, children_indices);
+
+    int flip = (children_indices[0].size() > children_indices[1].size());
+    for (int side = 0; side < 2; side++) {
+      // run _make_tree for the smallest child first (for cache locality)
+      m->children[side^flip] = _make_tree(children_indices[side^flip], false, _random, node_range, threaded_build_policy);
+    }
+
+    S item = _allocate_node(node_range);
+    memcpy(_build_node(item), m, _s);
+    return item;
+  }
+
+  void _make_split(const vector<S>& indices, bool is_root, Random& _random, Node* m, vector<S>* children_indices) {
+    // Fills in the split node m for indices, apart from its children, and
+    // divides indices between the two sides.
+    vector<Node*> children;
+    for (size_t i = 0; i < indices.size(); i++) {
+      S j = indices[i];
+      Node* n = _get(j);
+      if (n)
+        children.push_back(n);
+    }
+
+    for (int attempt = 0; attempt < 3; attempt++) {
+      children_indices[0].clear();
+      children_indices[1].clear();
+      D::create_split(children, _f, _s, _random, m);
+
+      for (size_t i = 0; i < indices.size(); i++) {
+        S j = indices[i];
+        Node* n = _get(j);
+        if (n) {
+          bool side = D::side(m, n->v, _f, _random);
+          children_indices[side].push_back(j);
+        } else {
+          showUpdate("No node for index %zu?\n", (size_t)j);
+        }
+      }
+
+      if (_split_imbalance(children_indices[0], children_indices[1]) < 0.95)
+        break;
+    }
+
+    // If we didn't find a hyperplane, just randomize sides as a last option
+    while (_split_imbalance(children_indices[0], children_indices[1]) > 0.99) {
+      if (_verbose)
+        showUpdate("\tNo hyperplane found (left has %zd children, right has %zd children)\n",
+          children_indices[0].size(), children_indices[1].size());
+
+      children_indices[0].clear();
+      children_indices[1].clear();
+
+      // Set the vector to 0.0
+      for (int z = 0; z < _f; z++)
+        m->v[z] = 0;
+
+      for (size_t i = 0; i < indices.size(); i++) {
+        S j = indices[i];
+        // Just randomize...
+        children_indices[_random.flip()].push_back(j);
+      }
+    }
+
+    m->n_descendants = is_root ? _n_items : (S)indices.size();
+  }
+
+  bool _stream_items(FILE* input, char** error) {
+    // Reads the vectors for build_from_file into the item nodes, a chunk of
+    // rows at a time
+    size_t row_size = (size_t)_f * sizeof(T);
+    size_t chunk = std::max((size_t)1, ((size_t)1 << 20) / row_size);
+    vector<T> rows(chunk * _f);
+    for (S i = 0; i < _n_items; ) {
+      size_t count = std::min(chunk, (size_t)(_n_items - i));
+      if (fread(&rows[0], row_size, count, input) != count) {
+        set_error_from_errno(error, "Unable to read");
+        return false;
+      }
+      for (size_t j = 0; j < count; j++)
+        _init_item(_get(i + (S)j), &rows[j * _f]);
+      i += (S)count;
+    }
+    return true;
+  }
+
+  bool _stream_tree(FILE* ids, S n, bool is_root, size_t max_ids, Random& _random, const char* filename, FILE* out, S* item, char** error) {
+    // Builds a tree over the n items whose ids are in ids, which it closes,
+    // or over every item if ids is NULL. The nodes are appended to out, and
+    // item is set to the root.
+    if ((size_t)n <= max_ids) {
+      vector<S> indices((size_t)n);
+      bool ok = _stream_ids(ids, 0, indices.empty() ? NULL : &indices[0], n) == (size_t)n;
+      if (ids)
+        fclose(ids);
+      if (!ok) {
+        set_error_from_errno(error, "Unable to read");
+        return false;
+      }
+      return _stream_make_tree(indices, is_root, _random, out, item, error);
+    }
+
+    Node* m = (Node*)alloca(_s);
+    FILE* sides[2] = { NULL, NULL };
+    S counts[2] = { 0, 0 };
+    bool ok = _stream_split(ids, n, is_root, _random, filename, m, sides, counts, error);
+    if (ids)
+      fclose(ids);
+
+    int flip = (counts[0] > counts[1]);
+    for (int side = 0; side < 2 && ok; side++) {
+      // Build the smallest side first, as _make_tree does
+      FILE* child = sides[side^flip];
+      sides[side^flip] = NULL;
+      rewind(child);
+      ok = _stream_tree(child, counts[side^flip], false, max_ids, _random, filename, out, &m->children[side^flip], error);
+    }
+    for (int side = 0; side < 2; side++) {
+      if (sides[side])
+        fclose(sides[side]);
+    }
+    return ok && _stream_write(out, m, item, error);
+  }
+
+  bool _stream_split(FILE* ids, S n, bool is_root, Random& _random, const char* filename, Node* m, FILE** sides, S* counts, char** error) {
+    // Like _make_split, for a set of items too big to hold in memory. The
+    // split is chosen from a sample of the items, then their ids are read
+    // again and written to a new temporary file for each side.
+    const size_t chunk = 4096;
+    vector<S> buffer(chunk);
+    vector<S> sample;
+    for (S i = 0; i < n; ) {
+      size_t count = std::min(chunk, (size_t)(n - i));
+      if (_stream_ids(ids, i, &buffer[0], count) != count) {
+        set_error_from_errno(error, "Unable to read");
+        return false;
+      }
+      for (size_t j = 0; j < count; j++) {
+        // Reservoir sampling, so every item is as likely to be picked
+        size_t seen = (size_t)i + j;
+        if (seen < ANNOY_STREAMING_SAMPLE) {
+          sample.push_back(buffer[j]);
+        } else {
+          size_t k = _random.index(seen + 1);
+          if (k < ANNOY_STREAMING_SAMPLE)
+            sample[k] = buffer[j];
+        }
+      }
+      i += (S)count;
+    }
 
-  template<typename W>
-  bool add_item_impl(S item, const W& w, char** error=NULL) {
-    if (_loaded) {
-      set_error_from_string(error, "You can't add an item to a loaded index");
-      return false;
+    vector<Node*> children;
+    for (size_t i = 0; i < sample.size(); i++)
+      children.push_back(_get(sample[i]));
+    memset((void*)m, 0, _s);
+    for (int attempt = 0; attempt < 3; attempt++) {
+      size_t sample_counts[2] = { 0, 0 };
+      D::create_split(children, _f, _s, _random, m);
+      for (size_t i = 0; i < children.size(); i++)
+        sample_counts[D::side(m, children[i]->v, _f, _random)]++;
+      if (_split_imbalance(sample_counts[0], sample_counts[1]) < 0.95)
+        break;
     }
-    _allocate_size(item + 1);
-    Node* n = _get(item);
 
-    D::zero_value(n);
+    vector<S> side_buffers[2];
+    for (bool randomize = false; ; randomize = true) {
+      for (int side = 0; side < 2; side++) {
+        sides[side] = _stream_temp_file(filename, error);
+        if (!sides[side])
+          return false;
+        side_buffers[side].clear();
+        counts[side] = 0;
+      }
+      if (ids)
+        rewind(ids);
+
+      bool ok = true;
+      for (S i = 0; i < n && ok; ) {
+        size_t count = std::min(chunk, (size_t)(n - i));
+        if (_stream_ids(ids, i, &buffer[0], count) != count) {
+          set_error_from_errno(error, "Unable to read");
+          return false;
+        }
+        for (size_t j = 0; j < count && ok; j++) {
+          S item = buffer[j];
+          int side = randomize ? _random.flip() : D::side(m, _get(item)->v, _f, _random);
+          side_buffers[side].push_back(item);
+          counts[side]++;
+          if (side_buffers[side].size() == chunk)
+            ok = _stream_flush_ids(sides[side], &side_buffers[side], error);
+        }
+        i += (S)count;
+      }
+      for (int side = 0; side < 2 && ok; side++)
+        ok = _stream_flush_ids(sides[side], &side_buffers[side], error);
+      if (!ok)
+        return false;
+      if (_split_imbalance(counts[0], counts[1]) <= 0.99)
+        break;
 
-    n->children[0] = 0;
-    n->children[1] = 0;
-    n->n_descendants = 1;
+      // If we didn't find a hyperplane, just randomize sides as a last option
+      if (_verbose)
+        showUpdate("\tNo hyperplane found (left has %zu children, right has %zu children)\n",
+          (size_t)counts[0], (size_t)counts[1]);
+      for (int side = 0; side < 2; side++) {
+        fclose(sides[side]);
+        sides[side] = NULL;
+      }
+      for (int z = 0; z < _f; z++)
+        m->v[z] = 0;
+    }
 
-    for (int z = 0; z < _f; z++)
-      n->v[z] = w[z];
+    m->n_descendants = is_root ? _n_items : n;
+    return true;
+  }
 
-    D::init_node(n, _f);
+  bool _stream_make_tree(const vector<S>& indices, bool is_root, Random& _random, FILE* out, S* item, char** error) {
+    // Like _make_tree, appending the nodes to out rather than the arena
+    if (indices.size() == 1 && !is_root) {
+      *item = indices[0];
+      return true;
+    }
 
-    if (item >= _n_items)
-      _n_items = item + 1;
+    Node* m = (Node*)alloca(_s);
+    memset((void*)m, 0, _s);
+    if (indices.size() <= (size_t)_K && (!is_root || (size_t)_n_items <= (size_t)_K || indices.size() == 1)) {
+      m->n_descendants = is_root ? _n_items : (S)indices.size();
+      if (!indices.empty())
+        memcpy(m->children, &indices[0], indices.size() * sizeof(S));
+      return _stream_write(out, m, item, error);
+    }
 
-    return true;
+    vector<S> children_indices[2];
+    _make_split(indices, is_root, _random, m, children_indices);
+
+    int flip = (children_indices[0].size() > children_indices[1].size());
+    for (int side = 0; side < 2; side++) {
+      if (!_stream_make_tree(children_indices[side^flip], false, _random, out, &m->children[side^flip], error))
+        return false;
+    }
+    return _stream_write(out, m, item, error);
   }
 
-  bool on_disk_build(const char* file, char** error=NULL) {
-    _on_disk = true;
-    _fd = open(file, O_RDWR | O_CREAT | O_TRUNC, (int) 0600);
-    if (_fd == -1) {
-      set_error_from_errno(error, "Unable to open");
-      _fd = 0;
+  bool _stream_write(FILE* out, const Node* m, S* item, char** error) {
+    // Appends a node of a tree being built from a file. Nodes are numbered
+    // in the order they're written, after the items.
+    if (_n_nodes == numeric_limits<S>::max()) {
+      set_error_from_string(error, "Index has too many nodes for its index type");
       return false;
     }
-    _nodes_size = 1;
-    if (ftruncate(_fd, FTRUNCATE_SIZE(_s) * FTRUNCATE_SIZE(_nodes_size)) == -1) {
-      set_error_from_errno(error, "Unable to truncate");
+    if (fwrite(m, _s, 1, out) != 1) {
+      set_error_from_errno(error, "Unable to write");
       return false;
     }
-#ifdef MAP_POPULATE
-    _nodes = (Node*) mmap(0, _s * _nodes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, 0);
-#else
-    _nodes = (Node*) mmap(0, _s * _nodes_size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
-#endif
+    *item = _n_nodes++;
     return true;
   }
 
-  bool build(int q, int n_threads=-1, char** error=NULL) {
-    if (_loaded) {
-      set_error_from_string(error, "You can't build a loaded index");
-      return false;
-    }
+  static size_t _stream_ids(FILE* ids, S first, S* buffer, size_t count) {
+    // Reads the next count ids of a set from ids, or if that's NULL, where
+    // the set is every item, makes them up from first on
+    if (ids)
+      return fread(buffer, sizeof(S), count, ids);
+    for (size_t i = 0; i < count; i++)
+      buffer[i] = first + (S)i;
+    return count;
+  }
 
-    if (_built) {
-      set_error_from_string(error, "You can't build a built index");
+  static bool _stream_flush_ids(FILE* f, vector<S>* ids, char** error) {
+    if (!ids->empty() && fwrite(&(*ids)[0], sizeof(S), ids->size(), f) != ids->size()) {
+      set_error_from_errno(error, "Unable to write");
       return false;
     }
+    ids->clear();
+    return true;
+  }
 
-    D::template preprocess<T, S, Node>(_nodes, _s, _n_items, _f);
-
-    _n_nodes = _n_items;
+  static FILE* _stream_temp_file(const char* filename, char** error) {
+    // Opens a temporary file that's deleted once it's closed. It's put next
+    // to filename rather than in the system's temporary directory, which
+    // may be in memory.
+#if defined(_MSC_VER) || defined(__MINGW32__)
+    FILE* f = tmpfile();
+#else
+    const char suffix[] = ".XXXXXX";
+    vector<char> path(filename, filename + strlen(filename));
+    path.insert(path.end(), suffix, suffix + sizeof(suffix));
+    FILE* f = NULL;
+    int fd = mkstemp(&path[0]);
+    if (fd != -1) {
+      unlink(&path[0]);
+      f = fdopen(fd, "w+b");
+      if (!f)
+        close(fd);
+    }
+#endif
+    if (!f)
+      set_error_from_errno(error, "Unable to create a temporary file");
+    return f;
+  }
 
-    ThreadedBuildPolicy::template build<S, T>(this, q, n_threads);
+  bool _finish_build(char** error) {
+    // Moves the trees in _build_nodes into _nodes, after the items
+    _relayout();
 
     // Also, copy the roots into the last segment of the array
     // This way we can load them faster without reading the whole file
@@ -977,7 +4063,7 @@ public:
       memcpy(_get(_n_nodes + (S)i), _get(_roots[i]), _s);
     _n_nodes += _roots.size();
 
-    if (_verbose) showUpdate("has %d nodes\n", _n_nodes);
+    if (_verbose) showUpdate("has %zu nodes\n", (size_t)_n_nodes);
 
     if (_on_disk) {
       if (!remap_memory_and_truncate(&_nodes, _fd,
@@ -993,510 +4079,953 @@ public:
     return true;
   }
 
-  bool unbuild(char** error=NULL) {
-    if (_loaded) {
-      set_error_from_string(error, "You can't unbuild a loaded index");
-      return false;
-    }
-
-    _roots.clear();
-    _n_nodes = _n_items;
-    _built = false;
-
-    return true;
-  }
-
-  bool save(const char* filename, bool prefault=false, char** error=NULL) {
-    if (!_built) {
-      set_error_from_string(error, "You can't save an index that hasn't been built");
-      return false;
-    }
-    if (_on_disk) {
-      return true;
-    } else {
-      // Delete file if it already exists (See issue #335)
-      unlink(filename);
-
-      FILE *f = fopen(filename, "wb");
-      if (f == NULL) {
-        set_error_from_errno(error, "Unable to open");
-        return false;
-      }
-
-      if (fwrite(_nodes, _s, _n_nodes, f) != (size_t) _n_nodes) {
-        set_error_from_errno(error, "Unable to write");
-        return false;
-      }
-
-      if (fclose(f) == EOF) {
-        set_error_from_errno(error, "Unable to close");
-        return false;
-      }
-
-      unload();
-      return load(filename, prefault, error);
-    }
+  bool _build_pending(int n_threads, char** error) {
+    // Adds the items in _pending to the trees, without rebuilding them. Each
+    // item goes down every tree the way a query would, into the bucket it
+    // lands in (see _insert_item). The trees are first copied out into
+    // _build_nodes, since the new items take the ids where the internal
+    // nodes were, and then moved back by _finish_build. Loaded indexes are
+    // copied into memory, and are no longer backed by their file.
+    S n_old = _n_items;
+    S n_new = _n_items + (S)(_pending.size() / _s);
+
+    _build_nodes.reset(_s, (size_t)numeric_limits<S>::max() - (size_t)n_new);
+    for (size_t r = 0; r < _roots.size(); r++)
+      _roots[r] = _copy_tree(_roots[r], n_new);
+
+    if (_loaded || _compact || _data_offset)
+      _copy_to_memory(n_new);
+    else
+      _allocate_size(n_new);
+    memcpy(_get(n_old), &_pending[0], _pending.size());
+    vector<uint8_t>().swap(_pending);
+    _n_items = n_new;
+    _n_nodes = n_new;
+    D::template preprocess_added<T, S, Node>(_nodes, _s, n_old, n_new, _f);
+    if (!_quantized.empty())
+      _quantized.template extend<S, Node>(_nodes, _s, n_new);
+
+    ThreadedBuildPolicy::template insert_items<S, T>(this, n_old, n_threads);
+    if (_verbose) showUpdate("added %zu items to %zu trees\n", (size_t)(n_new - n_old), _roots.size());
+
+    return _finish_build(error);
   }
 
-  void reinitialize() {
+  void _copy_to_memory(S n) {
+    // Replaces a loaded index's nodes with a copy of its items in memory,
+    // with room for n nodes. The trees have to be in _build_nodes by now.
+    void* nodes = malloc(_s * n);
+    memcpy(nodes, _nodes, _s * _n_items);
+    if (_compact)
+      _compact_layout = true; // These are saved compact regardless
+    _id_map.detach();
+    _payloads.detach();
+    _release_nodes();
     _fd = 0;
     _is_buffer = false;
-    _nodes = NULL;
+    _nodes = nodes;
+    _nodes_size = n;
+    _data_offset = 0;
+    _file_size = 0;
+    _compact = false;
+    _n_splits = 0;
+    _splits = NULL;
+    _leaves = NULL;
     _loaded = false;
-    _n_items = 0;
-    _n_nodes = 0;
-    _nodes_size = 0;
-    _on_disk = false;
-    _seed = Random::default_seed;
-    _roots.clear();
   }
 
-  void unload() {
-    if (_on_disk && _fd) {
-      close(_fd);
-      munmap(_nodes, _s * _nodes_size);
-    } else {
-      if (_fd) {
-        // we have mmapped data
-        close(_fd);
-        munmap(_nodes, _n_nodes * _s);
-      } else if (_is_buffer) {
-        // do nothing, v8 controls it
-      } else if (_nodes) {
-        // We have heap allocated data
-        free(_nodes);
-      }
+  void _mark_removed(S begin, S end) {
+    // Makes the removed items in [begin, end) look like ids that were never
+    // added (see issue #223)
+    for (S i = begin; i < end; i++) {
+      if (_removed.contains(i))
+        _get(i)->n_descendants = 0;
     }
-    reinitialize();
-    if (_verbose) showUpdate("unloaded\n");
   }
 
-  bool load(const char* filename, bool prefault=false, char** error=NULL) {
-    _fd = open(filename, O_RDONLY, (int)0400);
-    if (_fd == -1) {
-      set_error_from_errno(error, "Unable to open");
-      _fd = 0;
-      return false;
-    }
-    off_t size = lseek_getsize(_fd);
-    if (size == -1) {
-      set_error_from_errno(error, "Unable to get size");
-      return false;
-    } else if (size == 0) {
-      set_error_from_errno(error, "Size of file is zero");
-      return false;
-    } else if (size % _s) {
-      // Something is fishy with this index!
-      set_error_from_errno(error, "Index size is not a multiple of vector size. Ensure you are opening using the same metric you used to create the index.");
-      return false;
-    }
-
-    int flags = MAP_SHARED;
-    if (prefault) {
-#ifdef MAP_POPULATE
-      flags |= MAP_POPULATE;
-#else
-      showUpdate("prefault is set to true, but MAP_POPULATE is not defined on this platform");
-#endif
-    }
-    _nodes = (Node*)mmap(0, size, PROT_READ, flags, _fd, 0);
-    _n_nodes = (S)(size / _s);
-
-    // Find the roots by scanning the end of the file and taking the nodes with most descendants
-    _roots.clear();
-    S m = -1;
-    for (S i = _n_nodes - 1; i >= 0; i--) {
-      S k = _get(i)->n_descendants;
-      if (m == -1 || k == m) {
-        _roots.push_back(i);
-        m = k;
-      } else {
-        break;
+  S _copy_live(S i, S* n_live) {
+    // Copies the subtree at i into _build_nodes without the removed items.
+    // Returns its new id, or -1 if nothing is left, and sets *n_live to how
+    // many items are left in it.
+    S item;
+    const S* leaf = NULL;
+    S n_leaf = 0;
+    const Node* nd = _get_split(i, &item, &leaf, &n_leaf);
+    vector<S> indices;
+    if (nd) {
+      S children[2], n_children[2];
+      for (int side = 0; side < 2; side++)
+        children[side] = _copy_live(nd->children[side], &n_children[side]);
+      *n_live = n_children[0] + n_children[1];
+      if (children[0] == -1 || children[1] == -1)
+        return children[0] == -1 ? children[1] : children[0];
+      if (*n_live > _K) {
+        S id = _n_items + (S)_build_nodes.allocate(1);
+        Node* m = _build_node(id);
+        memcpy(m, nd, _s);
+        m->children[0] = children[0];
+        m->children[1] = children[1];
+        m->n_descendants = *n_live;
+        return id;
       }
-    }
-    // hacky fix: since the last root precedes the copy of all roots, delete it
-    if (_roots.size() > 1 && _get(_roots.front())->children[0] == _get(_roots.back())->children[0])
-      _roots.pop_back();
-    _loaded = true;
-    _built = true;
-    _n_items = m;
-    if (_verbose) showUpdate("found %zu roots with degree %d\n", _roots.size(), m);
-    return true;
-  }
-
-  bool loadBuffer(void* buffer, off_t size, bool copy=false, char** error=NULL) {
-    if (size == 0) {
-      set_error_from_errno(error, "Size of file is zero");
-      return false;
-    } else if (size % _s) {
-      // Something is fishy with this index!
-      set_error_from_errno(error, "Index size is not a multiple of vector size. Ensure you are opening using the same metric you used to create the index.");
-      return false;
-    }
-
-    _is_buffer = true;
-    if (copy) {
-      _nodes = malloc(size);
-      memcpy(_nodes, buffer, size);
+      // A split with this few items would be read as a bucket
+      _append_items(children[0], &indices);
+      _append_items(children[1], &indices);
     } else {
-      _nodes = (Node*)buffer;
-    }
-    _n_nodes = (S)(size / _s);
-
-    // Find the roots by scanning the end of the file and taking the nodes with most descendants
-    _roots.clear();
-    S m = -1;
-    for (S i = _n_nodes - 1; i >= 0; i--) {
-      S k = _get(i)->n_descendants;
-      if (m == -1 || k == m) {
-        _roots.push_back(i);
-        m = k;
-      } else {
-        break;
+      for (S k = 0; k < n_leaf; k++) {
+        if (!_removed.contains(leaf[k]))
+          indices.push_back(leaf[k]);
       }
+      *n_live = (S)indices.size();
     }
-    // hacky fix: since the last root precedes the copy of all roots, delete it
-    if (_roots.size() > 1 && _get(_roots.front())->children[0] == _get(_roots.back())->children[0])
-      _roots.pop_back();
-    _loaded = true;
-    _built = true;
-    _n_items = m;
-    if (_verbose) showUpdate("found %zu roots with degree %d\n", _roots.size(), m);
-    return true;
-  }
-
-  T get_distance(S i, S j) const {
-    return D::normalized_distance(D::distance(_get(i), _get(j), _f));
-  }
-
-  void get_nns_by_item(S item, size_t n, int search_k, vector<S>* result, vector<T>* distances, const char* filter_type=nullptr, vector<int>* filter_vector=nullptr) const {
-    // TODO: handle OOB
-    const Node* m = _get(item);
-    _get_all_nns(m->v, n, search_k, result, distances, filter_type, filter_vector);
-  }
-
-  void get_nns_by_vector(const T* w, size_t n, int search_k, vector<S>* result, vector<T>* distances, const char* filter_type=nullptr, vector<int>* filter_vector=nullptr) const {
-    _get_all_nns(w, n, search_k, result, distances, filter_type, filter_vector);
-  }
-
-  S get_n_items() const {
-    return _n_items;
-  }
-
-  S get_n_trees() const {
-    return (S)_roots.size();
-  }
-
-  void verbose(bool v) {
-    _verbose = v;
-  }
-
-  void get_item(S item, T* v) const {
-    // TODO: handle OOB
-    Node* m = _get(item);
-    memcpy(v, m->v, (_f) * sizeof(T));
+    if (indices.size() <= 1)
+      return indices.empty() ? -1 : indices[0];
+    S id = _n_items + (S)_build_nodes.allocate(1);
+    Node* m = _build_node(id);
+    m->n_descendants = (S)indices.size();
+    memcpy(m->children, &indices[0], indices.size() * sizeof(S));
+    return id;
   }
 
-  void set_seed(R seed) {
-    _seed = seed;
+  void _append_items(S i, vector<S>* indices) {
+    // Adds the items under i, which _copy_live made an item or a bucket
+    if (i == -1)
+      return;
+    if (i < _n_items) {
+      indices->push_back(i);
+      return;
+    }
+    Node* m = _build_node(i);
+    indices->insert(indices->end(), m->children, m->children + m->n_descendants);
   }
 
-  void thread_build(int q, int thread_idx, ThreadedBuildPolicy& threaded_build_policy) {
-    // Each thread needs its own seed, otherwise each thread would be building the same tree(s)
-    Random _random(_seed + thread_idx);
-
-    vector<S> thread_roots;
-    while (1) {
-      if (q == -1) {
-        threaded_build_policy.lock_n_nodes();
-        if (_n_nodes >= 2 * _n_items) {
-          threaded_build_policy.unlock_n_nodes();
-          break;
+  S _copy_tree(S root, S n_new) {
+    // Copies the tree at root into _build_nodes, numbering its nodes from
+    // n_new on, and returns the new id of the root.
+    vector<std::pair<S, S> > queue; // Old and new ids
+    S new_root = n_new + (S)_build_nodes.allocate(1);
+    queue.push_back(std::make_pair(root, new_root));
+    for (size_t k = 0; k < queue.size(); k++) {
+      Node* m = (Node*)_build_nodes.get(queue[k].second - n_new);
+      S item;
+      const S* leaf = NULL;
+      S n_leaf = 0;
+      const Node* nd = _get_split(queue[k].first, &item, &leaf, &n_leaf);
+      if (nd) {
+        memcpy(m, nd, _s);
+        for (int side = 0; side < 2; side++) {
+          if (m->children[side] >= _n_items) {
+            S child = n_new + (S)_build_nodes.allocate(1);
+            queue.push_back(std::make_pair(m->children[side], child));
+            m->children[side] = child;
+          }
         }
-        threaded_build_policy.unlock_n_nodes();
       } else {
-        if (thread_roots.size() >= (size_t)q) {
-          break;
-        }
+        // The roots' count is _n_items, which _get_split gives for root
+        // buckets too
+        m->n_descendants = n_leaf;
+        memcpy(m->children, leaf, n_leaf * sizeof(S));
       }
+    }
+    return new_root;
+  }
 
-      if (_verbose) showUpdate("pass %zd...\n", thread_roots.size());
-
+  void _insert_item(S root, S j, Random& _random, NodeRange& node_range, ThreadedBuildPolicy& threaded_build_policy) {
+    // Walks item j down the tree at root, adding it to the count of each
+    // split on the way, and then to the bucket it reaches. A bucket that
+    // would overflow is replaced by a new subtree from _make_tree, as is a
+    // single item.
+    const T* v = _get(j)->v;
+    Node* parent = _build_node(root);
+    while (true) {
+      int side = D::side(parent, v, _f, _random);
+      S i = parent->children[side];
       vector<S> indices;
-      threaded_build_policy.lock_shared_nodes();
-      for (S i = 0; i < _n_items; i++) {
-        if (_get(i)->n_descendants >= 1) { // Issue #223
-          indices.push_back(i);
+      if (i >= _n_items) {
+        Node* nd = _build_node(i);
+        if (nd->n_descendants > _K) {
+          nd->n_descendants++;
+          parent = nd;
+          continue;
         }
+        if (nd->n_descendants < _K) {
+          nd->children[nd->n_descendants++] = j;
+          return;
+        }
+        indices.assign(nd->children, nd->children + nd->n_descendants);
+      } else {
+        indices.push_back(i);
       }
-      threaded_build_policy.unlock_shared_nodes();
-
-      thread_roots.push_back(_make_tree(indices, true, _random, threaded_build_policy));
+      indices.push_back(j);
+      parent->children[side] = _make_tree(indices, false, _random, node_range, threaded_build_policy);
+      return;
     }
-
-    threaded_build_policy.lock_roots();
-    _roots.insert(_roots.end(), thread_roots.begin(), thread_roots.end());
-    threaded_build_policy.unlock_roots();
   }
 
-protected:
-  void _reallocate_nodes(S n) {
-    const double reallocation_factor = 1.3;
-    S new_nodes_size = std::max(n, (S) ((_nodes_size + 1) * reallocation_factor));
-    void *old = _nodes;
+  void _relayout() {
+    // Moves the nodes made by the build from _build_nodes to _nodes, after
+    // the items, with each tree in breadth-first order, one tree after
+    // another. _make_tree makes nodes in post-order, interleaved between
+    // threads, so the top levels of a tree, which every query visits, would
+    // otherwise be spread over the whole index. Ids reserved by a build
+    // thread but never used are dropped.
+    size_t n_built = _build_nodes.size();
+    vector<S> new_ids(n_built, -1); // Indexed by old id - _n_items
+    vector<S> order;                // Old ids, in their new order
+
+    for (size_t r = 0; r < _roots.size(); r++) {
+      if (_roots[r] < _n_items)
+        continue;
+      size_t k = order.size();
+      new_ids[_roots[r] - _n_items] = _n_items + (S)order.size();
+      order.push_back(_roots[r]);
+      for (; k < order.size(); k++) {
+        Node* nd = _build_node(order[k]);
+        if (nd->n_descendants <= _K)
+          continue; // Its children are items
+        for (int side = 0; side < 2; side++) {
+          S child = nd->children[side];
+          if (child >= _n_items && new_ids[child - _n_items] == -1) {
+            new_ids[child - _n_items] = _n_items + (S)order.size();
+            order.push_back(child);
+          }
+        }
+      }
+    }
 
-    if (_on_disk) {
-      if (!remap_memory_and_truncate(&_nodes, _fd,
-          static_cast<size_t>(_s) * static_cast<size_t>(_nodes_size),
-          static_cast<size_t>(_s) * static_cast<size_t>(new_nodes_size)) &&
-          _verbose)
-          showUpdate("File truncation error\n");
-    } else {
-      _nodes = realloc(_nodes, _s * new_nodes_size);
-      memset((char *) _nodes + (_nodes_size * _s) / sizeof(char), 0, (new_nodes_size - _nodes_size) * _s);
+    _allocate_size(_n_items + (S)order.size());
+    for (size_t k = 0; k < order.size(); k++) {
+      Node* nd = _get(_n_items + (S)k);
+      memcpy(nd, _build_node(order[k]), _s);
+      if (nd->n_descendants > _K) {
+        for (int side = 0; side < 2; side++) {
+          if (nd->children[side] >= _n_items)
+            nd->children[side] = new_ids[nd->children[side] - _n_items];
+        }
+      }
     }
+    _n_nodes = _n_items + (S)order.size();
+    for (size_t r = 0; r < _roots.size(); r++) {
+      if (_roots[r] >= _n_items)
+        _roots[r] = new_ids[_roots[r] - _n_items];
+    }
+    _build_nodes.clear();
+  }
 
-    _nodes_size = new_nodes_size;
-    if (_verbose) showUpdate("Reallocating to %d nodes: old_address=%p, new_address=%p\n", new_nodes_size, old, _nodes);
+  static size_t _align_to_file(size_t size) {
+    return (size + ANNOY_FILE_ALIGNMENT - 1) / ANNOY_FILE_ALIGNMENT * ANNOY_FILE_ALIGNMENT;
   }
 
-  void _allocate_size(S n, ThreadedBuildPolicy& threaded_build_policy) {
-    if (n > _nodes_size) {
-      threaded_build_policy.lock_nodes();
-      _reallocate_nodes(n);
-      threaded_build_policy.unlock_nodes();
+  bool _write_plain(FILE* f, char** error) const {
+    // Writes a header, then the nodes as they're written without one, then
+    // any id and payload sections.
+    vector<AnnoyFileSection> sections;
+    vector<const void*> data;
+    vector<S> id_order;
+    vector<uint64_t> payload_offsets;
+    vector<uint8_t> payload_blob;
+    _add_id_sections(&sections, &data, &id_order);
+    _add_payload_sections(&sections, &data, &payload_offsets, &payload_blob);
+    size_t header_size = _header_size(_roots.size(), sections.size());
+    size_t offset = header_size + (size_t)_n_nodes * _s;
+    _place_sections(&sections, offset);
+
+    vector<uint8_t> buffer;
+    _fill_header(&buffer, _roots, _n_nodes, sections);
+    if (fwrite(&buffer[0], 1, buffer.size(), f) != buffer.size() ||
+        fwrite(_nodes, _s, _n_nodes, f) != (size_t) _n_nodes) {
+      set_error_from_errno(error, "Unable to write");
+      return false;
     }
+    return _write_sections(f, offset, sections, data, error);
   }
 
-  void _allocate_size(S n) {
-    if (n > _nodes_size) {
-      _reallocate_nodes(n);
-    }
+  void _add_id_sections(vector<AnnoyFileSection>* sections, vector<const void*>* data, vector<S>* id_order) const {
+    // Adds the sections for external ids, if the items have them. id_order
+    // holds one of them until it's written.
+    if (_id_map.empty())
+      return;
+    _id_map.get_order(_n_items, id_order);
+    AnnoyFileSection section = AnnoyFileSection();
+    section.type = ANNOY_SECTION_IDS;
+    section.size = (uint64_t)_n_items * sizeof(uint64_t);
+    sections->push_back(section);
+    data->push_back(_id_map.ids());
+    section.type = ANNOY_SECTION_ID_ORDER;
+    section.size = (uint64_t)_n_items * sizeof(S);
+    sections->push_back(section);
+    data->push_back(id_order->empty() ? NULL : &(*id_order)[0]);
   }
 
-  Node* _get(const S i) const {
-    return get_node_ptr<S, Node>(_nodes, _s, i);
+  void _add_payload_sections(vector<AnnoyFileSection>* sections, vector<const void*>* data,
+                             vector<uint64_t>* offsets, vector<uint8_t>* blob) const {
+    // Adds the sections for payloads, if there are any. offsets and blob
+    // hold them until they're written.
+    if (_payloads.empty())
+      return;
+    _payloads.get_layout(_n_items, offsets, blob);
+    AnnoyFileSection section = AnnoyFileSection();
+    section.type = ANNOY_SECTION_PAYLOAD_OFFSETS;
+    section.size = offsets->size() * sizeof(uint64_t);
+    sections->push_back(section);
+    data->push_back(&(*offsets)[0]);
+    section.type = ANNOY_SECTION_PAYLOADS;
+    section.size = blob->size();
+    sections->push_back(section);
+    data->push_back(blob->empty() ? NULL : &(*blob)[0]);
   }
 
-  double _split_imbalance(const vector<S>& left_indices, const vector<S>& right_indices) {
-    double ls = (float)left_indices.size();
-    double rs = (float)right_indices.size();
-    float f = ls / (ls + rs + 1e-9);  // Avoid 0/0
-    return std::max(f, 1-f);
+  static size_t _header_size(size_t n_roots, size_t n_sections) {
+    return _align_to_file(annoy_file_header_base_size(n_sections ? ANNOY_FILE_VERSION : 1) +
+                          n_roots * sizeof(uint64_t) + n_sections * sizeof(AnnoyFileSection));
   }
 
-  S _make_tree(const vector<S>& indices, bool is_root, Random& _random, ThreadedBuildPolicy& threaded_build_policy) {
-    // The basic rule is that if we have <= _K items, then it's a leaf node, otherwise it's a split node.
-    // There's some regrettable complications caused by the problem that root nodes have to be "special":
-    // 1. We identify root nodes by the arguable logic that _n_items == n->n_descendants, regardless of how many descendants they actually have
-    // 2. Root nodes with only 1 child need to be a "dummy" parent
-    // 3. Due to the _n_items "hack", we need to be careful with the cases where _n_items <= _K or _n_items > _K
-    if (indices.size() == 1 && !is_root)
-      return indices[0];
+  static void _place_sections(vector<AnnoyFileSection>* sections, size_t offset) {
+    // Puts the sections one after another from offset, each aligned
+    for (size_t i = 0; i < sections->size(); i++) {
+      offset = _align_to_file(offset);
+      (*sections)[i].offset = offset;
+      offset += (*sections)[i].size;
+    }
+  }
 
-    if (indices.size() <= (size_t)_K && (!is_root || (size_t)_n_items <= (size_t)_K || indices.size() == 1)) {
-      threaded_build_policy.lock_n_nodes();
-      _allocate_size(_n_nodes + 1, threaded_build_policy);
-      S item = _n_nodes++;
-      threaded_build_policy.unlock_n_nodes();
+  bool _write_sections(FILE* f, size_t offset, const vector<AnnoyFileSection>& sections,
+                       const vector<const void*>& data, char** error) const {
+    // Writes the data of each section at its offset, from offset, which is
+    // where the file is now.
+    static const uint8_t padding[ANNOY_FILE_ALIGNMENT] = { 0 };
+    for (size_t i = 0; i < sections.size(); i++) {
+      size_t pad = sections[i].offset - offset;
+      if ((pad && fwrite(padding, 1, pad, f) != pad) ||
+          (sections[i].size && fwrite(data[i], 1, sections[i].size, f) != sections[i].size)) {
+        set_error_from_errno(error, "Unable to write");
+        return false;
+      }
+      offset = sections[i].offset + sections[i].size;
+    }
+    return true;
+  }
 
-      threaded_build_policy.lock_shared_nodes();
-      Node* m = _get(item);
-      m->n_descendants = is_root ? _n_items : (S)indices.size();
+  void _fill_header(vector<uint8_t>* buffer, const vector<S>& roots, S n_nodes, const vector<AnnoyFileSection>& sections) const {
+    // Files without sections are written as version 1, which older versions
+    // can still read.
+    uint32_t version = sections.empty() ? 1 : ANNOY_FILE_VERSION;
+    size_t header_size = _header_size(roots.size(), sections.size());
+    buffer->assign(std::max(header_size, sizeof(AnnoyFileHeader)), 0);
+
+    AnnoyFileHeader* header = (AnnoyFileHeader*)&(*buffer)[0];
+    memcpy(header->magic, ANNOY_FILE_MAGIC, sizeof(ANNOY_FILE_MAGIC));
+    header->version = version;
+    header->header_size = (uint32_t)header_size;
+    strncpy(header->metric, D::name(), sizeof(header->metric) - 1);
+    strncpy(header->value_type, AnnoyValueType<T>::name(), sizeof(header->value_type) - 1);
+    header->f = _f;
+    header->index_size = sizeof(S);
+    header->value_size = sizeof(T);
+    header->node_size = _s;
+    header->n_items = _n_items;
+    header->n_nodes = n_nodes;
+    header->n_roots = roots.size();
+    header->seed = _seed;
+    if (version > 1)
+      header->n_sections = sections.size();
+    uint64_t* file_roots = (uint64_t*)annoy_file_roots(header);
+    for (size_t i = 0; i < roots.size(); i++)
+      file_roots[i] = roots[i];
+    if (!sections.empty())
+      memcpy((void*)annoy_file_sections(header), &sections[0], sections.size() * sizeof(AnnoyFileSection));
+    header->checksum = annoy_file_checksum(header);
+    buffer->resize(header_size);
+  }
 
-      // Using std::copy instead of a loop seems to resolve issues #3 and #13,
-      // probably because gcc 4.8 goes overboard with optimizations.
-      // Using memcpy instead of std::copy for MSVC compatibility. #235
-      // Only copy when necessary to avoid crash in MSVC 9. #293
-      if (!indices.empty())
-        memcpy(m->children, &indices[0], indices.size() * sizeof(S));
+  bool _write_compact(FILE* f, char** error) const {
+    // Writes the compact layout: a header, then the item nodes, the split
+    // nodes, and the buckets, each in its own section. A bucket is stored as
+    // its number of items followed by their ids, so it takes only as much
+    // room as it needs rather than a whole node, and the roots are only in
+    // the header. Node ids count the items, then the splits, then positions
+    // in the buckets section, where each bucket starts. Splits and buckets
+    // are in the breadth-first order of the trees.
+    vector<uint8_t> split_buffer;
+    vector<S> leaf_buffer;
+    vector<S> roots = _roots;
+    const uint8_t* splits = _splits;
+    const S* leaves = _leaves;
+    size_t n_splits = _n_splits;
+    size_t n_leaves = _compact ? (size_t)(_n_nodes - _n_items - _n_splits) : 0;
+    if (!_compact) {
+      if (!_make_compact(&split_buffer, &leaf_buffer, &roots)) {
+        set_error_from_string(error, "Index has too many nodes for the compact layout");
+        return false;
+      }
+      n_splits = split_buffer.size() / _s;
+      n_leaves = leaf_buffer.size();
+      splits = split_buffer.empty() ? NULL : &split_buffer[0];
+      leaves = leaf_buffer.empty() ? NULL : &leaf_buffer[0];
+    }
 
-      threaded_build_policy.unlock_shared_nodes();
-      return item;
+    vector<const void*> data;
+    data.push_back(_nodes);
+    data.push_back(splits);
+    data.push_back(leaves);
+    vector<AnnoyFileSection> sections(3);
+    sections[0].type = ANNOY_SECTION_ITEMS;
+    sections[0].size = (uint64_t)_n_items * _s;
+    sections[1].type = ANNOY_SECTION_SPLITS;
+    sections[1].size = (uint64_t)n_splits * _s;
+    sections[2].type = ANNOY_SECTION_LEAVES;
+    sections[2].size = (uint64_t)n_leaves * sizeof(S);
+    vector<S> id_order;
+    vector<uint64_t> payload_offsets;
+    vector<uint8_t> payload_blob;
+    _add_id_sections(&sections, &data, &id_order);
+    _add_payload_sections(&sections, &data, &payload_offsets, &payload_blob);
+    size_t header_size = _header_size(roots.size(), sections.size());
+    _place_sections(&sections, header_size);
+
+    vector<uint8_t> buffer;
+    _fill_header(&buffer, roots, _n_items + (S)n_splits + (S)n_leaves, sections);
+    if (fwrite(&buffer[0], 1, buffer.size(), f) != buffer.size()) {
+      set_error_from_errno(error, "Unable to write");
+      return false;
     }
+    return _write_sections(f, header_size, sections, data, error);
+  }
 
-    threaded_build_policy.lock_shared_nodes();
-    vector<Node*> children;
-    for (size_t i = 0; i < indices.size(); i++) {
-      S j = indices[i];
-      Node* n = _get(j);
-      if (n)
-        children.push_back(n);
+  bool _make_compact(vector<uint8_t>* splits, vector<S>* leaves, vector<S>* roots) const {
+    // Copies the split nodes and buckets reachable from the roots into the
+    // compact layout, renumbering them and the roots to match. Fails if the
+    // ids don't fit in S.
+    size_t n_internal = _n_nodes > _n_items ? (size_t)(_n_nodes - _n_items) : 0;
+    vector<S> new_ids(n_internal, -1); // Indexed by old id - _n_items
+    vector<S> split_order, bucket_order; // Old ids, in their new order
+    for (size_t r = 0; r < roots->size(); r++) {
+      size_t k = split_order.size();
+      _visit_compact((*roots)[r], &new_ids, &split_order, &bucket_order);
+      for (; k < split_order.size(); k++) {
+        const Node* nd = _get(split_order[k]);
+        _visit_compact(nd->children[0], &new_ids, &split_order, &bucket_order);
+        _visit_compact(nd->children[1], &new_ids, &split_order, &bucket_order);
+      }
     }
 
-    vector<S> children_indices[2];
-    Node* m = (Node*)alloca(_s);
+    uint64_t next_id = (uint64_t)_n_items + split_order.size();
+    for (size_t k = 0; k < split_order.size(); k++)
+      new_ids[split_order[k] - _n_items] = _n_items + (S)k;
+    for (size_t k = 0; k < bucket_order.size(); k++) {
+      S n_descendants = _get(bucket_order[k])->n_descendants;
+      if (next_id + 1 + n_descendants > (uint64_t)numeric_limits<S>::max())
+        return false;
+      new_ids[bucket_order[k] - _n_items] = (S)next_id;
+      next_id += 1 + n_descendants;
+    }
 
-    for (int attempt = 0; attempt < 3; attempt++) {
-      children_indices[0].clear();
-      children_indices[1].clear();
-      D::create_split(children, _f, _s, _random, m);
+    splits->resize(split_order.size() * _s);
+    for (size_t k = 0; k < split_order.size(); k++) {
+      Node* nd = get_node_ptr<S, Node>(&(*splits)[0], _s, (S)k);
+      memcpy(nd, _get(split_order[k]), _s);
+      for (int side = 0; side < 2; side++) {
+        if (nd->children[side] >= _n_items)
+          nd->children[side] = new_ids[nd->children[side] - _n_items];
+      }
+    }
+    leaves->clear();
+    leaves->reserve(next_id - _n_items - split_order.size());
+    for (size_t k = 0; k < bucket_order.size(); k++) {
+      const Node* nd = _get(bucket_order[k]);
+      leaves->push_back(nd->n_descendants);
+      leaves->insert(leaves->end(), nd->children, nd->children + nd->n_descendants);
+    }
+    for (size_t r = 0; r < roots->size(); r++) {
+      if ((*roots)[r] >= _n_items)
+        (*roots)[r] = new_ids[(*roots)[r] - _n_items];
+    }
+    return true;
+  }
 
-      for (size_t i = 0; i < indices.size(); i++) {
-        S j = indices[i];
-        Node* n = _get(j);
-        if (n) {
-          bool side = D::side(m, n->v, _f, _random);
-          children_indices[side].push_back(j);
+  void _visit_compact(S i, vector<S>* new_ids, vector<S>* split_order, vector<S>* bucket_order) const {
+    if (i < _n_items || i >= _n_nodes || (*new_ids)[i - _n_items] != -1)
+      return;
+    (*new_ids)[i - _n_items] = 0; // Numbered once they're all found
+    if (_get(i)->n_descendants > _K)
+      split_order->push_back(i);
+    else
+      bucket_order->push_back(i);
+  }
+
+  bool _load_nodes(char** error) {
+    // Sets up a loaded index from the _file_size bytes at _nodes, which may
+    // start with an AnnoyFileHeader.
+    if (annoy_has_file_header(_nodes, _file_size)) {
+      if (!_load_header(error))
+        return false;
+    } else {
+      if (_file_size % _s) {
+        // Something is fishy with this index!
+        set_error_from_errno(error, "Index size is not a multiple of vector size. Ensure you are opening using the same metric you used to create the index.");
+        return false;
+      }
+      _n_nodes = (S)(_file_size / _s);
+
+      // Find the roots by scanning the end of the file and taking the nodes with most descendants
+      _roots.clear();
+      S m = -1;
+      for (S i = _n_nodes - 1; i >= 0; i--) {
+        S k = _get(i)->n_descendants;
+        if (m == -1 || k == m) {
+          _roots.push_back(i);
+          m = k;
         } else {
-          showUpdate("No node for index %d?\n", j);
+          break;
         }
       }
-
-      if (_split_imbalance(children_indices[0], children_indices[1]) < 0.95)
-        break;
+      // hacky fix: since the last root precedes the copy of all roots, delete it
+      if (_roots.size() > 1 && _get(_roots.front())->children[0] == _get(_roots.back())->children[0])
+        _roots.pop_back();
+      _n_items = m;
     }
-    threaded_build_policy.unlock_shared_nodes();
-
-    // If we didn't find a hyperplane, just randomize sides as a last option
-    while (_split_imbalance(children_indices[0], children_indices[1]) > 0.99) {
-      if (_verbose)
-        showUpdate("\tNo hyperplane found (left has %zd children, right has %zd children)\n",
-          children_indices[0].size(), children_indices[1].size());
-
-      children_indices[0].clear();
-      children_indices[1].clear();
-
-      // Set the vector to 0.0
-      for (int z = 0; z < _f; z++)
-        m->v[z] = 0;
+    _loaded = true;
+    _built = true;
+    if (_verbose) showUpdate("found %zu roots with degree %zu\n", _roots.size(), (size_t)_n_items);
+    return true;
+  }
 
-      for (size_t i = 0; i < indices.size(); i++) {
-        S j = indices[i];
-        // Just randomize...
-        children_indices[_random.flip()].push_back(j);
+  bool _load_header(char** error) {
+    const AnnoyFileHeader* header = (const AnnoyFileHeader*)_nodes;
+    if (!annoy_check_file_header(header, _file_size, error))
+      return false;
+    if (strncmp(header->metric, D::name(), sizeof(header->metric)) != 0) {
+      set_error_from_string(error, "Index file was saved with a different metric");
+      return false;
+    }
+    if (strncmp(header->value_type, AnnoyValueType<T>::name(), sizeof(header->value_type)) != 0) {
+      set_error_from_string(error, "Index file was saved with a different vector storage type");
+      return false;
+    }
+    if (header->f != _f || header->index_size != sizeof(S) || header->value_size != sizeof(T) || header->node_size != _s) {
+      set_error_from_string(error, "Index file was saved with different dimensions or types");
+      return false;
+    }
+    if (header->n_items > header->n_nodes) {
+      set_error_from_string(error, "Index file header is corrupt");
+      return false;
+    }
+    const uint64_t* roots = annoy_file_roots(header);
+    _roots.clear();
+    for (uint64_t i = 0; i < header->n_roots; i++) {
+      if (roots[i] >= header->n_nodes) {
+        set_error_from_string(error, "Index file header is corrupt");
+        return false;
       }
+      _roots.push_back((S)roots[i]);
     }
+    _n_items = (S)header->n_items;
+    _n_nodes = (S)header->n_nodes;
+    _seed = (R)header->seed;
+    _file_header = true;
+    if (!_load_ids(header, error) || !_load_payloads(header, error))
+      return false;
+    if (annoy_find_file_section(header, ANNOY_SECTION_ITEMS))
+      return _load_compact(header, error);
+    _data_offset = header->header_size;
+    _nodes = (uint8_t*)_nodes + _data_offset;
+    return true;
+  }
 
-    int flip = (children_indices[0].size() > children_indices[1].size());
-
-    m->n_descendants = is_root ? _n_items : (S)indices.size();
-    for (int side = 0; side < 2; side++) {
-      // run _make_tree for the smallest child first (for cache locality)
-      m->children[side^flip] = _make_tree(children_indices[side^flip], false, _random, threaded_build_policy);
+  bool _load_ids(const AnnoyFileHeader* header, char** error) {
+    const uint8_t* data = (const uint8_t*)header;
+    const AnnoyFileSection* ids = annoy_find_file_section(header, ANNOY_SECTION_IDS);
+    const AnnoyFileSection* order = annoy_find_file_section(header, ANNOY_SECTION_ID_ORDER);
+    if (!ids && !order)
+      return true;
+    if (!ids || !order || ids->size != header->n_items * sizeof(uint64_t) || order->size != header->n_items * sizeof(S)) {
+      set_error_from_string(error, "Index file header is corrupt");
+      return false;
     }
+    _id_map.load((const uint64_t*)(data + ids->offset), (const S*)(data + order->offset), _n_items);
+    return true;
+  }
 
-    threaded_build_policy.lock_n_nodes();
-    _allocate_size(_n_nodes + 1, threaded_build_policy);
-    S item = _n_nodes++;
-    threaded_build_policy.unlock_n_nodes();
-
-    threaded_build_policy.lock_shared_nodes();
-    memcpy(_get(item), m, _s);
-    threaded_build_policy.unlock_shared_nodes();
+  bool _load_payloads(const AnnoyFileHeader* header, char** error) {
+    const uint8_t* data = (const uint8_t*)header;
+    const AnnoyFileSection* offsets = annoy_find_file_section(header, ANNOY_SECTION_PAYLOAD_OFFSETS);
+    const AnnoyFileSection* blob = annoy_find_file_section(header, ANNOY_SECTION_PAYLOADS);
+    if (!offsets && !blob)
+      return true;
+    if (!offsets || !blob || offsets->size != (header->n_items + 1) * sizeof(uint64_t)) {
+      set_error_from_string(error, "Index file header is corrupt");
+      return false;
+    }
+    _payloads.load((const uint64_t*)(data + offsets->offset), data + blob->offset, blob->size, _n_items);
+    return true;
+  }
 
-    return item;
+  bool _load_compact(const AnnoyFileHeader* header, char** error) {
+    const uint8_t* data = (const uint8_t*)header;
+    const AnnoyFileSection* items = annoy_find_file_section(header, ANNOY_SECTION_ITEMS);
+    const AnnoyFileSection* splits = annoy_find_file_section(header, ANNOY_SECTION_SPLITS);
+    const AnnoyFileSection* leaves = annoy_find_file_section(header, ANNOY_SECTION_LEAVES);
+    if (!splits || !leaves || items->size != header->n_items * _s || splits->size % _s || leaves->size % sizeof(S) ||
+        header->n_items + splits->size / _s + leaves->size / sizeof(S) != header->n_nodes) {
+      set_error_from_string(error, "Index file header is corrupt");
+      return false;
+    }
+    _compact = true;
+    _n_splits = (S)(splits->size / _s);
+    _splits = data + splits->offset;
+    _leaves = (const S*)(data + leaves->offset);
+    _data_offset = items->offset;
+    _nodes = (uint8_t*)_nodes + _data_offset;
+    return true;
   }
 
-  void _get_all_nns(const T* v, size_t n, int search_k, vector<S>* result, vector<T>* distances, const char* filter_type=nullptr, vector<int>* filter_vector=nullptr) const {
+  void _get_all_nns(const T* v, size_t n, int search_k, vector<S>* result, vector<DT>* distances, const AnnoyFilter<S>* filter=nullptr) const {
     Node* v_node = (Node *)alloca(_s);
     D::template zero_value<Node>(v_node);
     memcpy(v_node->v, v, sizeof(T) * _f);
     D::init_node(v_node, _f);
 
-    std::priority_queue<pair<T, S> > q;
+    std::priority_queue<pair<DT, S> > q;
 
     if (search_k == -1) {
       search_k = n * _roots.size();
     }
+#ifdef ANNOYLIB_QUERY_STATS
+    annoy_query_stats() = AnnoyQueryStats();
+    annoy_query_stats().n_queries = 1;
+    annoy_query_stats().search_k = search_k;
+#endif
 
     for (size_t i = 0; i < _roots.size(); i++) {
-      q.push(make_pair(Distance::template pq_initial_value<T>(), _roots[i]));
+      q.push(make_pair(Distance::template pq_initial_value<DT>(), _roots[i]));
     }
 
+    // Only items that pass the filter, and haven't been removed, are
+    // collected, and so count towards search_k. With a restrictive filter
+    // this keeps descending until enough candidates are found, or every tree
+    // has been searched.
     std::vector<S> nns;
     while (nns.size() < (size_t)search_k && !q.empty()) {
-      const pair<T, S>& top = q.top();
-      T d = top.first;
+      const pair<DT, S>& top = q.top();
+      DT d = top.first;
       S i = top.second;
-      Node* nd = _get(i);
       q.pop();
-      if (nd->n_descendants == 1 && i < _n_items) {
-        nns.push_back(i);
-      } else if (nd->n_descendants <= _K) {
-        const S* dst = nd->children;
-        nns.insert(nns.end(), dst, &dst[nd->n_descendants]);
+      S item;
+      const S* dst = NULL;
+      S n_dst = 0;
+      const Node* nd = _get_split(i, &item, &dst, &n_dst);
+      ANNOY_QUERY_STAT(n_nodes, 1);
+      if (nd == NULL) {
+        ANNOY_QUERY_STAT(n_leaves, 1);
+        if (filter || _removed.size()) {
+          for (S k = 0; k < n_dst; k++) {
+            if (!_removed.contains(dst[k]) && (!filter || filter->accepts(dst[k])))
+              nns.push_back(dst[k]);
+          }
+        } else {
+          nns.insert(nns.end(), dst, &dst[n_dst]);
+        }
       } else {
-        T margin = D::margin(nd, v, _f);
+        DT margin = D::margin(nd, v, _f);
+        // One of these is likely to be popped next, so start loading both
+        _prefetch_node(nd->children[1]);
+        _prefetch_node(nd->children[0]);
         q.push(make_pair(D::pq_distance(d, margin, 1), static_cast<S>(nd->children[1])));
         q.push(make_pair(D::pq_distance(d, margin, 0), static_cast<S>(nd->children[0])));
       }
     }
 
     // Get distances for all items
-    // To avoid calculating distance multiple times for any items, sort by id
-    std::sort(nns.begin(), nns.end());
-    vector<pair<T, S> > nns_dist;
-    S last = -1;
-    for (size_t i = 0; i < nns.size(); i++) {
-      S j = nns[i];
-      if (j == last)
-        continue;
-      last = j;
-      if (_get(j)->n_descendants == 1)  // This is only to guard a really obscure case, #284
-        nns_dist.push_back(make_pair(D::distance(v_node, _get(j), _f), j));
+    // To avoid calculating distance multiple times for any items, drop duplicates first
+    ANNOY_QUERY_STAT(n_candidates, nns.size());
+    _remove_duplicates(&nns);
+    ANNOY_QUERY_STAT(n_duplicates, annoy_query_stats().n_candidates - nns.size());
+    vector<pair<DT, S> > nns_dist;
+    nns_dist.reserve(nns.size());
+    if (_quantized.empty()) {
+      _get_distances(v_node, nns, &nns_dist);
+    } else {
+      _get_quantized_distances(v_node, nns, n, &nns_dist);
     }
 
     size_t m = nns_dist.size();
-    bool do_filter = filter_type != nullptr && filter_vector != nullptr;
-    bool is_exclude = do_filter && strcmp(filter_type, "exclude") == 0;
-    bool is_include = do_filter && strcmp(filter_type, "include") == 0;
-    size_t filter_size = do_filter ? filter_vector->size() : 0;
-    size_t p = is_include && filter_size < n ? filter_size : n;
-    if (is_exclude) {
-      std::sort(nns_dist.begin(), nns_dist.end());
+    size_t p = n < m ? n : m; // Return this many items
+    std::partial_sort(nns_dist.begin(), nns_dist.begin() + p, nns_dist.end());
+    for (size_t i = 0; i < p; i++) {
+      if (distances)
+        distances->push_back(D::normalized_distance(nns_dist[i].first));
+      result->push_back(nns_dist[i].second);
+    }
+#ifdef ANNOYLIB_QUERY_STATS
+    _stats.add(annoy_query_stats());
+#endif
+  }
+
+  const Node* _get_split(S i, S* item, const S** leaf, S* n_leaf) const {
+    // Looks up node i of a tree. Split nodes are returned, and for items and
+    // buckets this returns NULL and points *leaf at the *n_leaf items in it
+    // (*item holds an item's own id).
+    if (_compact) {
+      if (i >= _n_items) {
+        S k = i - _n_items;
+        if (k < _n_splits)
+          return get_node_ptr<S, Node>(_splits, _s, k);
+        const S* bucket = _leaves + (k - _n_splits);
+        *leaf = bucket + 1;
+        *n_leaf = bucket[0];
+        return NULL;
+      }
+    } else {
+      const Node* nd = _get(i);
+      if (nd->n_descendants != 1 || i >= _n_items) {
+        if (nd->n_descendants > _K)
+          return nd;
+        *leaf = nd->children;
+        *n_leaf = nd->n_descendants;
+        return NULL;
+      }
+    }
+    *item = i;
+    *leaf = item;
+    *n_leaf = 1;
+    return NULL;
+  }
+
+  void _prefetch_node(S i) const {
+    if (_compact && i >= _n_items) {
+      S k = i - _n_items;
+      if (k < _n_splits)
+        annoy_prefetch(get_node_ptr<S, Node>(_splits, _s, k), _s);
+      else
+        annoy_prefetch(_leaves + (k - _n_splits), sizeof(S));
     } else {
-      std::partial_sort(nns_dist.begin(), nns_dist.begin() + p, nns_dist.end());
+      annoy_prefetch(_get(i), _s);
     }
-    size_t result_count = 0;
-    for (size_t i = 0; i < m && result_count < p; ++i) {
-      if (is_exclude &&
-          std::find(filter_vector->begin(), filter_vector->end(), nns_dist[i].second) != filter_vector->end()) {
+  }
+
+  void _remove_duplicates(vector<S>* nns) const {
+    // Keeps the first of each id in nns, using a bitset over the items. The
+    // bitset belongs to the thread and is cleared again before returning, so
+    // it costs nothing per query once it has grown to fit the index.
+    static thread_local vector<uint64_t> visited;
+    size_t n_words = (size_t)_n_items / 64 + 1;
+    if (visited.size() < n_words)
+      visited.resize(n_words, 0);
+
+    size_t m = 0;
+    for (size_t i = 0; i < nns->size(); i++) {
+      S j = (*nns)[i];
+      if (j < 0 || j >= _n_items)
         continue;
+      uint64_t mask = (uint64_t)1 << ((size_t)j % 64);
+      uint64_t& word = visited[(size_t)j / 64];
+      if (!(word & mask)) {
+        word |= mask;
+        (*nns)[m++] = j;
+      }
+    }
+    nns->resize(m);
+    for (size_t i = 0; i < m; i++)
+      visited[(size_t)(*nns)[i] / 64] = 0;
+  }
+
+  size_t _scan_exact(const Node* v_node, size_t n, S begin, S end, const AnnoyFilter<S>* filter, vector<pair<DT, S> >* heap) const {
+    // Scores the items from begin to end ANNOY_DISTANCE_BATCH at a time,
+    // keeping the n nearest in heap, a max-heap, so the worst of them is the
+    // one to replace. Returns how many items were scored.
+    Node* batch[ANNOY_DISTANCE_BATCH];
+    S ids[ANNOY_DISTANCE_BATCH];
+    DT dists[ANNOY_DISTANCE_BATCH];
+    size_t n_scored = 0;
+    if (n == 0)
+      return 0;
+    for (S i = begin; i < end; ) {
+      int m = 0;
+      for (; i < end && m < ANNOY_DISTANCE_BATCH; i++) {
+        Node* nd = _get(i);
+        if (nd->n_descendants == 1 && !_removed.contains(i) && (!filter || filter->accepts(i))) {
+          batch[m] = nd;
+          ids[m++] = i;
+        }
       }
-      if (is_include &&
-          std::find(filter_vector->begin(), filter_vector->end(), nns_dist[i].second) == filter_vector->end()) {
+      if (m == 0)
         continue;
+      D::distance_batch(v_node, batch, m, _f, dists);
+      n_scored += m;
+      for (int k = 0; k < m; k++) {
+        pair<DT, S> candidate = make_pair(dists[k], ids[k]);
+        if (heap->size() < n) {
+          heap->push_back(candidate);
+          std::push_heap(heap->begin(), heap->end());
+        } else if (candidate < heap->front()) {
+          std::pop_heap(heap->begin(), heap->end());
+          heap->back() = candidate;
+          std::push_heap(heap->begin(), heap->end());
+        }
       }
-      if (distances)
-        distances->push_back(D::normalized_distance(nns_dist[i].first));
-      result->push_back(nns_dist[i].second);
-      ++result_count;
     }
+    return n_scored;
+  }
+
+  void _get_distances(const Node* v_node, const vector<S>& nns, vector<pair<DT, S> >* nns_dist) const {
+    // Scores the candidates ANNOY_DISTANCE_BATCH at a time, prefetching the
+    // nodes of the next batch while the current one is scored.
+    Node* batch[ANNOY_DISTANCE_BATCH];
+    S ids[ANNOY_DISTANCE_BATCH];
+    DT dists[ANNOY_DISTANCE_BATCH];
+    for (size_t i = 0; i < nns.size() && i < ANNOY_DISTANCE_BATCH; i++)
+      annoy_prefetch(_get(nns[i]), _s);
+    for (size_t i = 0; i < nns.size(); i += ANNOY_DISTANCE_BATCH) {
+      size_t end = std::min(nns.size(), i + ANNOY_DISTANCE_BATCH);
+      for (size_t k = end; k < nns.size() && k < end + ANNOY_DISTANCE_BATCH; k++)
+        annoy_prefetch(_get(nns[k]), _s);
+      int m = 0;
+      for (size_t k = i; k < end; k++) {
+        Node* nd = _get(nns[k]);
+        if (nd->n_descendants == 1) {  // This is only to guard a really obscure case, #284
+          batch[m] = nd;
+          ids[m++] = nns[k];
+        }
+      }
+      D::distance_batch(v_node, batch, m, _f, dists);
+      ANNOY_QUERY_STAT(n_distances, m);
+      for (int k = 0; k < m; k++)
+        nns_dist->push_back(make_pair(dists[k], ids[k]));
+    }
+  }
+
+  void _get_quantized_distances(const Node* v_node, const vector<S>& nns, size_t n, vector<pair<DT, S> >* nns_dist) const {
+    // Scores the candidates in nns by decoding each one's codes into a node,
+    // then re-scores the best of them with the full vectors.
+    Node* c_node = (Node *)alloca(_s);
+    D::template zero_value<Node>(c_node);
+    for (size_t i = 0; i < nns.size(); i++) {
+      S j = nns[i];
+      if ((size_t)j >= _quantized.get_n_items())  // Added after quantize, or not an item
+        continue;
+      _quantized.decode(j, c_node->v);
+      D::init_node(c_node, _f);
+      nns_dist->push_back(make_pair(D::distance(v_node, c_node, _f), j));
+    }
+    ANNOY_QUERY_STAT(n_distances, nns_dist->size());
+
+    if (_rerank < 0)
+      return;
+    size_t k = std::min(std::max(n, (size_t)_rerank), nns_dist->size());
+    std::partial_sort(nns_dist->begin(), nns_dist->begin() + k, nns_dist->end());
+    nns_dist->resize(k);
+    for (size_t i = 0; i < k; i++) {
+      S j = (*nns_dist)[i].second;
+      (*nns_dist)[i].first = D::distance(v_node, _get(j), _f);
+    }
+    ANNOY_QUERY_STAT(n_distances, k);
   }
 };
 
 class AnnoyIndexSingleThreadedBuildPolicy {
 public:
+  static const int node_ids_per_allocation = 1;
+
   template<typename S, typename T, typename D, typename Random>
   static void build(AnnoyIndex<S, T, D, Random, AnnoyIndexSingleThreadedBuildPolicy>* annoy, int q, int n_threads) {
     AnnoyIndexSingleThreadedBuildPolicy threaded_build_policy;
     annoy->thread_build(q, 0, threaded_build_policy);
   }
 
-  void lock_n_nodes() {}
-  void unlock_n_nodes() {}
-
-  void lock_nodes() {}
-  void unlock_nodes() {}
+  template<typename S, typename T, typename D, typename Random>
+  static void add_items(AnnoyIndex<S, T, D, Random, AnnoyIndexSingleThreadedBuildPolicy>* annoy, S first_item, const T* w, S n_rows, int n_threads) {
+    annoy->add_items_range(first_item, w, 0, n_rows);
+  }
 
-  void lock_shared_nodes() {}
-  void unlock_shared_nodes() {}
+  template<typename S, typename T, typename D, typename Random>
+  static void insert_items(AnnoyIndex<S, T, D, Random, AnnoyIndexSingleThreadedBuildPolicy>* annoy, S first_item, int n_threads) {
+    AnnoyIndexSingleThreadedBuildPolicy threaded_build_policy;
+    annoy->thread_insert_items(first_item, 0, 1, threaded_build_policy);
+  }
 
   void lock_roots() {}
   void unlock_roots() {}
 };
 
 #ifdef ANNOYLIB_MULTITHREADED_BUILD
+template<typename Task>
+class AnnoyWorkStealingQueues {
+  /*
+   * A queue of tasks for each thread. Threads push and pop tasks at the back
+   * of their own queue, and when it's empty, take them from the front of the
+   * others' queues, where the oldest and usually biggest tasks are.
+   */
+public:
+  AnnoyWorkStealingQueues(int n_threads) : _queues(n_threads), _pending(0) {
+  }
+
+  void push(int thread_idx, Task& task) {
+    begin_task();
+    Queue& queue = _queues[thread_idx];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    queue.tasks.push_back(Task());
+    std::swap(queue.tasks.back(), task);
+  }
+
+  bool pop(int thread_idx, Task* task) {
+    {
+      Queue& queue = _queues[thread_idx];
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      if (!queue.tasks.empty()) {
+        std::swap(*task, queue.tasks.back());
+        queue.tasks.pop_back();
+        return true;
+      }
+    }
+    for (size_t i = 1; i < _queues.size(); i++) {
+      Queue& queue = _queues[(thread_idx + i) % _queues.size()];
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      if (!queue.tasks.empty()) {
+        std::swap(*task, queue.tasks.front());
+        queue.tasks.pop_front();
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // A task is pending from when it's pushed (or started without being
+  // pushed) until end_task is called for it, including while it runs and
+  // might push more.
+  void begin_task() {
+    _pending++;
+  }
+  void end_task() {
+    _pending--;
+  }
+  bool finished() const {
+    return _pending == 0;
+  }
+
+private:
+  struct Queue {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+  };
+  vector<Queue> _queues;
+  std::atomic<int64_t> _pending;
+};
+
 class AnnoyIndexMultiThreadedBuildPolicy {
 private:
-  std::shared_timed_mutex nodes_mutex;
-  std::mutex n_nodes_mutex;
   std::mutex roots_mutex;
 
 public:
+  // Each thread reserves this many node ids at a time, so that threads
+  // rarely touch the same counter.
+  static const int node_ids_per_allocation = 64;
+
   template<typename S, typename T, typename D, typename Random>
   static void build(AnnoyIndex<S, T, D, Random, AnnoyIndexMultiThreadedBuildPolicy>* annoy, int q, int n_threads) {
+    // The threads build the trees together, splitting big subtrees between
+    // them (see AnnoyIndex::thread_build_tasks), so they can all be busy
+    // even with fewer trees than threads.
+    typedef AnnoyIndex<S, T, D, Random, AnnoyIndexMultiThreadedBuildPolicy> Index;
     AnnoyIndexMultiThreadedBuildPolicy threaded_build_policy;
     if (n_threads == -1) {
       // If the hardware_concurrency() value is not well defined or not computable, it returns 0.
@@ -1504,17 +5033,43 @@ public:
       n_threads = std::max(1, (int)std::thread::hardware_concurrency());
     }
 
+    AnnoyWorkStealingQueues<typename Index::BuildTask> tasks(n_threads);
+    std::atomic<int> n_trees(0);
     vector<std::thread> threads(n_threads);
 
     for (int thread_idx = 0; thread_idx < n_threads; thread_idx++) {
-      int trees_per_thread = q == -1 ? -1 : (int)floor((q + thread_idx) / n_threads);
+      threads[thread_idx] = std::thread([&, thread_idx]() {
+        annoy->thread_build_tasks(q, thread_idx, tasks, n_trees, threaded_build_policy);
+      });
+    }
+
+    for (auto& thread : threads) {
+      thread.join();
+    }
+  }
+
+  template<typename S, typename T, typename D, typename Random>
+  static void add_items(AnnoyIndex<S, T, D, Random, AnnoyIndexMultiThreadedBuildPolicy>* annoy, S first_item, const T* w, S n_rows, int n_threads) {
+    if (n_threads == -1) {
+      n_threads = std::max(1, (int)std::thread::hardware_concurrency());
+    }
+    // Copying rows is cheap, so don't start a thread for fewer than this many.
+    const S min_rows_per_thread = 1024;
+    n_threads = std::max(1, std::min(n_threads, (int)(n_rows / min_rows_per_thread)));
+
+    vector<std::thread> threads(n_threads);
+
+    for (int thread_idx = 0; thread_idx < n_threads; thread_idx++) {
+      S begin = (S)((int64_t)n_rows * thread_idx / n_threads);
+      S end = (S)((int64_t)n_rows * (thread_idx + 1) / n_threads);
 
       threads[thread_idx] = std::thread(
-        &AnnoyIndex<S, T, D, Random, AnnoyIndexMultiThreadedBuildPolicy>::thread_build,
+        &AnnoyIndex<S, T, D, Random, AnnoyIndexMultiThreadedBuildPolicy>::add_items_range,
         annoy,
-        trees_per_thread,
-        thread_idx,
-        std::ref(threaded_build_policy)
+        first_item,
+        w,
+        begin,
+        end
       );
     }
 
@@ -1523,25 +5078,26 @@ public:
     }
   }
 
-  void lock_n_nodes() {
-    n_nodes_mutex.lock();
-  }
-  void unlock_n_nodes() {
-    n_nodes_mutex.unlock();
-  }
+  template<typename S, typename T, typename D, typename Random>
+  static void insert_items(AnnoyIndex<S, T, D, Random, AnnoyIndexMultiThreadedBuildPolicy>* annoy, S first_item, int n_threads) {
+    // Each thread takes whole trees
+    AnnoyIndexMultiThreadedBuildPolicy threaded_build_policy;
+    if (n_threads == -1) {
+      n_threads = std::max(1, (int)std::thread::hardware_concurrency());
+    }
+    n_threads = std::max(1, std::min(n_threads, (int)annoy->get_n_trees()));
 
-  void lock_nodes() {
-    nodes_mutex.lock();
-  }
-  void unlock_nodes() {
-    nodes_mutex.unlock();
-  }
+    vector<std::thread> threads(n_threads);
 
-  void lock_shared_nodes() {
-    nodes_mutex.lock_shared();
-  }
-  void unlock_shared_nodes() {
-    nodes_mutex.unlock_shared();
+    for (int thread_idx = 0; thread_idx < n_threads; thread_idx++) {
+      threads[thread_idx] = std::thread([&, thread_idx]() {
+        annoy->thread_insert_items(first_item, thread_idx, n_threads, threaded_build_policy);
+      });
+    }
+
+    for (auto& thread : threads) {
+      thread.join();
+    }
   }
 
   void lock_roots() {
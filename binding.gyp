@@ -2,13 +2,15 @@
   "targets": [
     {
       "target_name": "addon",
-      "sources": [ "addon.cc", "annoyindexwrapper.cc" ],
+      "sources": [ "addon.cc", "annoyindexwrapper.cc", "annoyindexworkers.cc", "annoyfilterwrapper.cc" ],
       "include_dirs": [
         "<!(node -e \"require('nan')\")"
       ],
       "defines": [
         # Comment out the next line for single threaded builds
-        "ANNOYLIB_MULTITHREADED_BUILD"
+        "ANNOYLIB_MULTITHREADED_BUILD",
+        # Uncomment the next line to count what queries cost (see getStats)
+        # "ANNOYLIB_QUERY_STATS",
       ]
     }
   ]
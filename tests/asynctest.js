@@ -0,0 +1,189 @@
+/* global __dirname */
+
+var test = require('tape');
+var fs = require('fs');
+var Annoy = require('../index');
+
+var annoyPath = __dirname + '/data/test-async.annoy';
+var vectorsPath = __dirname + '/data/test-stream.f32';
+var streamedPath = __dirname + '/data/test-stream.annoy';
+
+var items = [
+  [-5.0, -4.5, -3.2, -2.8, -2.1, -1.5, -0.34, 0, 3.7, 6],
+  [5.0, 4.5, 3.2, 2.8, 2.1, 1.5, 0.34, 0, -3.7, -6],
+  [0, 0, 0, 0, 0, -1, -1, -0.2, 0.1, 0.8]
+];
+
+test('buildAsync promise test', buildAsyncPromiseTest);
+test('buildAsync callback test', buildAsyncCallbackTest);
+test('getNNsByVectorBatch test', batchTest);
+test('buildFromFile test', buildFromFileTest);
+
+function makeIndex() {
+  var obj = new Annoy(10, 'Angular');
+  items.forEach((item, i) => obj.addItem(i, item));
+  return obj;
+}
+
+function buildAsyncPromiseTest(t) {
+  var obj = makeIndex();
+  var promise = obj.buildAsync(10, 2);
+
+  t.ok(promise instanceof Promise, 'buildAsync returns a promise.');
+  t.throws(
+    () => obj.addItem(3, items[0]),
+    /busy building/,
+    'addItem is refused while building.'
+  );
+  t.throws(
+    () => obj.getNNsByVector(items[0], 2),
+    /busy building/,
+    'getNNsByVector is refused while building.'
+  );
+  t.equal(obj.getNItems(), 3, 'getNItems still works while building.');
+
+  promise.then(checkBuilt, t.end);
+
+  function checkBuilt() {
+    var neighbors = obj.getNNsByItem(0, 3);
+    t.equal(neighbors.length, 3, 'Built index can be queried.');
+    t.ok(obj.save(annoyPath), 'Saved successfully.');
+    obj.unload();
+    t.end();
+  }
+}
+
+function buildAsyncCallbackTest(t) {
+  var obj = makeIndex();
+  obj.buildAsync(10, -1, checkBuilt);
+
+  function checkBuilt(error) {
+    t.error(error, 'No error from build.');
+    obj.buildAsync(10).then(
+      () => t.fail('Building a built index should fail.'),
+      (error) => {
+        t.ok(error instanceof Error, 'Rebuilding rejects with an error.');
+        t.end();
+      }
+    );
+  }
+}
+
+function batchTest(t) {
+  var obj = makeIndex();
+  obj.build();
+
+  var queries = new Float32Array(items[0].concat(items[1], items[2]));
+  var promise = obj.getNNsByVectorBatch(queries, 2, -1);
+
+  t.throws(
+    () => obj.unload(),
+    /busy answering queries/,
+    'unload is refused while a batch is running.'
+  );
+  t.equal(
+    obj.getNNsByVector(items[0], 1)[0],
+    0,
+    'Single queries still work while a batch is running.'
+  );
+
+  promise.then(checkResults, t.end);
+
+  function checkResults(result) {
+    t.ok(result.neighbors instanceof Int32Array, 'Neighbors is an Int32Array.');
+    t.ok(
+      result.distances instanceof Float32Array,
+      'Distances is a Float32Array.'
+    );
+    t.equal(result.neighbors.length, 6, 'There are n slots per query.');
+    for (var i = 0; i < items.length; ++i) {
+      var expected = obj.getNNsByVector(items[i], 2, -1, true);
+      t.deepEqual(
+        Array.from(result.neighbors.slice(i * 2, i * 2 + 2)),
+        expected.neighbors,
+        'Batch neighbors match getNNsByVector for query ' + i
+      );
+    }
+    t.throws(
+      () => obj.getNNsByVectorBatch(new Float32Array(11), 2),
+      /multiple of the index dimensions/,
+      'Queries must be a whole number of vectors.'
+    );
+    t.throws(
+      () => obj.getNNsByVectorBatch(queries, NaN),
+      /Expected n as a non-negative integer/,
+      'n must be an integer.'
+    );
+    t.throws(
+      () => obj.getNNsByVectorBatch(queries, 2, -2),
+      /Expected searchK as an integer of at least -1/,
+      'searchK must be -1 or more.'
+    );
+    obj.getNNsByVectorBatch(queries, 1e9).then((capped) => {
+      t.equal(capped.neighbors.length, 9, 'n is capped at the number of items.');
+      t.end();
+    }, t.end);
+  }
+}
+
+function buildFromFileTest(t) {
+  var dimensions = 10;
+  var count = 500;
+  var vectors = new Float32Array(dimensions * count);
+  for (var i = 0; i < vectors.length; ++i) {
+    vectors[i] = Math.sin(i * 12.9898) * 43758.5453 % 1;
+  }
+  fs.writeFileSync(vectorsPath, Buffer.from(vectors.buffer));
+
+  var obj = new Annoy(dimensions, 'Euclidean');
+  // A small memory limit, so the ids are split through temporary files.
+  var promise = obj.buildFromFile(vectorsPath, streamedPath, 5, 1000);
+
+  t.ok(promise instanceof Promise, 'buildFromFile returns a promise.');
+  t.throws(
+    () => obj.getNNsByItem(0, 1),
+    /busy building/,
+    'getNNsByItem is refused while building.'
+  );
+
+  promise.then(checkBuilt, t.end);
+
+  function checkBuilt() {
+    t.equal(obj.getNItems(), count, 'Every vector in the file is an item.');
+    t.deepEqual(
+      obj.getItem(7),
+      Array.from(vectors.slice(7 * dimensions, 8 * dimensions)),
+      'Items have the vectors from the file.'
+    );
+    var found = 0;
+    for (var i = 0; i < count; ++i) {
+      if (obj.getNNsByItem(i, 1, -1)[0] === i) {
+        found += 1;
+      }
+    }
+    t.equal(found, count, 'Every item is in the trees.');
+
+    var loaded = new Annoy(dimensions, 'Euclidean');
+    t.ok(loaded.load(streamedPath), 'The index file loads.');
+    t.deepEqual(
+      loaded.getNNsByItem(3, 10),
+      obj.getNNsByItem(3, 10),
+      'The loaded index gives the same results.'
+    );
+
+    obj.buildFromFile(vectorsPath, streamedPath, 5).then(
+      () => t.fail('Building into an index with items should fail.'),
+      (error) => {
+        t.ok(/already has items/.test(error.message), 'A second build is refused.');
+        fs.writeFileSync(vectorsPath, Buffer.alloc(6));
+        new Annoy(dimensions, 'Euclidean').buildFromFile(vectorsPath, streamedPath, 5, null, checkTruncated);
+      }
+    );
+  }
+
+  function checkTruncated(error) {
+    t.ok(error && /multiple of the vector size/.test(error.message), 'A partial vector is refused.');
+    fs.unlinkSync(vectorsPath);
+    t.end();
+  }
+}
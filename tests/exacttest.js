@@ -0,0 +1,121 @@
+var test = require('tape');
+var Annoy = require('../index');
+
+var dimensions = 8;
+var itemCount = 2000;
+
+test('Exact search test', exactTest);
+test('Exact threshold test', thresholdTest);
+
+function itemVector(i) {
+  var vector = [];
+  for (var j = 0; j < dimensions; ++j) {
+    vector.push(Math.sin(i * (j + 1)));
+  }
+  return vector;
+}
+
+function makeIndex(build) {
+  var obj = new Annoy(dimensions, 'Euclidean');
+  for (var i = 0; i < itemCount; ++i) {
+    obj.addItem(i, itemVector(i));
+  }
+  if (build) {
+    obj.build(2);
+  }
+  return obj;
+}
+
+function bruteForce(query, n, accepts) {
+  var all = [];
+  for (var i = 0; i < itemCount; ++i) {
+    if (accepts && !accepts(i)) {
+      continue;
+    }
+    var vector = itemVector(i);
+    var sum = 0;
+    for (var j = 0; j < dimensions; ++j) {
+      sum += (query[j] - vector[j]) * (query[j] - vector[j]);
+    }
+    all.push({ item: i, distance: Math.sqrt(sum) });
+  }
+  all.sort(function (a, b) { return a.distance - b.distance; });
+  return all.slice(0, n);
+}
+
+function checkResult(t, result, expected, message) {
+  t.deepEqual(
+    result.neighbors,
+    expected.map(function (e) { return e.item; }),
+    message + ': neighbors match brute force.'
+  );
+  t.ok(
+    result.distances.every(function (d, i) { return Math.abs(d - expected[i].distance) < 1e-4; }),
+    message + ': distances match brute force.'
+  );
+}
+
+function exactTest(t) {
+  var query = [0.5, -0.5, 0.25, 0, 1, -1, 0.75, 0.1];
+  var expected = bruteForce(query, 10);
+
+  var unbuilt = makeIndex(false);
+  checkResult(t, unbuilt.getNNsExact(query, 10, -1, true), expected, 'Unbuilt index');
+
+  var obj = makeIndex(true);
+  checkResult(t, obj.getNNsExact(query, 10, 1, true), expected, 'Built index with searchK 1');
+  t.deepEqual(
+    obj.getNNsExact(query, 10),
+    expected.map(function (e) { return e.item; }),
+    'Without distances, the neighbors are an array.'
+  );
+
+  checkResult(
+    t,
+    obj.getNNsExact(query, 5, -1, true, 'include', obj.createFilter([1, 3, 5, 7, 9, 11, 13])),
+    bruteForce(query, 5, function (i) { return i % 2 === 1 && i < 14; }),
+    'Include filter'
+  );
+
+  obj.removeItem(expected[0].item);
+  t.equal(
+    obj.getNNsExact(query, 10).indexOf(expected[0].item),
+    -1,
+    'Removed items are not found.'
+  );
+  t.end();
+}
+
+function thresholdTest(t) {
+  var obj = makeIndex(true);
+  var query = itemVector(17);
+  var expected = bruteForce(query, 20);
+
+  t.throws(function () { obj.setExactThreshold(-1); }, /negative/, 'A negative threshold throws.');
+
+  obj.setExactThreshold(itemCount + 1);
+  checkResult(t, obj.getNNsByVector(query, 20, 1, true), expected, 'getNNsByVector below the threshold');
+  checkResult(t, obj.getNNsByItem(17, 20, 1, true), expected, 'getNNsByItem below the threshold');
+
+  var queries = new Float32Array(query.concat(itemVector(99)));
+  obj.getNNsByVectorBatch(queries, 20, 1, function (error, result) {
+    t.error(error, 'No error from the batch.');
+    t.deepEqual(
+      Array.from(result.neighbors.subarray(0, 20)),
+      expected.map(function (e) { return e.item; }),
+      'getNNsByVectorBatch below the threshold is exact.'
+    );
+    t.deepEqual(
+      Array.from(result.neighbors.subarray(20)),
+      bruteForce(itemVector(99), 20).map(function (e) { return e.item; }),
+      'Each query in the batch is exact.'
+    );
+
+    obj.setExactThreshold(0);
+    t.ok(
+      obj.getNNsByVector(query, 20, 1).length < 20,
+      'With the threshold off, searchK limits the search again.'
+    );
+    t.end();
+  });
+}
@@ -0,0 +1,78 @@
+var test = require('tape');
+var Annoy = require('../index');
+
+var dimensions = 10;
+var itemCount = 1000;
+
+test('Filter test', filterTest);
+
+function makeIndex() {
+  var obj = new Annoy(dimensions, 'Euclidean');
+  var matrix = new Float32Array(dimensions * itemCount);
+  for (var i = 0; i < itemCount; ++i) {
+    for (var j = 0; j < dimensions; ++j) {
+      matrix[i * dimensions + j] = Math.sin(i * (j + 1));
+    }
+  }
+  obj.addItems(matrix);
+  obj.build(10);
+  return obj;
+}
+
+function filterTest(t) {
+  var obj = makeIndex();
+  var evens = [];
+  for (var i = 0; i < itemCount; i += 2) {
+    evens.push(i);
+  }
+  var filter = obj.createFilter(new Int32Array(evens));
+  t.equal(filter.size(), evens.length, 'Filter holds all the ids.');
+  t.equal(
+    obj.createFilter([0, 2, itemCount, 2147483647]).size(),
+    2,
+    'Ids outside the index are left out of a filter.'
+  );
+
+  var excluded = obj.getNNsByItem(0, 10, 1000, false, 'exclude', filter);
+  t.equal(excluded.length, 10, 'Exclude filter returns n results.');
+  t.ok(
+    excluded.every(id => id % 2 === 1),
+    'Exclude filter drops the ids in the filter.'
+  );
+  t.deepEqual(
+    obj.getNNsByItem(0, 10, 1000, false, 'exclude', evens),
+    excluded,
+    'Filter handles and id arrays give the same results.'
+  );
+
+  var included = obj.getNNsByItem(0, 10, 1000, true, 'include', filter);
+  t.ok(
+    included.neighbors.every(id => id % 2 === 0),
+    'Include filter keeps only the ids in the filter.'
+  );
+  t.equal(included.neighbors[0], 0, 'Item is its own nearest neighbor.');
+
+  var fewIds = [];
+  for (var j = 0; j < itemCount; j += 100) {
+    fewIds.push(j);
+  }
+  var fewResults = obj.getNNsByItem(1, 5, -1, false, 'include', fewIds);
+  t.equal(
+    fewResults.length,
+    5,
+    'A restrictive include filter still returns n results.'
+  );
+  t.ok(
+    fewResults.every(id => id % 100 === 0),
+    'Restrictive include filter keeps only the ids in the filter.'
+  );
+
+  t.throws(
+    () => obj.getNNsByItem(0, 10, -1, false, 'only', filter),
+    /Expected 'include' or 'exclude'/,
+    'Unknown filter types are rejected.'
+  );
+
+  obj.unload();
+  t.end();
+}
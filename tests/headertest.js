@@ -0,0 +1,125 @@
+/* global __dirname */
+
+var test = require('tape');
+var fs = require('fs');
+var Annoy = require('../index');
+
+var annoyPath = __dirname + '/data/test-header.annoy';
+var legacyPath = __dirname + '/data/test-legacy.annoy';
+var compactPath = __dirname + '/data/test-compact.annoy';
+
+var items = [
+  [-5.0, -4.5, -3.2, -2.8, -2.1, -1.5, -0.34, 0, 3.7, 6],
+  [5.0, 4.5, 3.2, 2.8, 2.1, 1.5, 0.34, 0, -3.7, -6],
+  [0, 0, 0, 0, 0, -1, -1, -0.2, 0.1, 0.8]
+];
+
+test('Save with header test', saveTest);
+test('Load from header test', loadFromHeaderTest);
+test('Header mismatch test', mismatchTest);
+test('Compact layout test', compactTest);
+
+function saveTest(t) {
+  var obj = new Annoy(10, 'Angular');
+  items.forEach((item, i) => obj.addItem(i, item));
+  obj.build(4);
+  t.ok(obj.save(legacyPath), 'Saved without a header.');
+  t.ok(obj.save(annoyPath, true), 'Saved with a header.');
+  t.equal(obj.getNItems(), 3, 'Index is reloaded after saving.');
+  obj.unload();
+
+  t.equal(
+    fs.readFileSync(annoyPath).toString('latin1', 0, 8),
+    'ANNOYIDX',
+    'File starts with the header.'
+  );
+  t.notEqual(
+    fs.readFileSync(legacyPath).toString('latin1', 0, 8),
+    'ANNOYIDX',
+    'Header is opt-in.'
+  );
+  t.end();
+}
+
+function loadFromHeaderTest(t) {
+  var obj = new Annoy();
+  t.ok(obj.load(annoyPath), 'Loads without knowing the dimensions or metric.');
+  t.equal(obj.getNItems(), 3, 'Number of items comes from the header.');
+  t.equal(obj.getItem(0).length, 10, 'Dimensions come from the header.');
+
+  var reference = new Annoy(10, 'Angular');
+  t.ok(reference.load(legacyPath), 'File without a header still loads.');
+  t.deepEqual(
+    obj.getNNsByVector(items[0], 3, -1, true),
+    reference.getNNsByVector(items[0], 3, -1, true),
+    'Both files give the same results.'
+  );
+
+  var buffer = fs.readFileSync(annoyPath);
+  var fromBuffer = new Annoy();
+  t.ok(
+    fromBuffer.load(
+      buffer.buffer.slice(buffer.byteOffset, buffer.byteOffset + buffer.length),
+      true
+    ),
+    'Loads from a buffer with a header.'
+  );
+  t.equal(fromBuffer.getNItems(), 3, 'Buffer index has all the items.');
+
+  obj.unload();
+  reference.unload();
+  fromBuffer.unload();
+  t.end();
+}
+
+function mismatchTest(t) {
+  t.notOk(
+    new Annoy(10, 'Euclidean').load(annoyPath),
+    'Loading with the wrong metric fails.'
+  );
+  t.notOk(
+    new Annoy(12, 'Angular').load(annoyPath),
+    'Loading with the wrong dimensions fails.'
+  );
+  t.end();
+}
+
+function compactTest(t) {
+  var obj = new Annoy(10, 'Euclidean');
+  for (var i = 0; i < 200; ++i) {
+    obj.addItem(i, items[0].map((x, j) => Math.sin(i * 10 + j)));
+  }
+  obj.build(10);
+  t.ok(obj.save(annoyPath, true), 'Saved with a header.');
+  // Search every tree to the bottom, so the results don't depend on the
+  // order nodes are visited in.
+  var expected = obj.getNNsByVector(items[2], 10, 10000, true);
+  t.ok(obj.save(compactPath, 'compact'), 'Saved with the compact layout.');
+  t.deepEqual(
+    obj.getNNsByVector(items[2], 10, 10000, true),
+    expected,
+    'Index is reloaded with the compact layout.'
+  );
+  obj.unload();
+
+  t.ok(
+    fs.statSync(compactPath).size < fs.statSync(annoyPath).size,
+    'Compact file is smaller.'
+  );
+  var compact = new Annoy();
+  t.ok(compact.load(compactPath), 'Compact file loads from its header.');
+  t.equal(compact.getNItems(), 200, 'Compact index has all the items.');
+  t.deepEqual(
+    compact.getNNsByVector(items[2], 10, 10000, true),
+    expected,
+    'Compact index gives the same results.'
+  );
+  t.ok(compact.save(annoyPath), 'Compact index saves again.');
+  compact.unload();
+  t.equal(
+    fs.readFileSync(annoyPath).compare(fs.readFileSync(compactPath)),
+    0,
+    'It stays compact.'
+  );
+  t.end();
+}
@@ -0,0 +1,88 @@
+/* global __dirname */
+
+var test = require('tape');
+var Annoy = require('../index');
+
+var annoyPath = __dirname + '/data/test-ids.annoy';
+
+var dimensions = 4;
+var bigId = 2n ** 63n + 5n;
+
+test('Add with ids test', addWithIdsTest);
+test('Saved ids test', savedIdsTest);
+
+function makeIndex() {
+  var obj = new Annoy(dimensions, 'Euclidean');
+  obj.addItemWithId(1000000000, [1, 0, 0, 0]);
+  obj.addItemWithId(bigId, [0, 1, 0, 0]);
+  obj.addItems(new Float32Array([0, 0, 1, 0, 0, 0, 0, 1]), [7, 123456789012]);
+  obj.build(5);
+  return obj;
+}
+
+function addWithIdsTest(t) {
+  var obj = makeIndex();
+  t.equal(obj.getNItems(), 4, 'Items get consecutive slots.');
+  t.equal(
+    obj.getNNsByVector([0, 1, 0, 0], 1)[0],
+    bigId,
+    'Ids above Number.MAX_SAFE_INTEGER come back as BigInts.'
+  );
+  t.deepEqual(
+    obj.getNNsByItem(7, 1),
+    [7],
+    'Items are looked up by id.'
+  );
+  t.equal(obj.getItem(123456789012)[3], 1, 'getItem takes an id.');
+  t.equal(
+    obj.getDistance(7, 1000000000).toPrecision(4),
+    Math.sqrt(2).toPrecision(4),
+    'getDistance takes ids.'
+  );
+  t.deepEqual(
+    obj.getNNsByVector([0, 1, 0, 0], 4, -1, false, 'include', [7, 8]),
+    [7],
+    'Filters hold ids.'
+  );
+  t.throws(
+    () => obj.getItem(8),
+    /No item has this id/,
+    'Unknown ids throw.'
+  );
+  t.throws(
+    () => obj.addItemWithId(7, [1, 1, 1, 1]),
+    /already added/,
+    'Ids can only be added once.'
+  );
+  t.throws(
+    () => obj.addItem(9, [1, 1, 1, 1]),
+    /external ids/,
+    'Items without ids can not be mixed in.'
+  );
+  obj.unload();
+  t.end();
+}
+
+function savedIdsTest(t) {
+  var obj = makeIndex();
+  t.ok(obj.save(annoyPath), 'Saved successfully.');
+  obj.unload();
+
+  var obj2 = new Annoy();
+  t.ok(obj2.load(annoyPath), 'Loads from the header.');
+  t.deepEqual(
+    obj2.getNNsByVector([0, 0, 1, 0], 1),
+    [7],
+    'Loaded index returns ids.'
+  );
+  obj2.getNNsByVectorBatch(new Float32Array([0, 1, 0, 0]), 5, -1).then((results) => {
+    t.ok(results.neighbors instanceof BigUint64Array, 'Batch neighbors are a BigUint64Array.');
+    t.equal(results.neighbors[0], bigId, 'Batch neighbors are ids.');
+    t.equal(results.neighbors[4], 2n ** 64n - 1n, 'Unused slots hold the largest id.');
+    obj2.unload();
+    t.end();
+  }, (error) => {
+    t.fail(error);
+    t.end();
+  });
+}
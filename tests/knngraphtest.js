@@ -0,0 +1,93 @@
+/* global __dirname */
+
+var test = require('tape');
+var fs = require('fs');
+var Annoy = require('../index');
+
+var graphPath = __dirname + '/data/test-knn-graph.bin';
+
+// Points on a line with different gaps, so no two neighbors tie.
+var points = [0, 1, 3, 7, 12, 18];
+var expectedGraph = [1, 2, 0, 2, 1, 0, 2, 4, 3, 5, 4, 3];
+
+test('k-NN graph test', graphTest);
+test('k-NN graph file test', graphFileTest);
+test('k-NN graph with ids test', graphIdsTest);
+
+function graphTest(t) {
+  var obj = new Annoy(2, 'Euclidean');
+  points.forEach((x, i) => obj.addItem(i, [x, 0]));
+  obj.build(4);
+
+  t.throws(() => obj.buildKnnGraph(0), /at least 1/, 'k of 0 throws.');
+  t.throws(() => obj.buildKnnGraph(NaN), /Expected k/, 'k must be an integer.');
+
+  obj.buildKnnGraph(2, 1000, 2).then(
+    (graph) => {
+      t.ok(graph.neighbors instanceof Int32Array, 'Neighbors are an Int32Array.');
+      t.ok(graph.distances instanceof Float32Array, 'Distances are a Float32Array.');
+      t.deepEqual(
+        Array.from(graph.neighbors),
+        expectedGraph,
+        'Each row holds the nearest other items.'
+      );
+      t.deepEqual(
+        Array.from(graph.distances.subarray(0, 4)),
+        [1, 3, 1, 2],
+        'Distances are to the neighbors.'
+      );
+
+      obj.buildKnnGraph(6, 1000).then((bigGraph) => {
+        t.equal(bigGraph.neighbors.length, 30, 'k is capped at the number of other items.');
+        t.notOk(bigGraph.neighbors.includes(-1), 'Every slot holds a neighbor.');
+        obj.unload();
+        t.end();
+      });
+    },
+    (error) => {
+      t.fail(error);
+      t.end();
+    }
+  );
+}
+
+function graphFileTest(t) {
+  var obj = new Annoy(2, 'Euclidean');
+  points.forEach((x, i) => obj.addItem(i, [x, 0]));
+  obj.build(4);
+
+  obj.buildKnnGraph(2, 1000, 0, graphPath, (error) => {
+    t.error(error, 'No error writing the graph.');
+    var contents = fs.readFileSync(graphPath);
+    t.deepEqual(
+      Array.from(new Int32Array(contents.buffer, contents.byteOffset, contents.length / 4)),
+      expectedGraph,
+      'The file holds the rows.'
+    );
+    fs.unlinkSync(graphPath);
+    obj.unload();
+    t.end();
+  });
+}
+
+function graphIdsTest(t) {
+  var obj = new Annoy(2, 'Euclidean');
+  points.forEach((x, i) => obj.addItemWithId(100 + i, [x, 0]));
+  obj.build(4);
+
+  obj.buildKnnGraph(2, 1000).then((graph) => {
+    t.ok(graph.neighbors instanceof BigUint64Array, 'Neighbors are ids.');
+    t.deepEqual(
+      Array.from(graph.ids).map(Number),
+      [100, 101, 102, 103, 104, 105],
+      'There is an id for each row.'
+    );
+    t.deepEqual(
+      Array.from(graph.neighbors).map(Number),
+      expectedGraph.map((item) => 100 + item),
+      'Rows hold the ids of the neighbors.'
+    );
+    obj.unload();
+    t.end();
+  });
+}
@@ -0,0 +1,125 @@
+/* global __dirname, BigInt */
+
+var test = require('tape');
+var Annoy = require('../index');
+
+var annoyPath = __dirname + '/data/test-hamming.annoy';
+
+var items = [
+  [-5.0, -4.5, -3.2, -2.8, -2.1, -1.5, -0.34, 0, 3.7, 6],
+  [5.0, 4.5, 3.2, 2.8, 2.1, 1.5, 0.34, 0, -3.7, -6],
+  [0, 0, 0, 0, 0, -1, -1, -0.2, 0.1, 0.8]
+];
+
+// 70 bits, so the codes take two words.
+var codes = [
+  makeCode((i) => i % 2),
+  makeCode((i) => (i % 2) ^ (i === 3 ? 1 : 0)),
+  makeCode((i) => (i < 35 ? 1 : 0))
+];
+
+test('DotProduct test', dotProductTest);
+test('Hamming test', hammingTest);
+test('Hamming packed test', hammingPackedTest);
+
+function makeCode(bitAt) {
+  var code = [];
+  for (var i = 0; i < 70; ++i) {
+    code.push(bitAt(i));
+  }
+  return code;
+}
+
+function dot(a, b) {
+  var sum = 0;
+  for (var i = 0; i < a.length; ++i) {
+    sum += a[i] * b[i];
+  }
+  return sum;
+}
+
+function dotProductTest(t) {
+  var obj = new Annoy(10, 'DotProduct');
+  items.forEach((item, i) => obj.addItem(i, item));
+  obj.build();
+
+  t.equal(
+    obj.getDistance(0, 1).toPrecision(4),
+    dot(items[0], items[1]).toPrecision(4),
+    'getDistance is the dot product.'
+  );
+  var result = obj.getNNsByVector(items[0], 3, -1, true);
+  t.equal(result.neighbors[0], 0, 'Largest inner product comes first.');
+  t.equal(
+    result.distances[0].toPrecision(4),
+    dot(items[0], items[0]).toPrecision(4),
+    'Distances are inner products.'
+  );
+  obj.unload();
+  t.end();
+}
+
+function hammingTest(t) {
+  var obj = new Annoy(70, 'Hamming');
+  codes.forEach((code, i) => obj.addItem(i, code));
+  obj.build();
+
+  t.deepEqual(
+    Array.from(obj.getItem(1)),
+    codes[1],
+    'getItem unpacks the bits.'
+  );
+  t.equal(obj.getDistance(0, 1), 1, 'getDistance counts differing bits.');
+  t.deepEqual(
+    obj.getNNsByVector(codes[1], 2, -1, false),
+    [1, 0],
+    'Nearest codes are found.'
+  );
+  t.ok(obj.save(annoyPath), 'Saved successfully.');
+  obj.unload();
+
+  var obj2 = new Annoy(70, 'Hamming');
+  t.ok(obj2.load(annoyPath), 'Loads successfully.');
+  t.equal(obj2.getDistance(0, 2), 35, 'Loaded index has the same codes.');
+  obj2.unload();
+  t.end();
+}
+
+function hammingPackedTest(t) {
+  var obj = new Annoy(70, 'Hamming');
+  codes.forEach((code, i) => obj.addItem(i, code));
+  obj.addItemPacked(3, new BigUint64Array([BigInt(0), BigInt(0)]));
+  obj.build();
+
+  var packed = obj.getItemPacked(3);
+  t.ok(packed instanceof BigUint64Array, 'getItemPacked returns a BigUint64Array.');
+  t.equal(packed.length, 2, 'There is one word per 64 bits.');
+  t.deepEqual(obj.getItemPacked(-1), packed, 'Negative indexes count back from the end.');
+  t.equal(
+    obj.getDistance(3, 2),
+    35,
+    'Packed items are compared with the unpacked ones.'
+  );
+  t.deepEqual(
+    obj.getNNsByVectorPacked(obj.getItemPacked(2), 1, -1, true),
+    { neighbors: [2], distances: [0] },
+    'getNNsByVectorPacked finds the same item.'
+  );
+  t.throws(
+    () => obj.getNNsByVectorPacked(new BigUint64Array(1), 1),
+    /does not match the index dimensions/,
+    'Packed queries must be the right length.'
+  );
+  t.throws(
+    () => obj.addItemPacked(3, packed),
+    /addItemPacked: .*replace an item in a built index/,
+    'Refused packed items throw.'
+  );
+  t.throws(
+    () => new Annoy(10, 'Euclidean').addItemPacked(0, packed),
+    /Only Hamming indexes/,
+    'Packed methods are only for Hamming indexes.'
+  );
+  obj.unload();
+  t.end();
+}
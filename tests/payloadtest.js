@@ -0,0 +1,63 @@
+/* global __dirname */
+
+var test = require('tape');
+var Annoy = require('../index');
+
+var annoyPath = __dirname + '/data/test-payloads.annoy';
+
+var dimensions = 3;
+var words = ['north', 'east', 'up'];
+
+test('Payload test', payloadTest);
+test('Saved payload test', savedPayloadTest);
+
+function makeIndex() {
+  var obj = new Annoy(dimensions, 'Euclidean');
+  words.forEach((word, i) => {
+    var vector = [0, 0, 0];
+    vector[i] = 1;
+    obj.addItem(i, vector);
+    obj.setPayload(i, word);
+  });
+  obj.setPayload(2, Buffer.from([0, 255, 7]));
+  obj.build(3);
+  return obj;
+}
+
+function payloadTest(t) {
+  var obj = makeIndex();
+  t.equal(obj.getPayload(0, 'utf8'), 'north', 'String payloads are read back.');
+  t.deepEqual(
+    Array.from(obj.getPayload(2)),
+    [0, 255, 7],
+    'Binary payloads are read back as Buffers.'
+  );
+
+  var result = obj.getNNsByVector([0, 1, 0], 2, -1, true, null, null, 'utf8');
+  t.deepEqual(result.neighbors, [1, 0], 'Neighbors are returned with payloads.');
+  t.equal(result.payloads[0], 'east', 'Payloads match the neighbors.');
+  t.equal(result.distances.length, 2, 'Distances are still included.');
+
+  result = obj.getNNsByItem(0, 1, -1, false, null, null, true);
+  t.ok(Buffer.isBuffer(result.payloads[0]), 'Payloads can be Buffers.');
+  t.notOk(result.distances, 'Distances are left out unless asked for.');
+  t.throws(() => obj.setPayload(NaN, 'x'), /Expected an item index/, 'setPayload needs an integer index.');
+  t.throws(() => obj.getPayload(), /Expected an item index/, 'getPayload needs an integer index.');
+  obj.unload();
+  t.end();
+}
+
+function savedPayloadTest(t) {
+  var obj = makeIndex();
+  t.ok(obj.save(annoyPath, 'compact'), 'Saved successfully.');
+  obj.unload();
+
+  var obj2 = new Annoy();
+  t.ok(obj2.load(annoyPath), 'Loads successfully.');
+  t.equal(obj2.getPayload(1, 'utf8'), 'east', 'Payloads are saved with the index.');
+  obj2.setPayload(1, 'west');
+  t.equal(obj2.getPayload(1, 'utf8'), 'west', 'Payloads of a loaded index can change.');
+  t.equal(obj2.getPayload(0, 'utf8'), 'north', 'The other payloads are kept.');
+  obj2.unload();
+  t.end();
+}
@@ -0,0 +1,96 @@
+/* global __dirname */
+
+var test = require('tape');
+var Annoy = require('../index');
+
+var annoyPath = __dirname + '/data/test-quantize.annoy';
+var codesPath = __dirname + '/data/test-quantize.codes';
+
+var items = [
+  [-5.0, -4.5, -3.2, -2.8, -2.1, -1.5, -0.34, 0, 3.7, 6],
+  [5.0, 4.5, 3.2, 2.8, 2.1, 1.5, 0.34, 0, -3.7, -6],
+  [0, 0, 0, 0, 0, -1, -1, -0.2, 0.1, 0.8],
+  [-4.9, -4.4, -3.0, -2.8, -2.0, -1.5, -0.3, 0.1, 3.6, 5.9]
+];
+
+test('Quantize test', quantizeTest);
+test('Quantized save and load test', quantizedSaveLoadTest);
+
+function makeIndex() {
+  var obj = new Annoy(10, 'Euclidean');
+  items.forEach((item, i) => obj.addItem(i, item));
+  obj.build(10);
+  return obj;
+}
+
+function quantizeTest(t) {
+  var obj = new Annoy(10, 'Euclidean');
+  items.forEach((item, i) => obj.addItem(i, item));
+  t.throws(
+    () => obj.quantize(),
+    /hasn't been built/,
+    'Quantizing needs a built index.'
+  );
+  obj.build(10);
+
+  var expected = obj.getNNsByVector(items[0], 3, -1, true);
+  obj.quantize();
+  t.deepEqual(
+    obj.getNNsByVector(items[0], 3, -1, true),
+    expected,
+    'Re-ranked results match the full precision ones.'
+  );
+
+  obj.setRerank(-1);
+  var approximate = obj.getNNsByVector(items[0], 3, -1, true);
+  t.deepEqual(
+    approximate.neighbors,
+    expected.neighbors,
+    'Quantized results without re-ranking find the same neighbors.'
+  );
+  for (var i = 0; i < 3; ++i) {
+    t.ok(
+      Math.abs(approximate.distances[i] - expected.distances[i]) < 0.1,
+      'Approximate distance ' + i + ' is close.'
+    );
+  }
+
+  t.throws(
+    () => new Annoy(70, 'Hamming').quantize(),
+    /hasn't been built|integer vectors/,
+    'Hamming indexes are not quantized.'
+  );
+  obj.unload();
+  t.end();
+}
+
+function quantizedSaveLoadTest(t) {
+  var obj = makeIndex();
+  t.notOk(obj.saveQuantized(codesPath), 'Nothing to save before quantizing.');
+  obj.quantize();
+  t.ok(obj.save(annoyPath), 'Saved index successfully.');
+  t.ok(
+    obj.saveQuantized(codesPath),
+    'Quantized vectors are kept when the index is saved.'
+  );
+  var expected = obj.getNNsByItem(3, 2, -1, true);
+  obj.unload();
+
+  var obj2 = new Annoy(10, 'Euclidean');
+  t.notOk(obj2.loadQuantized(codesPath), 'Quantized vectors need an index.');
+  t.ok(obj2.load(annoyPath), 'Loads index successfully.');
+  t.ok(obj2.loadQuantized(codesPath), 'Loads quantized vectors successfully.');
+  t.deepEqual(
+    obj2.getNNsByItem(3, 2, -1, true),
+    expected,
+    'Loaded quantized vectors give the same results.'
+  );
+  obj2.unload();
+
+  var obj3 = new Annoy(11, 'Euclidean');
+  t.notOk(
+    obj3.loadQuantized(codesPath),
+    'Quantized vectors must match the index dimensions.'
+  );
+  t.end();
+}
@@ -0,0 +1,44 @@
+var test = require('tape');
+var Annoy = require('../index');
+
+test('Query stats test', statsTest);
+
+// The counters themselves are checked by tools/query-stats-check, since the
+// addon is built without ANNOYLIB_QUERY_STATS. This checks the JS side.
+function statsTest(t) {
+  var obj = new Annoy(3, 'Euclidean');
+  obj.addItem(0, [0, 0, 1]);
+  obj.addItem(1, [0, 1, 0]);
+  obj.addItem(2, [1, 0, 0]);
+  obj.build(2);
+
+  t.doesNotThrow(() => obj.resetStats(), 'resetStats can always be called.');
+  obj.getNNsByItem(0, 2, -1);
+  var last = obj.getLastQueryStats();
+  var total = obj.getStats();
+
+  if (last === null) {
+    t.equal(total, null, 'Without ANNOYLIB_QUERY_STATS, getStats is null too.');
+    t.end();
+    return;
+  }
+
+  t.deepEqual(
+    Object.keys(last).sort(),
+    ['candidates', 'distances', 'duplicates', 'leavesVisited', 'nodesVisited', 'queries', 'searchK'],
+    'Stats have every field.'
+  );
+  t.equal(last.queries, 1, 'Last query stats are for one query.');
+  t.equal(last.searchK, 4, 'searchK -1 is n times the number of trees.');
+
+  var other = new Annoy(3, 'Euclidean');
+  other.addItem(0, [1, 1, 1]);
+  other.build(1);
+  other.getNNsByItem(0, 1, 7);
+  t.equal(obj.getLastQueryStats().searchK, 4, 'Queries on another index are not counted.');
+
+  t.equal(total.queries, 1, 'getStats counts the query.');
+  obj.resetStats();
+  t.equal(obj.getStats().queries, 0, 'resetStats clears the counts.');
+  t.end();
+}
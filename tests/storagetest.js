@@ -0,0 +1,66 @@
+/* global __dirname */
+
+var test = require('tape');
+var Annoy = require('../index');
+
+var annoyPath = __dirname + '/data/test-float16.annoy';
+
+var items = [
+  [-5.0, -4.5, -3.2, -2.8, -2.1, -1.5, -0.34, 0, 3.7, 6],
+  [5.0, 4.5, 3.2, 2.8, 2.1, 1.5, 0.34, 0, -3.7, -6],
+  [0, 0, 0, 0, 0, -1, -1, -0.2, 0.1, 0.8]
+];
+
+test('float16 storage test', storageTest.bind(null, 'float16', 1e-3));
+test('bfloat16 storage test', storageTest.bind(null, 'bfloat16', 1e-2));
+test('float16 header test', headerTest);
+
+function makeIndex(storage) {
+  var obj = new Annoy(10, 'Euclidean', storage);
+  items.forEach((item, i) => obj.addItem(i, item));
+  obj.build();
+  return obj;
+}
+
+function storageTest(storage, tolerance, t) {
+  var obj = makeIndex(storage);
+  var reference = makeIndex();
+
+  var vector = obj.getItem(1);
+  t.equal(vector.length, 10, 'getItem returns all the dimensions.');
+  for (var i = 0; i < vector.length; ++i) {
+    t.ok(
+      Math.abs(vector[i] - items[1][i]) <= Math.abs(items[1][i]) * tolerance,
+      'Value ' + i + ' is close to what was added.'
+    );
+  }
+  t.deepEqual(
+    obj.getNNsByVector(items[2], 3),
+    reference.getNNsByVector(items[2], 3),
+    'Neighbors match a float32 index.'
+  );
+  t.ok(
+    Math.abs(obj.getDistance(0, 1) - reference.getDistance(0, 1)) <
+      reference.getDistance(0, 1) * tolerance,
+    'Distances are close to a float32 index.'
+  );
+  obj.unload();
+  reference.unload();
+  t.end();
+}
+
+function headerTest(t) {
+  var obj = makeIndex('float16');
+  t.ok(obj.save(annoyPath, true), 'Saved with a header.');
+  obj.unload();
+
+  t.notOk(
+    new Annoy(10, 'Euclidean').load(annoyPath),
+    'A float32 index refuses a float16 file.'
+  );
+  var loaded = new Annoy();
+  t.ok(loaded.load(annoyPath), 'Storage type comes from the header.');
+  t.equal(loaded.getNNsByVector(items[0], 1)[0], 0, 'Loaded index works.');
+  loaded.unload();
+  t.end();
+}
@@ -0,0 +1,85 @@
+var test = require('tape');
+var Annoy = require('../index');
+
+var items = [
+  [-5.0, -4.5, -3.2, -2.8, -2.1, -1.5, -0.34, 0, 3.7, 6],
+  [5.0, 4.5, 3.2, 2.8, 2.1, 1.5, 0.34, 0, -3.7, -6],
+  [0, 0, 0, 0, 0, -1, -1, -0.2, 0.1, 0.8]
+];
+
+test('Typed array input test', typedArrayInputTest);
+test('addItems test', addItemsTest);
+
+function typedArrayInputTest(t) {
+  var obj = new Annoy(10, 'Euclidean');
+
+  obj.addItem(0, items[0]);
+  obj.addItem(1, new Float32Array(items[1]));
+  obj.addItem(2, new Float64Array(items[2]));
+  t.equal(obj.getNItems(), 3, 'Index has all the added items.');
+  t.throws(() => obj.addItem(NaN, items[0]), /Expected an item index/, 'A NaN index throws.');
+  t.throws(() => obj.addItem('3', items[0]), /Expected an item index/, 'A string index throws.');
+  t.equal(obj.getNItems(), 3, 'Bad indexes add nothing.');
+  obj.build();
+
+  for (var i = 0; i < items.length; ++i) {
+    var vector = obj.getItem(i);
+    t.ok(vector instanceof Float32Array, 'getItem returns a Float32Array.');
+    t.deepEqual(
+      Array.from(vector),
+      Array.from(new Float32Array(items[i])),
+      'Item ' + i + ' was stored correctly.'
+    );
+  }
+
+  t.deepEqual(
+    obj.getNNsByVector(new Float32Array(items[1]), 2, -1, false),
+    obj.getNNsByVector(items[1], 2, -1, false),
+    'Float32Array queries give the same neighbors as Array queries.'
+  );
+  t.deepEqual(
+    obj.getNNsByVector(items[1], 2, -1, false, 'exclude', new Int32Array([1])),
+    obj.getNNsByVector(items[1], 2, -1, false, 'exclude', [1]),
+    'Int32Array filters give the same neighbors as Array filters.'
+  );
+
+  obj.unload();
+  t.end();
+}
+
+function addItemsTest(t) {
+  var obj = new Annoy(10, 'Euclidean');
+  var matrix = new Float32Array(items[0].concat(items[1]));
+
+  obj.addItems(matrix);
+  t.equal(obj.getNItems(), 2, 'addItems adds one item per row.');
+  obj.addItems(new Float32Array(items[2]));
+  t.equal(obj.getNItems(), 3, 'addItems appends by default.');
+  obj.addItems(new Float32Array(items[0].concat(items[1])), 10, 2);
+  t.equal(obj.getNItems(), 12, 'addItems starts at the given id.');
+
+  t.deepEqual(
+    Array.from(obj.getItem(11)),
+    Array.from(new Float32Array(items[1])),
+    'Rows were copied into the right items.'
+  );
+  t.deepEqual(
+    Array.from(obj.getItem(-1)),
+    Array.from(obj.getItem(11)),
+    'Negative indexes count back from the end.'
+  );
+  t.throws(
+    () => obj.addItems(new Float32Array(15)),
+    /multiple of the index dimensions/,
+    'Matrix must hold a whole number of rows.'
+  );
+
+  obj.build();
+  t.deepEqual(
+    obj.getNNsByItem(10, 2).sort((a, b) => a - b),
+    [0, 10],
+    'Duplicate rows are nearest neighbors.'
+  );
+  obj.unload();
+  t.end();
+}
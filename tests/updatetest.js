@@ -0,0 +1,153 @@
+/* global __dirname */
+
+var test = require('tape');
+var Annoy = require('../index');
+
+var annoyPath = __dirname + '/data/test-update.annoy';
+var updatedPath = __dirname + '/data/test-update-2.annoy';
+var compactedPath = __dirname + '/data/test-update-compacted.annoy';
+
+var dimensions = 10;
+var seed = 1;
+
+test('Add to built index test', addToBuiltTest);
+test('Add to loaded index test', addToLoadedTest);
+test('Remove item test', removeItemTest);
+
+// Small deterministic generator, so failures can be reproduced.
+function random() {
+  seed = (seed * 16807) % 2147483647;
+  return seed / 2147483647 - 0.5;
+}
+
+function makeItems(count) {
+  var items = [];
+  for (var i = 0; i < count; ++i) {
+    var item = [];
+    for (var j = 0; j < dimensions; ++j) {
+      item.push(random());
+    }
+    items.push(item);
+  }
+  return items;
+}
+
+function countFoundThemselves(obj, first, count) {
+  var found = 0;
+  for (var i = first; i < first + count; ++i) {
+    if (obj.getNNsByItem(i, 1, -1)[0] === i) {
+      found += 1;
+    }
+  }
+  return found;
+}
+
+function addToBuiltTest(t) {
+  var items = makeItems(600);
+  var obj = new Annoy(dimensions, 'Angular');
+  items.slice(0, 500).forEach((item, i) => obj.addItem(i, item));
+  obj.build(5);
+
+  items.slice(500).forEach((item) => obj.addItem(item));
+  t.equal(obj.getNItems(), 600, 'getNItems counts the items waiting to be built.');
+  t.equal(
+    obj.getItem(550)[0].toPrecision(4),
+    items[550][0].toPrecision(4),
+    'Items waiting to be built can be read back.'
+  );
+  t.throws(
+    () => obj.addItem(3, items[0]),
+    /replace an item in a built index/,
+    'Items in the trees can not be replaced.'
+  );
+
+  obj.build();
+  t.equal(obj.getNItems(), 600, 'The new items are kept.');
+  t.equal(
+    countFoundThemselves(obj, 500, 100),
+    100,
+    'The new items are in the trees.'
+  );
+  t.equal(
+    countFoundThemselves(obj, 0, 100),
+    100,
+    'The old items are still in the trees.'
+  );
+  obj.unload();
+  t.end();
+}
+
+function addToLoadedTest(t) {
+  var items = makeItems(600);
+  var obj = new Annoy(dimensions, 'Euclidean');
+  items.slice(0, 300).forEach((item, i) => obj.addItem(i, item));
+  obj.build(5);
+  t.ok(obj.save(annoyPath, 'compact'), 'Saved successfully.');
+  obj.unload();
+
+  var obj2 = new Annoy(dimensions, 'Euclidean');
+  t.ok(obj2.load(annoyPath), 'Loads successfully.');
+  obj2.addItems(new Float32Array([].concat.apply([], items.slice(300))));
+  obj2.build();
+  t.equal(
+    countFoundThemselves(obj2, 300, 300),
+    300,
+    'Items added to a loaded index are in the trees.'
+  );
+  t.ok(obj2.save(updatedPath), 'Saved the updated index.');
+  obj2.unload();
+
+  var obj3 = new Annoy();
+  t.ok(obj3.load(updatedPath), 'Loads the updated index.');
+  t.equal(obj3.getNItems(), 600, 'Loaded index has all the items.');
+  t.equal(
+    countFoundThemselves(obj3, 0, 600),
+    600,
+    'Loaded index finds all the items.'
+  );
+  obj3.unload();
+  t.end();
+}
+
+function removeItemTest(t) {
+  var items = makeItems(400);
+  var obj = new Annoy(dimensions, 'Euclidean');
+  items.forEach((item, i) => obj.addItem(i, item));
+  obj.build(5);
+  t.ok(obj.save(annoyPath), 'Saved successfully.');
+
+  for (var i = 0; i < 400; i += 2) {
+    obj.removeItem(i);
+  }
+  var neighbors = obj.getNNsByVector(items[0], 400, -1);
+  t.equal(neighbors.length, 200, 'Removed items are not returned.');
+  t.ok(
+    neighbors.every((id) => id % 2 === 1),
+    'Only the items that are left are returned.'
+  );
+  t.throws(
+    () => obj.removeItem(400),
+    /out of range/,
+    'Items that were never added can not be removed.'
+  );
+  t.throws(
+    () => obj.removeItem('x'),
+    /Expected an item index/,
+    'removeItem needs an integer index.'
+  );
+
+  t.ok(obj.compact(compactedPath), 'Compacts and saves successfully.');
+  t.equal(
+    countFoundThemselves(obj, 1, 1),
+    1,
+    'Items that are left are still in the trees.'
+  );
+  obj.unload();
+
+  var obj2 = new Annoy(dimensions, 'Euclidean');
+  t.ok(obj2.load(compactedPath), 'Loads the compacted index.');
+  neighbors = obj2.getNNsByVector(items[0], 400, -1);
+  t.equal(neighbors.length, 200, 'The compacted index has no removed items.');
+  obj2.unload();
+  t.end();
+}
@@ -0,0 +1,319 @@
+// Measures recall and query speed of annoy indexes against exact nearest
+// neighbors found by brute force.
+//
+// Either builds indexes from a file of raw 32-bit float vectors (or random
+// ones) for each number of trees, or loads an existing index, then runs the
+// queries once for each search_k and prints a row per combination:
+// recall@k, queries per second, median and 99th percentile latency, and how
+// long the build took. Queries come from a file of raw floats too, or are a
+// sample of the items.
+
+#include "../annoylib.h"
+#include "../kissrandom.h"
+#include <chrono>
+#include <random>
+#include <string>
+#include <thread>
+
+using std::string;
+
+struct BenchOptions {
+  vector<string> metrics;
+  int dimensions;
+  string vectors_path;
+  string index_path;
+  string queries_path;
+  size_t random_items;
+  size_t n_queries;
+  size_t k;
+  vector<int> trees;
+  vector<int> search_ks;
+  int threads;
+  int query_threads;
+};
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static vector<int> parse_list(const char* s) {
+  vector<int> values;
+  for (const char* p = s; *p; ) {
+    char* end;
+    long value = strtol(p, &end, 10);
+    if (end == p)
+      break;
+    values.push_back((int)value);
+    p = *end == ',' ? end + 1 : end;
+  }
+  return values;
+}
+
+static vector<string> parse_names(const char* s) {
+  vector<string> names;
+  string name;
+  for (const char* p = s; ; p++) {
+    if (*p == ',' || !*p) {
+      if (!name.empty())
+        names.push_back(name);
+      name.clear();
+      if (!*p)
+        break;
+    } else {
+      name += *p;
+    }
+  }
+  return names;
+}
+
+static bool read_vectors(const string& path, int f, vector<float>* vectors) {
+  FILE* fp = fopen(path.c_str(), "rb");
+  if (!fp) {
+    fprintf(stderr, "Unable to open %s\n", path.c_str());
+    return false;
+  }
+  fseek(fp, 0, SEEK_END);
+  long size = ftell(fp);
+  rewind(fp);
+  size_t row_size = (size_t)f * sizeof(float);
+  if (size <= 0 || (size_t)size % row_size != 0) {
+    fprintf(stderr, "%s isn't a whole number of %d-dimensional float vectors\n", path.c_str(), f);
+    fclose(fp);
+    return false;
+  }
+  vectors->resize((size_t)size / sizeof(float));
+  bool ok = fread(&(*vectors)[0], 1, size, fp) == (size_t)size;
+  fclose(fp);
+  if (!ok)
+    fprintf(stderr, "Unable to read %s\n", path.c_str());
+  return ok;
+}
+
+template<typename Fn>
+static void parallel_for(size_t n, int n_threads, Fn fn) {
+  // Calls fn(begin, end) on n_threads threads over interleaved chunks of [0, n)
+  vector<std::thread> threads;
+  std::atomic<size_t> next(0);
+  const size_t chunk = 16;
+  for (int t = 0; t < n_threads; t++) {
+    threads.push_back(std::thread([&]() {
+      for (size_t begin; (begin = next.fetch_add(chunk)) < n; )
+        fn(begin, std::min(n, begin + chunk));
+    }));
+  }
+  for (size_t t = 0; t < threads.size(); t++)
+    threads[t].join();
+}
+
+template<typename D>
+class Bench {
+public:
+  typedef AnnoyIndex<int, float, D, Kiss64Random, AnnoyIndexMultiThreadedBuildPolicy> Index;
+
+  Bench(const BenchOptions& options) : _options(options), _f(options.dimensions) {
+  }
+
+  bool run(const char* metric) {
+    Index loaded(_f);
+    vector<float> items;
+    if (!_options.index_path.empty()) {
+      char* error = NULL;
+      if (!loaded.load(_options.index_path.c_str(), false, &error)) {
+        fprintf(stderr, "Unable to load %s: %s\n", _options.index_path.c_str(), error);
+        free(error);
+        return false;
+      }
+      items.resize((size_t)loaded.get_n_items() * _f);
+      for (int i = 0; i < loaded.get_n_items(); i++)
+        loaded.get_item(i, &items[(size_t)i * _f]);
+    } else if (!_options.vectors_path.empty()) {
+      if (!read_vectors(_options.vectors_path, _f, &items))
+        return false;
+    } else {
+      std::mt19937 generator(1);
+      std::normal_distribution<float> normal;
+      items.resize(_options.random_items * _f);
+      for (size_t i = 0; i < items.size(); i++)
+        items[i] = normal(generator);
+    }
+    size_t n_items = items.size() / _f;
+    if (n_items == 0) {
+      fprintf(stderr, "There are no items\n");
+      return false;
+    }
+
+    vector<float> queries;
+    if (!_options.queries_path.empty()) {
+      if (!read_vectors(_options.queries_path, _f, &queries))
+        return false;
+    } else {
+      // A sample of the items, which are then their own nearest neighbors
+      std::mt19937 generator(2);
+      for (size_t i = 0; i < _options.n_queries; i++) {
+        size_t item = generator() % n_items;
+        queries.insert(queries.end(), &items[item * _f], &items[(item + 1) * _f]);
+      }
+    }
+
+    // The ground truth comes from the loaded index, or else an unbuilt one
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    Index unbuilt(_f);
+    if (_options.index_path.empty())
+      unbuilt.add_items(0, &items[0], (int)n_items, _options.threads);
+    vector<vector<int> > truth;
+    _exact(_options.index_path.empty() ? unbuilt : loaded, queries, &truth);
+    fprintf(stderr, "%s: exact neighbors of %zu queries among %zu items in %.2f s\n",
+            metric, truth.size(), n_items, seconds_since(start));
+
+    if (!_options.index_path.empty()) {
+      for (size_t s = 0; s < _options.search_ks.size(); s++)
+        _query(loaded, metric, loaded.get_n_trees(), _options.search_ks[s], queries, truth, 0);
+      return true;
+    }
+    for (size_t t = 0; t < _options.trees.size(); t++) {
+      Index index(_f);
+      index.add_items(0, &items[0], (int)n_items, _options.threads);
+      start = std::chrono::steady_clock::now();
+      char* error = NULL;
+      if (!index.build(_options.trees[t], _options.threads, &error)) {
+        fprintf(stderr, "Unable to build: %s\n", error);
+        free(error);
+        return false;
+      }
+      double build_time = seconds_since(start);
+      for (size_t s = 0; s < _options.search_ks.size(); s++)
+        _query(index, metric, _options.trees[t], _options.search_ks[s], queries, truth, build_time);
+    }
+    return true;
+  }
+
+protected:
+  void _exact(const Index& index, const vector<float>& queries, vector<vector<int> >* truth) const {
+    // get_nns_exact scores every item, so this is the brute force answer by
+    // the index's own distances
+    size_t n_queries = queries.size() / _f;
+    truth->resize(n_queries);
+    parallel_for(n_queries, _options.threads, [&](size_t begin, size_t end) {
+      for (size_t q = begin; q < end; q++)
+        index.get_nns_exact(&queries[q * _f], _options.k, &(*truth)[q], NULL);
+    });
+  }
+
+  void _query(const Index& index, const char* metric, int trees, int search_k, const vector<float>& queries,
+              const vector<vector<int> >& truth, double build_time) const {
+    size_t n_queries = queries.size() / _f;
+    vector<double> latencies(n_queries);
+    vector<size_t> hits(n_queries);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    parallel_for(n_queries, _options.query_threads, [&](size_t begin, size_t end) {
+      vector<int> result;
+      vector<float> distances;
+      for (size_t q = begin; q < end; q++) {
+        result.clear();
+        distances.clear();
+        std::chrono::steady_clock::time_point query_start = std::chrono::steady_clock::now();
+        index.get_nns_by_vector(&queries[q * _f], _options.k, search_k, &result, &distances);
+        latencies[q] = seconds_since(query_start);
+        for (size_t i = 0; i < result.size(); i++)
+          hits[q] += std::find(truth[q].begin(), truth[q].end(), result[i]) != truth[q].end();
+      }
+    });
+    double elapsed = seconds_since(start);
+
+    size_t total_hits = 0, total = 0;
+    for (size_t q = 0; q < n_queries; q++) {
+      total_hits += hits[q];
+      total += truth[q].size();
+    }
+    std::sort(latencies.begin(), latencies.end());
+    printf("%-10s %6d %9d %9.4f %10.0f %9.3f %9.3f %9.2f\n", metric, trees, search_k,
+           total ? (double)total_hits / total : 0.0, n_queries / elapsed,
+           _percentile(latencies, 0.5) * 1e3, _percentile(latencies, 0.99) * 1e3, build_time);
+    fflush(stdout);
+  }
+
+  static double _percentile(const vector<double>& sorted, double p) {
+    if (sorted.empty())
+      return 0;
+    return sorted[std::min(sorted.size() - 1, (size_t)(p * sorted.size()))];
+  }
+
+  const BenchOptions& _options;
+  int _f;
+};
+
+static void usage() {
+  fprintf(stderr,
+    "Usage: annoy-bench --dimensions F [options]\n"
+    "  --vectors PATH      raw 32-bit float vectors to build indexes from\n"
+    "  --index PATH        an index to load instead of building one\n"
+    "  --random N          build from N random vectors (default 100000)\n"
+    "  --queries PATH      raw 32-bit float query vectors (default: a sample of the items)\n"
+    "  --n-queries N       size of that sample (default 1000)\n"
+    "  --metric LIST       angular, euclidean, manhattan and/or dot (default angular)\n"
+    "  --k K               neighbors per query (default 10)\n"
+    "  --trees LIST        numbers of trees to build (default 10,50,100)\n"
+    "  --search-k LIST     search_k values to query with (default -1,1000,10000)\n"
+    "  --threads N         threads for building and exact search (default: one per core)\n"
+    "  --query-threads N   threads running the queries (default 1)\n");
+}
+
+int main(int argc, char** argv) {
+  BenchOptions options;
+  options.metrics.push_back("angular");
+  options.dimensions = 0;
+  options.random_items = 100000;
+  options.n_queries = 1000;
+  options.k = 10;
+  options.trees = parse_list("10,50,100");
+  options.search_ks = parse_list("-1,1000,10000");
+  options.threads = std::max(1, (int)std::thread::hardware_concurrency());
+  options.query_threads = 1;
+
+  for (int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    if (i + 1 >= argc) {
+      usage();
+      return 1;
+    }
+    const char* value = argv[++i];
+    if (arg == "--vectors") options.vectors_path = value;
+    else if (arg == "--index") options.index_path = value;
+    else if (arg == "--queries") options.queries_path = value;
+    else if (arg == "--random") options.random_items = strtoul(value, NULL, 10);
+    else if (arg == "--n-queries") options.n_queries = strtoul(value, NULL, 10);
+    else if (arg == "--dimensions") options.dimensions = atoi(value);
+    else if (arg == "--metric") options.metrics = parse_names(value);
+    else if (arg == "--k") options.k = strtoul(value, NULL, 10);
+    else if (arg == "--trees") options.trees = parse_list(value);
+    else if (arg == "--search-k") options.search_ks = parse_list(value);
+    else if (arg == "--threads") options.threads = std::max(1, atoi(value));
+    else if (arg == "--query-threads") options.query_threads = std::max(1, atoi(value));
+    else {
+      usage();
+      return 1;
+    }
+  }
+  if (options.dimensions <= 0 || options.k == 0 || options.trees.empty() || options.search_ks.empty()) {
+    usage();
+    return 1;
+  }
+
+  printf("%-10s %6s %9s %9s %10s %9s %9s %9s\n",
+         "metric", "trees", "search_k", "recall", "qps", "p50_ms", "p99_ms", "build_s");
+  for (size_t m = 0; m < options.metrics.size(); m++) {
+    const string& metric = options.metrics[m];
+    bool ok;
+    if (metric == "angular") ok = Bench<Angular>(options).run("angular");
+    else if (metric == "euclidean") ok = Bench<Euclidean>(options).run("euclidean");
+    else if (metric == "manhattan") ok = Bench<Manhattan>(options).run("manhattan");
+    else if (metric == "dot") ok = Bench<DotProduct>(options).run("dot");
+    else {
+      fprintf(stderr, "Unknown metric %s\n", metric.c_str());
+      ok = false;
+    }
+    if (!ok)
+      return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,98 @@
+// Checks the query counters that ANNOYLIB_QUERY_STATS compiles in. The
+// addon is built without them, so tests/statstest.js can only see that
+// they're off; this builds an index with them on and checks that the
+// counts add up. Exits with 1 if any check fails.
+
+#ifndef ANNOYLIB_QUERY_STATS
+#define ANNOYLIB_QUERY_STATS
+#endif
+
+#include "../annoylib.h"
+#include "../kissrandom.h"
+#include <random>
+#include <thread>
+
+typedef AnnoyIndex<int, float, Angular, Kiss64Random, AnnoyIndexMultiThreadedBuildPolicy> Index;
+
+static int failures = 0;
+
+static void check(bool ok, const char* what) {
+  if (!ok) {
+    fprintf(stderr, "FAIL: %s\n", what);
+    failures++;
+  }
+}
+
+static AnnoyQueryStats query(const Index& index, int item, int search_k) {
+  vector<int> result;
+  index.get_nns_by_item(item, 10, search_k, &result, NULL);
+  AnnoyQueryStats stats;
+  check(index.get_last_query_stats(&stats), "last query stats are kept");
+  return stats;
+}
+
+int main() {
+  const int f = 16, n = 5000, trees = 10;
+  std::mt19937 generator(5);
+  std::normal_distribution<float> normal;
+  vector<float> items((size_t)n * f);
+  for (size_t i = 0; i < items.size(); i++)
+    items[i] = normal(generator);
+  Index index(f);
+  index.add_items(0, &items[0], n);
+  index.build(trees);
+
+  const int search_ks[] = {-1, 10, 100, 1000, 10000};
+  AnnoyQueryStats last;
+  for (size_t i = 0; i < sizeof(search_ks) / sizeof(search_ks[0]); i++) {
+    last = query(index, 1, search_ks[i]);
+    check(last.n_queries == 1, "last query stats are for one query");
+    check(last.search_k == (uint64_t)(search_ks[i] == -1 ? 10 * trees : search_ks[i]), "search_k is recorded");
+    check(last.n_leaves <= last.n_nodes, "leaves are among the nodes visited");
+    check(last.n_candidates >= std::min<uint64_t>(last.search_k, n), "at least search_k candidates are collected");
+    check(last.n_distances == last.n_candidates - last.n_duplicates, "a distance is computed for each distinct candidate");
+  }
+
+  AnnoyQueryStats total;
+  index.get_stats(&total);
+  check(total.n_queries == 5, "get_stats counts every query");
+
+  // Both are per index, and count queries from any thread
+  std::thread other([&index]() { query(index, 2, 50); });
+  other.join();
+  index.get_last_query_stats(&last);
+  check(last.search_k == 50, "another thread's query is the last one");
+  index.get_stats(&total);
+  check(total.n_queries == 6, "get_stats counts queries on every thread");
+
+  Index other_index(f);
+  other_index.add_items(0, &items[0], 100);
+  other_index.build(trees);
+  query(other_index, 0, 20);
+  index.get_last_query_stats(&last);
+  check(last.search_k == 50, "a query on another index leaves the last stats alone");
+
+  vector<int> result;
+  index.get_nns_exact(&items[0], 10, &result, NULL);
+  index.get_last_query_stats(&last);
+  check(last.n_distances == (uint64_t)n && last.n_nodes == 0, "exact search scores every item");
+
+  index.reset_stats();
+  index.get_stats(&total);
+  check(total.n_queries == 0 && total.n_distances == 0, "reset_stats clears the counts");
+  index.get_last_query_stats(&last);
+  check(last.n_queries == 0, "reset_stats clears the last query");
+
+  // Quantized queries also compute a full distance for each re-ranked item
+  index.quantize();
+  index.set_rerank(20);
+  last = query(index, 1, 500);
+  check(last.n_distances == last.n_candidates - last.n_duplicates + 20, "re-ranking is counted");
+
+  if (failures) {
+    printf("query stats: %d checks failed\n", failures);
+    return 1;
+  }
+  printf("query stats: ok\n");
+  return 0;
+}